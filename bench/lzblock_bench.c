@@ -0,0 +1,79 @@
+/* Microbenchmark: lzblock frame encode/decode throughput and ratio on
+ * text-like and random input, the two cases adaptive skipping is for.
+ * Also checks that every frame decodes back to its input.
+ * Usage: ./bench/lzblock_bench [MB] */
+#define _POSIX_C_SOURCE 200809L
+#include "lzblock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* CSV-ish log lines: timestamps, a few repeated words, varying numbers */
+static void fill_text(unsigned char *buf, size_t n) {
+    static const char *words[] = { "INFO", "WARN", "upload", "download", "user", "bytes", "ok", "retry" };
+    size_t i = 0;
+    unsigned long seq = 0;
+    while (i < n) {
+        char line[128];
+        int len = snprintf(line, sizeof(line), "2026-10-16T12:%02lu:%02lu,%s,%s,%lu,%s\n", seq / 60 % 60,
+                           seq % 60, words[rand() % 2], words[2 + rand() % 6], (unsigned long)rand() % 100000,
+                           words[6 + rand() % 2]);
+        for (int k = 0; k < len && i < n; ++k) buf[i++] = (unsigned char)line[k];
+        seq++;
+    }
+}
+
+static int run(const char *name, const unsigned char *data, size_t size, size_t mb) {
+    size_t total = mb * 1024 * 1024;
+    unsigned char *frame = malloc(LZBLOCK_FRAME_MAX);
+    unsigned char *out = malloc(LZBLOCK_MAX);
+    if (!frame || !out) return 1;
+    lzblock_adapt a = { 0, 0 };
+    size_t wire = 0, zframes = 0, frames = 0;
+    double enc = 0, dec = 0;
+    for (size_t done = 0; done < total; done += LZBLOCK_MAX) {
+        const unsigned char *src = data + (done % size);
+        int z = 0;
+        double t0 = now_sec();
+        size_t f = lzblock_frame(&a, src, LZBLOCK_MAX, frame, &z);
+        double t1 = now_sec();
+        long got = lzblock_frame_decode(frame, f, out);
+        dec += now_sec() - t1;
+        enc += t1 - t0;
+        if (got != LZBLOCK_MAX || memcmp(out, src, LZBLOCK_MAX) != 0) {
+            printf("MISMATCH: %s frame at %zu does not round-trip\n", name, done);
+            return 1;
+        }
+        wire += f;
+        zframes += z != 0;
+        frames++;
+    }
+    printf("%-7s %6zu MB  ratio %5.2f  encode %7.2f MB/s  decode %7.2f MB/s  compressed %zu/%zu frames\n",
+           name, mb, (double)total / (double)wire, (double)total / enc / 1e6, (double)total / dec / 1e6,
+           zframes, frames);
+    free(frame);
+    free(out);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    if (mb == 0) mb = 1;
+    size_t size = 16 * LZBLOCK_MAX;
+    unsigned char *buf = malloc(size);
+    if (!buf) return 1;
+    srand(42);
+    fill_text(buf, size);
+    if (run("text", buf, size, mb) != 0) return 1;
+    for (size_t i = 0; i < size; ++i) buf[i] = (unsigned char)rand();
+    if (run("random", buf, size, mb) != 0) return 1;
+    free(buf);
+    return 0;
+}
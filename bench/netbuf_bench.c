@@ -0,0 +1,102 @@
+/* Microbenchmark: command-line parsing with one-byte recv() (the old
+ * robust_readline/read_line) versus the buffered netbuf reader.
+ * A writer thread streams N command lines over a socketpair; the reader
+ * parses them and we report recv syscalls and time per command.
+ * Usage: ./bench/netbuf_bench [commands] */
+#define _POSIX_C_SOURCE 200809L
+#include "netbuf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+static size_t ncmds = 200000;
+
+static void *writer_main(void *arg) {
+    int fd = *(int *)arg;
+    char batch[64 * 1024];
+    size_t len = 0;
+    for (size_t i = 0; i < ncmds; ++i) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "DOWNLOAD report_%06zu.csv\n", i);
+        if (len + (size_t)n > sizeof(batch)) {
+            if (write(fd, batch, len) != (ssize_t)len) break;
+            len = 0;
+        }
+        memcpy(batch + len, line, (size_t)n);
+        len += (size_t)n;
+    }
+    if (len) {
+        ssize_t w = write(fd, batch, len);
+        (void)w;
+    }
+    shutdown(fd, SHUT_WR);
+    return NULL;
+}
+
+/* the pre-netbuf reader, kept verbatim apart from the counter */
+static unsigned long bytewise_calls = 0;
+static ssize_t bytewise_readline(int fd, char *buf, size_t maxlen) {
+    size_t idx = 0;
+    while (idx + 1 < maxlen) {
+        char c;
+        bytewise_calls++;
+        ssize_t r = recv(fd, &c, 1, 0);
+        if (r == 0) {
+            if (idx == 0) return 0;
+            break;
+        } else if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        } else {
+            buf[idx++] = c;
+            if (c == '\n') break;
+        }
+    }
+    buf[idx] = '\0';
+    return (ssize_t)idx;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, int buffered) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { perror("socketpair"); exit(1); }
+    pthread_t w;
+    pthread_create(&w, NULL, writer_main, &sv[1]);
+    netbuf nb;
+    netbuf_init(&nb, sv[0], 8192);
+    char line[2048];
+    size_t lines = 0;
+    double t0 = now_sec();
+    while (1) {
+        ssize_t n = buffered ? netbuf_readline(&nb, line, sizeof(line))
+                             : bytewise_readline(sv[0], line, sizeof(line));
+        if (n <= 0) break;
+        lines++;
+    }
+    double dt = now_sec() - t0;
+    pthread_join(w, NULL);
+    unsigned long calls = buffered ? nb.recv_calls : bytewise_calls;
+    printf("%-10s %8zu cmds  %10lu recv  %8.3f recv/cmd  %8.1f ns/cmd\n",
+           name, lines, calls, (double)calls / (double)lines, dt * 1e9 / (double)lines);
+    netbuf_free(&nb);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) ncmds = strtoul(argv[1], NULL, 10);
+    if (ncmds == 0) ncmds = 1;
+    run("bytewise", 0);
+    run("netbuf", 1);
+    return 0;
+}
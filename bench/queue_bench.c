@@ -0,0 +1,181 @@
+/* Microbenchmark: the lock-free queue_t against the previous mutex +
+ * condvar ring, with N producers and N consumers for N = 1..64. Each
+ * producer pushes its share of the items; consumers check that every item
+ * arrives exactly once. The batched run pushes and pops 16 at a time.
+ * Usage: ./bench/queue_bench [items] [max_threads] */
+#define _POSIX_C_SOURCE 200809L
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define BENCH_CAP 1024
+#define BENCH_BATCH 16
+
+/* the mutex ring queue_t used before, kept here as the baseline */
+typedef struct {
+    void **buf;
+    size_t capacity, head, tail, count;
+    int closed;
+    pthread_mutex_t mtx;
+    pthread_cond_t not_empty, not_full;
+} mutex_queue;
+
+static mutex_queue *mq_create(size_t capacity) {
+    mutex_queue *q = calloc(1, sizeof(*q));
+    q->buf = calloc(capacity, sizeof(void *));
+    q->capacity = capacity;
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return q;
+}
+
+static void mq_destroy(mutex_queue *q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mtx);
+    free(q->buf);
+    free(q);
+}
+
+static int mq_push(mutex_queue *q, void *item) {
+    pthread_mutex_lock(&q->mtx);
+    while (!q->closed && q->count == q->capacity) pthread_cond_wait(&q->not_full, &q->mtx);
+    if (q->closed) { pthread_mutex_unlock(&q->mtx); return -1; }
+    q->buf[q->tail] = item;
+    q->tail = (q->tail + 1) % q->capacity;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mtx);
+    return 0;
+}
+
+static void *mq_pop(mutex_queue *q) {
+    pthread_mutex_lock(&q->mtx);
+    while (!q->closed && q->count == 0) pthread_cond_wait(&q->not_empty, &q->mtx);
+    if (q->count == 0) { pthread_mutex_unlock(&q->mtx); return NULL; }
+    void *item = q->buf[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mtx);
+    return item;
+}
+
+static void mq_close(mutex_queue *q) {
+    pthread_mutex_lock(&q->mtx);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+enum { KIND_MUTEX, KIND_LOCKFREE, KIND_BATCH };
+static const char *kind_names[] = { "mutex", "lockfree", "batch16" };
+
+typedef struct {
+    int kind;
+    void *q;
+    size_t first, count;    /* producer: items first+1 .. first+count */
+    atomic_uchar *seen;     /* consumer: one flag per item */
+    int bad;
+} worker;
+
+static void *producer_main(void *arg) {
+    worker *w = arg;
+    void *items[BENCH_BATCH];
+    for (size_t i = 0; i < w->count;) {
+        if (w->kind == KIND_BATCH) {
+            size_t n = w->count - i < BENCH_BATCH ? w->count - i : BENCH_BATCH;
+            for (size_t k = 0; k < n; ++k) items[k] = (void *)(uintptr_t)(w->first + i + k + 1);
+            i += queue_push_batch(w->q, items, n);
+        } else {
+            void *item = (void *)(uintptr_t)(w->first + i + 1);
+            if (w->kind == KIND_MUTEX) mq_push(w->q, item);
+            else queue_push(w->q, item);
+            i++;
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_main(void *arg) {
+    worker *w = arg;
+    void *items[BENCH_BATCH];
+    for (;;) {
+        size_t n;
+        if (w->kind == KIND_BATCH) {
+            n = queue_pop_batch(w->q, items, BENCH_BATCH);
+        } else {
+            items[0] = w->kind == KIND_MUTEX ? mq_pop(w->q) : queue_pop(w->q);
+            n = items[0] != NULL;
+        }
+        if (n == 0) break;
+        for (size_t k = 0; k < n; ++k) {
+            if (atomic_exchange(&w->seen[(uintptr_t)items[k] - 1], 1)) w->bad = 1;
+        }
+    }
+    return NULL;
+}
+
+static double run(int kind, size_t threads, size_t total, int *ok) {
+    void *q = kind == KIND_MUTEX ? (void *)mq_create(BENCH_CAP) : (void *)queue_create(BENCH_CAP);
+    atomic_uchar *seen = calloc(total, sizeof(atomic_uchar));
+    worker *prod = calloc(threads, sizeof(worker)), *cons = calloc(threads, sizeof(worker));
+    pthread_t *pt = calloc(threads, sizeof(pthread_t)), *ct = calloc(threads, sizeof(pthread_t));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < threads; ++i) {
+        cons[i] = (worker){ .kind = kind, .q = q, .seen = seen };
+        pthread_create(&ct[i], NULL, consumer_main, &cons[i]);
+    }
+    size_t share = total / threads;
+    for (size_t i = 0; i < threads; ++i) {
+        prod[i] = (worker){ .kind = kind, .q = q, .first = i * share,
+                            .count = i + 1 == threads ? total - i * share : share };
+        pthread_create(&pt[i], NULL, producer_main, &prod[i]);
+    }
+    for (size_t i = 0; i < threads; ++i) pthread_join(pt[i], NULL);
+    if (kind == KIND_MUTEX) mq_close(q);
+    else queue_close(q);
+    for (size_t i = 0; i < threads; ++i) pthread_join(ct[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    *ok = 1;
+    for (size_t i = 0; i < threads; ++i) if (cons[i].bad) *ok = 0;
+    for (size_t i = 0; i < total; ++i) if (!seen[i]) *ok = 0;
+    if (kind == KIND_MUTEX) mq_destroy(q);
+    else queue_destroy(q);
+    free(seen);
+    free(prod);
+    free(cons);
+    free(pt);
+    free(ct);
+    return (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+    if (total == 0) total = 1;
+    printf("%zu items, capacity %d, N producers + N consumers\n", total, BENCH_CAP);
+    printf("%8s %12s %12s %12s  (Mops/s)\n", "N", kind_names[0], kind_names[1], kind_names[2]);
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        printf("%8zu", n);
+        for (int kind = KIND_MUTEX; kind <= KIND_BATCH; ++kind) {
+            int ok;
+            double dt = run(kind, n, total, &ok);
+            if (!ok) {
+                printf("\nLOST OR DUPLICATE ITEM: %s with %zu threads\n", kind_names[kind], n);
+                return 1;
+            }
+            printf(" %12.2f", (double)total / dt / 1e6);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+/* Microbenchmark: the server's task round trip with calloc/free against
+ * the slab caches. N producers (the reactors) allocate a task and queue
+ * it; N consumers (the workers) free the task, allocate a result and send
+ * it back to the producer, which frees it. Both objects are freed on a
+ * different thread than the one that allocated them. Prints round trips
+ * per second and malloc calls per round trip.
+ * Usage: ./bench/slab_bench [round_trips] [max_threads] */
+#define _POSIX_C_SOURCE 200809L
+#include "slab.h"
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_WINDOW 128 /* round trips a producer has in flight */
+
+/* sizes of Task and TaskResult in the server */
+typedef struct bench_task {
+    char filename[256];
+    char rest[160];
+    queue_t *reply;
+} bench_task;
+
+typedef struct bench_result {
+    char errmsg[256];
+    char rest[96];
+} bench_result;
+
+static slab_cache task_cache = SLAB_CACHE_INIT("task", sizeof(bench_task));
+static slab_cache result_cache = SLAB_CACHE_INIT("result", sizeof(bench_result));
+
+typedef struct {
+    int slab;
+    queue_t *tasks;
+    queue_t *reply;
+    size_t count;
+} worker;
+
+static void *obj_alloc(int slab, slab_cache *c, size_t size) {
+    return slab ? slab_alloc(c) : calloc(1, size);
+}
+
+static void obj_free(int slab, slab_cache *c, void *p) {
+    if (slab) slab_free(c, p);
+    else free(p);
+}
+
+static void *producer_main(void *arg) {
+    worker *w = arg;
+    size_t inflight = 0;
+    for (size_t i = 0; i < w->count; ++i) {
+        if (inflight == BENCH_WINDOW) {
+            obj_free(w->slab, &result_cache, queue_pop(w->reply));
+            inflight--;
+        }
+        bench_task *t = obj_alloc(w->slab, &task_cache, sizeof(bench_task));
+        snprintf(t->filename, sizeof(t->filename), "file%zu", i);
+        t->reply = w->reply;
+        queue_push(w->tasks, t);
+        inflight++;
+    }
+    while (inflight--) obj_free(w->slab, &result_cache, queue_pop(w->reply));
+    return NULL;
+}
+
+static void *consumer_main(void *arg) {
+    worker *w = arg;
+    bench_task *t;
+    while ((t = queue_pop(w->tasks)) != NULL) {
+        queue_t *reply = t->reply;
+        obj_free(w->slab, &task_cache, t);
+        bench_result *r = obj_alloc(w->slab, &result_cache, sizeof(bench_result));
+        r->errmsg[0] = 'k';
+        queue_push(reply, r);
+    }
+    return NULL;
+}
+
+static uint64_t sys_allocs(void) {
+    slab_stats st[SLAB_MAX_CACHES];
+    size_t n = slab_get_stats(st, SLAB_MAX_CACHES);
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; ++i) total += st[i].sys_allocs;
+    return total;
+}
+
+static double run(int slab, size_t threads, size_t total, double *mallocs) {
+    queue_t *tasks = queue_create(1024);
+    worker *prod = calloc(threads, sizeof(worker)), *cons = calloc(threads, sizeof(worker));
+    pthread_t *pt = calloc(threads, sizeof(pthread_t)), *ct = calloc(threads, sizeof(pthread_t));
+    uint64_t before = sys_allocs();
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < threads; ++i) {
+        cons[i] = (worker){ .slab = slab, .tasks = tasks };
+        pthread_create(&ct[i], NULL, consumer_main, &cons[i]);
+    }
+    size_t share = total / threads;
+    for (size_t i = 0; i < threads; ++i) {
+        prod[i] = (worker){ .slab = slab, .tasks = tasks, .reply = queue_create(2 * BENCH_WINDOW),
+                            .count = i + 1 == threads ? total - i * share : share };
+        pthread_create(&pt[i], NULL, producer_main, &prod[i]);
+    }
+    for (size_t i = 0; i < threads; ++i) pthread_join(pt[i], NULL);
+    queue_close(tasks);
+    for (size_t i = 0; i < threads; ++i) pthread_join(ct[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    /* calloc mode: one task and one result per round trip */
+    *mallocs = slab ? (double)(sys_allocs() - before) / (double)total : 2.0;
+    for (size_t i = 0; i < threads; ++i) queue_destroy(prod[i].reply);
+    queue_destroy(tasks);
+    free(prod);
+    free(cons);
+    free(pt);
+    free(ct);
+    return (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+    if (total == 0) total = 1;
+    printf("%zu round trips, N producers + N consumers\n", total);
+    printf("%8s %12s %12s %14s\n", "N", "calloc", "slab", "slab mallocs");
+    printf("%8s %12s %12s %14s\n", "", "(Mops/s)", "(Mops/s)", "per trip");
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        double m0, m1;
+        double plain = run(0, n, total, &m0);
+        double slab = run(1, n, total, &m1);
+        printf("%8zu %12.2f %12.2f %14.5f\n", n, (double)total / plain / 1e6, (double)total / slab / 1e6, m1);
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Content-addressed chunk store used by storage.c in dedup mode.
+ * Blobs are cut into content-defined chunks (gear rolling hash, 16 KB min,
+ * ~64 KB average, 256 KB max) named by their lanehash256 digest under
+ * <root>/.chunks/<xx>/. Each distinct chunk is stored once; a user file
+ * becomes a small text manifest listing its chunks. Chunk reference counts
+ * live in memory and are rebuilt from the manifests at startup. */
+
+/* activates the store if enable is set or <root>/.chunks already exists
+ * (dedup mode sticks to a storage root). Plain files found in user
+ * directories are converted to manifests. Returns 1 if active, 0 if not,
+ * -1 on error. Call before any other thread uses storage. */
+int chunkstore_init(const char *root, int enable);
+
+/* splits a stream into chunks as it is written; each new chunk is stored
+ * (or referenced) immediately, so no whole-file buffer is kept */
+typedef struct chunkstore_writer chunkstore_writer;
+chunkstore_writer *chunkstore_writer_new(void);
+int chunkstore_writer_write(chunkstore_writer *w, const void *buf, size_t n);
+/* cuts the last chunk and writes the manifest to fd; frees w */
+int chunkstore_writer_finish(chunkstore_writer *w, int fd);
+/* drops the references taken so far; frees w */
+void chunkstore_writer_abort(chunkstore_writer *w);
+
+/* logical size recorded in the manifest open at fd */
+int chunkstore_manifest_size(int fd, size_t *size);
+/* reads the file described by the manifest at fd in place from its chunk
+ * files. Each chunk is pinned until the reader is closed, so the version
+ * stays readable after the manifest is replaced or deleted. Open it under
+ * the file's lock; afterwards it needs none. One thread at a time. */
+typedef struct chunkstore_reader chunkstore_reader;
+chunkstore_reader *chunkstore_reader_open(int fd, size_t *len); /* NULL on error; len set */
+/* the chunk file holding byte pos: returns its fd (owned by the reader,
+ * valid until the next call) with bytes [*off, *off + *n) of it being the
+ * file from pos to the chunk's end, or -1 past the end or on error */
+int chunkstore_reader_fd(chunkstore_reader *rd, size_t pos, size_t *off, size_t *n);
+/* up to n bytes from pos across chunks; short only at the end, -1 on error */
+ssize_t chunkstore_reader_pread(chunkstore_reader *rd, void *buf, size_t n, size_t pos);
+void chunkstore_reader_close(chunkstore_reader *rd);
+/* releases the chunks of a manifest that was deleted or replaced */
+void chunkstore_unref(int fd);
+
+typedef struct chunkstore_stats {
+    uint64_t chunks;        /* distinct chunks on disk */
+    uint64_t logical_bytes; /* bytes referenced by all manifests */
+    uint64_t stored_bytes;  /* bytes actually stored */
+} chunkstore_stats;
+void chunkstore_get_stats(chunkstore_stats *st);
+
+#endif /* CHUNKSTORE_H */
@@ -2,9 +2,21 @@
 #define CLIENT_POOL_H
 
 #include "queue.h"
+#include "server_types.h"
 
-/* start/stop client pool */
-int client_pool_start(size_t num_threads, queue_t *client_queue, queue_t *task_queue);
+/* start/stop client pool: num_threads epoll reactors fed from client_queue,
+ * submitting tasks to the worker pool.
+ * upload_buffer_cap bounds the bytes of upload chunk buffers in flight;
+ * max_inflight_per_session bounds pipelined (tagged) tasks per session. */
+int client_pool_start(size_t num_threads, queue_t *client_queue,
+                      size_t upload_buffer_cap, int max_inflight_per_session);
 void client_pool_stop(void);
 
+/* called by workers: hand a finished task back to the reactor owning res->session */
+void client_pool_complete(TaskResult *res);
+
+/* answer a connection that cannot be taken on with ERR serverbusy and a
+ * retry-after hint, then close it */
+void client_pool_refuse(int fd);
+
 #endif /* CLIENT_POOL_H */
@@ -0,0 +1,48 @@
+#ifndef DELTA_H
+#define DELTA_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* rsync-style delta encoding, shared by the server and client_app.
+ * The server describes its copy as one signature per block: a rolling weak
+ * checksum plus a 128-bit strong hash. The client scans its new version
+ * with the rolling checksum and sends a stream of ops:
+ *   'C' u32 first_block u32 block_count   copy blocks of the old version
+ *   'L' u32 length <bytes>                literal bytes
+ * Integers are little endian. */
+
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_HDR 9          /* op byte + two u32 (literal ops use one) */
+#define DELTA_STRONG_LEN 16
+#define DELTA_SIG_LEN (4 + DELTA_STRONG_LEN)
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (64 * 1024)
+
+/* block size for a file of this size: about sqrt(size), 1 KB aligned */
+size_t delta_block_size(size_t filesize);
+
+uint32_t delta_weak(const unsigned char *p, size_t n);
+
+/* slide the weak checksum of an n-byte window one byte forward */
+static inline uint32_t delta_weak_roll(uint32_t w, unsigned char out, unsigned char in, size_t n) {
+    uint32_t a = w & 0xffff, b = w >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)(n * out) + a) & 0xffff;
+    return a | (b << 16);
+}
+
+void delta_strong(const unsigned char *p, size_t n, uint8_t out[DELTA_STRONG_LEN]);
+
+static inline void delta_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline uint32_t delta_get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif /* DELTA_H */
@@ -4,12 +4,45 @@
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 2048
 
-/* queue capacities */
+/* queue capacities (server --client-queue / --task-queue override) */
 #define CLIENT_QUEUE_CAP 256
 #define TASK_QUEUE_CAP 1024
+/* how long accept waits for room in the client queue before it answers
+ * ERR serverbusy and closes the connection */
+#define CLIENT_QUEUE_WAIT_MS 100
 
-/* threadpool sizes (tune as needed) */
+/* threadpool sizes (server --reactors / --workers <min>[:<max>] override);
+ * the worker pool scales between WORKER_POOL_SIZE and WORKER_POOL_MAX */
 #define CLIENT_POOL_SIZE 4
 #define WORKER_POOL_SIZE 4
+#define WORKER_POOL_MAX 16
+/* workers that only run latency-sensitive tasks (LIST, DELETE, DOWNLOAD, ...) */
+#define WORKER_FAST_RESERVED 1
+
+/* total upload chunk buffers in flight across all sessions (server
+ * --upload-mb overrides) */
+#define UPLOAD_BUFFER_CAP (64 * 1024 * 1024)
+
+/* tasks one user may have queued or running over all its sessions (server
+ * --user-tasks overrides) */
+#define USER_MAX_TASKS 64
+
+/* per-user quota in MB (server --quota-mb overrides; 0 = none); users in
+ * server_storage/quotas.txt get their own */
+#define USER_QUOTA_MB 0
+
+/* memory for cached download files (server --cache-mb overrides; 0 = off) */
+#define FILE_CACHE_CAP (64 * 1024 * 1024)
+
+/* durable mode: how long a synced batch collects writes (server
+ * --durable-window <us> overrides) */
+#define DURABLE_WINDOW_US 500
+
+/* files in one LIST reply: the default page size and the most a client may
+ * ask for */
+#define LIST_PAGE_MAX 1000
+
+/* pipelined (tagged) tasks a session may have outstanding */
+#define SESSION_MAX_INFLIGHT 32
 
 #endif /* DROPBOX_H */
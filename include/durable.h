@@ -0,0 +1,33 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+#include <stdint.h>
+#include "server_types.h"
+
+/* Group commit for durable mode. Instead of posting the result of a
+ * successful UPLOAD, PATCH or DELETE, a worker hands it to the sync thread,
+ * which collects results for up to window_us after the first one arrives,
+ * syncs the whole batch with storage_sync, and only then posts the replies.
+ * An acknowledged write therefore survives a crash, and a busy server pays
+ * one sync per batch instead of one per file. If the sync fails, the writes
+ * are still in place, so every reply in the batch stays OK but is marked
+ * unsynced ("OK upload unsynced"). */
+int durable_start(unsigned window_us);
+/* syncs and posts what is pending; after the workers stop, before the reactors */
+void durable_stop(void);
+int durable_enabled(void);
+
+/* res goes to client_pool_complete once user's filename is synced */
+void durable_submit(TaskResult *res, const char *username, const char *filename);
+
+typedef struct durable_stats {
+    int enabled;
+    uint64_t window_us;
+    uint64_t batches;       /* storage_sync calls */
+    uint64_t writes;        /* replies released by them */
+    uint64_t batch_max;     /* largest batch */
+    uint64_t syncfs;        /* batches synced with one syncfs */
+    uint64_t errors;        /* failed batches */
+} durable_stats;
+void durable_get_stats(durable_stats *st);
+
+#endif /* DURABLE_H */
@@ -0,0 +1,71 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Hash-sharded layout for plain files, used by storage.c. A sharded user
+ * keeps <root>/<user>/<name> at <root>/<user>/.fanout/<xx>/<name>, xx being
+ * the top byte of the name's (mixed) FNV-1a hash, so each of the 256 directories
+ * holds about a 256th of the files (and of the temp files next to them).
+ * One level is enough: more, sparser directories cost more in inode and
+ * journal traffic than they save at the sizes an account reaches. Shard
+ * directories are made on first use.
+ *
+ * Each user is in one of three layouts, kept on disk: flat (no .fanout),
+ * migrating (.fanout without .fanout/done: new writes go to shards, older
+ * files may still be flat) and sharded. With fanout enabled, new users
+ * start sharded and a background thread migrates the flat ones online:
+ * it flips a user to migrating, moves every flat file into its shard with
+ * a rename that never replaces (a newer version already written there
+ * wins), and marks the user done. Users already migrating or sharded stay
+ * so whether or not fanout is enabled. */
+#define FANOUT_DIR ".fanout"
+
+enum { FANOUT_FLAT = 0, FANOUT_MIGRATING = 1, FANOUT_SHARDED = 2 };
+
+/* enable makes new users sharded (and lets the migration run). With it off,
+ * and no user already migrating or sharded, every user stays flat at no
+ * cost. */
+int fanout_init(const char *root, int enable);
+void fanout_shutdown(void); /* stops the migration thread */
+
+/* enable only: migrate the users that are not sharded yet, in the
+ * background. Call once storage has loaded its file indexes. */
+int fanout_migrate_start(void);
+
+/* the user's layout, read from disk on first use */
+int fanout_layout(const char *user);
+/* a write (commit or delete) holds its user's layout steady from choosing
+ * a path to its rename or unlink: the flip to migrating waits for it.
+ * *layout gets the layout; pass the handle (maybe NULL) to unlock. */
+typedef struct fanout_user fanout_user;
+fanout_user *fanout_lock(const char *user, int *layout);
+void fanout_unlock(fanout_user *fu);
+
+/* enable only: create <root>/<user> sharded from the start. It is built
+ * under a temporary name and renamed into place, so no write can see the
+ * user flat first. 0 if made, 1 if it existed, -1 on error. */
+int fanout_new_user(const char *user);
+
+/* <root>/<user>/.fanout/<xx>[/<name>] */
+void fanout_dir(const char *user, const char *name, char *path, size_t n);
+void fanout_path(const char *user, const char *name, char *path, size_t n);
+/* create name's shard directory, for a create that failed with ENOENT.
+ * Not synced: a durable write syncs its shard and .fanout. */
+int fanout_mkdir(const char *user, const char *name);
+
+/* calls fn for each regular file in the user's shards (temp files, whose
+ * names start with '.', are skipped) */
+typedef void (*fanout_visit_fn)(void *ctx, const char *name, const struct stat *st);
+int fanout_each(const char *user, fanout_visit_fn fn, void *ctx);
+
+typedef struct fanout_stats {
+    int enabled;
+    uint64_t sharded;   /* users known to be sharded */
+    uint64_t migrating;
+    uint64_t moved;     /* flat files the migration moved into shards */
+} fanout_stats;
+void fanout_get_stats(fanout_stats *st);
+
+#endif /* FANOUT_H */
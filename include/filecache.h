@@ -0,0 +1,59 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* Shared cache of hot download files for the worker pool. Files up to
+ * filecache_max_object() bytes are kept whole in refcounted buffers; larger
+ * ones still stream from the page cache with sendfile. The key space is
+ * split over FILECACHE_SHARDS shards, each with its own lock, hash table
+ * and CLOCK hand, and its slice of the memory budget (size-aware: a new
+ * entry evicts until its bytes fit). Readers hold a reference, so an entry
+ * evicted or invalidated while a download sends it stays valid until the
+ * last reference is dropped. Keys are "<user>/<file>"; callers fill and
+ * invalidate under that file's lock. */
+
+#define FILECACHE_SHARDS 16
+
+typedef struct filecache_blob {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} filecache_blob;
+
+/* budget in bytes; 0 disables the cache. Call before the workers start. */
+int filecache_init(size_t budget);
+void filecache_shutdown(void);
+
+/* largest file that is cached; 0 when disabled */
+size_t filecache_max_object(void);
+
+/* a referenced entry, or NULL; counts a hit or a miss */
+filecache_blob *filecache_get(const char *key);
+
+/* reads len bytes of fd from off into a new entry for key; returns it
+ * referenced for the caller, or NULL if it is too big or the read fails */
+filecache_blob *filecache_load(const char *key, int fd, size_t off, size_t len);
+/* the same, reading with fn(ctx, buf, n, off) (bytes read, 0 at the
+ * end, -1 on error) for files that are not one fd */
+typedef ssize_t (*filecache_read_fn)(void *ctx, void *buf, size_t n, size_t off);
+filecache_blob *filecache_load_with(const char *key, filecache_read_fn fn, void *ctx, size_t off, size_t len);
+
+/* drop the entry for key after the file was replaced or deleted */
+void filecache_invalidate(const char *key);
+
+void filecache_release(filecache_blob *b);
+
+typedef struct filecache_stats {
+    uint64_t budget;
+    uint64_t bytes;         /* bytes held by live entries */
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} filecache_stats;
+void filecache_get_stats(filecache_stats *st);
+
+#endif /* FILECACHE_H */
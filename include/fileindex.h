@@ -0,0 +1,92 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Per-user metadata index used by storage.c: name, size, mtime and content
+ * hash of every file in <root>/<user>/, kept sorted by name in memory so
+ * LIST costs time proportional to its output instead of a readdir plus a
+ * stat (and, in dedup mode, a manifest read) per file, and is served a page
+ * at a time.
+ *
+ * A user's index is loaded on first use from <root>/<user>/.index, an
+ * append-only log of fixed-header records (put, delete) behind a magic.
+ * Storage appends a record after each rename or unlink; the log is
+ * rewritten from the live entries once it holds twice as many records as
+ * files. A clean shutdown ends the log with a clean record carrying the
+ * user's usage, which the next load strips again; a log without one (a
+ * crash, a torn record) is replaced by a rescan of the directory, keeping
+ * the hashes of files whose size and mtime did not change. */
+#define FILEINDEX_LOG ".index"
+#define FILEINDEX_NAME_MAX 255
+
+/* logical size of the file at path (st is its stat); 0 or -1 to skip it */
+typedef int (*fileindex_size_fn)(const char *path, const struct stat *st, uint64_t *size);
+/* a rescan also takes the files storage keeps outside the directory (see
+ * packstore.h, fanout.h): extra_fn calls add(ctx, ...) for each of the
+ * user's, and they win over a file of the same name in the directory. A
+ * hash of 0 keeps the old entry's if size and mtime did not change. */
+typedef void (*fileindex_add_fn)(void *ctx, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash);
+typedef int (*fileindex_extra_fn)(const char *user, fileindex_add_fn add, void *ctx);
+
+/* learns every user's usage: from the clean record of a log, or by loading
+ * (and if need be rescanning) the index of one that has none. extra_fn may
+ * be NULL. */
+int fileindex_init(const char *root, fileindex_size_fn size_fn, fileindex_extra_fn extra_fn);
+/* ends every loaded log with a clean record; no other call may follow */
+void fileindex_shutdown(void);
+
+/* record a version renamed into place, or a file unlinked. Callers serialise
+ * updates to one file (storage holds its file lock). Names starting with '.'
+ * are storage's own and are not indexed. */
+void fileindex_put(const char *user, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash);
+void fileindex_remove(const char *user, const char *name);
+/* the indexed size of name, 0 if it has none (loads the index if need be) */
+uint64_t fileindex_size(const char *user, const char *name);
+
+/* one page of "name size\n" lines, NUL-terminated and malloc'd: up to limit
+ * files whose names start with prefix and sort (bytewise) after `after`,
+ * in name order. "" for both starts at the first file. next (at least
+ * FILEINDEX_NAME_MAX + 1 bytes) gets the last name listed when more files
+ * match, "" after the last page. Only the page is visited or allocated.
+ * NULL if the user has no directory; len (optional) gets the length. */
+char *fileindex_list(const char *user, const char *prefix, const char *after, size_t limit, size_t *len,
+                     char *next);
+
+/* usage accounting for quotas, kept next to the entries (a put or remove
+ * adjusts it) and safe to read from any thread without loading them */
+typedef struct fileindex_usage {
+    uint64_t bytes;    /* logical bytes in the indexed files */
+    uint64_t files;
+    uint64_t reserved; /* held by uploads in progress */
+} fileindex_usage;
+void fileindex_get_usage(const char *user, fileindex_usage *us);
+/* hold bytes for an upload unless bytes + reserved + usage would pass limit
+ * (0 = no limit): 0 if held, -1 if not. Release after the upload's put. */
+int fileindex_reserve(const char *user, uint64_t bytes, uint64_t limit);
+void fileindex_release(const char *user, uint64_t bytes);
+
+/* streaming 64-bit content hash (XXH64, seed 0): four independent lanes
+ * over 32-byte stripes, so it keeps up with the upload path. 0 means "not
+ * known" (a file the index found on a rescan); a digest of 0 is stored as 1. */
+typedef struct fileindex_hasher {
+    uint64_t lane[4];
+    uint64_t len;
+    unsigned char tail[32];
+    unsigned tail_len;
+} fileindex_hasher;
+void fileindex_hash_init(fileindex_hasher *h);
+void fileindex_hash_update(fileindex_hasher *h, const void *data, size_t n);
+uint64_t fileindex_hash_final(const fileindex_hasher *h);
+
+typedef struct fileindex_stats {
+    uint64_t users;       /* indexes loaded */
+    uint64_t entries;     /* files across them */
+    uint64_t appends;     /* log records written */
+    uint64_t compactions; /* logs rewritten from the live entries */
+    uint64_t rescans;     /* indexes rebuilt from a directory scan */
+} fileindex_stats;
+void fileindex_get_stats(fileindex_stats *st);
+
+#endif /* FILEINDEX_H */
@@ -0,0 +1,22 @@
+#ifndef LANEHASH_H
+#define LANEHASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* 256-bit content hash for the chunk store. Eight independent 64-bit lanes
+ * take one 64-byte stripe per step (multiply-accumulate in the style of
+ * XXH3), so the inner loop runs on SSE2 or AVX2 registers. Every variant
+ * produces the same digest. Not cryptographic: the chunk store compares
+ * bytes before it trusts a match. */
+#define LANEHASH_LEN 32
+
+void lanehash256(const void *data, size_t len, uint8_t out[LANEHASH_LEN]);
+
+/* the variant lanehash256 dispatches to ("avx2", "sse2" or "scalar") */
+const char *lanehash_impl(void);
+
+/* individual variants, for the benchmark; NULL where the CPU lacks them */
+typedef void (*lanehash_fn)(const void *data, size_t len, uint8_t out[LANEHASH_LEN]);
+lanehash_fn lanehash_variant(const char *name);
+
+#endif /* LANEHASH_H */
@@ -0,0 +1,45 @@
+#ifndef LZBLOCK_H
+#define LZBLOCK_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* LZ4-class block codec for transfer bodies, shared by the server and
+ * client_app. The compressed format is the LZ4 block format (byte token,
+ * 16-bit offsets), so one block is at most 64 KB.
+ *
+ * A compressed body is a stream of frames, each one block of the file:
+ *   u32 raw_len  u32 z_len  <payload>
+ * z_len 0 means the payload is the raw_len bytes as they are; otherwise it
+ * is z_len bytes of compressed data. Integers are little endian. */
+
+#define LZBLOCK_MAX (64 * 1024)
+#define LZBLOCK_HDR 8
+#define LZBLOCK_FRAME_MAX (LZBLOCK_HDR + LZBLOCK_MAX)
+
+/* compress n <= LZBLOCK_MAX bytes; returns the compressed size, or 0 if
+ * the result would not fit in cap bytes */
+size_t lzblock_compress(const void *src, size_t n, void *dst, size_t cap);
+
+/* decode untrusted input; returns the decoded size, or -1 if it is
+ * malformed or would exceed cap bytes */
+long lzblock_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+/* adaptive skipping: a block that does not shrink by at least 1/16 is sent
+ * raw, and the next 1, 2, 4 ... 64 blocks are sent raw without trying */
+typedef struct {
+    unsigned skip;          /* blocks still to send without trying */
+    unsigned backoff;       /* length of the last skip run */
+} lzblock_adapt;
+
+/* frame n <= LZBLOCK_MAX bytes into dst (LZBLOCK_FRAME_MAX bytes);
+ * returns the frame size. *z is set when the block was compressed. */
+size_t lzblock_frame(lzblock_adapt *a, const void *src, size_t n, void *dst, int *z);
+
+/* parse a frame header; returns 0 and the raw and payload sizes, or -1 */
+int lzblock_frame_header(const void *hdr, size_t *raw, size_t *payload);
+
+/* decode one whole frame into dst (LZBLOCK_MAX bytes); returns the raw
+ * size or -1 */
+long lzblock_frame_decode(const void *frame, size_t n, void *dst);
+
+#endif /* LZBLOCK_H */
@@ -0,0 +1,45 @@
+#ifndef NETBUF_H
+#define NETBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Buffered socket reader: a ring buffer filled with large recv calls.
+ * Command lines are parsed out of it and whatever follows a line (an
+ * UPLOAD/DOWNLOAD body) is handed to the body reader via netbuf_take. */
+typedef struct netbuf {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t head;              /* index of first buffered byte */
+    size_t len;               /* buffered bytes */
+    unsigned long recv_calls; /* syscalls issued, for benchmarking */
+} netbuf;
+
+int netbuf_init(netbuf *nb, int fd, size_t cap);
+void netbuf_free(netbuf *nb);
+
+static inline size_t netbuf_len(const netbuf *nb) { return nb->len; }
+static inline size_t netbuf_room(const netbuf *nb) { return nb->cap - nb->len; }
+/* first buffered byte; only valid when netbuf_len() > 0 */
+static inline char netbuf_peek(const netbuf *nb) { return nb->buf[nb->head]; }
+
+/* one recv into the free space; returns bytes read, 0 on EOF, -1 on error
+ * (errno set; EAGAIN for non-blocking sockets with nothing to read) */
+ssize_t netbuf_fill(netbuf *nb);
+
+/* copy one buffered line (with its '\n') into out as a C string. A line
+ * longer than maxlen-1 is split. Returns its length, or 0 if no complete
+ * line is buffered yet. Never touches the socket. */
+size_t netbuf_getline(netbuf *nb, char *out, size_t maxlen);
+
+/* move up to n buffered bytes to dst; returns bytes moved */
+size_t netbuf_take(netbuf *nb, void *dst, size_t n);
+/* drop up to n buffered bytes; returns bytes dropped */
+size_t netbuf_skip(netbuf *nb, size_t n);
+
+/* blocking helpers for clients: same contracts as the old recv loops */
+ssize_t netbuf_readline(netbuf *nb, char *out, size_t maxlen);
+ssize_t netbuf_read_n(netbuf *nb, void *dst, size_t n);
+
+#endif /* NETBUF_H */
@@ -0,0 +1,68 @@
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-structured store for small files, used by storage.c in pack mode.
+ * Files up to PACKSTORE_FILE_MAX bytes are appended as records (header,
+ * name, data) to per-user segment files under <root>/.pack/<user>/, so a
+ * small upload is one pwrite to an open file instead of a temp file create,
+ * write, close and rename, and a download is a range of an open segment.
+ * An in-memory table maps each name to its newest record; it is rebuilt
+ * from the segments on a user's first use (records carry a sequence number
+ * and a content hash, a torn tail is cut off).
+ *
+ * A segment is closed at PACKSTORE_SEGMENT_BYTES and a new one started.
+ * Overwrites and deletes leave dead records behind; once a user's dead bytes
+ * pass their live bytes a background thread copies the live records of the
+ * oldest segment to the newest and unlinks it. Oldest first is what lets it
+ * drop delete records: any older version they hide is in that segment. */
+#define PACKSTORE_FILE_MAX (16 * 1024)
+#define PACKSTORE_SEGMENT_BYTES (8u << 20)
+
+/* activates the store if enable is set or <root>/.pack already exists (pack
+ * mode sticks to a storage root) and starts the compaction thread. Returns
+ * 1 if active, 0 if not, -1 on error. */
+int packstore_init(const char *root, int enable);
+/* stops the compaction thread and closes the segments */
+void packstore_shutdown(void);
+
+/* Callers serialise updates to one name (storage holds its file lock). */
+
+/* append a version of name; mtime_ns gets its time. 1 if it replaced a
+ * packed version, 0 if the name was not packed, -1 on error. */
+int packstore_put(const char *user, const char *name, const void *data, size_t n, uint64_t hash,
+                  int64_t *mtime_ns);
+/* 0 if a packed version was removed, 1 if the name was not packed, -1 on error */
+int packstore_remove(const char *user, const char *name);
+
+/* where the current version lives: bytes [off, off + len) of fd, a
+ * descriptor of its own (close it) that keeps the data readable after a
+ * later overwrite, delete or compaction */
+typedef struct packstore_loc {
+    int fd;
+    uint64_t off;
+    uint64_t len;
+    int64_t mtime_ns;
+    uint64_t hash;
+} packstore_loc;
+/* 0 and loc filled, 1 if the name is not packed, -1 on error */
+int packstore_open(const char *user, const char *name, packstore_loc *loc);
+
+/* calls fn for each of a user's packed files (for a file index rescan) */
+typedef void (*packstore_visit_fn)(void *ctx, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash);
+int packstore_each(const char *user, packstore_visit_fn fn, void *ctx);
+
+/* fdatasync the user's segments written since the last call */
+int packstore_sync(const char *user);
+
+typedef struct packstore_stats {
+    uint64_t files;       /* live packed files */
+    uint64_t segments;
+    uint64_t live_bytes;  /* records of live files */
+    uint64_t dead_bytes;  /* overwritten or deleted, until compacted */
+    uint64_t compactions; /* segments compacted away */
+} packstore_stats;
+void packstore_get_stats(packstore_stats *st);
+
+#endif /* PACKSTORE_H */
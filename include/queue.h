@@ -5,22 +5,50 @@
 #include <pthread.h>
 #include <stdatomic.h>
 
+/* Bounded lock-free multi-producer/multi-consumer ring (Vyukov): each slot
+ * carries a sequence number that says whether it is free or full for the
+ * current lap, so producers and consumers only contend on their own
+ * cache-line-padded position counter. A thread that finds the ring full
+ * (or empty) spins briefly, then parks on a condvar; the other side only
+ * takes the park mutex when someone is parked. */
+#define QUEUE_CACHE_LINE 64
+
+typedef struct queue_cell {
+    atomic_size_t seq;
+    void *item;
+} queue_cell;
+
 typedef struct queue_t {
-    void **buf;
-    size_t capacity;
-    size_t head;
-    size_t tail;
-    size_t count;
-    pthread_mutex_t mtx;
+    queue_cell *buf;
+    size_t mask;            /* capacity - 1; capacity is a power of two */
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t head; /* next slot to pop */
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail; /* next slot to push */
+    _Alignas(QUEUE_CACHE_LINE) atomic_int closed;
+    atomic_int pop_waiters;  /* threads parked (or parking) on not_empty */
+    atomic_int push_waiters; /* threads parked (or parking) on not_full */
+    pthread_mutex_t park_mtx;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
-    atomic_int closed;
 } queue_t;
 
-queue_t *queue_create(size_t capacity);
+queue_t *queue_create(size_t capacity); /* rounded up to a power of two */
 void queue_destroy(queue_t *q);
 int queue_push(queue_t *q, void *item); /* returns 0 on success, -1 if closed/error */
+/* like queue_push, but waits at most timeout_ms for a free slot: -2 if none came */
+int queue_push_timed(queue_t *q, void *item, unsigned timeout_ms);
 void *queue_pop(queue_t *q);             /* returns item or NULL if closed and empty */
 void queue_close(queue_t *q);
 
+/* push all n items, blocking while full; returns how many were pushed
+ * (fewer than n only if the queue was closed) */
+size_t queue_push_batch(queue_t *q, void **items, size_t n);
+/* wait for at least one item and take up to max; returns 0 if closed and empty */
+size_t queue_pop_batch(queue_t *q, void **out, size_t max);
+
+/* non-blocking: -1 if full or closed / NULL if empty */
+int queue_try_push(queue_t *q, void *item);
+void *queue_try_pop(queue_t *q);
+/* items queued right now; a snapshot, racy under concurrent use */
+size_t queue_depth(queue_t *q);
+
 #endif /* QUEUE_H */
@@ -3,35 +3,65 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /* Task types */
-typedef enum { TASK_UPLOAD, TASK_DOWNLOAD, TASK_DELETE, TASK_LIST } TaskType;
+/* TASK_UPLOAD_BEGIN opens a resumable upload's partial file; TASK_UPLOAD_CHUNK
+ * appends to an upload in progress; TASK_UPLOAD writes the last chunk and
+ * commits it. TASK_SIGS returns delta signatures; TASK_PATCH is the last
+ * chunk of a delta upload. */
+typedef enum { TASK_UPLOAD, TASK_UPLOAD_BEGIN, TASK_UPLOAD_CHUNK, TASK_DOWNLOAD, TASK_DELETE, TASK_LIST,
+               TASK_SIGS, TASK_PATCH } TaskType;
+
+struct Reactor;
+struct storage_upload;
+struct storage_patch;
+struct filecache_blob;
+struct wp_tenant;
 
 typedef struct ClientSession {
     int sockfd;
     char username[64];   /* set after login */
     int logged_in;
-    pthread_mutex_t resp_lock;
-    pthread_cond_t resp_cv;
-    struct TaskResult *pending_result; /* worker writes here & signals */
+    struct Reactor *reactor; /* I/O thread that owns the connection; results are posted there */
     int alive; /* 1 while session active */
 } ClientSession;
 
 typedef struct Task {
     TaskType type;
     char filename[256];
-    size_t filesize;        /* for upload if client provides size */
-    char *upload_data;      /* allocated by client thread, freed by worker */
+    size_t filesize;        /* bytes in upload_data */
+    char *upload_data;      /* chunk buffer, owned by the connection */
+    struct storage_upload *upload; /* open upload the chunk belongs to */
+    struct storage_patch *patch;   /* set instead of upload for delta chunks */
+    int framed;             /* upload_data holds lzblock frames (see lzblock.h) */
+    size_t offset;          /* DOWNLOAD range start */
+    size_t length;          /* DOWNLOAD range length, 0 = to end of file; LIST page size */
+    char after[256];        /* LIST: continue after this name ("" = from the start; filename holds the prefix) */
     ClientSession *session; /* pointer to originating client session */
-    unsigned long task_id;
+    unsigned long task_id;  /* client's pipeline tag, 0 for untagged commands */
+    void *ctx;              /* opaque to workers; returned in the result */
+    uint64_t submit_ns;     /* set by worker_pool_submit, for lane latency */
+    struct wp_tenant *tenant; /* worker pool fair-share bookkeeping */
+    struct Task *next;      /* user's backlog in the worker pool */
 } Task;
 
 typedef struct TaskResult {
+    TaskType type;
     int status;            /* 0 OK, -1 error */
-    char *payload;         /* for DOWNLOAD or LIST; malloc'd by worker */
-    size_t payload_size;
+    int unsynced;          /* durable mode: the write took effect but its sync failed */
+    char *payload;         /* for LIST and SIGS; malloc'd by worker */
+    char *cursor;          /* LIST: name the next page starts after, malloc'd; NULL on the last page */
+    int fd;                /* for DOWNLOAD: open file to stream, -1 if none */
+    struct filecache_blob *blob; /* for DOWNLOAD: cached file to send instead of fd */
+    struct chunkstore_reader *chunks; /* for DOWNLOAD in dedup mode: chunk files to send instead of fd */
+    size_t payload_size;   /* bytes in payload, or bytes to send from fd */
+    size_t offset;         /* fd start offset; bytes held for UPLOAD_BEGIN */
     char errmsg[256];
     unsigned long task_id;
+    void *ctx;
+    ClientSession *session;  /* session the result is routed back to */
+    struct TaskResult *next; /* reactor completion list */
 } TaskResult;
 
 #endif /* SERVER_TYPES_H */
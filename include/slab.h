@@ -0,0 +1,58 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Object caches for the server's hot fixed-size objects (tasks, results,
+ * connections, output chunks). Objects are carved from malloc'd slabs of
+ * SLAB_OBJECTS and never returned to malloc until slab_release. Each thread
+ * keeps two magazines of up to SLAB_BATCH free objects per cache, so alloc
+ * and free touch no shared state; when both are empty (or full) a whole
+ * magazine is swapped with the cache's depot under its mutex. An object
+ * allocated on one thread and freed on another (a Task made by a reactor
+ * and freed by a worker) therefore goes back in batches. A thread's
+ * magazines return to the depot when it exits. */
+
+#define SLAB_OBJECTS 64
+#define SLAB_BATCH 32
+#define SLAB_MAX_CACHES 8
+
+struct slab_obj;
+
+typedef struct slab_cache {
+    const char *name;
+    size_t size;
+    atomic_int id;           /* index into the thread magazines; 0 = not yet registered */
+    pthread_mutex_t mtx;     /* guards the depot, slabs and counters below */
+    struct slab_obj *depot;  /* magazines, linked through their first object */
+    void *slabs;             /* system allocations, for slab_release */
+    uint64_t objects;        /* objects carved */
+    uint64_t sys_allocs;     /* malloc calls */
+    uint64_t depot_swaps;    /* magazines taken from or given to the depot */
+    atomic_ullong allocs;    /* slab_alloc calls; not under mtx */
+} slab_cache;
+
+/* static initializer; a cache needs no other setup */
+#define SLAB_CACHE_INIT(nm, sz) { .name = (nm), .size = (sz), .mtx = PTHREAD_MUTEX_INITIALIZER }
+
+/* a zeroed object (like calloc), or NULL if out of memory */
+void *slab_alloc(slab_cache *c);
+/* p must come from slab_alloc on c; NULL is ignored */
+void slab_free(slab_cache *c, void *p);
+/* free every slab; only once no thread uses c any more */
+void slab_release(slab_cache *c);
+
+typedef struct slab_stats {
+    const char *name;
+    uint64_t objects;
+    uint64_t sys_allocs;
+    uint64_t allocs;
+    uint64_t depot_swaps;
+} slab_stats;
+/* fills up to max entries, one per cache used so far; returns how many */
+size_t slab_get_stats(slab_stats *st, size_t max);
+
+#endif /* SLAB_H */
@@ -2,20 +2,146 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 #include <stddef.h>
+#include <stdint.h>
 
+/* dedup mode (content-addressed chunk store) for storage_init; a storage
+ * root that has been deduplicated stays that way */
+void storage_set_dedup(int enable);
+/* pack mode for storage_init: small files are appended to per-user segment
+ * files (see packstore.h) instead of getting an inode each; a storage root
+ * that has packed files stays that way. Not used in dedup mode. */
+void storage_set_pack(int enable);
+/* fanout for storage_init: new users keep their files in hashed
+ * subdirectories (see fanout.h) and existing ones are migrated in the
+ * background; users once sharded stay so. Not used in dedup mode. */
+void storage_set_fanout(int enable);
+/* default per-user quota in bytes for storage_init (0 = none); users listed
+ * in server_storage/quotas.txt ("<user> <MB>" lines) get their own */
+void storage_set_quota(uint64_t bytes);
 int storage_init(void);
+/* after the pools have stopped: closes the file index logs (fileindex.h) */
+void storage_shutdown(void);
 int storage_ensure_userdir(const char *username);
 
 /* write a blob to user's filename (atomic via temp+rename) */
 int storage_write_blob(const char *username, const char *filename, const char *buf, size_t n);
 
+/* streaming upload: chunks are appended to a private temp file which
+ * commit renames over the target; abort removes it. begin does no I/O. */
+typedef struct storage_upload storage_upload;
+storage_upload *storage_upload_begin(const char *username, const char *filename);
+int storage_upload_write(storage_upload *u, const char *buf, size_t n);
+/* frees u; -3 if it no longer fits the quota reserved for it (see
+ * storage_upload_reserve) */
+int storage_upload_commit(storage_upload *u);
+void storage_upload_abort(storage_upload *u);  /* frees u */
+/* 1 if filename starts with '.': storage keeps those names for itself, so
+ * begin, resume, patch and delete refuse them */
+int storage_name_reserved(const char *filename);
+/* hold what a size-byte version adds to the user's usage (its growth over
+ * the indexed file it replaces, if any) until u is committed or freed: 0,
+ * or -2 if that does not fit next to what is stored and already held.
+ * Commit, under the file lock, holds the growth over the version it
+ * actually replaces. */
+int storage_upload_reserve(storage_upload *u, size_t size);
+
+/* resumable upload of a total-byte file: the temp file is a persistent
+ * partial that survives disconnects. storage_upload_open claims it and
+ * reports how many bytes it already holds (writes append from there);
+ * returns -2 if another session is writing it. close keeps the partial
+ * of a resumable upload and removes any other temp file. */
+storage_upload *storage_upload_resume(const char *username, const char *filename, size_t total);
+int storage_upload_open(storage_upload *u, size_t *offset);
+void storage_upload_close(storage_upload *u); /* frees u */
+
 /* read whole file into malloc'd buffer; returns NULL on error; len set */
 char *storage_read_file(const char *username, const char *filename, size_t *len);
 
+/* open file read-only for zero-copy sends; returns 0 or -1. The file is
+ * bytes [off, off + len) of *fd: a packed file is a range of its segment.
+ * In dedup mode it is all of *chunks instead, read in place from the chunk
+ * files (see chunkstore.h), and *fd is -1. */
+struct chunkstore_reader;
+int storage_open_file(const char *username, const char *filename, int *fd, struct chunkstore_reader **chunks,
+                      size_t *off, size_t *len);
+
+/* delta sync (see delta.h). storage_signatures returns a malloc'd payload:
+ * "<token> <block> <size> <count>\n" followed by count DELTA_SIG_LEN-byte
+ * block signatures; the token names the version they describe. */
+#define STORAGE_TOKEN_LEN 64
+char *storage_signatures(const char *username, const char *filename, size_t *len);
+
+/* rebuilds a file from the version named by base_token plus a delta stream,
+ * through a normal upload (temp + rename on commit). write returns -2 when
+ * the base is gone or was replaced, -1 on a malformed delta or I/O error;
+ * commit (called under the file lock) returns -2 if the base was replaced
+ * and -3 if the new version no longer fits the quota. */
+typedef struct storage_patch storage_patch;
+storage_patch *storage_patch_begin(const char *username, const char *filename, const char *base_token,
+                                   size_t block, size_t newsize);
+int storage_patch_reserve(storage_patch *p); /* the new size, as above */
+int storage_patch_write(storage_patch *p, const char *buf, size_t n);
+int storage_patch_commit(storage_patch *p); /* frees p */
+void storage_patch_abort(storage_patch *p);  /* frees p */
+
 /* delete file */
 int storage_delete_file(const char *username, const char *filename);
 
-/* list files for user: returns malloc'd newline-separated string */
-char *storage_list_files(const char *username);
+/* one page of a user's files from their file index (see fileindex_list):
+ * malloc'd "name size\n" lines, bytewise name order, at most limit files
+ * starting with prefix and sorting after `after`. next (STORAGE_NAME_MAX + 1
+ * bytes) gets the name the following page starts after, "" on the last. */
+#define STORAGE_NAME_MAX 255
+char *storage_list_files(const char *username, const char *prefix, const char *after, size_t limit,
+                         size_t *len, char *next);
+
+/* durable mode (see durable.h): make the named writes, already renamed
+ * into place or deleted, survive a crash. Up to STORAGE_SYNC_FILES plain
+ * files are fsync'ed, then each user directory (or the files' shard
+ * directories) and the user's pack segments written since once; a bigger batch, or any batch in dedup mode, is one
+ * syncfs of the storage filesystem.
+ * Returns 0 after fsyncs, 1 after a syncfs, -1 on error. */
+#define STORAGE_SYNC_FILES 16
+typedef struct storage_sync_item {
+    const char *username;
+    const char *filename;
+} storage_sync_item;
+int storage_sync(const storage_sync_item *items, size_t n);
+
+/* a user's usage (logical bytes in their files) and quota, in O(1) from
+ * the file index; limit 0 means none */
+typedef struct storage_usage {
+    uint64_t bytes;
+    uint64_t files;
+    uint64_t reserved; /* held by uploads in progress */
+    uint64_t limit;
+} storage_usage;
+uint64_t storage_quota(const char *username);
+void storage_get_usage(const char *username, storage_usage *us);
+
+/* dedup accounting (all zero with dedup off), pack store and fanout
+ * (likewise) and file index counters */
+typedef struct storage_stats {
+    unsigned long long index_users;  /* see fileindex_stats */
+    unsigned long long index_entries;
+    unsigned long long index_appends;
+    unsigned long long index_compactions;
+    unsigned long long index_rescans;
+    int pack;
+    unsigned long long pack_files; /* see packstore_stats */
+    unsigned long long pack_segments;
+    unsigned long long pack_live_bytes;
+    unsigned long long pack_dead_bytes;
+    unsigned long long pack_compactions;
+    int fanout;
+    unsigned long long fanout_sharded; /* see fanout_stats */
+    unsigned long long fanout_migrating;
+    unsigned long long fanout_moved;
+    int dedup;
+    unsigned long long chunks;
+    unsigned long long logical_bytes;
+    unsigned long long stored_bytes;
+} storage_stats;
+void storage_get_stats(storage_stats *st);
 
 #endif /* STORAGE_H */
@@ -0,0 +1,30 @@
+#ifndef UTIL_H
+#define UTIL_H
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Small helpers shared by the server modules. */
+
+/* FNV-1a of a NUL-terminated name: user, file and lock-key tables. Its top
+ * bits mix poorly for short names; fanout finalises it before using them. */
+static inline uint64_t name_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)s; *p; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* fsync a file or directory by name; one that is gone counts as synced */
+static inline int fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+#endif /* UTIL_H */
@@ -1,9 +1,63 @@
 #ifndef WORKER_POOL_H
 #define WORKER_POOL_H
 
-#include "queue.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "server_types.h"
+#include "slab.h"
 
-int worker_pool_start(size_t num_threads, queue_t *task_queue);
+/* min_threads workers, each with a fast and a bulk task queue; the first
+ * fast_reserved workers run only fast tasks (at least one worker runs
+ * bulk). When max_threads > min_threads a scaler adds workers while tasks
+ * wait and retires them after a quiet spell, logging each change to
+ * stderr. queue_cap bounds each lane's backlog across all users; user_cap
+ * (0 = none) bounds the tasks one user may have queued or running. */
+int worker_pool_start(size_t min_threads, size_t max_threads, size_t fast_reserved, size_t queue_cap,
+                      size_t user_cap);
 void worker_pool_stop(void);
 
+/* Tasks (made by the reactors, freed by the workers) and TaskResults (the
+ * other way round) come from these caches */
+extern slab_cache task_slab;
+extern slab_cache task_result_slab;
+
+/* queue t in its user's backlog for its lane; from there it is admitted
+ * fair-share to the worker its file key maps to. Never blocks: -1 once
+ * stopping, or for new work while the user holds its share of the lane's
+ * queue slots (the next chunk of an upload is always taken). */
+int worker_pool_submit(Task *t);
+
+/* submit-to-completion latency, each rounded up to its histogram bucket */
+typedef struct worker_lane_stats {
+    const char *name;
+    uint64_t tasks;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+} worker_lane_stats;
+
+typedef struct worker_pool_stats {
+    uint64_t workers;       /* running now */
+    uint64_t workers_min;
+    uint64_t workers_max;
+    uint64_t scale_ups;     /* workers the scaler added */
+    uint64_t scale_downs;   /* workers the scaler retired */
+    uint64_t reserved;      /* workers kept for the fast lane */
+    uint64_t queued;        /* tasks waiting, all queues */
+    uint64_t queued_max;    /* deepest single queue */
+    uint64_t tasks;         /* tasks run */
+    uint64_t steals;        /* tasks an idle worker took from another's queue */
+    worker_lane_stats lanes[2]; /* fast, bulk */
+    uint64_t tenants;       /* users with tasks queued or running */
+    uint64_t backlog;       /* tasks waiting for admission, all users */
+    uint64_t refused;       /* submits over the user's share or limit, or to a full lane */
+    uint64_t user_cap;      /* tasks per user; 0 = no limit */
+    uint64_t user_limited;  /* of refused, over user_cap */
+} worker_pool_stats;
+void worker_pool_get_stats(worker_pool_stats *st);
+
+/* retry-after hint for a refused client, in ms: about how long the
+ * workers need for what is queued now */
+unsigned worker_pool_retry_ms(void);
+
 #endif /* WORKER_POOL_H */
@@ -0,0 +1,711 @@
+#include "chunkstore.h"
+#include "lanehash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CS_MIN_CHUNK (16 * 1024)
+#define CS_AVG_CHUNK (64 * 1024)
+#define CS_MAX_CHUNK (256 * 1024)
+/* normalized chunking (FastCDC): a harder cut test below the average size
+ * and an easier one above it keeps chunk sizes close to the average */
+#define CS_MASK_HARD (~0ULL << (64 - 18))
+#define CS_MASK_EASY (~0ULL << (64 - 14))
+/* the gear hash only depends on the last 64 bytes it has seen */
+#define CS_WINDOW 64
+#define MANIFEST_MAGIC "DBXMANIFEST 1 "
+
+typedef struct cs_entry {
+    uint8_t digest[LANEHASH_LEN];
+    uint32_t len;
+    uint32_t refs;          /* manifest entries pointing at this chunk */
+    uint32_t readers;       /* open readers using it; the file stays until they close */
+    int pending;            /* still being written by the thread that added it */
+    int on_disk;            /* startup bookkeeping */
+    struct cs_entry *next;
+} cs_entry;
+
+typedef struct cs_ref {
+    uint8_t digest[LANEHASH_LEN];
+    uint32_t len;
+} cs_ref;
+
+struct chunkstore_writer {
+    unsigned char *buf;     /* chunk being cut, up to CS_MAX_CHUNK bytes */
+    size_t len;
+    uint64_t fp;            /* gear hash over buf */
+    cs_ref *refs;           /* chunks stored so far, in file order */
+    size_t nrefs;
+    size_t cap;
+    uint64_t size;
+};
+
+struct chunkstore_reader {
+    cs_ref *refs;           /* the manifest's chunks, each pinned once */
+    uint64_t *ends;         /* ends[i]: file offset just past chunk i */
+    size_t nrefs;
+    size_t cur;             /* chunk open in fd */
+    int fd;                 /* -1 until a chunk is read */
+};
+
+static char chunk_root[512];
+static uint64_t gear[256];
+
+/* digest -> entry; one lock, held only for table updates (never across I/O
+ * except the unlink of a chunk whose last reference goes away) */
+static pthread_mutex_t cs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cs_cond = PTHREAD_COND_INITIALIZER; /* pending writes finished */
+static cs_entry **table = NULL;
+static size_t table_size = 0;
+static size_t table_count = 0;
+static chunkstore_stats stats;
+static atomic_ulong tmp_seq = 1;
+
+static void to_hex(const uint8_t *d, char out[2 * LANEHASH_LEN + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < LANEHASH_LEN; ++i) {
+        out[2 * i] = digits[d[i] >> 4];
+        out[2 * i + 1] = digits[d[i] & 15];
+    }
+    out[2 * LANEHASH_LEN] = '\0';
+}
+
+static int from_hex(const char *s, uint8_t *d) {
+    for (int i = 0; i < 2 * LANEHASH_LEN; ++i) {
+        int v;
+        char ch = s[i];
+        if (ch >= '0' && ch <= '9') v = ch - '0';
+        else if (ch >= 'a' && ch <= 'f') v = ch - 'a' + 10;
+        else return -1;
+        if (i & 1) d[i / 2] = (uint8_t)(d[i / 2] | v);
+        else d[i / 2] = (uint8_t)(v << 4);
+    }
+    return 0;
+}
+
+static void chunk_path(const uint8_t *d, char *out, size_t n) {
+    char hex[2 * LANEHASH_LEN + 1];
+    to_hex(d, hex);
+    snprintf(out, n, "%s/%.2s/%s", chunk_root, hex, hex);
+}
+
+static size_t bucket_of(const uint8_t *d, size_t size) {
+    uint64_t h;
+    memcpy(&h, d, sizeof(h));
+    return (size_t)(h & (size - 1));
+}
+
+static cs_entry *table_find(const uint8_t *d) {
+    for (cs_entry *e = table[bucket_of(d, table_size)]; e; e = e->next)
+        if (memcmp(e->digest, d, LANEHASH_LEN) == 0) return e;
+    return NULL;
+}
+
+static cs_entry *table_add(const uint8_t *d, uint32_t len) {
+    if (table_count >= table_size) {
+        /* keep chains short: double and rehash */
+        size_t nsize = table_size * 2;
+        cs_entry **nt = calloc(nsize, sizeof(cs_entry *));
+        if (nt) {
+            for (size_t i = 0; i < table_size; ++i) {
+                while (table[i]) {
+                    cs_entry *e = table[i];
+                    table[i] = e->next;
+                    size_t b = bucket_of(e->digest, nsize);
+                    e->next = nt[b];
+                    nt[b] = e;
+                }
+            }
+            free(table);
+            table = nt;
+            table_size = nsize;
+        }
+    }
+    cs_entry *e = calloc(1, sizeof(cs_entry));
+    if (!e) return NULL;
+    memcpy(e->digest, d, LANEHASH_LEN);
+    e->len = len;
+    size_t b = bucket_of(d, table_size);
+    e->next = table[b];
+    table[b] = e;
+    table_count++;
+    return e;
+}
+
+static void table_remove(cs_entry *e) {
+    cs_entry **pp = &table[bucket_of(e->digest, table_size)];
+    while (*pp && *pp != e) pp = &(*pp)->next;
+    if (*pp) *pp = e->next;
+    table_count--;
+    free(e);
+}
+
+static int write_all(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+/* write via temp + rename so a chunk file is always complete */
+static int chunk_write_file(const uint8_t *d, const void *data, size_t len) {
+    char path[640], tmp[700];
+    chunk_path(d, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", path, atomic_fetch_add(&tmp_seq, 1));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[chunkstore] open(%s) failed: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    int rc = write_all(fd, data, len);
+    if (close(fd) != 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0) {
+        fprintf(stderr, "[chunkstore] write(%s) failed: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/* 1 if the stored chunk holds exactly data, 0 if not, -1 if it is missing */
+static int chunk_matches(const uint8_t *d, const unsigned char *data, size_t len) {
+    char path[640];
+    chunk_path(d, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? -1 : 0;
+    unsigned char buf[16 * 1024];
+    size_t off = 0;
+    int same = 1;
+    while (same && off <= len) {
+        ssize_t r = pread(fd, buf, sizeof(buf), (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) { same = 0; break; }
+        if (r == 0) { same = off == len; break; }
+        if (off + (size_t)r > len || memcmp(buf, data + off, (size_t)r) != 0) same = 0;
+        off += (size_t)r;
+    }
+    close(fd);
+    return same;
+}
+
+/* drop a chunk nothing references or reads any more; cs_mtx held, so a
+ * concurrent put cannot revive it mid-unlink */
+static void chunk_drop_if_unused(cs_entry *e) {
+    if (e->refs || e->readers) return;
+    char path[640];
+    chunk_path(e->digest, path, sizeof(path));
+    if (unlink(path) != 0 && errno != ENOENT)
+        fprintf(stderr, "[chunkstore] unlink(%s) failed: %s\n", path, strerror(errno));
+    stats.chunks--;
+    stats.stored_bytes -= e->len;
+    table_remove(e);
+}
+
+static void chunk_unref_digest(const uint8_t *d) {
+    pthread_mutex_lock(&cs_mtx);
+    cs_entry *e = table_find(d);
+    if (e && e->refs > 0) {
+        e->refs--;
+        stats.logical_bytes -= e->len;
+        chunk_drop_if_unused(e);
+    }
+    pthread_mutex_unlock(&cs_mtx);
+}
+
+/* store one chunk (or take a reference to an identical stored one) */
+static int chunk_put(const unsigned char *data, size_t len, uint8_t *digest) {
+    lanehash256(data, len, digest);
+    pthread_mutex_lock(&cs_mtx);
+    cs_entry *e;
+    while ((e = table_find(digest)) && e->pending) pthread_cond_wait(&cs_cond, &cs_mtx);
+    if (e) {
+        e->refs++;
+        stats.logical_bytes += len;
+        pthread_mutex_unlock(&cs_mtx);
+        /* the digest is not cryptographic: compare bytes before sharing a
+         * chunk, so a crafted collision cannot alias another user's data */
+        int m = e->len == len ? chunk_matches(digest, data, len) : 0;
+        if (m == 1) return 0;
+        if (m < 0 && chunk_write_file(digest, data, len) == 0) return 0; /* repaired */
+        fprintf(stderr, "[chunkstore] digest collision on %zu-byte chunk, upload refused\n", len);
+        chunk_unref_digest(digest);
+        return -1;
+    }
+    e = table_add(digest, (uint32_t)len);
+    if (!e) {
+        pthread_mutex_unlock(&cs_mtx);
+        return -1;
+    }
+    e->pending = 1;
+    e->refs = 1;
+    pthread_mutex_unlock(&cs_mtx);
+
+    int rc = chunk_write_file(digest, data, len);
+
+    pthread_mutex_lock(&cs_mtx);
+    e->pending = 0;
+    if (rc == 0) {
+        stats.chunks++;
+        stats.stored_bytes += len;
+        stats.logical_bytes += len;
+    } else {
+        table_remove(e);
+    }
+    pthread_cond_broadcast(&cs_cond);
+    pthread_mutex_unlock(&cs_mtx);
+    return rc;
+}
+
+chunkstore_writer *chunkstore_writer_new(void) {
+    chunkstore_writer *w = calloc(1, sizeof(chunkstore_writer));
+    if (!w) return NULL;
+    w->buf = malloc(CS_MAX_CHUNK);
+    if (!w->buf) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static int writer_cut(chunkstore_writer *w) {
+    if (w->nrefs == w->cap) {
+        size_t ncap = w->cap ? w->cap * 2 : 64;
+        cs_ref *nr = realloc(w->refs, ncap * sizeof(cs_ref));
+        if (!nr) return -1;
+        w->refs = nr;
+        w->cap = ncap;
+    }
+    cs_ref *r = &w->refs[w->nrefs];
+    if (chunk_put(w->buf, w->len, r->digest) != 0) return -1;
+    r->len = (uint32_t)w->len;
+    w->nrefs++;
+    w->size += w->len;
+    w->len = 0;
+    w->fp = 0;
+    return 0;
+}
+
+int chunkstore_writer_write(chunkstore_writer *w, const void *buf, size_t n) {
+    if (!w) return -1;
+    const unsigned char *p = buf;
+    while (n) {
+        size_t take = CS_MAX_CHUNK - w->len;
+        if (take > n) take = n;
+        /* cut points depend only on content, never on how writes are split */
+        size_t i = 0;
+        if (w->len < CS_MIN_CHUNK - CS_WINDOW) i = CS_MIN_CHUNK - CS_WINDOW - w->len;
+        if (i > take) i = take;
+        int cut = 0;
+        for (; i < take; ++i) {
+            w->fp = (w->fp << 1) + gear[p[i]];
+            size_t clen = w->len + i + 1;
+            if (clen < CS_MIN_CHUNK) continue;
+            if (!(w->fp & (clen < CS_AVG_CHUNK ? CS_MASK_HARD : CS_MASK_EASY))) {
+                i++;
+                cut = 1;
+                break;
+            }
+        }
+        memcpy(w->buf + w->len, p, i);
+        w->len += i;
+        p += i;
+        n -= i;
+        if ((cut || w->len == CS_MAX_CHUNK) && writer_cut(w) != 0) return -1;
+    }
+    return 0;
+}
+
+void chunkstore_writer_abort(chunkstore_writer *w) {
+    if (!w) return;
+    for (size_t i = 0; i < w->nrefs; ++i) chunk_unref_digest(w->refs[i].digest);
+    free(w->refs);
+    free(w->buf);
+    free(w);
+}
+
+int chunkstore_writer_finish(chunkstore_writer *w, int fd) {
+    if (!w) return -1;
+    if (w->len && writer_cut(w) != 0) {
+        chunkstore_writer_abort(w);
+        return -1;
+    }
+    /* "<hex digest> <len>\n" per chunk after a header with size and count */
+    size_t cap = 64 + w->nrefs * (2 * LANEHASH_LEN + 16);
+    char *text = malloc(cap);
+    if (!text) {
+        chunkstore_writer_abort(w);
+        return -1;
+    }
+    size_t len = (size_t)snprintf(text, cap, MANIFEST_MAGIC "%llu %zu\n",
+                                  (unsigned long long)w->size, w->nrefs);
+    for (size_t i = 0; i < w->nrefs; ++i) {
+        char hex[2 * LANEHASH_LEN + 1];
+        to_hex(w->refs[i].digest, hex);
+        len += (size_t)snprintf(text + len, cap - len, "%s %u\n", hex, w->refs[i].len);
+    }
+    int rc = write_all(fd, text, len);
+    free(text);
+    if (rc != 0) {
+        fprintf(stderr, "[chunkstore] manifest write failed: %s\n", strerror(errno));
+        chunkstore_writer_abort(w);
+        return -1;
+    }
+    free(w->refs);
+    free(w->buf);
+    free(w);
+    return 0;
+}
+
+/* parse a whole manifest; malformed ones (or plain files) return -1 */
+static int manifest_load(int fd, uint64_t *size, cs_ref **refs, size_t *nrefs) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    size_t flen = (size_t)st.st_size;
+    if (flen < sizeof(MANIFEST_MAGIC) - 1) return -1;
+    char *text = malloc(flen + 1);
+    if (!text) return -1;
+    size_t got = 0;
+    while (got < flen) {
+        ssize_t r = pread(fd, text + got, flen - got, (off_t)got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    text[got] = '\0';
+    unsigned long long total = 0;
+    size_t count = 0;
+    int hdr = 0;
+    if (got != flen || strncmp(text, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1) != 0 ||
+        sscanf(text + sizeof(MANIFEST_MAGIC) - 1, "%llu %zu\n%n", &total, &count, &hdr) != 2 ||
+        hdr == 0 || count > flen / (2 * LANEHASH_LEN)) {
+        free(text);
+        return -1;
+    }
+    cs_ref *list = calloc(count ? count : 1, sizeof(cs_ref));
+    if (!list) {
+        free(text);
+        return -1;
+    }
+    const char *p = text + sizeof(MANIFEST_MAGIC) - 1 + hdr;
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i < count; ++i) {
+        char *end;
+        if (strlen(p) < 2 * LANEHASH_LEN + 2 || from_hex(p, list[i].digest) != 0 ||
+            p[2 * LANEHASH_LEN] != ' ')
+            break;
+        unsigned long clen = strtoul(p + 2 * LANEHASH_LEN + 1, &end, 10);
+        if (*end != '\n' || clen == 0 || clen > CS_MAX_CHUNK) break;
+        list[i].len = (uint32_t)clen;
+        sum += clen;
+        p = end + 1;
+    }
+    int trailing = *p != '\0';
+    free(text);
+    if (i != count || trailing || sum != total) {
+        free(list);
+        return -1;
+    }
+    *size = total;
+    *refs = list;
+    *nrefs = count;
+    return 0;
+}
+
+int chunkstore_manifest_size(int fd, size_t *size) {
+    char head[96];
+    ssize_t r = pread(fd, head, sizeof(head) - 1, 0);
+    if (r <= 0) return -1;
+    head[r] = '\0';
+    unsigned long long total;
+    if (strncmp(head, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1) != 0 ||
+        sscanf(head + sizeof(MANIFEST_MAGIC) - 1, "%llu", &total) != 1)
+        return -1;
+    if (size) *size = (size_t)total;
+    return 0;
+}
+
+chunkstore_reader *chunkstore_reader_open(int fd, size_t *len) {
+    uint64_t size;
+    chunkstore_reader *rd = calloc(1, sizeof(*rd));
+    if (!rd) return NULL;
+    rd->fd = -1;
+    if (manifest_load(fd, &size, &rd->refs, &rd->nrefs) != 0) {
+        fprintf(stderr, "[chunkstore_reader_open] not a valid manifest\n");
+        free(rd);
+        return NULL;
+    }
+    rd->ends = malloc((rd->nrefs ? rd->nrefs : 1) * sizeof(*rd->ends));
+    if (!rd->ends) {
+        free(rd->refs);
+        free(rd);
+        return NULL;
+    }
+    uint64_t end = 0;
+    for (size_t i = 0; i < rd->nrefs; ++i) {
+        end += rd->refs[i].len;
+        rd->ends[i] = end;
+    }
+    /* the caller holds the file lock, so every chunk is still referenced */
+    size_t pinned = 0;
+    pthread_mutex_lock(&cs_mtx);
+    for (; pinned < rd->nrefs; ++pinned) {
+        cs_entry *e = table_find(rd->refs[pinned].digest);
+        if (!e) break;
+        e->readers++;
+    }
+    pthread_mutex_unlock(&cs_mtx);
+    if (pinned != rd->nrefs) {
+        fprintf(stderr, "[chunkstore_reader_open] manifest names a missing chunk\n");
+        rd->nrefs = pinned;
+        chunkstore_reader_close(rd);
+        return NULL;
+    }
+    if (len) *len = (size_t)size;
+    return rd;
+}
+
+int chunkstore_reader_fd(chunkstore_reader *rd, size_t pos, size_t *off, size_t *n) {
+    size_t i = rd->fd >= 0 ? rd->cur : 0;
+    if (rd->fd < 0 || pos >= rd->ends[i] || pos < rd->ends[i] - rd->refs[i].len) {
+        /* first chunk ending after pos */
+        size_t lo = 0, hi = rd->nrefs;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (rd->ends[mid] <= pos) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == rd->nrefs) return -1;
+        char path[640];
+        chunk_path(rd->refs[lo].digest, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "[chunkstore] chunk %s unreadable: %s\n", path, strerror(errno));
+            return -1;
+        }
+        if (rd->fd >= 0) close(rd->fd);
+        rd->fd = fd;
+        rd->cur = i = lo;
+    }
+    size_t start = (size_t)(rd->ends[i] - rd->refs[i].len);
+    *off = pos - start;
+    *n = (size_t)rd->ends[i] - pos;
+    return rd->fd;
+}
+
+ssize_t chunkstore_reader_pread(chunkstore_reader *rd, void *buf, size_t n, size_t pos) {
+    size_t got = 0;
+    while (got < n) {
+        size_t off, left;
+        int fd = chunkstore_reader_fd(rd, pos + got, &off, &left);
+        if (fd < 0) break; /* past the end, or a chunk is gone */
+        size_t want = n - got < left ? n - got : left;
+        ssize_t r = pread(fd, (char *)buf + got, want, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return got ? (ssize_t)got : -1; /* a short chunk file is corruption */
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+void chunkstore_reader_close(chunkstore_reader *rd) {
+    if (!rd) return;
+    if (rd->fd >= 0) close(rd->fd);
+    pthread_mutex_lock(&cs_mtx);
+    for (size_t i = 0; i < rd->nrefs; ++i) {
+        cs_entry *e = table_find(rd->refs[i].digest);
+        if (!e || !e->readers) continue;
+        e->readers--;
+        chunk_drop_if_unused(e);
+    }
+    pthread_mutex_unlock(&cs_mtx);
+    free(rd->ends);
+    free(rd->refs);
+    free(rd);
+}
+
+void chunkstore_unref(int fd) {
+    uint64_t size;
+    cs_ref *refs;
+    size_t nrefs;
+    if (manifest_load(fd, &size, &refs, &nrefs) != 0) return;
+    for (size_t i = 0; i < nrefs; ++i) chunk_unref_digest(refs[i].digest);
+    free(refs);
+}
+
+void chunkstore_get_stats(chunkstore_stats *st) {
+    pthread_mutex_lock(&cs_mtx);
+    *st = stats;
+    pthread_mutex_unlock(&cs_mtx);
+}
+
+/* startup: count the references of a manifest, or turn a plain file into one */
+static void load_or_convert(const char *dir, const char *name) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    uint64_t size;
+    cs_ref *refs;
+    size_t nrefs;
+    if (manifest_load(fd, &size, &refs, &nrefs) == 0) {
+        for (size_t i = 0; i < nrefs; ++i) {
+            cs_entry *e = table_find(refs[i].digest);
+            if (!e) e = table_add(refs[i].digest, refs[i].len);
+            if (!e) continue;
+            e->refs++;
+            stats.logical_bytes += refs[i].len;
+        }
+        free(refs);
+        close(fd);
+        return;
+    }
+    chunkstore_writer *w = chunkstore_writer_new();
+    char *buf = malloc(CS_MAX_CHUNK);
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s/.%s.cas.tmp", dir, name);
+    int ok = w && buf;
+    while (ok) {
+        ssize_t r = read(fd, buf, CS_MAX_CHUNK);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) ok = 0;
+        if (r <= 0) break;
+        if (chunkstore_writer_write(w, buf, (size_t)r) != 0) ok = 0;
+    }
+    free(buf);
+    close(fd);
+    int out = ok ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
+    if (out < 0) {
+        chunkstore_writer_abort(w);
+        fprintf(stderr, "[chunkstore_init] could not convert %s\n", path);
+        return;
+    }
+    ok = chunkstore_writer_finish(w, out) == 0;
+    if (close(out) != 0) ok = 0;
+    if (ok && rename(tmp, path) == 0) {
+        fprintf(stderr, "[chunkstore_init] converted %s\n", path);
+    } else {
+        fprintf(stderr, "[chunkstore_init] could not convert %s\n", path);
+        if (ok) {
+            out = open(tmp, O_RDONLY | O_CLOEXEC);
+            if (out >= 0) {
+                chunkstore_unref(out);
+                close(out);
+            }
+        }
+        unlink(tmp);
+    }
+}
+
+static void scan_users(const char *root) {
+    DIR *d = opendir(root);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", root, e->d_name);
+        struct stat st;
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        DIR *ud = opendir(dir);
+        if (!ud) continue;
+        struct dirent *f;
+        while ((f = readdir(ud)) != NULL) {
+            /* temp files and resumable partials stay plain */
+            if (f->d_name[0] == '.') continue;
+            load_or_convert(dir, f->d_name);
+        }
+        closedir(ud);
+    }
+    closedir(d);
+}
+
+/* delete chunks nothing references (a crash between chunk and manifest
+ * writes) and leftover temp files; count what is really on disk */
+static void collect_garbage(void) {
+    stats.chunks = 0;
+    stats.stored_bytes = 0;
+    unsigned long orphans = 0, missing = 0;
+    for (int i = 0; i < 256; ++i) {
+        char dir[600];
+        snprintf(dir, sizeof(dir), "%s/%02x", chunk_root, i);
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *f;
+        while ((f = readdir(d)) != NULL) {
+            if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0) continue;
+            uint8_t digest[LANEHASH_LEN];
+            cs_entry *e = NULL;
+            if (strlen(f->d_name) == 2 * LANEHASH_LEN && from_hex(f->d_name, digest) == 0)
+                e = table_find(digest);
+            if (e) {
+                e->on_disk = 1;
+                stats.chunks++;
+                stats.stored_bytes += e->len;
+                continue;
+            }
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, f->d_name);
+            if (unlink(path) == 0) orphans++;
+        }
+        closedir(d);
+    }
+    for (size_t b = 0; b < table_size; ++b)
+        for (cs_entry *e = table[b]; e; e = e->next)
+            if (!e->on_disk) missing++;
+    if (orphans) fprintf(stderr, "[chunkstore_init] removed %lu unreferenced files\n", orphans);
+    if (missing) fprintf(stderr, "[chunkstore_init] WARNING: %lu referenced chunks are missing\n", missing);
+}
+
+int chunkstore_init(const char *root, int enable) {
+    snprintf(chunk_root, sizeof(chunk_root), "%s/.chunks", root);
+    struct stat st;
+    int exists = stat(chunk_root, &st) == 0 && S_ISDIR(st.st_mode);
+    if (!exists && !enable) return 0;
+    if (!exists && mkdir(chunk_root, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "[chunkstore_init] mkdir(%s) failed: %s\n", chunk_root, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < 256; ++i) {
+        char dir[600];
+        snprintf(dir, sizeof(dir), "%s/%02x", chunk_root, i);
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "[chunkstore_init] mkdir(%s) failed: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+    /* fixed gear table (splitmix64), so cut points are stable across restarts */
+    uint64_t x = 0x2545F4914F6CDD1DULL;
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    table_size = 1 << 16;
+    table = calloc(table_size, sizeof(cs_entry *));
+    if (!table) return -1;
+    memset(&stats, 0, sizeof(stats));
+    scan_users(root);
+    collect_garbage();
+    double ratio = stats.stored_bytes ? (double)stats.logical_bytes / (double)stats.stored_bytes : 1.0;
+    fprintf(stderr, "[chunkstore_init] dedup on (%s hashing): %llu chunks, %llu bytes stored for %llu, ratio %.2f\n",
+            lanehash_impl(), (unsigned long long)stats.chunks, (unsigned long long)stats.stored_bytes,
+            (unsigned long long)stats.logical_bytes, ratio);
+    return 1;
+}
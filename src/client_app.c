@@ -5,27 +5,27 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include "netbuf.h"
+#include "delta.h"
+#include "lzblock.h"
 
 #ifndef SERVER_PORT
 #define SERVER_PORT 8080
 #endif
 
-static ssize_t read_n_bytes(int fd, void *buf, size_t n) {
-    size_t left = n;
-    char *p = buf;
-    while (left) {
-        ssize_t r = recv(fd, p, left, 0);
-        if (r == 0) return (ssize_t)(n - left);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        left -= (size_t)r;
-        p += r;
-    }
-    return (ssize_t)n;
-}
+/* a dropped UPLOAD/DOWNLOAD reconnects and resumes this many times */
+#define TRANSFER_RETRIES 5
+/* a command answered ERR serverbusy is retried this many times */
+#define BUSY_RETRIES 5
+#define BUSY_BACKOFF_MAX_MS 10000
+/* files asked for per LIST page */
+#define LIST_PAGE 1000
 
 static int send_all(int fd, const void *buf, size_t len) {
     const char *p = buf;
@@ -42,45 +42,548 @@ static int send_all(int fd, const void *buf, size_t len) {
     return 0;
 }
 
-static ssize_t read_line(int fd, char *buf, size_t maxlen) {
-    size_t idx = 0;
-    while (idx + 1 < maxlen) {
-        char c;
-        ssize_t r = recv(fd, &c, 1, 0);
-        if (r == 0) {
-            if (idx == 0) return 0;
-            break;
-        } else if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        } else {
-            buf[idx++] = c;
-            if (c == '\n') break;
+
+/* one server connection plus what is needed to re-establish it */
+typedef struct {
+    int sock;
+    netbuf nb;
+    int logged_in;
+    int lz;                 /* server accepted CAPS lz: transfers are framed */
+    char user[64];
+    char pass[64];
+} Conn;
+
+static int server_connect(Conn *c) {
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    /* replies are read through one buffered reader for the whole session */
+    if (netbuf_init(&c->nb, sock, 4096) != 0) {
+        close(sock);
+        return -1;
+    }
+    c->sock = sock;
+    return 0;
+}
+
+static void server_close(Conn *c) {
+    if (c->sock < 0) return;
+    netbuf_free(&c->nb);
+    close(c->sock);
+    c->sock = -1;
+}
+
+/* the retry-after hint of an ERR serverbusy reply, -1 for any other reply */
+static long busy_hint_ms(const char *reply) {
+    if (strncmp(reply, "ERR serverbusy", 14) != 0) return -1;
+    const char *p = strstr(reply, "retry-after ");
+    long ms = p ? strtol(p + 12, NULL, 10) : 0;
+    return ms > 0 ? ms : 200;
+}
+
+/* wait before busy retry number attempt (from 0): the hint doubled per
+ * attempt and capped, then a random point in its upper half, so clients
+ * refused together do not all come back at once */
+static void busy_backoff(long hint_ms, int attempt) {
+    long ms = hint_ms << (attempt < 6 ? attempt : 6);
+    if (ms > BUSY_BACKOFF_MAX_MS) ms = BUSY_BACKOFF_MAX_MS;
+    ms = ms / 2 + rand() % (ms / 2 + 1);
+    printf("Server busy, retrying in %ld ms\n", ms);
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/* send a command line and read the first reply line, retrying while the
+ * server is busy; 0, or -1 if the connection is lost */
+static int command(Conn *c, const char *cmdline, char *reply, size_t n) {
+    for (int attempt = 0;; ++attempt) {
+        if (send_all(c->sock, cmdline, strlen(cmdline)) != 0) return -1;
+        if (netbuf_readline(&c->nb, reply, n) <= 0) return -1;
+        long hint = busy_hint_ms(reply);
+        if (hint < 0 || attempt == BUSY_RETRIES) return 0;
+        busy_backoff(hint, attempt);
+    }
+}
+
+/* offer lzblock framing after LOGIN; a server without CAPS says ERR */
+static int server_caps(Conn *c) {
+    c->lz = 0;
+    if (send_all(c->sock, "CAPS lz\n", 8) != 0) return -1;
+    char reply[256];
+    if (netbuf_readline(&c->nb, reply, sizeof(reply)) <= 0) return -1;
+    c->lz = strncmp(reply, "OK caps", 7) == 0 && strstr(reply + 7, " lz") != NULL;
+    return 0;
+}
+
+/* drop the broken connection, then connect and LOGIN again with backoff */
+static int server_reconnect(Conn *c, int attempt) {
+    server_close(c);
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+    /* attempt counts from 1: wait 1s, 2s, 4s, ... */
+    ts.tv_sec = 1L << (attempt < 1 ? 0 : attempt < 5 ? attempt - 1 : 4);
+    printf("Connection lost, reconnecting (attempt %d)...\n", attempt);
+    nanosleep(&ts, NULL);
+    if (server_connect(c) != 0) return -1;
+    char cmdline[160], reply[256];
+    snprintf(cmdline, sizeof(cmdline), "LOGIN %s %s\n", c->user, c->pass);
+    if (send_all(c->sock, cmdline, strlen(cmdline)) != 0) return -1;
+    if (netbuf_readline(&c->nb, reply, sizeof(reply)) <= 0) return -1;
+    if (strncmp(reply, "OK", 2) != 0) return -1;
+    return server_caps(c);
+}
+
+/* one attempt: 1 done, 0 server refused (reply printed), -1 connection lost */
+static int upload_once(Conn *c, FILE *fp, const char *filename, size_t sz) {
+    /* resumable: the server answers READY <bytes it already has> */
+    char header[512];
+    snprintf(header, sizeof(header), "UPLOAD %s %zu resume%s\n", filename, sz, c->lz ? " lz" : "");
+    for (int busy = 0;; ++busy) {
+        char ready[256];
+        if (command(c, header, ready, sizeof(ready)) != 0) return -1;
+        if (strncmp(ready, "READY", 5) != 0) {
+            printf("Server not ready: %s", ready);
+            return 0;
         }
+        size_t offset = 0;
+        sscanf(ready + 5, "%zu", &offset);
+        if (offset > sz || fseek(fp, (long)offset, SEEK_SET) != 0) return 0;
+        if (offset) printf("Resuming upload at byte %zu\n", offset);
+
+        /* Send file bytes, one frame per block when framed */
+        char buf[LZBLOCK_MAX];
+        char frame[LZBLOCK_FRAME_MAX];
+        lzblock_adapt lz = { 0, 0 };
+        size_t total_sent = offset;
+        while (total_sent < sz) {
+            size_t to_read = c->lz ? LZBLOCK_MAX : 4096;
+            if (to_read > sz - total_sent) to_read = sz - total_sent;
+            size_t rr = fread(buf, 1, to_read, fp);
+            if (rr == 0) break;
+            if (c->lz) {
+                size_t n = lzblock_frame(&lz, buf, rr, frame, NULL);
+                if (send_all(c->sock, frame, n) != 0) return -1;
+            } else if (send_all(c->sock, buf, rr) != 0) {
+                return -1;
+            }
+            total_sent += rr;
+        }
+
+        /* Read response after worker completes */
+        char res[256];
+        if (netbuf_readline(&c->nb, res, sizeof(res)) <= 0) return -1;
+        long hint = busy_hint_ms(res);
+        if (hint < 0 || busy == BUSY_RETRIES) {
+            printf("%s", res);
+            return 1;
+        }
+        /* refused after the body went out: the partial is kept, so the retry resumes */
+        busy_backoff(hint, busy);
     }
-    buf[idx] = '\0';
-    return (ssize_t)idx;
 }
 
-int main() {
-    char server_ip[64] = "127.0.0.1";
-    int port = SERVER_PORT;
-    int sock;
-    struct sockaddr_in serv_addr;
+static void do_upload(Conn *c, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        perror("fopen");
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    long sz = ftell(fp);
+    if (sz < 0) {
+        fclose(fp);
+        printf("Cannot stat file\n");
+        return;
+    }
+    for (int attempt = 0; attempt <= TRANSFER_RETRIES; ++attempt) {
+        if (c->sock < 0 && server_reconnect(c, attempt) != 0) continue;
+        if (upload_once(c, fp, filename, (size_t)sz) >= 0) {
+            fclose(fp);
+            return;
+        }
+        server_close(c);
+    }
+    fclose(fp);
+    printf("Upload failed: server unreachable\n");
+}
+
+/* framed DOWNLOAD body: only whole frames count towards *got, so a retry
+ * resumes at a frame boundary */
+static int download_frames(Conn *c, FILE *fp, size_t *got, size_t total) {
+    char frame[LZBLOCK_FRAME_MAX];
+    char raw[LZBLOCK_MAX];
+    while (*got < total) {
+        size_t n, payload;
+        if (netbuf_read_n(&c->nb, frame, LZBLOCK_HDR) != LZBLOCK_HDR) return -1;
+        if (lzblock_frame_header(frame, &n, &payload) != 0 || n > total - *got) {
+            printf("Corrupt frame from server\n");
+            return 0;
+        }
+        if (netbuf_read_n(&c->nb, frame + LZBLOCK_HDR, payload) != (ssize_t)payload) return -1;
+        long r = lzblock_frame_decode(frame, LZBLOCK_HDR + payload, raw);
+        if (r < 0) {
+            printf("Corrupt frame from server\n");
+            return 0;
+        }
+        if (fwrite(raw, 1, (size_t)r, fp) != (size_t)r) {
+            perror("fwrite");
+            return 0;
+        }
+        *got += (size_t)r;
+    }
+    return 1;
+}
+
+/* one attempt appending to fp from *got: 1 done, 0 refused, -1 connection lost */
+static int download_once(Conn *c, FILE *fp, const char *filename, size_t *got, size_t *total) {
+    char header[512];
+    if (*got) snprintf(header, sizeof(header), "DOWNLOAD %s %zu\n", filename, *got);
+    else snprintf(header, sizeof(header), "DOWNLOAD %s\n", filename);
+    char resp[256];
+    if (command(c, header, resp, sizeof(resp)) != 0) return -1;
+    if (strncmp(resp, "OK download ", 12) != 0) {
+        printf("%s", resp);
+        return 0;
+    }
+    size_t size = 0;
+    char mode[8] = "";
+    sscanf(resp + 12, "%zu %7s", &size, mode);
+    int framed = strcmp(mode, "lz") == 0;
+    if (*got == 0) *total = size;
+    else if (*got + size != *total) {
+        /* the file changed between attempts: the pieces do not fit together */
+        printf("File changed on the server, download aborted\n");
+        return 0;
+    }
+
+    /* stream to disk so a retry keeps what already arrived */
+    if (framed) return download_frames(c, fp, got, *total);
+    char buf[65536];
+    while (*got < *total) {
+        size_t want = *total - *got;
+        if (want > sizeof(buf)) want = sizeof(buf);
+        ssize_t n = netbuf_read_n(&c->nb, buf, want);
+        if (n > 0 && fwrite(buf, 1, (size_t)n, fp) != (size_t)n) {
+            perror("fwrite");
+            return 0;
+        }
+        if (n > 0) *got += (size_t)n;
+        if (n != (ssize_t)want) return -1;
+    }
+    return 1;
+}
 
-    printf("Client: connecting to %s:%d\n", server_ip, port);
+static void do_download(Conn *c, const char *filename) {
+    /* Save to file in downloads/ to make location explicit */
+    char outdir[] = "downloads";
+    mkdir(outdir, 0755);
+    char outpath[512];
+    snprintf(outpath, sizeof(outpath), "%s/%s", outdir, filename);
+    FILE *fp = fopen(outpath, "wb");
+    if (!fp) {
+        perror("fopen");
+        return;
+    }
+    size_t got = 0, total = 0;
+    int rc = -1;
+    for (int attempt = 0; attempt <= TRANSFER_RETRIES && rc < 0; ++attempt) {
+        if (c->sock < 0 && server_reconnect(c, attempt) != 0) continue;
+        rc = download_once(c, fp, filename, &got, &total);
+        if (rc < 0) {
+            server_close(c);
+            if (got) printf("Interrupted at %zu of %zu bytes\n", got, total);
+        }
+    }
+    fclose(fp);
+    if (rc != 1) remove(outpath);
+    if (rc == 1) printf("Downloaded %s -> %s (%zu bytes)\n", filename, outpath, total);
+    else if (rc < 0) printf("incomplete download (got %zu, expected %zu)\n", got, total);
+}
+
+/* SYNC builds the new version from the server's signatures; literal ops are
+ * split so the server never needs a huge contiguous run */
+#define SYNC_LITERAL_MAX (1024 * 1024)
+
+typedef struct {
+    FILE *out;
+    size_t bytes;           /* delta bytes written */
+    size_t literal;         /* literal payload bytes */
+    size_t reused;          /* blocks copied from the server's version */
+    uint32_t copy_first;    /* pending copy run, merged until it breaks */
+    uint32_t copy_count;
+    int failed;
+} DeltaOut;
+
+static void delta_flush_copy(DeltaOut *d) {
+    if (!d->copy_count) return;
+    unsigned char op[DELTA_OP_HDR];
+    op[0] = DELTA_OP_COPY;
+    delta_put_u32(op + 1, d->copy_first);
+    delta_put_u32(op + 5, d->copy_count);
+    if (fwrite(op, 1, sizeof(op), d->out) != sizeof(op)) d->failed = 1;
+    d->bytes += sizeof(op);
+    d->reused += d->copy_count;
+    d->copy_count = 0;
+}
+
+static void delta_copy(DeltaOut *d, uint32_t idx) {
+    if (d->copy_count && d->copy_first + d->copy_count == idx) {
+        d->copy_count++;
+        return;
+    }
+    delta_flush_copy(d);
+    d->copy_first = idx;
+    d->copy_count = 1;
+}
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
+static void delta_literal(DeltaOut *d, const unsigned char *p, size_t n) {
+    if (n) delta_flush_copy(d);
+    while (n) {
+        size_t k = n < SYNC_LITERAL_MAX ? n : SYNC_LITERAL_MAX;
+        unsigned char op[5];
+        op[0] = DELTA_OP_LITERAL;
+        delta_put_u32(op + 1, (uint32_t)k);
+        if (fwrite(op, 1, sizeof(op), d->out) != sizeof(op) || fwrite(p, 1, k, d->out) != k) d->failed = 1;
+        d->bytes += sizeof(op) + k;
+        d->literal += k;
+        p += k;
+        n -= k;
+    }
+}
+
+/* server block idx matches data[0, n) if both checksums agree */
+static int sig_match(const unsigned char *sigs, uint32_t idx, const unsigned char *data, size_t n,
+                     uint8_t strong[DELTA_STRONG_LEN], int *have_strong) {
+    const unsigned char *s = sigs + (size_t)idx * DELTA_SIG_LEN;
+    if (!*have_strong) {
+        delta_strong(data, n, strong);
+        *have_strong = 1;
+    }
+    return memcmp(s + 4, strong, DELTA_STRONG_LEN) == 0;
+}
+
+/* rolling-checksum scan of data against the server's block signatures */
+static int delta_encode(DeltaOut *d, const unsigned char *data, size_t size,
+                        const unsigned char *sigs, size_t count, size_t block, size_t oldsize) {
+    /* chained hash on the weak checksum; the last block only matches at the end */
+    size_t full = oldsize / block;
+    size_t nb = 16;
+    while (nb < 2 * full) nb <<= 1;
+    int32_t *head = malloc(nb * sizeof(int32_t));
+    int32_t *next = malloc((full ? full : 1) * sizeof(int32_t));
+    if (!head || !next) {
+        free(head);
+        free(next);
         return -1;
     }
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
-        perror("inet_pton");
+    memset(head, -1, nb * sizeof(int32_t));
+    for (size_t i = full; i-- > 0;) {
+        size_t b = delta_get_u32(sigs + i * DELTA_SIG_LEN) & (nb - 1);
+        next[i] = head[b];
+        head[b] = (int32_t)i;
+    }
+
+    size_t pos = 0, lit = 0;
+    uint32_t weak = 0;
+    int fresh = 1;
+    while (full && pos + block <= size) {
+        if (fresh) weak = delta_weak(data + pos, block);
+        fresh = 0;
+        uint8_t strong[DELTA_STRONG_LEN];
+        int have_strong = 0;
+        int32_t hit = -1;
+        for (int32_t i = head[weak & (nb - 1)]; i >= 0; i = next[i]) {
+            if (delta_get_u32(sigs + (size_t)i * DELTA_SIG_LEN) != weak) continue;
+            if (sig_match(sigs, (uint32_t)i, data + pos, block, strong, &have_strong)) {
+                hit = i;
+                break;
+            }
+        }
+        if (hit >= 0) {
+            delta_literal(d, data + lit, pos - lit);
+            delta_copy(d, (uint32_t)hit);
+            pos += block;
+            lit = pos;
+            fresh = 1;
+            continue;
+        }
+        if (pos + block == size) break;
+        weak = delta_weak_roll(weak, data[pos], data[pos + block], block);
+        pos++;
+    }
+    free(head);
+    free(next);
+
+    /* a short last block can only line up with the end of the new file */
+    size_t tail = oldsize - full * block;
+    if (tail && count > full && size - lit >= tail) {
+        const unsigned char *p = data + size - tail;
+        uint8_t strong[DELTA_STRONG_LEN];
+        int have_strong = 0;
+        if (delta_get_u32(sigs + full * DELTA_SIG_LEN) == delta_weak(p, tail) &&
+            sig_match(sigs, (uint32_t)full, p, tail, strong, &have_strong)) {
+            delta_literal(d, data + lit, size - tail - lit);
+            delta_copy(d, (uint32_t)full);
+            lit = size;
+        }
+    }
+    delta_literal(d, data + lit, size - lit);
+    delta_flush_copy(d);
+    return d->failed ? -1 : 0;
+}
+
+/* one attempt: 1 done, 0 fall back to a full upload, -1 connection lost */
+static int sync_once(Conn *c, const char *filename, const unsigned char *data, size_t size) {
+    char header[512];
+    snprintf(header, sizeof(header), "SIGS %s\n", filename);
+    char resp[256];
+    if (command(c, header, resp, sizeof(resp)) != 0) return -1;
+    if (strncmp(resp, "OK sigs ", 8) != 0) return 0; /* no server copy yet */
+    size_t n = 0;
+    sscanf(resp + 8, "%zu", &n);
+    char *payload = malloc(n + 1);
+    if (!payload) return -1;
+    if (netbuf_read_n(&c->nb, payload, n) != (ssize_t)n) {
+        free(payload);
         return -1;
     }
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    payload[n] = '\0';
+
+    char token[64];
+    size_t block = 0, oldsize = 0, count = 0;
+    char *nl = memchr(payload, '\n', n);
+    if (!nl || sscanf(payload, "%63s %zu %zu %zu", token, &block, &oldsize, &count) != 4 ||
+        block == 0 || (size_t)(payload + n - (nl + 1)) != count * DELTA_SIG_LEN) {
+        free(payload);
+        printf("Bad signature reply\n");
+        return 0;
+    }
+
+    DeltaOut d;
+    memset(&d, 0, sizeof(d));
+    d.out = tmpfile();
+    int rc = d.out ? delta_encode(&d, data, size, (unsigned char *)nl + 1, count, block, oldsize) : -1;
+    free(payload);
+    if (rc != 0 || fflush(d.out) != 0) {
+        if (d.out) fclose(d.out);
+        printf("Cannot build delta\n");
+        return 0;
+    }
+
+    snprintf(header, sizeof(header), "PATCH %s %s %zu %zu %zu\n", filename, token, block, size, d.bytes);
+    rc = -1;
+    if (command(c, header, resp, sizeof(resp)) != 0) goto out;
+    if (strncmp(resp, "READY", 5) != 0) {
+        printf("Server not ready: %s", resp);
+        rc = 0;
+        goto out;
+    }
+    rewind(d.out);
+    char buf[65536];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), d.out)) > 0) {
+        if (send_all(c->sock, buf, r) != 0) goto out;
+    }
+    if (netbuf_readline(&c->nb, resp, sizeof(resp)) <= 0) goto out;
+    if (strncmp(resp, "OK", 2) != 0) {
+        /* "stale": the server copy changed since SIGS */
+        printf("Delta rejected: %s", resp);
+        rc = 0;
+        goto out;
+    }
+    printf("%s", resp);
+    printf("Synced %s: %zu blocks reused, %zu literal bytes, sent %zu of %zu bytes\n",
+           filename, d.reused, d.literal, d.bytes, size);
+    rc = 1;
+out:
+    fclose(d.out);
+    return rc;
+}
+
+/* send only what changed against the server's copy; full upload otherwise */
+static void do_sync(Conn *c, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("open");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (size && data == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    int rc = sync_once(c, filename, data, size);
+    if (data) munmap(data, size);
+    if (rc == 1) return;
+    if (rc < 0) server_close(c);
+    printf("Sending whole file\n");
+    do_upload(c, filename);
+}
+
+/* print the files starting with prefix ("" for all) a page at a time: the
+ * next page is only asked for once this one is printed. -1 if the
+ * connection failed. */
+static int do_list(Conn *c, const char *prefix) {
+    char cmdline[1024], resp[1024], cursor[600] = "";
+    size_t files = 0;
+    for (;;) {
+        int len = snprintf(cmdline, sizeof(cmdline), "LIST limit=%d", LIST_PAGE);
+        if (prefix[0]) len += snprintf(cmdline + len, sizeof(cmdline) - (size_t)len, " prefix=%s", prefix);
+        if (cursor[0]) len += snprintf(cmdline + len, sizeof(cmdline) - (size_t)len, " after=%s", cursor);
+        snprintf(cmdline + len, sizeof(cmdline) - (size_t)len, "\n");
+        if (command(c, cmdline, resp, sizeof(resp)) != 0) {
+            perror("recv");
+            return -1;
+        }
+        size_t size = 0;
+        char next[600] = "";
+        if (sscanf(resp, "OK list %zu %599s", &size, next) < 1) {
+            printf("%s", resp);
+            return 0;
+        }
+        char *buf = malloc(size + 1);
+        if (!buf) {
+            printf("alloc fail\n");
+            return -1;
+        }
+        if (netbuf_read_n(&c->nb, buf, size) != (ssize_t)size) {
+            printf("incomplete list\n");
+            free(buf);
+            return -1;
+        }
+        buf[size] = '\0';
+        if (files == 0 && size) printf("Files:\n");
+        printf("%s", buf);
+        for (size_t i = 0; i < size; ++i) files += buf[i] == '\n';
+        free(buf);
+        if (!next[0]) break;
+        strcpy(cursor, next);
+    }
+    if (files == 0) printf("(empty directory)\n");
+    return 0;
+}
+
+int main() {
+    Conn conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.sock = -1;
+    /* a server that refuses the connection closes it: report, do not die */
+    signal(SIGPIPE, SIG_IGN);
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+
+    printf("Client: connecting to %s:%d\n", "127.0.0.1", SERVER_PORT);
+    if (server_connect(&conn) != 0) {
         perror("connect");
         return -1;
     }
@@ -91,12 +594,14 @@ int main() {
     printf("  LOGIN <user> <pass>\n");
     printf("  UPLOAD <filename>\n");
     printf("  DOWNLOAD <filename>\n");
-    printf("  LIST\n");
+    printf("  SYNC <filename>\n");
+    printf("  LIST [prefix]\n");
     printf("  DELETE <filename>\n");
+    printf("  USAGE\n");
+    printf("  STATS\n");
     printf("  QUIT\n\n");
 
     char line[1024];
-    int logged_in = 0;
     
     while (1) {
         printf("> ");
@@ -113,14 +618,21 @@ int main() {
         /* Parse command */
         char cmd[32] = {0};
         sscanf(line, "%31s", cmd);
+
+        /* only transfers reconnect by themselves */
+        if (conn.sock < 0 && strcmp(cmd, "UPLOAD") != 0 && strcmp(cmd, "DOWNLOAD") != 0 &&
+            strcmp(cmd, "SYNC") != 0) {
+            printf("Not connected\n");
+            break;
+        }
         
         if (strcmp(cmd, "QUIT") == 0) {
             char quitcmd[64];
             snprintf(quitcmd, sizeof(quitcmd), "QUIT\n");
-            send_all(sock, quitcmd, strlen(quitcmd));
+            send_all(conn.sock, quitcmd, strlen(quitcmd));
             
             char reply[256];
-            ssize_t r = read_line(sock, reply, sizeof(reply));
+            ssize_t r = netbuf_readline(&conn.nb, reply, sizeof(reply));
             if (r > 0) {
                 printf("%s", reply);
             }
@@ -128,16 +640,16 @@ int main() {
             
         } else if (strcmp(cmd, "SIGNUP") == 0 || strcmp(cmd, "LOGIN") == 0) {
             /* Send command with newline */
-            char cmdline[512];
+            char cmdline[1100];
             snprintf(cmdline, sizeof(cmdline), "%s\n", line);
-            if (send_all(sock, cmdline, strlen(cmdline)) != 0) {
+            if (send_all(conn.sock, cmdline, strlen(cmdline)) != 0) {
                 perror("send");
                 break;
             }
             
             /* Read response */
             char reply[256];
-            ssize_t r = read_line(sock, reply, sizeof(reply));
+            ssize_t r = netbuf_readline(&conn.nb, reply, sizeof(reply));
             if (r <= 0) {
                 perror("recv");
                 break;
@@ -145,11 +657,14 @@ int main() {
             printf("%s", reply);
             
             if (strcmp(cmd, "LOGIN") == 0 && strncmp(reply, "OK", 2) == 0) {
-                logged_in = 1;
+                /* kept so an interrupted transfer can log in again */
+                sscanf(line, "%*s %63s %63s", conn.user, conn.pass);
+                conn.logged_in = 1;
+                if (server_caps(&conn) != 0) server_close(&conn);
             }
             
         } else if (strcmp(cmd, "UPLOAD") == 0) {
-            if (!logged_in) {
+            if (!conn.logged_in) {
                 printf("ERR: Please login first\n");
                 continue;
             }
@@ -159,73 +674,23 @@ int main() {
                 printf("Usage: UPLOAD <filename>\n");
                 continue;
             }
+            do_upload(&conn, filename);
             
-            /* Open file */
-            FILE *fp = fopen(filename, "rb");
-            if (!fp) {
-                perror("fopen");
-                continue;
-            }
-            
-            /* Get file size */
-            fseek(fp, 0, SEEK_END);
-            long sz = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            if (sz < 0) {
-                fclose(fp);
-                printf("Cannot stat file\n");
+        } else if (strcmp(cmd, "SYNC") == 0) {
+            if (!conn.logged_in) {
+                printf("ERR: Please login first\n");
                 continue;
             }
             
-            /* Send command with size */
-            char header[512];
-            snprintf(header, sizeof(header), "UPLOAD %s %ld\n", filename, sz);
-            if (send_all(sock, header, strlen(header)) != 0) {
-                perror("send");
-                fclose(fp);
-                break;
-            }
-            
-            /* Wait for READY */
-            char ready[256];
-            ssize_t r = read_line(sock, ready, sizeof(ready));
-            if (r <= 0 || strncmp(ready, "READY", 5) != 0) {
-                printf("Server not ready: %s\n", ready);
-                fclose(fp);
+            char filename[256];
+            if (sscanf(line + 5, "%255s", filename) != 1) {
+                printf("Usage: SYNC <filename>\n");
                 continue;
             }
-            
-            /* Send file bytes */
-            char buf[4096];
-            size_t total_sent = 0;
-            while (total_sent < (size_t)sz) {
-                size_t to_read = sizeof(buf);
-                if (to_read > (size_t)sz - total_sent) {
-                    to_read = (size_t)sz - total_sent;
-                }
-                size_t rr = fread(buf, 1, to_read, fp);
-                if (rr == 0) break;
-                if (send_all(sock, buf, rr) != 0) {
-                    perror("send");
-                    fclose(fp);
-                    goto cleanup;
-                }
-                total_sent += rr;
-            }
-            fclose(fp);
-            
-            /* Read response after worker completes */
-            char res[256];
-            ssize_t s = read_line(sock, res, sizeof(res));
-            if (s > 0) {
-                printf("%s", res);
-            } else {
-                perror("recv response");
-                break;
-            }
+            do_sync(&conn, filename);
             
         } else if (strcmp(cmd, "DOWNLOAD") == 0) {
-            if (!logged_in) {
+            if (!conn.logged_in) {
                 printf("ERR: Please login first\n");
                 continue;
             }
@@ -235,120 +700,74 @@ int main() {
                 printf("Usage: DOWNLOAD <filename>\n");
                 continue;
             }
+            do_download(&conn, filename);
             
-            /* Send command */
-            char header[512];
-            snprintf(header, sizeof(header), "DOWNLOAD %s\n", filename);
-            if (send_all(sock, header, strlen(header)) != 0) {
-                perror("send");
-                break;
+        } else if (strcmp(cmd, "LIST") == 0) {
+            if (!conn.logged_in) {
+                printf("ERR: Please login first\n");
+                continue;
+            }
+            
+            char prefix[256] = "";
+            sscanf(line + 4, "%255s", prefix);
+            if (do_list(&conn, prefix) != 0) break;
+            
+        } else if (strcmp(cmd, "STATS") == 0) {
+            if (!conn.logged_in) {
+                printf("ERR: Please login first\n");
+                continue;
             }
             
-            /* Read response header */
+            /* Read response header, then "name value" lines */
             char resp[256];
-            ssize_t r = read_line(sock, resp, sizeof(resp));
-            if (r <= 0) {
+            if (command(&conn, "STATS\n", resp, sizeof(resp)) != 0) {
                 perror("recv");
                 break;
             }
             
-            if (strncmp(resp, "OK download ", 12) == 0) {
+            if (strncmp(resp, "OK stats ", 9) == 0) {
                 size_t size = 0;
-                sscanf(resp + 12, "%zu", &size);
-                
-                /* Receive exact size */
+                sscanf(resp + 9, "%zu", &size);
                 char *buf = malloc(size + 1);
                 if (!buf) {
                     printf("alloc fail\n");
                     break;
                 }
-                
-                ssize_t got = read_n_bytes(sock, buf, size);
-                if (got != (ssize_t)size) {
-                    printf("incomplete download (got %zd, expected %zu)\n", got, size);
+                if (netbuf_read_n(&conn.nb, buf, size) != (ssize_t)size) {
+                    printf("incomplete stats\n");
                     free(buf);
                     break;
                 }
-                
                 buf[size] = '\0';
-                
-                /* Save to file in downloads/ to make location explicit */
-                char outdir[] = "downloads";
-                mkdir(outdir, 0755);
-                char outpath[512];
-                snprintf(outpath, sizeof(outpath), "%s/%s", outdir, filename);
-                FILE *fp = fopen(outpath, "wb");
-                if (!fp) {
-                    perror("fopen");
-                    free(buf);
-                    continue;
-                }
-                size_t wrote = fwrite(buf, 1, size, fp);
-                fclose(fp);
+                printf("%s", buf);
                 free(buf);
-
-                if (wrote != size) {
-                    printf("Download incomplete: wrote %zu of %zu bytes\n", wrote, size);
-                } else {
-                    printf("Downloaded %s -> %s (%zu bytes)\n", filename, outpath, size);
-                }
             } else {
                 printf("%s", resp);
             }
             
-        } else if (strcmp(cmd, "LIST") == 0) {
-            if (!logged_in) {
+        } else if (strcmp(cmd, "USAGE") == 0) {
+            if (!conn.logged_in) {
                 printf("ERR: Please login first\n");
                 continue;
             }
             
-            /* Send command */
-            char cmdline[64];
-            snprintf(cmdline, sizeof(cmdline), "LIST\n");
-            if (send_all(sock, cmdline, strlen(cmdline)) != 0) {
-                perror("send");
-                break;
-            }
-            
-            /* Read response header */
             char resp[256];
-            ssize_t r = read_line(sock, resp, sizeof(resp));
-            if (r <= 0) {
+            if (command(&conn, "USAGE\n", resp, sizeof(resp)) != 0) {
                 perror("recv");
                 break;
             }
             
-            if (strncmp(resp, "OK list ", 8) == 0) {
-                size_t size = 0;
-                sscanf(resp + 8, "%zu", &size);
-                
-                if (size == 0) {
-                    printf("(empty directory)\n");
-                } else {
-                    /* Receive list data */
-                    char *buf = malloc(size + 1);
-                    if (!buf) {
-                        printf("alloc fail\n");
-                        break;
-                    }
-                    
-                    ssize_t got = read_n_bytes(sock, buf, size);
-                    if (got != (ssize_t)size) {
-                        printf("incomplete list\n");
-                        free(buf);
-                        break;
-                    }
-                    
-                    buf[size] = '\0';
-                    printf("Files:\n%s", buf);
-                    free(buf);
-                }
+            unsigned long long used = 0, limit = 0, files = 0;
+            if (sscanf(resp, "OK usage %llu %llu %llu", &used, &limit, &files) == 3) {
+                if (limit) printf("%llu files, %llu of %llu bytes used (%.1f%%)\n", files, used, limit,
+                                  100.0 * (double)used / (double)limit);
+                else printf("%llu files, %llu bytes used (no quota)\n", files, used);
             } else {
                 printf("%s", resp);
             }
             
         } else if (strcmp(cmd, "DELETE") == 0) {
-            if (!logged_in) {
+            if (!conn.logged_in) {
                 printf("ERR: Please login first\n");
                 continue;
             }
@@ -359,18 +778,11 @@ int main() {
                 continue;
             }
             
-            /* Send command */
+            /* Send command, read response */
             char cmdline[512];
             snprintf(cmdline, sizeof(cmdline), "DELETE %s\n", filename);
-            if (send_all(sock, cmdline, strlen(cmdline)) != 0) {
-                perror("send");
-                break;
-            }
-            
-            /* Read response */
             char resp[256];
-            ssize_t r = read_line(sock, resp, sizeof(resp));
-            if (r > 0) {
+            if (command(&conn, cmdline, resp, sizeof(resp)) == 0) {
                 printf("%s", resp);
             } else {
                 perror("recv");
@@ -382,7 +794,6 @@ int main() {
         }
     }
 
-cleanup:
-    close(sock);
+    server_close(&conn);
     return 0;
 }
\ No newline at end of file
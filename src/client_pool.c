@@ -1,338 +1,1315 @@
-
 #define _POSIX_C_SOURCE 200809L
 #include "client_pool.h"
 #include "server_types.h"
 #include "queue.h"
 #include "auth.h"
 #include "storage.h"
+#include "netbuf.h"
+#include "lzblock.h"
+#include "filecache.h"
+#include "chunkstore.h"
+#include "worker_pool.h"
+#include "slab.h"
+#include "durable.h"
+#include "dropbox.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 
 #ifndef BUFFER_SIZE
 #define BUFFER_SIZE 4096
 #endif
 
-static pthread_t *client_threads = NULL;
-static size_t client_thread_count = 0;
+/* per-connection receive buffer; must hold at least one full command line */
+#define CONN_INBUF_SIZE (4 * BUFFER_SIZE)
+#define REACTOR_MAX_EVENTS 64
+#define STATS_TEXT_MAX 4096
+
+/* reply lines up to this long are copied into their out_chunk */
+#define OUT_INLINE 96
+
+/* upload bodies go to disk in chunks of at most this many bytes */
+#ifndef UPLOAD_CHUNK_SIZE
+#define UPLOAD_CHUNK_SIZE (256 * 1024)
+#endif
+
+/* queued outgoing bytes; data (or fd) is owned by the chunk.
+ * fd >= 0 means bytes [off, len) of that file are sent with sendfile().
+ * With blob set, bytes [off, len) come from a shared file cache entry;
+ * with chunks set, from a dedup file's chunk files, also with sendfile().
+ * A framed chunk sends the file as lzblock frames instead, built one at a
+ * time in data. A short reply with neither data nor fd nor blob is sent
+ * from text. */
+typedef struct out_chunk {
+    char *data;
+    int fd;
+    filecache_blob *blob;   /* one reference, dropped when the chunk is freed */
+    chunkstore_reader *chunks; /* closed when the chunk is freed */
+    size_t len;
+    size_t off;
+    int framed;
+    lzblock_adapt lz;
+    size_t frame_len;       /* framed: bytes of data holding the current frame */
+    size_t frame_off;       /* framed: bytes of it already sent */
+    struct out_chunk *next;
+    char text[OUT_INLINE];
+} out_chunk;
+
+static slab_cache out_slab = SLAB_CACHE_INIT("out_chunk", sizeof(out_chunk));
+
+/* cap per sendfile() call so one big download cannot starve other sessions */
+#define SENDFILE_MAX (1024 * 1024)
+
+typedef enum {
+    CONN_LINE,  /* parsing command lines */
+    CONN_BODY,  /* receiving an UPLOAD body into the chunk buffer */
+    CONN_WAIT   /* an untagged task or upload chunk is in the worker pool; input is paused */
+} ConnState;
+
+/* one UPLOAD or PATCH from READY until its commit task completes */
+typedef struct Upload {
+    storage_upload *up;     /* NULL once the commit task owns it */
+    storage_patch *patch;   /* PATCH: body is a delta applied by the workers */
+    char name[256];
+    unsigned long tag;
+    char *chunk;            /* one chunk buffer per upload, reused; NULL when only draining */
+    size_t chunk_cap;       /* bytes reserved against upload_buf_cap */
+    size_t chunk_len;
+    size_t body_left;       /* body bytes not yet received */
+    char err[320];          /* set when the upload failed; rest of body is drained */
+    int framed;             /* body is lzblock frames; body_left counts raw bytes */
+    unsigned char hdr[LZBLOCK_HDR]; /* frame header being received */
+    size_t hdr_len;
+    size_t frame_left;      /* payload bytes of the current frame not yet received */
+} Upload;
+
+typedef struct Connection {
+    ClientSession sess;     /* must stay first: workers only see the session */
+    ConnState state;
+    netbuf in;
+    out_chunk *out_head;
+    out_chunk *out_tail;
+    struct Upload *upload;  /* body currently being received */
+    int inflight;           /* tasks pushed and not yet completed */
+    int closing;            /* QUIT seen: flush output, then close */
+    int lz;                 /* CAPS lz: transfers may be lzblock framed */
+    int registered;         /* fd is in the reactor's epoll set */
+    uint32_t events;        /* epoll mask currently registered */
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+static slab_cache conn_slab = SLAB_CACHE_INIT("conn", sizeof(Connection));
+
+typedef struct Reactor {
+    pthread_t thread;
+    int epfd;
+    int evfd;                 /* wakes epoll_wait for the inbox */
+    pthread_mutex_t inbox_mtx;
+    Connection *incoming;     /* accepted by the dispatcher, not yet registered */
+    TaskResult *done_head;    /* results posted by workers */
+    TaskResult *done_tail;
+    int stopping;
+    Connection *conns;        /* registered connections, reactor thread only */
+    char lz_src[LZBLOCK_MAX]; /* file block being framed for a download */
+} Reactor;
+
+static Reactor *reactors = NULL;
+static size_t reactor_count = 0;
+static pthread_t dispatch_thread;
 static queue_t *client_queue_global = NULL;
-static queue_t *task_queue_global = NULL;
-/* client threads stop when queue is closed; use client_threads != NULL as started flag */
-
-static ssize_t robust_readline(int fd, char *buf, size_t maxlen) {
-    size_t idx = 0;
-    while (idx + 1 < maxlen) {
-        char c;
-        ssize_t r = recv(fd, &c, 1, 0);
-        if (r == 0) {
-            if (idx == 0) return 0;
-            break;
-        } else if (r < 0) {
+static size_t upload_buf_cap = 0;
+static atomic_size_t upload_buf_used = 0;
+static int max_inflight = 1;
+/* framed transfer totals for STATS: raw bytes, bytes on the wire, frames */
+static atomic_ullong lz_raw_bytes = 0;
+static atomic_ullong lz_wire_bytes = 0;
+static atomic_ullong lz_frames = 0;
+static atomic_ullong lz_frames_raw = 0;
+static atomic_ullong busy_replies = 0; /* ERR serverbusy sent, incl. refused accepts */
+/* reactors stop on their stopping flag; use reactors != NULL as started flag */
+
+static void reactor_wake(Reactor *r) {
+    uint64_t one = 1;
+    ssize_t w = write(r->evfd, &one, sizeof(one));
+    (void)w; /* counter saturation still leaves the fd readable */
+}
+
+static void out_append(Connection *c, out_chunk *oc) {
+    if (c->out_tail) c->out_tail->next = oc;
+    else c->out_head = oc;
+    c->out_tail = oc;
+}
+
+static void out_free(out_chunk *oc) {
+    if (oc->fd >= 0) close(oc->fd);
+    filecache_release(oc->blob);
+    chunkstore_reader_close(oc->chunks);
+    free(oc->data);
+    slab_free(&out_slab, oc);
+}
+
+static void conn_send_owned(Connection *c, char *data, size_t len) {
+    if (len == 0) { free(data); return; }
+    out_chunk *oc = slab_alloc(&out_slab);
+    if (!oc) { free(data); c->sess.alive = 0; return; }
+    oc->data = data;
+    oc->fd = -1;
+    oc->len = len;
+    out_append(c, oc);
+}
+
+/* queue len bytes of fd starting at offset */
+static void conn_send_file(Connection *c, int fd, size_t offset, size_t len) {
+    if (len == 0) { close(fd); return; }
+    out_chunk *oc = slab_alloc(&out_slab);
+    if (!oc) { close(fd); c->sess.alive = 0; return; }
+    oc->fd = fd;
+    oc->off = offset;
+    oc->len = offset + len;
+    out_append(c, oc);
+}
+
+/* queue len bytes of a cached file starting at offset; takes the reference */
+static void conn_send_blob(Connection *c, filecache_blob *blob, size_t offset, size_t len) {
+    if (len == 0) { filecache_release(blob); return; }
+    out_chunk *oc = slab_alloc(&out_slab);
+    if (!oc) { filecache_release(blob); c->sess.alive = 0; return; }
+    oc->blob = blob;
+    oc->fd = -1;
+    oc->off = offset;
+    oc->len = offset + len;
+    out_append(c, oc);
+}
+
+/* queue len bytes of a dedup file starting at offset, sent from its chunk
+ * files; takes the reader */
+static void conn_send_chunks(Connection *c, chunkstore_reader *chunks, size_t offset, size_t len) {
+    if (len == 0) { chunkstore_reader_close(chunks); return; }
+    out_chunk *oc = slab_alloc(&out_slab);
+    if (!oc) { chunkstore_reader_close(chunks); c->sess.alive = 0; return; }
+    oc->chunks = chunks;
+    oc->fd = -1;
+    oc->off = offset;
+    oc->len = offset + len;
+    out_append(c, oc);
+}
+
+/* queue len bytes of fd (or of blob or chunks, when fd < 0) starting at
+ * offset as lzblock frames; takes the fd, the reference or the reader */
+static void conn_send_framed(Connection *c, int fd, filecache_blob *blob, chunkstore_reader *chunks,
+                             size_t offset, size_t len) {
+    out_chunk *oc = NULL;
+    char *frame = NULL;
+    if (len) {
+        oc = slab_alloc(&out_slab);
+        frame = malloc(LZBLOCK_FRAME_MAX);
+        if (!oc || !frame) c->sess.alive = 0;
+    }
+    if (!oc || !frame) {
+        slab_free(&out_slab, oc);
+        free(frame);
+        if (fd >= 0) close(fd);
+        filecache_release(blob);
+        chunkstore_reader_close(chunks);
+        return;
+    }
+    oc->data = frame;
+    oc->fd = fd;
+    oc->blob = blob;
+    oc->chunks = chunks;
+    oc->off = offset;
+    oc->len = offset + len;
+    oc->framed = 1;
+    out_append(c, oc);
+}
+
+static void lz_count(size_t raw, size_t wire, int z) {
+    atomic_fetch_add(&lz_raw_bytes, raw);
+    atomic_fetch_add(&lz_wire_bytes, wire);
+    atomic_fetch_add(&lz_frames, 1);
+    if (!z) atomic_fetch_add(&lz_frames_raw, 1);
+}
+
+/* frame and send the next blocks of a framed chunk; 1 once all of it is
+ * sent, 0 to wait for EPOLLOUT (or to let other sessions run) */
+static int conn_flush_framed(Connection *c, out_chunk *oc) {
+    Reactor *r = c->sess.reactor;
+    size_t framed = 0;
+    while (1) {
+        if (oc->frame_off == oc->frame_len) {
+            if (oc->off == oc->len) return 1;
+            if (framed >= SENDFILE_MAX) return 0;
+            size_t n = oc->len - oc->off < LZBLOCK_MAX ? oc->len - oc->off : LZBLOCK_MAX;
+            const char *src = oc->blob ? oc->blob->data + oc->off : r->lz_src;
+            ssize_t got = oc->blob ? (ssize_t)n
+                        : oc->chunks ? chunkstore_reader_pread(oc->chunks, r->lz_src, n, oc->off)
+                        : pread(oc->fd, r->lz_src, n, (off_t)oc->off);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                /* file shorter than announced: the stream cannot be resynced */
+                c->sess.alive = 0;
+                return 0;
+            }
+            int z = 0;
+            oc->frame_len = lzblock_frame(&oc->lz, src, (size_t)got, oc->data, &z);
+            oc->frame_off = 0;
+            oc->off += (size_t)got;
+            framed += (size_t)got;
+            lz_count((size_t)got, oc->frame_len, z);
+        }
+        ssize_t w = send(c->sess.sockfd, oc->data + oc->frame_off, oc->frame_len - oc->frame_off, MSG_NOSIGNAL);
+        if (w < 0) {
             if (errno == EINTR) continue;
-            return -1;
-        } else {
-            buf[idx++] = c;
-            if (c == '\n') break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->sess.alive = 0;
+            return 0;
         }
+        oc->frame_off += (size_t)w;
     }
-    buf[idx] = '\0';
-    return (ssize_t)idx;
 }
 
-static ssize_t read_n_bytes(int fd, void *buf, size_t n) {
-    size_t left = n;
-    char *p = buf;
-    while (left) {
-        ssize_t r = recv(fd, p, left, 0);
-        if (r == 0) return (ssize_t)(n - left);
-        if (r < 0) {
+/* sendfile the next bytes of a chunks chunk, one chunk file after another;
+ * 1 once all of it is sent, 0 to wait for EPOLLOUT (or to let other
+ * sessions run) */
+static int conn_flush_chunks(Connection *c, out_chunk *oc) {
+    size_t sent = 0;
+    while (oc->off < oc->len) {
+        if (sent >= SENDFILE_MAX) return 0;
+        size_t coff, n;
+        int fd = chunkstore_reader_fd(oc->chunks, oc->off, &coff, &n);
+        if (fd < 0) {
+            /* chunk file unreadable: the stream cannot be resynced */
+            c->sess.alive = 0;
+            return 0;
+        }
+        if (n > oc->len - oc->off) n = oc->len - oc->off;
+        if (n > SENDFILE_MAX - sent) n = SENDFILE_MAX - sent;
+        off_t off = (off_t)coff;
+        ssize_t w = sendfile(c->sess.sockfd, fd, &off, n);
+        if (w == 0) {
+            c->sess.alive = 0;
+            return 0;
+        }
+        if (w < 0) {
             if (errno == EINTR) continue;
-            return -1;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->sess.alive = 0;
+            return 0;
         }
-        left -= (size_t)r;
-        p += r;
+        oc->off += (size_t)w;
+        sent += (size_t)w;
     }
-    return (ssize_t)n;
+    return 1;
 }
 
-static int send_all(int fd, const void *buf, size_t len) {
-    const char *p = buf;
-    size_t left = len;
-    while (left) {
-        ssize_t w = send(fd, p, left, 0);
-        if (w <= 0) {
+static void conn_send(Connection *c, const char *s) {
+    size_t len = strlen(s);
+    if (len > 0 && len <= OUT_INLINE) {
+        out_chunk *oc = slab_alloc(&out_slab);
+        if (!oc) { c->sess.alive = 0; return; }
+        memcpy(oc->text, s, len);
+        oc->fd = -1;
+        oc->len = len;
+        out_append(c, oc);
+        return;
+    }
+    char *copy = malloc(len);
+    if (!copy) { c->sess.alive = 0; return; }
+    memcpy(copy, s, len);
+    conn_send_owned(c, copy, len);
+}
+
+/* write as much queued output as the socket takes without blocking */
+static void conn_flush(Connection *c) {
+    while (c->out_head && c->sess.alive) {
+        out_chunk *oc = c->out_head;
+        ssize_t w;
+        if (oc->framed) {
+            if (!conn_flush_framed(c, oc)) return;
+            w = 0;
+        } else if (oc->chunks) {
+            if (!conn_flush_chunks(c, oc)) return;
+            w = 0;
+        } else if (oc->fd >= 0) {
+            off_t off = (off_t)oc->off;
+            size_t n = oc->len - oc->off;
+            if (n > SENDFILE_MAX) n = SENDFILE_MAX;
+            w = sendfile(c->sess.sockfd, oc->fd, &off, n);
+            if (w == 0) {
+                /* file shorter than announced: the stream cannot be resynced */
+                c->sess.alive = 0;
+                return;
+            }
+        } else {
+            const char *base = oc->blob ? oc->blob->data : oc->data ? oc->data : oc->text;
+            w = send(c->sess.sockfd, base + oc->off, oc->len - oc->off, MSG_NOSIGNAL);
+        }
+        if (w < 0) {
             if (errno == EINTR) continue;
-            return -1;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            c->sess.alive = 0;
+            return;
+        }
+        oc->off += (size_t)w;
+        if (oc->off < oc->len) {
+            if (oc->fd >= 0) return; /* let other sessions run; EPOLLOUT resumes */
+            continue;
         }
-        left -= (size_t)w;
-        p += w;
+        c->out_head = oc->next;
+        if (!c->out_head) c->out_tail = NULL;
+        out_free(oc);
+    }
+}
+
+static void conn_reply(Connection *c, unsigned long tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* queue one reply line, prefixed with "#<tag> " for pipelined commands */
+static void conn_reply(Connection *c, unsigned long tag, const char *fmt, ...) {
+    char tmp[640];
+    int off = 0;
+    if (tag) off = snprintf(tmp, sizeof(tmp), "#%lu ", tag);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(tmp + off, sizeof(tmp) - (size_t)off, fmt, ap);
+    va_end(ap);
+    conn_send(c, tmp);
+}
+
+/* a refusal under load, with a hint of when to retry */
+static void busy_text(char *buf, size_t n) {
+    atomic_fetch_add_explicit(&busy_replies, 1, memory_order_relaxed);
+    snprintf(buf, n, "ERR serverbusy retry-after %u\n", worker_pool_retry_ms());
+}
+
+static void conn_reply_busy(Connection *c, unsigned long tag) {
+    char text[64];
+    busy_text(text, sizeof(text));
+    conn_reply(c, tag, "%s", text);
+}
+
+void client_pool_refuse(int fd) {
+    char text[64];
+    busy_text(text, sizeof(text));
+    ssize_t w = send(fd, text, strlen(text), MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)w; /* best effort: the connection is closed either way */
+    close(fd);
+}
+
+/* untagged tasks keep the old one-at-a-time behaviour; tagged ones run
+ * concurrently up to max_inflight per session */
+static int conn_submit(Connection *c, Task *t, unsigned long tag) {
+    t->session = &c->sess;
+    t->task_id = tag;
+    if (worker_pool_submit(t) != 0) {
+        slab_free(&task_slab, t);
+        return -1;
     }
+    c->inflight++;
+    if (!tag) c->state = CONN_WAIT;
     return 0;
 }
 
-static void cleanup_session(ClientSession *sess) {
-    if (!sess) return;
-    pthread_mutex_lock(&sess->resp_lock);
-    sess->alive = 0;
-    pthread_cond_broadcast(&sess->resp_cv);
-    pthread_mutex_unlock(&sess->resp_lock);
-    pthread_mutex_destroy(&sess->resp_lock);
-    pthread_cond_destroy(&sess->resp_cv);
-    close(sess->sockfd);
-    free(sess);
-}
-
-static void client_handle_connection(int client_fd) {
-    /* allocate session */
-    ClientSession *sess = calloc(1, sizeof(ClientSession));
-    sess->sockfd = client_fd;
-    sess->username[0] = '\0';
-    sess->logged_in = 0;
-    pthread_mutex_init(&sess->resp_lock, NULL);
-    pthread_cond_init(&sess->resp_cv, NULL);
-    sess->pending_result = NULL;
-    sess->alive = 1;
-
-    char line[BUFFER_SIZE];
-
-    /* Authentication loop: require SIGNUP or LOGIN */
-    while (1) {
-        ssize_t n = robust_readline(client_fd, line, sizeof(line));
-        if (n <= 0) { cleanup_session(sess); return; }
+/* in-flight upload memory is capped server-wide; fails instead of waiting */
+static int upload_buf_reserve(size_t n) {
+    size_t cur = atomic_load(&upload_buf_used);
+    do {
+        if (cur + n > upload_buf_cap) return -1;
+    } while (!atomic_compare_exchange_weak(&upload_buf_used, &cur, cur + n));
+    return 0;
+}
+
+static void upload_free(Upload *u) {
+    if (!u) return;
+    /* a resumable upload keeps its partial file for the client's retry */
+    if (u->up) storage_upload_close(u->up);
+    if (u->patch) storage_patch_abort(u->patch);
+    free(u->chunk);
+    atomic_fetch_sub(&upload_buf_used, u->chunk_cap);
+    free(u);
+}
+
+/* hand the filled chunk to a worker; the last one also commits the upload */
+static void conn_upload_chunk(Connection *c) {
+    Upload *u = c->upload;
+    if (u->err[0]) {
+        /* failed earlier: drop bytes until the body ends, then report */
+        u->chunk_len = 0;
+        if (u->body_left) return;
+        c->upload = NULL;
+        c->state = CONN_LINE;
+        conn_reply(c, u->tag, "%s", u->err);
+        upload_free(u);
+        return;
+    }
+    Task *t = slab_alloc(&task_slab);
+    if (!t) {
+        snprintf(u->err, sizeof(u->err), "ERR nomem\n");
+        conn_upload_chunk(c);
+        return;
+    }
+    TaskType last = u->patch ? TASK_PATCH : TASK_UPLOAD;
+    TaskType type = u->body_left ? TASK_UPLOAD_CHUNK : last;
+    t->type = type;
+    strncpy(t->filename, u->name, sizeof(t->filename)-1);
+    t->upload_data = u->chunk;
+    t->filesize = u->chunk_len;
+    t->upload = u->up;
+    t->patch = u->patch;
+    t->framed = u->framed;
+    t->ctx = u;
+    if (type != TASK_UPLOAD_CHUNK) {
+        /* the commit task owns the upload from here on */
+        c->upload = NULL;
+        c->state = CONN_LINE;
+    }
+    if (conn_submit(c, t, u->tag) != 0) {
+        /* still consume the rest of the body before replying */
+        c->upload = u;
+        c->state = CONN_BODY;
+        busy_text(u->err, sizeof(u->err));
+        conn_upload_chunk(c);
+        return;
+    }
+    /* t belongs to the worker now; the chunk buffer is in use until it is done */
+    if (type == TASK_UPLOAD_CHUNK) {
+        c->state = CONN_WAIT;
+    } else {
+        /* committed or aborted by the worker */
+        u->up = NULL;
+        u->patch = NULL;
+    }
+}
+
+static void conn_handle_auth(Connection *c, unsigned long tag, const char *line) {
+    char cmd[16], user[64], pass[64];
+    int args = sscanf(line, "%15s %63s %63s", cmd, user, pass);
+    if (args < 1) {
+        conn_reply(c, tag, "ERR invalid\n");
+        return;
+    }
+    if (strcmp(cmd, "SIGNUP") == 0 && args == 3) {
+        if (auth_signup(user, pass) == 0) {
+            storage_ensure_userdir(user);
+            conn_reply(c, tag, "OK signup\n");
+        } else {
+            conn_reply(c, tag, "ERR userexists\n");
+        }
+    } else if (strcmp(cmd, "LOGIN") == 0 && args == 3) {
+        if (auth_login(user, pass) == 0) {
+            strncpy(c->sess.username, user, sizeof(c->sess.username)-1);
+            c->sess.logged_in = 1;
+            conn_reply(c, tag, "OK login\n");
+        } else {
+            conn_reply(c, tag, "ERR badcreds\n");
+        }
+    } else if (strcmp(cmd, "SIGNUP") == 0 || strcmp(cmd, "LOGIN") == 0) {
+        conn_reply(c, tag, "ERR invalid\n");
+    } else if (strcmp(cmd, "QUIT") == 0) {
+        conn_reply(c, tag, "OK bye\n");
+        c->closing = 1;
+    } else {
+        conn_reply(c, tag, "ERR need SIGNUP/LOGIN\n");
+    }
+}
+
+/* refuse an UPLOAD before READY. A tagged client may already be sending the
+ * body, so swallow body bytes first; the error is replied once they are in. */
+static void conn_reject_upload(Connection *c, unsigned long tag, size_t body, const char *err) {
+    Upload *u = tag && body ? calloc(1, sizeof(Upload)) : NULL;
+    if (!u) {
+        conn_reply(c, tag, "%s", err);
+        return;
+    }
+    u->tag = tag;
+    u->body_left = body;
+    snprintf(u->err, sizeof(u->err), "%s", err);
+    c->upload = u;
+    c->state = CONN_BODY;
+}
+
+/* an Upload with its chunk buffer reserved, or NULL after rejecting the body */
+static Upload *conn_upload_new(Connection *c, unsigned long tag, const char *fname,
+                               size_t body, size_t blind, int framed) {
+    /* body is streamed to a temp file one chunk at a time; a framed chunk
+     * holds whole frames, so it also needs room for their headers */
+    size_t wire = framed ? body + (body / LZBLOCK_MAX + 1) * LZBLOCK_HDR : body;
+    size_t cap = wire < UPLOAD_CHUNK_SIZE ? wire : UPLOAD_CHUNK_SIZE;
+    if (cap == 0) cap = 1;
+    if (upload_buf_reserve(cap) != 0) {
+        char busy[64];
+        busy_text(busy, sizeof(busy));
+        conn_reject_upload(c, tag, blind, busy);
+        return NULL;
+    }
+    Upload *u = calloc(1, sizeof(Upload));
+    if (!u) {
+        atomic_fetch_sub(&upload_buf_used, cap);
+        conn_reject_upload(c, tag, blind, "ERR nomem\n");
+        return NULL;
+    }
+    u->chunk_cap = cap;
+    u->chunk = malloc(cap);
+    if (!u->chunk) {
+        upload_free(u);
+        conn_reject_upload(c, tag, blind, "ERR nomem\n");
+        return NULL;
+    }
+    strncpy(u->name, fname, sizeof(u->name)-1);
+    u->tag = tag;
+    u->body_left = body;
+    u->framed = framed;
+    return u;
+}
+
+static void conn_handle_upload(Connection *c, unsigned long tag, const char *fname,
+                               size_t filesize, int resume, int framed) {
+    /* a resumable body starts at the offset in READY, so it is never sent
+     * blind; neither is a framed one, whose length is not known up front */
+    size_t blind = resume || framed ? 0 : filesize;
+    Upload *u = conn_upload_new(c, tag, fname, filesize, blind, framed);
+    if (!u) return;
+    u->up = resume ? storage_upload_resume(c->sess.username, fname, filesize)
+                   : storage_upload_begin(c->sess.username, fname);
+    if (!u->up) {
+        upload_free(u);
+        conn_reject_upload(c, tag, blind, storage_name_reserved(fname) ? "ERR upload badname\n" : "ERR nomem\n");
+        return;
+    }
+    /* the whole file must fit the quota before any of the body is taken */
+    if (storage_upload_reserve(u->up, filesize) != 0) {
+        upload_free(u);
+        conn_reject_upload(c, tag, blind, "ERR upload quota\n");
+        return;
+    }
+    c->upload = u;
+    if (resume) {
+        /* a worker opens the partial file; READY <offset> is sent when it is done */
+        Task *t = slab_alloc(&task_slab);
+        if (!t) {
+            c->upload = NULL;
+            upload_free(u);
+            conn_reply(c, tag, "ERR nomem\n");
+            return;
+        }
+        t->type = TASK_UPLOAD_BEGIN;
+        strncpy(t->filename, fname, sizeof(t->filename)-1);
+        t->upload = u->up;
+        t->ctx = u;
+        if (conn_submit(c, t, tag) != 0) {
+            c->upload = NULL;
+            upload_free(u);
+            conn_reply_busy(c, tag);
+            return;
+        }
+        c->state = CONN_WAIT;
+        return;
+    }
+    c->state = CONN_BODY;
+    /* tell client ready */
+    conn_reply(c, tag, "READY\n");
+}
+
+/* PATCH <file> <token> <block> <newsize> <deltasize>: the body is a delta
+ * (see delta.h) against the version named by the token from SIGS */
+static void conn_handle_patch(Connection *c, unsigned long tag, const char *line) {
+    char cmd[16], fname[256], token[STORAGE_TOKEN_LEN];
+    size_t block = 0, newsize = 0, deltasize = 0;
+    if (sscanf(line, "%15s %255s %63s %zu %zu %zu", cmd, fname, token, &block, &newsize, &deltasize) != 6) {
+        conn_reply(c, tag, "ERR invalid\n");
+        return;
+    }
+    Upload *u = conn_upload_new(c, tag, fname, deltasize, deltasize, 0);
+    if (!u) return;
+    u->patch = storage_patch_begin(c->sess.username, fname, token, block, newsize);
+    if (!u->patch) {
+        upload_free(u);
+        conn_reject_upload(c, tag, deltasize, "ERR patch invalid\n");
+        return;
+    }
+    if (storage_patch_reserve(u->patch) != 0) {
+        upload_free(u);
+        conn_reject_upload(c, tag, deltasize, "ERR patch quota\n");
+        return;
+    }
+    c->upload = u;
+    c->state = CONN_BODY;
+    conn_reply(c, tag, "READY\n");
+}
+
+/* CAPS <name>...: enable the optional features the server knows; the
+ * reply lists the ones now on */
+static void conn_handle_caps(Connection *c, unsigned long tag, const char *line) {
+    char on[64] = "";
+    const char *p = line + strcspn(line, " ");
+    while (*p) {
+        char name[32];
+        int used = 0;
+        if (sscanf(p, " %31s%n", name, &used) != 1) break;
+        p += used;
+        if (strcmp(name, "lz") == 0 && !c->lz) {
+            c->lz = 1;
+            strcat(on, " lz");
+        }
+    }
+    conn_reply(c, tag, "OK caps%s\n", on);
+}
+
+/* USAGE: bytes stored, quota (0 = none) and file count; kept up to date by
+ * the file index, so answered inline */
+static void conn_handle_usage(Connection *c, unsigned long tag) {
+    storage_usage us;
+    storage_get_usage(c->sess.username, &us);
+    conn_reply(c, tag, "OK usage %llu %llu %llu\n", (unsigned long long)us.bytes,
+               (unsigned long long)us.limit, (unsigned long long)us.files);
+}
+
+/* server counters as "name value" lines; cheap enough to answer inline */
+static void conn_handle_stats(Connection *c, unsigned long tag) {
+    storage_stats st;
+    storage_get_stats(&st);
+    char *text = malloc(STATS_TEXT_MAX);
+    if (!text) { conn_reply(c, tag, "ERR nomem\n"); return; }
+    double ratio = st.stored_bytes ? (double)st.logical_bytes / (double)st.stored_bytes : 1.0;
+    unsigned long long raw = atomic_load(&lz_raw_bytes), wire = atomic_load(&lz_wire_bytes);
+    filecache_stats fc;
+    filecache_get_stats(&fc);
+    worker_pool_stats wp;
+    worker_pool_get_stats(&wp);
+    durable_stats du;
+    durable_get_stats(&du);
+    int n = snprintf(text, STATS_TEXT_MAX,
+                     "durable %s\ndurable_window_us %llu\ndurable_batches %llu\ndurable_writes %llu\n"
+                     "durable_batch_max %llu\ndurable_syncfs %llu\ndurable_errors %llu\n"
+                     "index_users %llu\nindex_entries %llu\nindex_appends %llu\n"
+                     "index_compactions %llu\nindex_rescans %llu\n"
+                     "pack %s\npack_files %llu\npack_segments %llu\npack_live_bytes %llu\n"
+                     "pack_dead_bytes %llu\npack_compactions %llu\n"
+                     "fanout %s\nfanout_users_sharded %llu\nfanout_users_migrating %llu\nfanout_moved %llu\n"
+                     "dedup %s\ndedup_chunks %llu\ndedup_logical_bytes %llu\n"
+                     "dedup_stored_bytes %llu\ndedup_ratio %.2f\n"
+                     "lz_raw_bytes %llu\nlz_wire_bytes %llu\nlz_saved_bytes %lld\n"
+                     "lz_frames %llu\nlz_frames_raw %llu\n"
+                     "cache_budget %llu\ncache_bytes %llu\ncache_entries %llu\n"
+                     "cache_hits %llu\ncache_misses %llu\ncache_evictions %llu\n"
+                     "workers %llu\nworkers_min %llu\nworkers_max %llu\n"
+                     "workers_scale_ups %llu\nworkers_scale_downs %llu\nworkers_fast_reserved %llu\n"
+                     "worker_queued %llu\nworker_queued_max %llu\n"
+                     "worker_tasks %llu\nworker_steals %llu\n"
+                     "fair_tenants %llu\nfair_backlog %llu\nfair_refused %llu\n"
+                     "fair_user_cap %llu\nfair_user_limited %llu\n"
+                     "upload_budget %llu\nupload_inflight %llu\nbusy_replies %llu\n",
+                     du.enabled ? "on" : "off", (unsigned long long)du.window_us,
+                     (unsigned long long)du.batches, (unsigned long long)du.writes,
+                     (unsigned long long)du.batch_max, (unsigned long long)du.syncfs,
+                     (unsigned long long)du.errors,
+                     st.index_users, st.index_entries, st.index_appends, st.index_compactions,
+                     st.index_rescans,
+                     st.pack ? "on" : "off", st.pack_files, st.pack_segments, st.pack_live_bytes,
+                     st.pack_dead_bytes, st.pack_compactions,
+                     st.fanout ? "on" : "off", st.fanout_sharded, st.fanout_migrating, st.fanout_moved,
+                     st.dedup ? "on" : "off", st.chunks, st.logical_bytes, st.stored_bytes, ratio,
+                     raw, wire, (long long)(raw - wire), atomic_load(&lz_frames), atomic_load(&lz_frames_raw),
+                     (unsigned long long)fc.budget, (unsigned long long)fc.bytes,
+                     (unsigned long long)fc.entries, (unsigned long long)fc.hits,
+                     (unsigned long long)fc.misses, (unsigned long long)fc.evictions,
+                     (unsigned long long)wp.workers, (unsigned long long)wp.workers_min,
+                     (unsigned long long)wp.workers_max, (unsigned long long)wp.scale_ups,
+                     (unsigned long long)wp.scale_downs, (unsigned long long)wp.reserved,
+                     (unsigned long long)wp.queued,
+                     (unsigned long long)wp.queued_max, (unsigned long long)wp.tasks,
+                     (unsigned long long)wp.steals, (unsigned long long)wp.tenants,
+                     (unsigned long long)wp.backlog, (unsigned long long)wp.refused,
+                     (unsigned long long)wp.user_cap, (unsigned long long)wp.user_limited,
+                     (unsigned long long)upload_buf_cap, (unsigned long long)atomic_load(&upload_buf_used),
+                     (unsigned long long)atomic_load(&busy_replies));
+    for (int l = 0; l < 2 && n > 0 && n < STATS_TEXT_MAX; ++l) {
+        const worker_lane_stats *ls = &wp.lanes[l];
+        n += snprintf(text + n, STATS_TEXT_MAX - (size_t)n,
+                      "lane_%s_tasks %llu\nlane_%s_p50_us %llu\nlane_%s_p99_us %llu\nlane_%s_max_us %llu\n",
+                      ls->name, (unsigned long long)ls->tasks, ls->name, (unsigned long long)ls->p50_us,
+                      ls->name, (unsigned long long)ls->p99_us, ls->name, (unsigned long long)ls->max_us);
+    }
+    slab_stats sl[SLAB_MAX_CACHES];
+    size_t ns = slab_get_stats(sl, SLAB_MAX_CACHES);
+    for (size_t i = 0; i < ns && n > 0 && n < STATS_TEXT_MAX; ++i) {
+        n += snprintf(text + n, STATS_TEXT_MAX - (size_t)n,
+                      "slab_%s_allocs %llu\nslab_%s_objects %llu\nslab_%s_sys_allocs %llu\n",
+                      sl[i].name, (unsigned long long)sl[i].allocs, sl[i].name,
+                      (unsigned long long)sl[i].objects, sl[i].name, (unsigned long long)sl[i].sys_allocs);
+    }
+    if (n >= STATS_TEXT_MAX) n = STATS_TEXT_MAX - 1;
+    conn_reply(c, tag, "OK stats %d\n", n);
+    conn_send_owned(c, text, (size_t)n);
+}
+
+/* LIST cursors are the hex of the last name sent: opaque to clients, and
+ * free of spaces whatever the name holds */
+static void cursor_encode(const char *name, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        *out++ = hex[*p >> 4];
+        *out++ = hex[*p & 15];
+    }
+    *out = '\0';
+}
+
+static int hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+/* 0 and the name in out (n bytes), or -1 if cursor is not one of ours */
+static int cursor_decode(const char *cursor, char *out, size_t n) {
+    size_t len = strlen(cursor);
+    if (len == 0 || len % 2 || len / 2 >= n) return -1;
+    for (size_t i = 0; i < len; i += 2) {
+        int hi = hex_digit(cursor[i]), lo = hex_digit(cursor[i + 1]);
+        if (hi < 0 || lo < 0 || (hi | lo) == 0) return -1;
+        out[i / 2] = (char)(hi << 4 | lo);
+    }
+    out[len / 2] = '\0';
+    return 0;
+}
+
+/* LIST [prefix=<p>] [after=<cursor>] [limit=<n>], in any order: one page
+ * of at most limit (LIST_PAGE_MAX by default and at most) names. A missing
+ * prefix lists every name, a missing cursor starts at the first. */
+static void conn_handle_list(Connection *c, unsigned long tag, const char *line) {
+    char words[1024], *save = NULL;
+    snprintf(words, sizeof(words), "%s", line);
+    const char *prefix = "", *cursor = NULL;
+    size_t pagesize = LIST_PAGE_MAX;
+    int bad = strlen(line) >= sizeof(words);
+    strtok_r(words, " ", &save); /* LIST */
+    for (char *w = strtok_r(NULL, " ", &save); w && !bad; w = strtok_r(NULL, " ", &save)) {
+        if (strncmp(w, "prefix=", 7) == 0) {
+            prefix = w + 7;
+            bad = strlen(prefix) > STORAGE_NAME_MAX;
+        } else if (strncmp(w, "after=", 6) == 0) {
+            cursor = w + 6;
+        } else if (strncmp(w, "limit=", 6) == 0) {
+            char *end;
+            pagesize = strtoull(w + 6, &end, 10);
+            bad = *end != '\0' || pagesize == 0;
+            if (pagesize > LIST_PAGE_MAX) pagesize = LIST_PAGE_MAX;
+        } else {
+            bad = 1;
+        }
+    }
+    if (bad) {
+        conn_reply(c, tag, "ERR invalid\n");
+        return;
+    }
+    Task *t = slab_alloc(&task_slab);
+    if (!t) { conn_reply(c, tag, "ERR nomem\n"); return; }
+    t->type = TASK_LIST;
+    t->length = pagesize;
+    strncpy(t->filename, prefix, sizeof(t->filename)-1);
+    if (cursor && cursor_decode(cursor, t->after, sizeof(t->after)) != 0) {
+        slab_free(&task_slab, t);
+        conn_reply(c, tag, "ERR list badcursor\n");
+        return;
+    }
+    if (conn_submit(c, t, tag) != 0) conn_reply_busy(c, tag);
+}
+
+static void conn_handle_command(Connection *c, unsigned long tag, const char *line) {
+    char cmd[16], fname[256], extra[32], extra2[32];
+    size_t num = 0;
+    int args = sscanf(line, "%15s %255s %zu %31s %31s", cmd, fname, &num, extra, extra2);
+    if (args < 1) return;
+    if (strcmp(cmd, "UPLOAD") == 0 && args >= 3) {
+        /* UPLOAD <file> <size> [resume] [lz] */
+        int resume = 0, framed = 0;
+        for (int i = 3; i < args; ++i) {
+            const char *flag = i == 3 ? extra : extra2;
+            if (strcmp(flag, "resume") == 0) resume = 1;
+            else if (strcmp(flag, "lz") == 0 && c->lz) framed = 1;
+            else {
+                conn_reply(c, tag, "ERR invalid\n");
+                return;
+            }
+        }
+        conn_handle_upload(c, tag, fname, num, resume, framed);
+    } else if ((strcmp(cmd, "DOWNLOAD") == 0 || strcmp(cmd, "DELETE") == 0) && args >= 2) {
+        Task *t = slab_alloc(&task_slab);
+        if (!t) { conn_reply(c, tag, "ERR nomem\n"); return; }
+        t->type = strcmp(cmd, "DOWNLOAD") == 0 ? TASK_DOWNLOAD : TASK_DELETE;
+        strncpy(t->filename, fname, sizeof(t->filename)-1);
+        if (t->type == TASK_DOWNLOAD) {
+            /* DOWNLOAD <file> [offset [length]] */
+            char *end = NULL;
+            if (args >= 3) t->offset = num;
+            if (args == 4) t->length = strtoull(extra, &end, 10);
+            if (args == 4 && (*end != '\0' || t->length == 0)) {
+                slab_free(&task_slab, t);
+                conn_reply(c, tag, "ERR invalid\n");
+                return;
+            }
+        }
+        if (conn_submit(c, t, tag) != 0) conn_reply_busy(c, tag);
+    } else if (strcmp(cmd, "PATCH") == 0) {
+        conn_handle_patch(c, tag, line);
+    } else if (strcmp(cmd, "SIGS") == 0 && args >= 2) {
+        Task *t = slab_alloc(&task_slab);
+        if (!t) { conn_reply(c, tag, "ERR nomem\n"); return; }
+        t->type = TASK_SIGS;
+        strncpy(t->filename, fname, sizeof(t->filename)-1);
+        if (conn_submit(c, t, tag) != 0) conn_reply_busy(c, tag);
+    } else if (strcmp(cmd, "LIST") == 0) {
+        conn_handle_list(c, tag, line);
+    } else if (strcmp(cmd, "STATS") == 0) {
+        conn_handle_stats(c, tag);
+    } else if (strcmp(cmd, "USAGE") == 0) {
+        conn_handle_usage(c, tag);
+    } else if (strcmp(cmd, "CAPS") == 0) {
+        conn_handle_caps(c, tag, line);
+    } else if (strcmp(cmd, "QUIT") == 0) {
+        conn_reply(c, tag, "OK bye\n");
+        c->closing = 1;
+    } else {
+        conn_reply(c, tag, "ERR unknown_command\n");
+    }
+}
+
+/* can the next buffered command be started now? */
+static int conn_can_dispatch(Connection *c) {
+    if (c->state == CONN_WAIT) return 0;
+    if (c->state == CONN_BODY || c->inflight == 0) return 1;
+    if (c->inflight >= max_inflight) return 0;
+    /* an untagged command waits for every earlier tagged one */
+    return netbuf_len(&c->in) == 0 || netbuf_peek(&c->in) == '#';
+}
+
+/* move buffered frames of a framed body into the chunk, whole frames only;
+ * 1 when the chunk should go to a worker, 0 when more input is needed */
+static int conn_take_frames(Connection *c) {
+    Upload *u = c->upload;
+    while (c->sess.alive) {
+        if (u->frame_left) {
+            size_t take = netbuf_take(&c->in, u->chunk + u->chunk_len, u->frame_left);
+            u->chunk_len += take;
+            u->frame_left -= take;
+            if (u->frame_left) return 0;
+            continue;
+        }
+        if (u->body_left == 0) return 1;
+        size_t next = u->body_left < LZBLOCK_MAX ? u->body_left : LZBLOCK_MAX;
+        if (u->chunk_cap - u->chunk_len < LZBLOCK_HDR + next) return 1;
+        u->hdr_len += netbuf_take(&c->in, u->hdr + u->hdr_len, LZBLOCK_HDR - u->hdr_len);
+        if (u->hdr_len < LZBLOCK_HDR) return 0;
+        u->hdr_len = 0;
+        size_t raw, payload;
+        if (lzblock_frame_header(u->hdr, &raw, &payload) != 0 || raw > u->body_left) {
+            /* the frame boundaries are lost: the stream cannot be resynced */
+            c->sess.alive = 0;
+            return 0;
+        }
+        memcpy(u->chunk + u->chunk_len, u->hdr, LZBLOCK_HDR);
+        u->chunk_len += LZBLOCK_HDR;
+        u->frame_left = payload;
+        u->body_left -= raw;
+        lz_count(raw, LZBLOCK_HDR + payload, payload != raw);
+    }
+    return 0;
+}
+
+/* run the protocol over buffered input until it needs more bytes or a worker */
+static void conn_process_input(Connection *c) {
+    while (c->sess.alive && !c->closing && conn_can_dispatch(c)) {
+        if (c->state == CONN_BODY && !c->upload->chunk) {
+            /* rejected upload: discard its body */
+            Upload *u = c->upload;
+            u->body_left -= netbuf_skip(&c->in, u->body_left);
+            if (u->body_left) return;
+            conn_upload_chunk(c);
+            continue;
+        }
+        if (c->state == CONN_BODY && c->upload->framed) {
+            if (!conn_take_frames(c)) return;
+            conn_upload_chunk(c);
+            continue;
+        }
+        if (c->state == CONN_BODY) {
+            Upload *u = c->upload;
+            size_t take = u->chunk_cap - u->chunk_len;
+            if (take > u->body_left) take = u->body_left;
+            take = netbuf_take(&c->in, u->chunk + u->chunk_len, take);
+            u->chunk_len += take;
+            u->body_left -= take;
+            if (u->body_left && u->chunk_len < u->chunk_cap) return;
+            conn_upload_chunk(c);
+            continue;
+        }
+        char line[BUFFER_SIZE];
+        size_t n = netbuf_getline(&c->in, line, sizeof(line));
+        if (n == 0) return;
         /* strip newline */
         if (line[n-1] == '\n') line[n-1] = '\0';
-        char cmd[16], user[64], pass[64];
-        if (sscanf(line, "%15s %63s %63s", cmd, user, pass) >= 1) {
-            if (strcmp(cmd, "SIGNUP") == 0) {
-                if (auth_signup(user, pass) == 0) {
-                    storage_ensure_userdir(user);
-                    send_all(client_fd, "OK signup\n", strlen("OK signup\n"));
-                    /* keep looping to allow immediate LOGIN */
-                } else {
-                    send_all(client_fd, "ERR userexists\n", strlen("ERR userexists\n"));
-                }
-            } else if (strcmp(cmd, "LOGIN") == 0) {
-                if (auth_login(user, pass) == 0) {
-                    strncpy(sess->username, user, sizeof(sess->username)-1);
-                    sess->logged_in = 1;
-                    send_all(client_fd, "OK login\n", strlen("OK login\n"));
-                    break;
-                } else {
-                    send_all(client_fd, "ERR badcreds\n", strlen("ERR badcreds\n"));
-                }
-            } else {
-                send_all(client_fd, "ERR need SIGNUP/LOGIN\n", strlen("ERR need SIGNUP/LOGIN\n"));
+        /* optional "#<tag> " prefix marks a pipelined command */
+        unsigned long tag = 0;
+        const char *cmd = line;
+        if (line[0] == '#') {
+            char *end;
+            tag = strtoul(line + 1, &end, 10);
+            if (tag == 0 || end == line + 1 || (*end != ' ' && *end != '\0')) {
+                conn_reply(c, 0, "ERR invalid\n");
+                continue;
             }
-        } else {
-            send_all(client_fd, "ERR invalid\n", strlen("ERR invalid\n"));
+            cmd = end;
         }
+        if (!c->sess.logged_in) conn_handle_auth(c, tag, cmd);
+        else conn_handle_command(c, tag, cmd);
     }
+}
 
-    /* Command loop (after login) */
-    while (sess->alive) {
-        ssize_t n = robust_readline(client_fd, line, sizeof(line));
-        if (n <= 0) break;
-        if (line[n-1] == '\n') line[n-1] = '\0';
-        char cmd[16], fname[256];
-        size_t filesize = 0;
-        int args = sscanf(line, "%15s %255s %zu", cmd, fname, &filesize);
-        if (args >= 1) {
-            if (strcmp(cmd, "UPLOAD") == 0 && args >= 3) {
-                /* read exact filesize into memory then create task */
-                char *buf = malloc(filesize + 1);
-                if (!buf) {
-                    send_all(client_fd, "ERR nomem\n", strlen("ERR nomem\n"));
-                    continue;
-                }
-                /* tell client ready */
-                send_all(client_fd, "READY\n", strlen("READY\n"));
-                ssize_t r = read_n_bytes(client_fd, buf, filesize);
-                if (r != (ssize_t)filesize) {
-                    free(buf);
-                    send_all(client_fd, "ERR readfail\n", strlen("ERR readfail\n"));
-                    continue;
-                }
-                buf[filesize] = '\0';
-                Task *t = calloc(1, sizeof(Task));
-                t->type = TASK_UPLOAD;
-                strncpy(t->filename, fname, sizeof(t->filename)-1);
-                t->filesize = filesize;
-                t->upload_data = buf;
-                t->session = sess;
-                t->task_id = 0; /* worker assigns id */
-                /* push to task queue */
-                if (queue_push(task_queue_global, t) != 0) {
-                    free(t->upload_data);
-                    free(t);
-                    send_all(client_fd, "ERR serverbusy\n", strlen("ERR serverbusy\n"));
-                    continue;
-                }
-                /* wait for result */
-                pthread_mutex_lock(&sess->resp_lock);
-                while (sess->pending_result == NULL && sess->alive) {
-                    pthread_cond_wait(&sess->resp_cv, &sess->resp_lock);
-                }
-                TaskResult *res = sess->pending_result;
-                sess->pending_result = NULL;
-                pthread_mutex_unlock(&sess->resp_lock);
-                if (!res) {
-                    send_all(client_fd, "ERR sessionclosed\n", strlen("ERR sessionclosed\n"));
-                    continue;
-                }
-                if (res->status == 0) {
-                    send_all(client_fd, "OK upload\n", strlen("OK upload\n"));
-                } else {
-                    char tmp[256];
-                    snprintf(tmp, sizeof(tmp), "ERR upload %s\n", res->errmsg);
-                    send_all(client_fd, tmp, strlen(tmp));
-                }
-                if (res->payload) free(res->payload);
-                free(res);
-            } else if (strcmp(cmd, "DOWNLOAD") == 0 && args >= 2) {
-                Task *t = calloc(1, sizeof(Task));
-                t->type = TASK_DOWNLOAD;
-                strncpy(t->filename, fname, sizeof(t->filename)-1);
-                t->session = sess;
-                t->task_id = 0;
-                if (queue_push(task_queue_global, t) != 0) {
-                    free(t);
-                    send_all(client_fd, "ERR serverbusy\n", strlen("ERR serverbusy\n"));
-                    continue;
-                }
-                pthread_mutex_lock(&sess->resp_lock);
-                while (sess->pending_result == NULL && sess->alive) {
-                    pthread_cond_wait(&sess->resp_cv, &sess->resp_lock);
-                }
-                TaskResult *res = sess->pending_result;
-                sess->pending_result = NULL;
-                pthread_mutex_unlock(&sess->resp_lock);
-                if (!res) { send_all(client_fd, "ERR sessionclosed\n", strlen("ERR sessionclosed\n")); continue; }
-                if (res->status == 0 && res->payload) {
-                    /* send OK size\n then raw bytes */
-                    char header[128];
-                    snprintf(header, sizeof(header), "OK download %zu\n", res->payload_size);
-                    send_all(client_fd, header, strlen(header));
-                    send_all(client_fd, res->payload, res->payload_size);
-                } else {
-                    char tmp[512];
-                    snprintf(tmp, sizeof(tmp), "ERR download %s\n", res->errmsg);
-                    send_all(client_fd, tmp, strlen(tmp));
-                }
-                if (res->payload) free(res->payload);
-                free(res);
-            } else if (strcmp(cmd, "LIST") == 0) {
-                Task *t = calloc(1, sizeof(Task));
-                t->type = TASK_LIST;
-                t->session = sess;
-                t->task_id = 0;
-                if (queue_push(task_queue_global, t) != 0) {
-                    free(t);
-                    send_all(client_fd, "ERR serverbusy\n", strlen("ERR serverbusy\n"));
-                    continue;
-                }
-                pthread_mutex_lock(&sess->resp_lock);
-                while (sess->pending_result == NULL && sess->alive) {
-                    pthread_cond_wait(&sess->resp_cv, &sess->resp_lock);
-                }
-                TaskResult *res = sess->pending_result;
-                sess->pending_result = NULL;
-                pthread_mutex_unlock(&sess->resp_lock);
-                if (!res) { send_all(client_fd, "ERR sessionclosed\n", strlen("ERR sessionclosed\n")); continue; }
-                if (res->status == 0 && res->payload) {
-                    char header[64];
-                    snprintf(header, sizeof(header), "OK list %zu\n", res->payload_size);
-                    send_all(client_fd, header, strlen(header));
-                    send_all(client_fd, res->payload, res->payload_size);
-                } else {
-                    char tmp[256];
-                    snprintf(tmp, sizeof(tmp), "ERR list %s\n", res->errmsg);
-                    send_all(client_fd, tmp, strlen(tmp));
-                }
-                if (res->payload) free(res->payload);
-                free(res);
-            } else if (strcmp(cmd, "DELETE") == 0 && args >= 2) {
-                Task *t = calloc(1, sizeof(Task));
-                t->type = TASK_DELETE;
-                strncpy(t->filename, fname, sizeof(t->filename)-1);
-                t->session = sess;
-                t->task_id = 0;
-                if (queue_push(task_queue_global, t) != 0) {
-                    free(t);
-                    send_all(client_fd, "ERR serverbusy\n", strlen("ERR serverbusy\n"));
-                    continue;
-                }
-                pthread_mutex_lock(&sess->resp_lock);
-                while (sess->pending_result == NULL && sess->alive) {
-                    pthread_cond_wait(&sess->resp_cv, &sess->resp_lock);
-                }
-                TaskResult *res = sess->pending_result;
-                sess->pending_result = NULL;
-                pthread_mutex_unlock(&sess->resp_lock);
-                if (!res) { send_all(client_fd, "ERR sessionclosed\n", strlen("ERR sessionclosed\n")); continue; }
-                if (res->status == 0) {
-                    send_all(client_fd, "OK delete\n", strlen("OK delete\n"));
-                } else {
-                    char tmp[256];
-                    snprintf(tmp, sizeof(tmp), "ERR delete %s\n", res->errmsg);
-                    send_all(client_fd, tmp, strlen(tmp));
-                }
-                if (res->payload) free(res->payload);
-                free(res);
-            } else if (strcmp(cmd, "QUIT") == 0) {
-                send_all(client_fd, "OK bye\n", strlen("OK bye\n"));
-                break;
+static void conn_on_readable(Connection *c) {
+    Upload *u = c->upload;
+    int direct = c->state == CONN_BODY && u->chunk && !u->framed && netbuf_len(&c->in) == 0;
+    ssize_t r;
+    if (direct) {
+        /* body bytes go straight into the chunk, skipping the ring */
+        size_t room = u->chunk_cap - u->chunk_len;
+        if (room > u->body_left) room = u->body_left;
+        if (room == 0) return;
+        r = recv(c->sess.sockfd, u->chunk + u->chunk_len, room, 0);
+    } else {
+        if (netbuf_room(&c->in) == 0) return;
+        r = netbuf_fill(&c->in);
+    }
+    if (r == 0) {
+        /* peer closed: nothing more to say to it */
+        c->sess.alive = 0;
+        return;
+    }
+    if (r < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) c->sess.alive = 0;
+        return;
+    }
+    if (direct) {
+        u->chunk_len += (size_t)r;
+        u->body_left -= (size_t)r;
+    }
+    conn_process_input(c);
+}
+
+static void conn_destroy(Reactor *r, Connection *c) {
+    if (c->prev) c->prev->next = c->next;
+    else if (r->conns == c) r->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    if (c->registered) epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->sess.sockfd, NULL);
+    close(c->sess.sockfd);
+    while (c->out_head) {
+        out_chunk *oc = c->out_head;
+        c->out_head = oc->next;
+        out_free(oc);
+    }
+    upload_free(c->upload);
+    netbuf_free(&c->in);
+    slab_free(&conn_slab, c);
+}
+
+/* flush, then either free the connection or re-arm epoll for what it waits on */
+static void conn_update(Reactor *r, Connection *c) {
+    if (c->out_head) conn_flush(c);
+    if (c->inflight == 0 && (!c->sess.alive || (c->closing && !c->out_head))) {
+        conn_destroy(r, c);
+        return;
+    }
+    if (!c->sess.alive) {
+        /* dead but tasks outstanding: stop HUP/ERR from firing until they return */
+        if (c->registered) {
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->sess.sockfd, NULL);
+            c->registered = 0;
+        }
+        return;
+    }
+    uint32_t want = 0;
+    if (!c->closing && conn_can_dispatch(c) && netbuf_room(&c->in) > 0) want |= EPOLLIN;
+    if (c->out_head) want |= EPOLLOUT;
+    if (want != c->events) {
+        struct epoll_event ev = { .events = want, .data.ptr = c };
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->sess.sockfd, &ev);
+        c->events = want;
+    }
+}
+
+static void conn_complete(Reactor *r, TaskResult *res) {
+    Connection *c = (Connection *)res->session;
+    unsigned long tag = res->task_id;
+    c->inflight--;
+    /* only the task input was paused for resumes it; other tagged results may
+     * arrive while an upload chunk is still being written */
+    if (c->state == CONN_WAIT && (tag == 0 || res->type == TASK_UPLOAD_CHUNK ||
+                                  res->type == TASK_UPLOAD_BEGIN))
+        c->state = CONN_LINE;
+    if (res->type == TASK_UPLOAD_BEGIN) {
+        Upload *u = res->ctx;
+        if (res->status == 0) {
+            u->body_left -= res->offset;
+            if (c->sess.alive) conn_reply(c, tag, "READY %zu\n", res->offset);
+            c->state = CONN_BODY;
+            /* nothing left to send: commit what the partial already holds */
+            if (u->body_left == 0) conn_upload_chunk(c);
+        } else {
+            c->upload = NULL;
+            upload_free(u);
+            if (c->sess.alive) conn_reply(c, tag, "ERR upload %s\n", res->errmsg);
+        }
+    } else if (res->type == TASK_UPLOAD_CHUNK) {
+        Upload *u = res->ctx;
+        c->state = CONN_BODY;
+        u->chunk_len = 0;
+        if (res->status != 0)
+            snprintf(u->err, sizeof(u->err), "ERR %s %s\n", u->patch ? "patch" : "upload", res->errmsg);
+    } else if (res->type == TASK_UPLOAD || res->type == TASK_PATCH) {
+        upload_free(res->ctx);
+    }
+    if (c->sess.alive) {
+        if (res->type == TASK_UPLOAD) {
+            if (res->status == 0) conn_reply(c, tag, "OK upload%s\n", res->unsynced ? " unsynced" : "");
+            else conn_reply(c, tag, "ERR upload %s\n", res->errmsg);
+        } else if (res->type == TASK_PATCH) {
+            if (res->status == 0) conn_reply(c, tag, "OK patch%s\n", res->unsynced ? " unsynced" : "");
+            else conn_reply(c, tag, "ERR patch %s\n", res->errmsg);
+        } else if (res->type == TASK_DOWNLOAD) {
+            if (res->status == 0 && (res->fd >= 0 || res->blob || res->chunks) && c->lz) {
+                /* the size stays the raw byte count; frames follow */
+                conn_reply(c, tag, "OK download %zu lz\n", res->payload_size);
+                conn_send_framed(c, res->fd, res->blob, res->chunks, res->offset, res->payload_size);
+                res->fd = -1;
+                res->blob = NULL;
+                res->chunks = NULL;
+            } else if (res->status == 0 && res->blob) {
+                /* shared cache entry: sent without a copy */
+                conn_reply(c, tag, "OK download %zu\n", res->payload_size);
+                conn_send_blob(c, res->blob, res->offset, res->payload_size);
+                res->blob = NULL;
+            } else if (res->status == 0 && res->fd >= 0) {
+                /* send OK size\n then raw bytes straight from the page cache */
+                conn_reply(c, tag, "OK download %zu\n", res->payload_size);
+                conn_send_file(c, res->fd, res->offset, res->payload_size);
+                res->fd = -1;
+            } else if (res->status == 0 && res->chunks) {
+                /* dedup: straight from the chunk files, nothing reassembled */
+                conn_reply(c, tag, "OK download %zu\n", res->payload_size);
+                conn_send_chunks(c, res->chunks, res->offset, res->payload_size);
+                res->chunks = NULL;
             } else {
-                send_all(client_fd, "ERR unknown_command\n", strlen("ERR unknown_command\n"));
+                conn_reply(c, tag, "ERR download %s\n", res->errmsg);
             }
+        } else if (res->type == TASK_LIST) {
+            if (res->status == 0 && res->payload && res->cursor) {
+                /* more pages follow */
+                char cursor[2 * STORAGE_NAME_MAX + 1];
+                cursor_encode(res->cursor, cursor);
+                conn_reply(c, tag, "OK list %zu %s\n", res->payload_size, cursor);
+                conn_send_owned(c, res->payload, res->payload_size);
+                res->payload = NULL;
+            } else if (res->status == 0 && res->payload) {
+                conn_reply(c, tag, "OK list %zu\n", res->payload_size);
+                conn_send_owned(c, res->payload, res->payload_size);
+                res->payload = NULL;
+            } else {
+                conn_reply(c, tag, "ERR list %s\n", res->errmsg);
+            }
+        } else if (res->type == TASK_SIGS) {
+            if (res->status == 0 && res->payload) {
+                conn_reply(c, tag, "OK sigs %zu\n", res->payload_size);
+                conn_send_owned(c, res->payload, res->payload_size);
+                res->payload = NULL;
+            } else {
+                conn_reply(c, tag, "ERR sigs %s\n", res->errmsg);
+            }
+        } else if (res->type == TASK_DELETE) {
+            if (res->status == 0) conn_reply(c, tag, "OK delete%s\n", res->unsynced ? " unsynced" : "");
+            else conn_reply(c, tag, "ERR delete %s\n", res->errmsg);
+        }
+    }
+    if (res->payload) free(res->payload);
+    free(res->cursor);
+    if (res->fd >= 0) close(res->fd);
+    filecache_release(res->blob);
+    chunkstore_reader_close(res->chunks);
+    slab_free(&task_result_slab, res);
+    /* commands that arrived while we waited are still buffered */
+    conn_process_input(c);
+    conn_update(r, c);
+}
+
+static void reactor_drain_inbox(Reactor *r) {
+    uint64_t cnt;
+    ssize_t rd = read(r->evfd, &cnt, sizeof(cnt));
+    (void)rd;
+    pthread_mutex_lock(&r->inbox_mtx);
+    Connection *incoming = r->incoming;
+    TaskResult *done = r->done_head;
+    r->incoming = NULL;
+    r->done_head = r->done_tail = NULL;
+    pthread_mutex_unlock(&r->inbox_mtx);
+
+    while (incoming) {
+        Connection *c = incoming;
+        incoming = c->next;
+        c->prev = NULL;
+        c->next = r->conns;
+        if (r->conns) r->conns->prev = c;
+        r->conns = c;
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->sess.sockfd, &ev) != 0) {
+            perror("[reactor] epoll_ctl add");
+            conn_destroy(r, c);
+            continue;
         }
+        c->registered = 1;
     }
+    while (done) {
+        TaskResult *res = done;
+        done = res->next;
+        conn_complete(r, res);
+    }
+}
 
-    cleanup_session(sess);
+static void *reactor_thread_main(void *arg) {
+    Reactor *r = arg;
+    struct epoll_event evs[REACTOR_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(r->epfd, evs, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[reactor] epoll_wait");
+            break;
+        }
+        int woken = 0;
+        for (int i = 0; i < n; ++i) {
+            Connection *c = evs[i].data.ptr;
+            if (!c) { woken = 1; continue; }
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) conn_on_readable(c);
+            if (evs[i].events & EPOLLOUT) conn_flush(c);
+            conn_update(r, c);
+        }
+        if (!woken) continue;
+        reactor_drain_inbox(r);
+        pthread_mutex_lock(&r->inbox_mtx);
+        int stop = r->stopping;
+        pthread_mutex_unlock(&r->inbox_mtx);
+        if (stop) break;
+    }
+    return NULL;
 }
 
-/* thread main */
-static void *client_thread_main(void *arg) {
+/* pops accepted fds and spreads them over the reactors round-robin */
+static void *client_dispatch_main(void *arg) {
     (void)arg;
+    size_t next = 0;
     while (1) {
         int *pfd = (int *)queue_pop(client_queue_global);
         if (!pfd) break;
         int client_fd = *pfd;
         free(pfd);
-        client_handle_connection(client_fd);
+        int flags = fcntl(client_fd, F_GETFL, 0);
+        Connection *c = slab_alloc(&conn_slab);
+        if (c && netbuf_init(&c->in, client_fd, CONN_INBUF_SIZE) != 0) {
+            slab_free(&conn_slab, c);
+            c = NULL;
+        }
+        if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) != 0 || !c) {
+            if (c) netbuf_free(&c->in);
+            slab_free(&conn_slab, c);
+            close(client_fd);
+            continue;
+        }
+        Reactor *r = &reactors[next++ % reactor_count];
+        c->sess.sockfd = client_fd;
+        c->sess.reactor = r;
+        c->sess.alive = 1;
+        c->state = CONN_LINE;
+        pthread_mutex_lock(&r->inbox_mtx);
+        c->next = r->incoming;
+        r->incoming = c;
+        pthread_mutex_unlock(&r->inbox_mtx);
+        reactor_wake(r);
     }
     return NULL;
 }
 
-int client_pool_start(size_t num_threads, queue_t *client_queue, queue_t *task_queue) {
-    if (client_threads != NULL) return -1;
-    if (!client_queue || !task_queue || num_threads == 0) return -1;
+void client_pool_complete(TaskResult *res) {
+    Reactor *r = res->session->reactor;
+    res->next = NULL;
+    pthread_mutex_lock(&r->inbox_mtx);
+    if (r->done_tail) r->done_tail->next = res;
+    else r->done_head = res;
+    r->done_tail = res;
+    pthread_mutex_unlock(&r->inbox_mtx);
+    reactor_wake(r);
+}
+
+int client_pool_start(size_t num_threads, queue_t *client_queue,
+                      size_t upload_buffer_cap, int max_inflight_per_session) {
+    if (reactors != NULL) return -1;
+    if (!client_queue || num_threads == 0 || max_inflight_per_session < 1) return -1;
+    max_inflight = max_inflight_per_session;
     client_queue_global = client_queue;
-    task_queue_global = task_queue;
-    client_threads = calloc(num_threads, sizeof(pthread_t));
-    if (!client_threads) return -1;
-    client_thread_count = num_threads;
+    upload_buf_cap = upload_buffer_cap;
+    reactors = calloc(num_threads, sizeof(Reactor));
+    if (!reactors) return -1;
+    reactor_count = num_threads;
     for (size_t i = 0; i < num_threads; ++i) {
-        pthread_create(&client_threads[i], NULL, client_thread_main, NULL);
+        Reactor *r = &reactors[i];
+        pthread_mutex_init(&r->inbox_mtx, NULL);
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (r->epfd < 0 || r->evfd < 0) {
+            perror("[client_pool_start] epoll/eventfd");
+            return -1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev);
+        pthread_create(&r->thread, NULL, reactor_thread_main, r);
     }
+    pthread_create(&dispatch_thread, NULL, client_dispatch_main, NULL);
     return 0;
 }
 
+/* call after worker_pool_stop so no result can arrive for a freed session */
 void client_pool_stop(void) {
-    if (!client_threads) return;
-    /* close the client queue to wake client threads */
+    if (!reactors) return;
+    /* close the client queue to stop the dispatcher */
     queue_close(client_queue_global);
-    for (size_t i = 0; i < client_thread_count; ++i) {
-        pthread_join(client_threads[i], NULL);
+    pthread_join(dispatch_thread, NULL);
+    for (size_t i = 0; i < reactor_count; ++i) {
+        Reactor *r = &reactors[i];
+        pthread_mutex_lock(&r->inbox_mtx);
+        r->stopping = 1;
+        pthread_mutex_unlock(&r->inbox_mtx);
+        reactor_wake(r);
+        pthread_join(r->thread, NULL);
+        /* anything still queued after the final drain */
+        reactor_drain_inbox(r);
+        while (r->conns) conn_destroy(r, r->conns);
+        close(r->epfd);
+        close(r->evfd);
+        pthread_mutex_destroy(&r->inbox_mtx);
     }
-    free(client_threads);
-    client_threads = NULL;
-    client_thread_count = 0;
+    free(reactors);
+    reactors = NULL;
+    reactor_count = 0;
     client_queue_global = NULL;
-    task_queue_global = NULL;
+    slab_release(&conn_slab);
+    slab_release(&out_slab);
 }
@@ -0,0 +1,25 @@
+#include "delta.h"
+#include "lanehash.h"
+#include <string.h>
+
+size_t delta_block_size(size_t filesize) {
+    size_t b = 1024;
+    while (b * b < filesize && b < DELTA_MAX_BLOCK) b += 1024;
+    if (b < DELTA_MIN_BLOCK) b = DELTA_MIN_BLOCK;
+    return b;
+}
+
+uint32_t delta_weak(const unsigned char *p, size_t n) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; ++i) {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+void delta_strong(const unsigned char *p, size_t n, uint8_t out[DELTA_STRONG_LEN]) {
+    uint8_t full[LANEHASH_LEN];
+    lanehash256(p, n, full);
+    memcpy(out, full, DELTA_STRONG_LEN);
+}
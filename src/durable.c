@@ -0,0 +1,162 @@
+#define _POSIX_C_SOURCE 200809L
+#include "durable.h"
+#include "storage.h"
+#include "client_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define DURABLE_BATCH_MAX 256 /* a full batch is synced without waiting out the window */
+
+typedef struct durable_item {
+    TaskResult *res;
+    char username[64];
+    char filename[256];
+} durable_item;
+
+static atomic_int durable_on = 0;
+static unsigned durable_window_us = 0;
+static pthread_t durable_thread;
+static pthread_mutex_t durable_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t durable_cv; /* CLOCK_MONOTONIC */
+/* guarded by durable_mtx */
+static durable_item *pending = NULL;
+static size_t pending_n = 0, pending_cap = 0;
+static struct timespec pending_since; /* arrival of pending[0] */
+static int durable_stopping = 0;
+static uint64_t st_batches = 0, st_writes = 0, st_batch_max = 0, st_syncfs = 0, st_errors = 0;
+
+static void sync_batch(durable_item *items, size_t n) {
+    storage_sync_item *names = malloc(n * sizeof(storage_sync_item));
+    int rc = -1;
+    if (names) {
+        for (size_t i = 0; i < n; ++i) {
+            names[i].username = items[i].username;
+            names[i].filename = items[i].filename;
+        }
+        rc = storage_sync(names, n);
+        free(names);
+    }
+    if (rc < 0) fprintf(stderr, "[durable] sync of %zu writes failed: %s\n", n, strerror(errno));
+    pthread_mutex_lock(&durable_mtx);
+    st_batches++;
+    st_writes += n;
+    if (n > st_batch_max) st_batch_max = n;
+    if (rc == 1) st_syncfs++;
+    if (rc < 0) st_errors++;
+    pthread_mutex_unlock(&durable_mtx);
+    /* the writes are in place and readable either way: a failed sync only
+     * means they may not survive a crash */
+    for (size_t i = 0; i < n; ++i) {
+        items[i].res->unsynced = rc < 0;
+        client_pool_complete(items[i].res);
+    }
+}
+
+static void *durable_main(void *arg) {
+    (void)arg;
+    durable_item *batch = NULL;
+    size_t batch_cap = 0;
+    pthread_mutex_lock(&durable_mtx);
+    for (;;) {
+        while (pending_n == 0 && !durable_stopping) pthread_cond_wait(&durable_cv, &durable_mtx);
+        if (pending_n == 0) break;
+        /* let more writes join until the window closes or the batch is full */
+        struct timespec until = pending_since;
+        until.tv_nsec += (long)durable_window_us * 1000;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (pending_n < DURABLE_BATCH_MAX && !durable_stopping &&
+               pthread_cond_timedwait(&durable_cv, &durable_mtx, &until) != ETIMEDOUT) {}
+        /* swap buffers: new writes queue while this batch syncs */
+        durable_item *items = pending;
+        size_t n = pending_n, cap = pending_cap;
+        pending = batch;
+        pending_cap = batch_cap;
+        pending_n = 0;
+        batch = items;
+        batch_cap = cap;
+        pthread_mutex_unlock(&durable_mtx);
+        sync_batch(items, n);
+        pthread_mutex_lock(&durable_mtx);
+    }
+    pthread_mutex_unlock(&durable_mtx);
+    free(batch);
+    return NULL;
+}
+
+int durable_start(unsigned window_us) {
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&durable_cv, &ca);
+    pthread_condattr_destroy(&ca);
+    durable_window_us = window_us;
+    durable_stopping = 0;
+    if (pthread_create(&durable_thread, NULL, durable_main, NULL) != 0) return -1;
+    atomic_store(&durable_on, 1);
+    return 0;
+}
+
+void durable_stop(void) {
+    if (!atomic_load(&durable_on)) return;
+    pthread_mutex_lock(&durable_mtx);
+    durable_stopping = 1;
+    pthread_cond_signal(&durable_cv);
+    pthread_mutex_unlock(&durable_mtx);
+    pthread_join(durable_thread, NULL);
+    atomic_store(&durable_on, 0);
+    free(pending);
+    pending = NULL;
+    pending_cap = 0;
+    pthread_cond_destroy(&durable_cv);
+}
+
+int durable_enabled(void) {
+    return atomic_load_explicit(&durable_on, memory_order_relaxed);
+}
+
+void durable_submit(TaskResult *res, const char *username, const char *filename) {
+    pthread_mutex_lock(&durable_mtx);
+    if (pending_n == pending_cap) {
+        size_t cap = pending_cap ? pending_cap * 2 : 64;
+        durable_item *p = realloc(pending, cap * sizeof(durable_item));
+        if (!p) {
+            /* cannot queue it: answer now rather than lose the reply */
+            pthread_mutex_unlock(&durable_mtx);
+            res->unsynced = 1;
+            client_pool_complete(res);
+            return;
+        }
+        pending = p;
+        pending_cap = cap;
+    }
+    durable_item *it = &pending[pending_n];
+    it->res = res;
+    snprintf(it->username, sizeof(it->username), "%s", username);
+    snprintf(it->filename, sizeof(it->filename), "%s", filename);
+    if (pending_n++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &pending_since);
+        pthread_cond_signal(&durable_cv);
+    } else if (pending_n == DURABLE_BATCH_MAX) {
+        pthread_cond_signal(&durable_cv);
+    }
+    pthread_mutex_unlock(&durable_mtx);
+}
+
+void durable_get_stats(durable_stats *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&durable_mtx);
+    st->enabled = atomic_load(&durable_on);
+    st->window_us = durable_window_us;
+    st->batches = st_batches;
+    st->writes = st_writes;
+    st->batch_max = st_batch_max;
+    st->syncfs = st_syncfs;
+    st->errors = st_errors;
+    pthread_mutex_unlock(&durable_mtx);
+}
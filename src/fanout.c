@@ -0,0 +1,380 @@
+#define _GNU_SOURCE /* renameat2 */
+#include "fanout.h"
+#include "util.h"
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define FO_USER_BUCKETS 256
+#define FO_DONE "done" /* in .fanout: the migration finished */
+
+struct fanout_user {
+    char *name;
+    struct fanout_user *chain;
+    pthread_rwlock_t rw; /* writes shared, the flip to migrating exclusive */
+    atomic_int layout;   /* -1 until read from disk */
+};
+
+static int enabled = 0;
+static int active = 0; /* enabled, or a user was found migrating or sharded */
+static const char *root_dir = NULL;
+static fanout_user *users[FO_USER_BUCKETS];
+static pthread_mutex_t users_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t migrate_thread;
+static int migrate_running = 0;
+static atomic_int stopping = 0;
+
+static atomic_ulong new_seq = 0;
+#define FO_NEW ".fanout-new." /* in the root: a user directory being built */
+
+static atomic_ullong stat_sharded = 0;
+static atomic_ullong stat_migrating = 0;
+static atomic_ullong stat_moved = 0;
+
+/* -1 if the user has no directory yet: it may still be made sharded */
+static int layout_read(const char *user) {
+    char path[600];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s/%s", root_dir, user, FANOUT_DIR);
+    if (stat(path, &st) != 0) {
+        snprintf(path, sizeof(path), "%s/%s", root_dir, user);
+        return stat(path, &st) == 0 ? FANOUT_FLAT : -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s/%s", root_dir, user, FANOUT_DIR, FO_DONE);
+    return stat(path, &st) == 0 ? FANOUT_SHARDED : FANOUT_MIGRATING;
+}
+
+static void layout_count(int layout, int delta) {
+    if (layout == FANOUT_SHARDED) atomic_fetch_add(&stat_sharded, (unsigned long long)delta);
+    else if (layout == FANOUT_MIGRATING) atomic_fetch_add(&stat_migrating, (unsigned long long)delta);
+}
+
+/* the user's node, made on first use */
+static fanout_user *user_get(const char *user) {
+    if (!user) return NULL;
+    fanout_user **bucket = &users[name_hash(user) % FO_USER_BUCKETS];
+    pthread_mutex_lock(&users_mtx);
+    fanout_user *u = *bucket;
+    while (u && strcmp(u->name, user) != 0) u = u->chain;
+    if (!u) {
+        u = calloc(1, sizeof(fanout_user));
+        if (u) u->name = strdup(user);
+        if (!u || !u->name) {
+            free(u);
+            pthread_mutex_unlock(&users_mtx);
+            return NULL;
+        }
+        pthread_rwlock_init(&u->rw, NULL);
+        atomic_init(&u->layout, -1);
+        u->chain = *bucket;
+        *bucket = u;
+    }
+    pthread_mutex_unlock(&users_mtx);
+    return u;
+}
+
+static int node_layout(fanout_user *u) {
+    int l = atomic_load(&u->layout);
+    if (l >= 0) return l;
+    l = layout_read(u->name);
+    if (l < 0) return FANOUT_FLAT; /* nothing stored, nothing to find */
+    int expect = -1;
+    if (!atomic_compare_exchange_strong(&u->layout, &expect, l)) return expect;
+    layout_count(l, 1);
+    return l;
+}
+
+static void set_layout(fanout_user *u, int l) {
+    layout_count(node_layout(u), -1);
+    atomic_store(&u->layout, l);
+    layout_count(l, 1);
+}
+
+int fanout_layout(const char *user) {
+    if (!active) return FANOUT_FLAT;
+    fanout_user *u = user_get(user);
+    if (u) return node_layout(u);
+    int l = layout_read(user);
+    return l < 0 ? FANOUT_FLAT : l;
+}
+
+fanout_user *fanout_lock(const char *user, int *layout) {
+    if (!active) {
+        *layout = FANOUT_FLAT;
+        return NULL;
+    }
+    fanout_user *u = user_get(user);
+    if (!u) {
+        *layout = fanout_layout(user);
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&u->rw);
+    *layout = node_layout(u);
+    return u;
+}
+
+void fanout_unlock(fanout_user *u) {
+    if (u) pthread_rwlock_unlock(&u->rw);
+}
+
+void fanout_dir(const char *user, const char *name, char *path, size_t n) {
+    /* FNV-1a's top bits barely change between short names that differ at
+     * the end (f1, f2, ...): mix them in first (murmur3's finaliser) */
+    uint64_t h = name_hash(name);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    snprintf(path, n, "%s/%s/%s/%02x", root_dir, user, FANOUT_DIR, (unsigned)(h >> 56));
+}
+
+void fanout_path(const char *user, const char *name, char *path, size_t n) {
+    fanout_dir(user, name, path, n);
+    size_t len = strlen(path);
+    if (len < n) snprintf(path + len, n - len, "/%s", name);
+}
+
+int fanout_mkdir(const char *user, const char *name) {
+    char dir[600];
+    fanout_dir(user, name, dir, sizeof(dir));
+    return mkdir(dir, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* remove a user directory fanout_new_user built but did not rename */
+static void new_user_discard(const char *tmp) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s/%s", tmp, FANOUT_DIR, FO_DONE);
+    unlink(path);
+    *strrchr(path, '/') = '\0';
+    rmdir(path);
+    rmdir(tmp);
+}
+
+int fanout_new_user(const char *user) {
+    char path[600], tmp[600];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root_dir, user);
+    if (stat(path, &st) == 0) return 1;
+    /* built aside and renamed in whole, so nobody sees the user flat */
+    snprintf(tmp, sizeof(tmp), "%s/%s%lu.%s", root_dir, FO_NEW, atomic_fetch_add(&new_seq, 1), user);
+    char fan[640], done[680];
+    snprintf(fan, sizeof(fan), "%s/%s", tmp, FANOUT_DIR);
+    snprintf(done, sizeof(done), "%s/%s", fan, FO_DONE);
+    int rc = mkdir(tmp, 0777) == 0 && mkdir(fan, 0777) == 0 ? 0 : -1;
+    int fd = rc == 0 ? open(done, O_WRONLY | O_CREAT | O_CLOEXEC, 0666) : -1;
+    if (fd < 0) rc = -1;
+    else close(fd);
+    if (rc == 0 && (fsync_path(fan) != 0 || fsync_path(tmp) != 0)) rc = -1;
+    if (rc == 0 && renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE) != 0) rc = errno == EEXIST ? 1 : -1;
+    if (rc != 0) {
+        if (rc < 0) fprintf(stderr, "[fanout] creating %s failed: %s\n", path, strerror(errno));
+        new_user_discard(tmp);
+    }
+    return rc;
+}
+
+static int is_shard(const char *name) {
+    return strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2;
+}
+
+int fanout_each(const char *user, fanout_visit_fn fn, void *ctx) {
+    if (fanout_layout(user) == FANOUT_FLAT) return 0;
+    char top[600];
+    snprintf(top, sizeof(top), "%s/%s/%s", root_dir, user, FANOUT_DIR);
+    DIR *d = opendir(top);
+    if (!d) return -1;
+    struct dirent *de, *fe;
+    while ((de = readdir(d)) != NULL) {
+        if (!is_shard(de->d_name)) continue;
+        char shard[640];
+        snprintf(shard, sizeof(shard), "%s/%.2s", top, de->d_name);
+        DIR *sd = opendir(shard);
+        while (sd && (fe = readdir(sd)) != NULL) {
+            if (fe->d_name[0] == '.') continue;
+            char path[1024];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", shard, fe->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) fn(ctx, fe->d_name, &st);
+        }
+        if (sd) closedir(sd);
+    }
+    closedir(d);
+    return 0;
+}
+
+/* move one user's flat files into their shards. A rename that would
+ * replace finds a newer version already written to the shard (the user is
+ * migrating, so writes go there), and the flat one is dropped. Once all
+ * are moved they are synced before the done marker, so a crash cannot
+ * leave a sharded user with files still flat. 1 if stopped early. */
+static int migrate_user(fanout_user *u) {
+    char dir[512], fan[600];
+    snprintf(dir, sizeof(dir), "%s/%s", root_dir, u->name);
+    snprintf(fan, sizeof(fan), "%s/%s", dir, FANOUT_DIR);
+    int l = node_layout(u);
+    if (l == FANOUT_SHARDED) return 0;
+    if (l == FANOUT_FLAT) {
+        /* waits for writes that chose a flat path; later ones pick shards */
+        pthread_rwlock_wrlock(&u->rw);
+        int rc = mkdir(fan, 0777) == 0 || errno == EEXIST ? fsync_path(dir) : -1;
+        if (rc == 0) set_layout(u, FANOUT_MIGRATING);
+        pthread_rwlock_unlock(&u->rw);
+        if (rc != 0) return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *de;
+    unsigned long long moved = 0;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        /* skips the index, the shards and temp files of uploads in flight */
+        if (de->d_name[0] == '.') continue;
+        if (atomic_load(&stopping)) {
+            rc = 1;
+            break;
+        }
+        char from[1024], to[1024];
+        struct stat st;
+        snprintf(from, sizeof(from), "%s/%s", dir, de->d_name);
+        if (lstat(from, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        fanout_path(u->name, de->d_name, to, sizeof(to));
+        int r = renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE);
+        if (r != 0 && errno == ENOENT && fanout_mkdir(u->name, de->d_name) == 0)
+            r = renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE);
+        if (r == 0) {
+            moved++;
+            atomic_fetch_add_explicit(&stat_moved, 1, memory_order_relaxed);
+        } else if (errno == EEXIST) {
+            unlink(from);
+        } else if (errno != ENOENT) {
+            /* ENOENT: deleted meanwhile */
+            fprintf(stderr, "[fanout] moving %s failed: %s\n", from, strerror(errno));
+            rc = -1;
+        }
+    }
+    closedir(d);
+    if (rc != 0) return rc;
+    char done[640];
+    snprintf(done, sizeof(done), "%s/%s", fan, FO_DONE);
+    int fd = open(fan, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) rc = -1;
+    if (fd >= 0) close(fd);
+    if (rc == 0 && (fd = open(done, O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) >= 0) {
+        close(fd);
+        rc = fsync_path(fan);
+    } else {
+        rc = -1;
+    }
+    if (rc != 0) return -1;
+    set_layout(u, FANOUT_SHARDED);
+    fprintf(stderr, "[fanout] %s sharded (%llu files moved)\n", u->name, moved);
+    return 0;
+}
+
+static void *migrate_main(void *arg) {
+    (void)arg;
+    /* names first, so the root is not held open while users migrate */
+    DIR *d = opendir(root_dir);
+    if (!d) return NULL;
+    char **names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root_dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(*names));
+            if (!grown) break;
+            names = grown;
+        }
+        if ((names[n] = strdup(de->d_name)) != NULL) n++;
+    }
+    closedir(d);
+    size_t done = 0, failed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        fanout_user *u = atomic_load(&stopping) ? NULL : user_get(names[i]);
+        int rc = u ? migrate_user(u) : 1;
+        if (rc == 0) done++;
+        else if (rc < 0) failed++;
+        free(names[i]);
+    }
+    free(names);
+    if (failed) fprintf(stderr, "[fanout] %zu user(s) could not be migrated; retried on the next start\n", failed);
+    else if (done == n) fprintf(stderr, "[fanout] all %zu user(s) sharded\n", done);
+    return NULL;
+}
+
+int fanout_init(const char *root, int enable) {
+    root_dir = root;
+    enabled = enable;
+    active = enable;
+    DIR *d = opendir(root);
+    if (!d) return -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char path[600];
+        struct stat st;
+        if (strncmp(de->d_name, FO_NEW, strlen(FO_NEW)) == 0) {
+            /* a crash before its rename */
+            snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+            new_user_discard(path);
+            continue;
+        }
+        /* without the flag, users sharded before still need their layout */
+        if (active || de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", root, de->d_name, FANOUT_DIR);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) active = 1;
+    }
+    closedir(d);
+    return 0;
+}
+
+int fanout_migrate_start(void) {
+    if (!enabled) return 0;
+    atomic_store(&stopping, 0);
+    if (pthread_create(&migrate_thread, NULL, migrate_main, NULL) != 0) return -1;
+    migrate_running = 1;
+    return 0;
+}
+
+void fanout_shutdown(void) {
+    if (migrate_running) {
+        atomic_store(&stopping, 1);
+        pthread_join(migrate_thread, NULL);
+        migrate_running = 0;
+    }
+    for (size_t b = 0; b < FO_USER_BUCKETS; ++b) {
+        fanout_user *u = users[b];
+        while (u) {
+            fanout_user *next = u->chain;
+            pthread_rwlock_destroy(&u->rw);
+            free(u->name);
+            free(u);
+            u = next;
+        }
+        users[b] = NULL;
+    }
+    atomic_store(&stat_sharded, 0);
+    atomic_store(&stat_migrating, 0);
+    active = enabled = 0;
+}
+
+void fanout_get_stats(fanout_stats *st) {
+    st->enabled = enabled;
+    st->sharded = atomic_load(&stat_sharded);
+    st->migrating = atomic_load(&stat_migrating);
+    st->moved = atomic_load(&stat_moved);
+}
@@ -0,0 +1,225 @@
+#define _POSIX_C_SOURCE 200809L
+#include "filecache.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define FC_BUCKETS 256                  /* hash chains per shard */
+#define FC_MAX_OBJECT (8 * 1024 * 1024) /* bigger files are sent with sendfile */
+
+typedef struct fc_entry {
+    char *key;
+    uint64_t hash;
+    filecache_blob *blob;   /* holds one reference for the cache */
+    int referenced;         /* CLOCK bit: set on a hit, cleared as the hand passes */
+    struct fc_entry *chain; /* next in the hash bucket */
+    struct fc_entry *prev;  /* CLOCK ring */
+    struct fc_entry *next;
+} fc_entry;
+
+typedef struct fc_shard {
+    pthread_mutex_t mtx;
+    fc_entry *buckets[FC_BUCKETS];
+    fc_entry *hand;         /* next eviction candidate; NULL when empty */
+    size_t bytes;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} fc_shard;
+
+static fc_shard *shards = NULL;
+static size_t shard_cap = 0;
+static size_t max_object = 0;
+
+static fc_shard *fc_shard_of(uint64_t h) {
+    return &shards[h % FILECACHE_SHARDS];
+}
+
+static fc_entry **fc_bucket(fc_shard *s, uint64_t h) {
+    return &s->buckets[(h / FILECACHE_SHARDS) % FC_BUCKETS];
+}
+
+static fc_entry *fc_find(fc_shard *s, const char *key, uint64_t h) {
+    for (fc_entry *e = *fc_bucket(s, h); e; e = e->chain) {
+        if (e->hash == h && strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+/* unlink e from its bucket and the ring and free it; shard lock held */
+static void fc_remove(fc_shard *s, fc_entry *e) {
+    fc_entry **pp = fc_bucket(s, e->hash);
+    while (*pp != e) pp = &(*pp)->chain;
+    *pp = e->chain;
+    if (e->next == e) {
+        s->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (s->hand == e) s->hand = e->next;
+    }
+    s->bytes -= e->blob->len;
+    s->entries--;
+    filecache_release(e->blob);
+    free(e->key);
+    free(e);
+}
+
+/* CLOCK: entries hit since the hand last passed get a second chance */
+static void fc_make_room(fc_shard *s, size_t need) {
+    while (s->hand && s->bytes + need > shard_cap) {
+        fc_entry *e = s->hand;
+        if (e->referenced) {
+            e->referenced = 0;
+            s->hand = e->next;
+            continue;
+        }
+        fc_remove(s, e);
+        s->evictions++;
+    }
+}
+
+int filecache_init(size_t budget) {
+    if (shards) return -1;
+    if (budget == 0) return 0;
+    shards = calloc(FILECACHE_SHARDS, sizeof(fc_shard));
+    if (!shards) return -1;
+    for (size_t i = 0; i < FILECACHE_SHARDS; ++i) pthread_mutex_init(&shards[i].mtx, NULL);
+    shard_cap = budget / FILECACHE_SHARDS;
+    /* an entry may take at most a quarter of its shard */
+    max_object = shard_cap / 4 < FC_MAX_OBJECT ? shard_cap / 4 : FC_MAX_OBJECT;
+    return 0;
+}
+
+void filecache_shutdown(void) {
+    if (!shards) return;
+    for (size_t i = 0; i < FILECACHE_SHARDS; ++i) {
+        fc_shard *s = &shards[i];
+        while (s->hand) fc_remove(s, s->hand);
+        pthread_mutex_destroy(&s->mtx);
+    }
+    free(shards);
+    shards = NULL;
+    shard_cap = max_object = 0;
+}
+
+size_t filecache_max_object(void) {
+    return max_object;
+}
+
+filecache_blob *filecache_get(const char *key) {
+    if (!shards) return NULL;
+    uint64_t h = name_hash(key);
+    fc_shard *s = fc_shard_of(h);
+    pthread_mutex_lock(&s->mtx);
+    fc_entry *e = fc_find(s, key, h);
+    filecache_blob *b = NULL;
+    if (e) {
+        e->referenced = 1;
+        b = e->blob;
+        atomic_fetch_add(&b->refs, 1);
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->mtx);
+    return b;
+}
+
+static ssize_t fc_pread(void *ctx, void *buf, size_t n, size_t off) {
+    ssize_t r;
+    do r = pread(*(int *)ctx, buf, n, (off_t)off);
+    while (r < 0 && errno == EINTR);
+    return r;
+}
+
+filecache_blob *filecache_load(const char *key, int fd, size_t off, size_t len) {
+    return filecache_load_with(key, fc_pread, &fd, off, len);
+}
+
+filecache_blob *filecache_load_with(const char *key, filecache_read_fn fn, void *ctx, size_t off, size_t len) {
+    if (!shards || len > max_object) return NULL;
+    fc_entry *e = calloc(1, sizeof(fc_entry));
+    filecache_blob *b = malloc(sizeof(filecache_blob) + len);
+    if (e) e->key = strdup(key);
+    if (!e || !e->key || !b) {
+        if (e) free(e->key);
+        free(e);
+        free(b);
+        return NULL;
+    }
+    atomic_init(&b->refs, 2); /* the caller's and the cache's */
+    b->len = len;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = fn(ctx, b->data + got, len - got, off + got);
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    if (got != len) {
+        fprintf(stderr, "[filecache_load] short read for %s\n", key);
+        free(e->key);
+        free(e);
+        free(b);
+        return NULL;
+    }
+    e->hash = name_hash(key);
+    e->blob = b;
+    fc_shard *s = fc_shard_of(e->hash);
+    pthread_mutex_lock(&s->mtx);
+    fc_entry *old = fc_find(s, key, e->hash);
+    if (old) fc_remove(s, old);
+    fc_make_room(s, len);
+    fc_entry **bucket = fc_bucket(s, e->hash);
+    e->chain = *bucket;
+    *bucket = e;
+    /* join the ring just behind the hand: the last place it looks */
+    if (s->hand) {
+        e->next = s->hand;
+        e->prev = s->hand->prev;
+        e->prev->next = e;
+        s->hand->prev = e;
+    } else {
+        e->next = e->prev = e;
+        s->hand = e;
+    }
+    s->bytes += len;
+    s->entries++;
+    pthread_mutex_unlock(&s->mtx);
+    return b;
+}
+
+void filecache_invalidate(const char *key) {
+    if (!shards) return;
+    uint64_t h = name_hash(key);
+    fc_shard *s = fc_shard_of(h);
+    pthread_mutex_lock(&s->mtx);
+    fc_entry *e = fc_find(s, key, h);
+    if (e) fc_remove(s, e);
+    pthread_mutex_unlock(&s->mtx);
+}
+
+void filecache_release(filecache_blob *b) {
+    if (b && atomic_fetch_sub(&b->refs, 1) == 1) free(b);
+}
+
+void filecache_get_stats(filecache_stats *st) {
+    memset(st, 0, sizeof(*st));
+    if (!shards) return;
+    st->budget = (uint64_t)shard_cap * FILECACHE_SHARDS;
+    for (size_t i = 0; i < FILECACHE_SHARDS; ++i) {
+        fc_shard *s = &shards[i];
+        pthread_mutex_lock(&s->mtx);
+        st->bytes += s->bytes;
+        st->entries += s->entries;
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        pthread_mutex_unlock(&s->mtx);
+    }
+}
@@ -0,0 +1,796 @@
+#define _POSIX_C_SOURCE 200809L
+#include "fileindex.h"
+#include "util.h"
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define FI_USER_BUCKETS 256
+#define FI_MAGIC "DBXIDX2\n"
+#define FI_MAGIC_LEN 8
+#define FI_COMPACT_SLACK 64 /* records a log may hold beyond twice its files */
+
+enum { FI_PUT = 1, FI_DEL = 2, FI_CLEAN = 3 };
+
+/* log record header, followed by name_len bytes of name (no NUL) */
+typedef struct fi_rec {
+    uint32_t check;    /* FNV-1a of the rest of the header and the name */
+    uint8_t op;
+    uint8_t pad;
+    uint16_t name_len;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+} fi_rec;
+
+typedef struct fi_entry {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+    unsigned line;     /* length of its "name size\n" line */
+    uint16_t name_len;
+    char name[];
+} fi_entry;
+
+typedef struct fi_user {
+    char *name;
+    struct fi_user *chain;
+    pthread_mutex_t mtx;
+    int loaded;
+    int fd;            /* the log, O_APPEND; -1 once it could not be written */
+    fi_entry **v;      /* sorted by name */
+    size_t n, cap;
+    size_t records;    /* in the log */
+    /* usage, readable without mtx: known from startup on (see
+     * fileindex_init) whether or not the entries are loaded */
+    atomic_ullong bytes;
+    atomic_ullong files;
+    atomic_ullong reserved;
+} fi_user;
+
+static const char *root_dir = NULL;
+static fileindex_size_fn logical_size = NULL;
+static fileindex_extra_fn extra_files = NULL;
+static fi_user *users[FI_USER_BUCKETS];
+static pthread_mutex_t users_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ullong stat_users = 0;
+static atomic_ullong stat_entries = 0;
+static atomic_ullong stat_appends = 0;
+static atomic_ullong stat_compactions = 0;
+static atomic_ullong stat_rescans = 0;
+
+static uint32_t fi_check(const void *data, size_t n, uint32_t h) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t rec_check(const fi_rec *r, const char *name) {
+    uint32_t h = fi_check((const char *)r + sizeof(r->check), sizeof(*r) - sizeof(r->check), 2166136261u);
+    return fi_check(name, r->name_len, h);
+}
+
+static unsigned digits(uint64_t v) {
+    unsigned d = 1;
+    while (v >= 10) {
+        v /= 10;
+        d++;
+    }
+    return d;
+}
+
+static fi_entry *entry_new(const char *name, size_t name_len, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    fi_entry *e = malloc(sizeof(fi_entry) + name_len + 1);
+    if (!e) return NULL;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    e->hash = hash;
+    e->name_len = (uint16_t)name_len;
+    e->line = (unsigned)name_len + 1 + digits(size) + 1;
+    memcpy(e->name, name, name_len);
+    e->name[name_len] = '\0';
+    return e;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp((*(fi_entry *const *)a)->name, (*(fi_entry *const *)b)->name);
+}
+
+/* index of name in v, or -1 with *pos set to where it would go */
+static long entry_find(fi_entry **v, size_t n, const char *name, size_t *pos) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(v[mid]->name, name);
+        if (c == 0) return (long)mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+static void entries_free(fi_entry **v, size_t n) {
+    for (size_t i = 0; i < n; ++i) free(v[i]);
+    free(v);
+}
+
+static int user_set(fi_user *u, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    size_t pos = 0;
+    long at = entry_find(u->v, u->n, name, &pos);
+    fi_entry *e = entry_new(name, strlen(name), size, mtime_ns, hash);
+    if (!e) return -1;
+    atomic_fetch_add_explicit(&u->bytes, size, memory_order_relaxed);
+    if (at >= 0) {
+        atomic_fetch_sub_explicit(&u->bytes, u->v[at]->size, memory_order_relaxed);
+        free(u->v[at]);
+        u->v[at] = e;
+    } else {
+        if (u->n == u->cap) {
+            size_t cap = u->cap ? u->cap * 2 : 64;
+            fi_entry **v = realloc(u->v, cap * sizeof(*v));
+            if (!v) {
+                free(e);
+                return -1;
+            }
+            u->v = v;
+            u->cap = cap;
+        }
+        memmove(u->v + pos + 1, u->v + pos, (u->n - pos) * sizeof(*u->v));
+        u->v[pos] = e;
+        u->n++;
+        atomic_fetch_add_explicit(&u->files, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_entries, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void user_del(fi_user *u, const char *name) {
+    long at = entry_find(u->v, u->n, name, NULL);
+    if (at < 0) return;
+    atomic_fetch_sub_explicit(&u->bytes, u->v[at]->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&u->files, 1, memory_order_relaxed);
+    free(u->v[at]);
+    memmove(u->v + at, u->v + at + 1, (u->n - (size_t)at - 1) * sizeof(*u->v));
+    u->n--;
+    atomic_fetch_sub_explicit(&stat_entries, 1, memory_order_relaxed);
+}
+
+/* encode one record into buf (sizeof(fi_rec) + FILEINDEX_NAME_MAX bytes) */
+static size_t rec_encode(char *buf, int op, const char *name, size_t name_len, uint64_t size, int64_t mtime_ns,
+                         uint64_t hash) {
+    fi_rec r;
+    memset(&r, 0, sizeof(r));
+    r.op = (uint8_t)op;
+    r.name_len = (uint16_t)name_len;
+    r.size = size;
+    r.mtime_ns = mtime_ns;
+    r.hash = hash;
+    r.check = rec_check(&r, name);
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), name, name_len);
+    return sizeof(r) + name_len;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static void log_path(const fi_user *u, const char *suffix, char *path, size_t n) {
+    snprintf(path, n, "%s/%s/%s%s", root_dir, u->name, FILEINDEX_LOG, suffix);
+}
+
+/* stop writing a log that failed: without its clean record the next load
+ * rescans the directory */
+static void log_broken(fi_user *u, const char *what) {
+    fprintf(stderr, "[fileindex] %s of %s's index failed: %s\n", what, u->name, strerror(errno));
+    if (u->fd >= 0) close(u->fd);
+    u->fd = -1;
+}
+
+/* rewrite the log as one put per file, in name order */
+static int log_compact(fi_user *u) {
+    char tmp[512], path[512];
+    log_path(u, ".tmp", tmp, sizeof(tmp));
+    log_path(u, "", path, sizeof(path));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    size_t cap = 64 * 1024, len = 0;
+    char *buf = malloc(cap);
+    int rc = buf ? 0 : -1;
+    if (buf) {
+        memcpy(buf, FI_MAGIC, FI_MAGIC_LEN);
+        len = FI_MAGIC_LEN;
+    }
+    for (size_t i = 0; rc == 0 && i < u->n; ++i) {
+        if (cap - len < sizeof(fi_rec) + FILEINDEX_NAME_MAX) {
+            rc = write_all(fd, buf, len);
+            len = 0;
+        }
+        const fi_entry *e = u->v[i];
+        len += rec_encode(buf + len, FI_PUT, e->name, e->name_len, e->size, e->mtime_ns, e->hash);
+    }
+    if (rc == 0) rc = write_all(fd, buf, len);
+    free(buf);
+    if (close(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    if (u->fd >= 0) close(u->fd);
+    u->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (u->fd < 0) return -1;
+    u->records = u->n;
+    atomic_fetch_add_explicit(&stat_compactions, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void log_append(fi_user *u, int op, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    if (u->fd < 0) return;
+    char buf[sizeof(fi_rec) + FILEINDEX_NAME_MAX];
+    size_t n = rec_encode(buf, op, name, strlen(name), size, mtime_ns, hash);
+    if (write_all(u->fd, buf, n) != 0) {
+        log_broken(u, "append");
+        return;
+    }
+    atomic_fetch_add_explicit(&stat_appends, 1, memory_order_relaxed);
+    if (++u->records > 2 * u->n + FI_COMPACT_SLACK && log_compact(u) != 0) log_broken(u, "compaction");
+}
+
+/* a parsed log record, with its position so the last one per name wins */
+typedef struct fi_replay {
+    fi_rec rec;        /* copied out: records are not aligned in the log */
+    const char *name;
+    size_t seq;
+} fi_replay;
+
+static int replay_cmp(const void *a, const void *b) {
+    const fi_replay *x = a, *y = b;
+    size_t n = x->rec.name_len < y->rec.name_len ? x->rec.name_len : y->rec.name_len;
+    int c = memcmp(x->name, y->name, n);
+    if (c == 0) c = (int)x->rec.name_len - (int)y->rec.name_len;
+    if (c == 0) c = x->seq < y->seq ? -1 : 1;
+    return c;
+}
+
+static int same_name(const fi_replay *x, const fi_replay *y) {
+    return x->rec.name_len == y->rec.name_len && memcmp(x->name, y->name, x->rec.name_len) == 0;
+}
+
+/* fill u with the files a log describes, sorted by name; returns 1 if it
+ * ended with a clean record (whose offset goes to *clean_at), 0 if not, -1
+ * on error */
+static int log_replay(const char *data, size_t len, fi_user *u, size_t *clean_at) {
+    if (len < FI_MAGIC_LEN || memcmp(data, FI_MAGIC, FI_MAGIC_LEN) != 0) return 0;
+    size_t cap = 1024, n = 0;
+    fi_replay *recs = malloc(cap * sizeof(*recs));
+    if (!recs) return -1;
+    size_t pos = FI_MAGIC_LEN, last = 0;
+    int last_op = 0;
+    while (len - pos >= sizeof(fi_rec)) {
+        fi_rec r;
+        memcpy(&r, data + pos, sizeof(r));
+        const char *name = data + pos + sizeof(fi_rec);
+        if (r.name_len == 0 || r.name_len > FILEINDEX_NAME_MAX || len - pos - sizeof(fi_rec) < r.name_len ||
+            r.check != rec_check(&r, name))
+            break; /* torn or corrupt: nothing after it is trusted */
+        last = pos;
+        last_op = r.op;
+        pos += sizeof(fi_rec) + r.name_len;
+        if (r.op == FI_CLEAN) continue;
+        if (n == cap) {
+            cap *= 2;
+            fi_replay *grown = realloc(recs, cap * sizeof(*recs));
+            if (!grown) {
+                free(recs);
+                return -1;
+            }
+            recs = grown;
+        }
+        recs[n].rec = r;
+        recs[n].name = name;
+        recs[n].seq = n;
+        n++;
+    }
+    qsort(recs, n, sizeof(*recs), replay_cmp);
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; ++i) {
+        /* only the last record for a name counts */
+        if ((i + 1 < n && same_name(&recs[i], &recs[i + 1])) || recs[i].rec.op != FI_PUT) continue;
+        if (u->n == u->cap) {
+            size_t grown_cap = u->cap ? u->cap * 2 : 64;
+            fi_entry **v = realloc(u->v, grown_cap * sizeof(*v));
+            if (!v) {
+                rc = -1;
+                break;
+            }
+            u->v = v;
+            u->cap = grown_cap;
+        }
+        const fi_rec *r = &recs[i].rec;
+        fi_entry *e = entry_new(recs[i].name, r->name_len, r->size, r->mtime_ns, r->hash);
+        if (!e) {
+            rc = -1;
+            break;
+        }
+        u->v[u->n++] = e;
+    }
+    u->records = n;
+    free(recs);
+    if (rc != 0) return -1;
+    if (pos == len && last_op == FI_CLEAN) {
+        *clean_at = last;
+        return 1;
+    }
+    return 0;
+}
+
+static int user_push(fi_user *u, fi_entry *e) {
+    if (!e) return -1;
+    if (u->n == u->cap) {
+        size_t cap = u->cap ? u->cap * 2 : 64;
+        fi_entry **v = realloc(u->v, cap * sizeof(*v));
+        if (!v) {
+            free(e);
+            return -1;
+        }
+        u->v = v;
+        u->cap = cap;
+    }
+    u->v[u->n++] = e;
+    return 0;
+}
+
+typedef struct fi_extra {
+    fi_user *u;
+    fi_entry **old;
+    size_t old_n;
+    int rc;
+} fi_extra;
+
+static void extra_add(void *ctx, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    fi_extra *x = ctx;
+    size_t name_len = strlen(name);
+    if (x->rc != 0 || name[0] == '.' || name_len > FILEINDEX_NAME_MAX) return;
+    if (!hash) {
+        long at = entry_find(x->old, x->old_n, name, NULL);
+        if (at >= 0 && x->old[at]->size == size && x->old[at]->mtime_ns == mtime_ns) hash = x->old[at]->hash;
+    }
+    x->rc = user_push(x->u, entry_new(name, name_len, size, mtime_ns, hash));
+}
+
+/* rebuild the entries from the directory; old (sorted) supplies the hashes
+ * of files that still have the same size and mtime */
+static int user_rescan(fi_user *u, fi_entry **old, size_t old_n) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/%s", root_dir, u->name);
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    u->v = NULL;
+    u->n = u->cap = 0;
+    fi_extra x = {u, old, old_n, 0};
+    if (extra_files && extra_files(u->name, extra_add, &x) != 0) x.rc = -1;
+    qsort(u->v, u->n, sizeof(*u->v), entry_cmp);
+    size_t extra_n = u->n;
+    struct dirent *de;
+    int rc = x.rc;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        /* skips . and .. as well as the log and in-progress uploads */
+        size_t name_len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || name_len > FILEINDEX_NAME_MAX) continue;
+        if (entry_find(u->v, extra_n, de->d_name, NULL) >= 0) continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        uint64_t size = (uint64_t)st.st_size;
+        if (logical_size && logical_size(path, &st, &size) != 0) continue;
+        int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        uint64_t hash = 0;
+        long at = entry_find(old, old_n, de->d_name, NULL);
+        if (at >= 0 && old[at]->size == size && old[at]->mtime_ns == mtime_ns) hash = old[at]->hash;
+        rc = user_push(u, entry_new(de->d_name, name_len, size, mtime_ns, hash));
+    }
+    closedir(d);
+    if (rc != 0) return -1;
+    qsort(u->v, u->n, sizeof(*u->v), entry_cmp);
+    atomic_fetch_add_explicit(&stat_rescans, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void user_clear(fi_user *u) {
+    entries_free(u->v, u->n);
+    u->v = NULL;
+    u->n = u->cap = 0;
+    u->records = 0;
+}
+
+static void user_loaded(fi_user *u) {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < u->n; ++i) bytes += u->v[i]->size;
+    atomic_store(&u->bytes, bytes);
+    atomic_store(&u->files, u->n);
+    u->loaded = 1;
+    atomic_fetch_add_explicit(&stat_users, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_entries, u->n, memory_order_relaxed);
+}
+
+/* read the log, or rescan the directory if it is missing or was not closed
+ * cleanly. Called with u->mtx held; -1 if the user has no directory (yet). */
+static int user_load(fi_user *u) {
+    if (u->loaded) return 0;
+    char path[512];
+    log_path(u, "", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    int clean = 0;
+    size_t clean_at = 0;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t len = (size_t)st.st_size, got = 0;
+        char *data = malloc(len);
+        while (data && got < len) {
+            ssize_t r = pread(fd, data + got, len - got, (off_t)got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        clean = data ? log_replay(data, got, u, &clean_at) : -1;
+        free(data);
+    }
+    if (clean == 1) {
+        /* running without a clean record: a crash from here on rescans */
+        int ok = ftruncate(fd, (off_t)clean_at) == 0 && fdatasync(fd) == 0;
+        close(fd);
+        if (ok) u->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (u->fd >= 0) {
+            user_loaded(u);
+            return 0;
+        }
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    /* the replayed entries only lend their hashes to the rescan */
+    fi_entry **old = u->v;
+    size_t old_n = u->n;
+    int rc = clean < 0 ? -1 : user_rescan(u, old, old_n);
+    int err = errno;
+    entries_free(old, old_n);
+    if (rc != 0) {
+        if (u->v != old) user_clear(u);
+        u->v = NULL;
+        u->n = u->cap = 0;
+        u->records = 0;
+        if (err != ENOENT) fprintf(stderr, "[fileindex] loading %s's index failed: %s\n", u->name, strerror(err));
+        return -1;
+    }
+    if (log_compact(u) != 0) log_broken(u, "rewrite");
+    user_loaded(u);
+    return 0;
+}
+
+/* the user's node, made on first use; its entries may not be loaded */
+static fi_user *user_get(const char *user) {
+    if (!root_dir || !user) return NULL;
+    fi_user **bucket = &users[name_hash(user) % FI_USER_BUCKETS];
+    pthread_mutex_lock(&users_mtx);
+    fi_user *u = *bucket;
+    while (u && strcmp(u->name, user) != 0) u = u->chain;
+    if (!u) {
+        u = calloc(1, sizeof(fi_user));
+        if (u) u->name = strdup(user);
+        if (!u || !u->name) {
+            free(u);
+            pthread_mutex_unlock(&users_mtx);
+            return NULL;
+        }
+        pthread_mutex_init(&u->mtx, NULL);
+        u->fd = -1;
+        u->chain = *bucket;
+        *bucket = u;
+    }
+    pthread_mutex_unlock(&users_mtx);
+    return u;
+}
+
+/* the user's index, locked and loaded; NULL if it cannot be */
+static fi_user *user_lock(const char *user) {
+    fi_user *u = user_get(user);
+    if (!u) return NULL;
+    pthread_mutex_lock(&u->mtx);
+    if (user_load(u) != 0) {
+        pthread_mutex_unlock(&u->mtx);
+        return NULL;
+    }
+    return u;
+}
+
+/* usage from the clean record that ends a log, without replaying it: 0 if
+ * there is one */
+static int usage_from_tail(fi_user *u) {
+    char path[512];
+    log_path(u, "", path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char buf[sizeof(fi_rec) + 1];
+    struct stat st;
+    int rc = -1;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)(FI_MAGIC_LEN + sizeof(buf)) &&
+        pread(fd, buf, sizeof(buf), st.st_size - (off_t)sizeof(buf)) == (ssize_t)sizeof(buf)) {
+        fi_rec r;
+        memcpy(&r, buf, sizeof(r));
+        if (r.op == FI_CLEAN && r.name_len == 1 && r.check == rec_check(&r, buf + sizeof(r))) {
+            atomic_store(&u->bytes, r.size);
+            atomic_store(&u->files, r.hash);
+            rc = 0;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+int fileindex_init(const char *root, fileindex_size_fn size_fn, fileindex_extra_fn extra_fn) {
+    root_dir = root;
+    logical_size = size_fn;
+    extra_files = extra_fn;
+    /* every user's usage up front; only logs not closed cleanly are read */
+    DIR *d = opendir(root);
+    if (!d) return -1;
+    struct dirent *de;
+    size_t scanned = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        fi_user *u = user_get(de->d_name);
+        if (!u) continue;
+        if (usage_from_tail(u) == 0) continue;
+        pthread_mutex_lock(&u->mtx);
+        user_load(u);
+        pthread_mutex_unlock(&u->mtx);
+        scanned++;
+    }
+    closedir(d);
+    if (scanned) fprintf(stderr, "[fileindex] rebuilt %zu index(es) not closed cleanly\n", scanned);
+    return 0;
+}
+
+void fileindex_shutdown(void) {
+    char buf[sizeof(fi_rec) + FILEINDEX_NAME_MAX];
+    for (size_t b = 0; b < FI_USER_BUCKETS; ++b) {
+        fi_user *u = users[b];
+        while (u) {
+            fi_user *next = u->chain;
+            if (u->fd >= 0) {
+                /* carries the usage, for the next start */
+                size_t n = rec_encode(buf, FI_CLEAN, "-", 1, atomic_load(&u->bytes), 0, atomic_load(&u->files));
+                if (write_all(u->fd, buf, n) != 0 || fdatasync(u->fd) != 0) log_broken(u, "close");
+                if (u->fd >= 0) close(u->fd);
+            }
+            entries_free(u->v, u->n);
+            pthread_mutex_destroy(&u->mtx);
+            free(u->name);
+            free(u);
+            u = next;
+        }
+        users[b] = NULL;
+    }
+    root_dir = NULL;
+}
+
+void fileindex_put(const char *user, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    if (!name || name[0] == '.' || strlen(name) > FILEINDEX_NAME_MAX) return;
+    fi_user *u = user_lock(user);
+    if (!u) return;
+    if (user_set(u, name, size, mtime_ns, hash) == 0) log_append(u, FI_PUT, name, size, mtime_ns, hash);
+    else log_broken(u, "update"); /* the entry is stale: rescan next time */
+    pthread_mutex_unlock(&u->mtx);
+}
+
+void fileindex_remove(const char *user, const char *name) {
+    if (!name || name[0] == '.' || strlen(name) > FILEINDEX_NAME_MAX) return;
+    fi_user *u = user_lock(user);
+    if (!u) return;
+    user_del(u, name);
+    log_append(u, FI_DEL, name, 0, 0, 0);
+    pthread_mutex_unlock(&u->mtx);
+}
+
+uint64_t fileindex_size(const char *user, const char *name) {
+    fi_user *u = user_lock(user);
+    if (!u) return 0;
+    long at = entry_find(u->v, u->n, name, NULL);
+    uint64_t size = at >= 0 ? u->v[at]->size : 0;
+    pthread_mutex_unlock(&u->mtx);
+    return size;
+}
+
+static char *put_u64(char *p, uint64_t v, unsigned d) {
+    for (unsigned i = d; i-- > 0; v /= 10) p[i] = (char)('0' + v % 10);
+    return p + d;
+}
+
+/* first entry that sorts after `after` and not before prefix */
+static size_t page_start(const fi_user *u, const char *prefix, const char *after) {
+    size_t pos = 0;
+    if (after[0] && strcmp(after, prefix) >= 0) {
+        long at = entry_find(u->v, u->n, after, &pos);
+        return at >= 0 ? (size_t)at + 1 : pos;
+    }
+    long at = entry_find(u->v, u->n, prefix, &pos);
+    return at >= 0 ? (size_t)at : pos;
+}
+
+char *fileindex_list(const char *user, const char *prefix, const char *after, size_t limit, size_t *len,
+                     char *next) {
+    fi_user *u = user_lock(user);
+    if (!u) return NULL;
+    size_t plen = strlen(prefix);
+    size_t first = page_start(u, prefix, after), end = first, bytes = 0;
+    while (end < u->n && end - first < limit && strncmp(u->v[end]->name, prefix, plen) == 0)
+        bytes += u->v[end++]->line;
+    char *out = malloc(bytes + 1);
+    if (!out) {
+        pthread_mutex_unlock(&u->mtx);
+        return NULL;
+    }
+    char *p = out;
+    for (size_t i = first; i < end; ++i) {
+        const fi_entry *e = u->v[i];
+        memcpy(p, e->name, e->name_len);
+        p += e->name_len;
+        *p++ = ' ';
+        p = put_u64(p, e->size, e->line - e->name_len - 2);
+        *p++ = '\n';
+    }
+    *p = '\0';
+    if (len) *len = (size_t)(p - out);
+    /* more to come if the next name still matches */
+    next[0] = '\0';
+    if (end > first && end < u->n && strncmp(u->v[end]->name, prefix, plen) == 0)
+        memcpy(next, u->v[end - 1]->name, u->v[end - 1]->name_len + 1);
+    pthread_mutex_unlock(&u->mtx);
+    return out;
+}
+
+void fileindex_get_usage(const char *user, fileindex_usage *us) {
+    memset(us, 0, sizeof(*us));
+    fi_user *u = user_get(user);
+    if (!u) return;
+    us->bytes = atomic_load(&u->bytes);
+    us->files = atomic_load(&u->files);
+    us->reserved = atomic_load(&u->reserved);
+}
+
+int fileindex_reserve(const char *user, uint64_t bytes, uint64_t limit) {
+    fi_user *u = user_get(user);
+    if (!u) return -1;
+    unsigned long long held = atomic_load(&u->reserved);
+    do {
+        uint64_t used = atomic_load(&u->bytes);
+        if (limit && (used > limit || held > limit - used || bytes > limit - used - held)) return -1;
+    } while (!atomic_compare_exchange_weak(&u->reserved, &held, held + bytes));
+    return 0;
+}
+
+void fileindex_release(const char *user, uint64_t bytes) {
+    fi_user *u = user_get(user);
+    if (u) atomic_fetch_sub(&u->reserved, bytes);
+}
+
+void fileindex_get_stats(fileindex_stats *st) {
+    st->users = atomic_load(&stat_users);
+    st->entries = atomic_load(&stat_entries);
+    st->appends = atomic_load(&stat_appends);
+    st->compactions = atomic_load(&stat_compactions);
+    st->rescans = atomic_load(&stat_rescans);
+}
+
+/* XXH64 */
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    acc += in * P2;
+    return rotl64(acc, 31) * P1;
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void hash_stripe(uint64_t *lane, const unsigned char *p) {
+    lane[0] = xxh_round(lane[0], read64(p));
+    lane[1] = xxh_round(lane[1], read64(p + 8));
+    lane[2] = xxh_round(lane[2], read64(p + 16));
+    lane[3] = xxh_round(lane[3], read64(p + 24));
+}
+
+void fileindex_hash_init(fileindex_hasher *h) {
+    memset(h, 0, sizeof(*h));
+    h->lane[0] = P1 + P2;
+    h->lane[1] = P2;
+    h->lane[2] = 0;
+    h->lane[3] = 0 - P1;
+}
+
+void fileindex_hash_update(fileindex_hasher *h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    h->len += n;
+    if (h->tail_len) {
+        size_t k = sizeof(h->tail) - h->tail_len;
+        if (k > n) k = n;
+        memcpy(h->tail + h->tail_len, p, k);
+        h->tail_len += (unsigned)k;
+        p += k;
+        n -= k;
+        if (h->tail_len < sizeof(h->tail)) return;
+        hash_stripe(h->lane, h->tail);
+        h->tail_len = 0;
+    }
+    uint64_t lane[4] = {h->lane[0], h->lane[1], h->lane[2], h->lane[3]};
+    for (; n >= 32; p += 32, n -= 32) hash_stripe(lane, p);
+    memcpy(h->lane, lane, sizeof(lane));
+    memcpy(h->tail, p, n);
+    h->tail_len = (unsigned)n;
+}
+
+uint64_t fileindex_hash_final(const fileindex_hasher *h) {
+    uint64_t acc;
+    if (h->len >= 32) {
+        const uint64_t *l = h->lane;
+        acc = rotl64(l[0], 1) + rotl64(l[1], 7) + rotl64(l[2], 12) + rotl64(l[3], 18);
+        for (int i = 0; i < 4; ++i) acc = (acc ^ xxh_round(0, l[i])) * P1 + P4;
+    } else {
+        acc = P5;
+    }
+    acc += h->len;
+    const unsigned char *p = h->tail;
+    size_t n = h->tail_len;
+    for (; n >= 8; p += 8, n -= 8) acc = rotl64(acc ^ xxh_round(0, read64(p)), 27) * P1 + P4;
+    if (n >= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        acc = rotl64(acc ^ (uint64_t)w * P1, 23) * P2 + P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; ++p, --n) acc = rotl64(acc ^ *p * P5, 11) * P1;
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc ? acc : 1;
+}
@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+#include "lanehash.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LANEHASH_X86 1
+#endif
+
+#define STRIPE 64               /* 8 lanes x 8 bytes */
+#define STRIPES_PER_BLOCK 16    /* lanes are scrambled once per block */
+#define BLOCK (STRIPE * STRIPES_PER_BLOCK)
+#define PRIME32 0x9E3779B1ULL
+#define PRIME64 0x9E3779B185EBCA87ULL
+
+/* stripe s, lane i uses secret[s + i]; the scramble uses secret[24 + i] */
+static const uint64_t secret[32] = {
+    0x1ac046dda8e86e2aULL, 0xbe2c3b00b1d348c8ULL, 0x9b1a66a95412ff75ULL, 0xc448c2b1f05f7e4cULL,
+    0xc111ca6b8f6e73c4ULL, 0xb54861920d05b01dULL, 0x8d61500f4a7bbe16ULL, 0x5e0c25471f89e02eULL,
+    0x48105a3d28f0e221ULL, 0x2169f8846b637746ULL, 0x3d628782e0c0d863ULL, 0xa5ddb2216078aa40ULL,
+    0xc8119d17f0571101ULL, 0x98e2e2eb8f33280fULL, 0x8cd1e28860679cc4ULL, 0x9dca6189c923aef3ULL,
+    0x9d8d3071ba4f04c4ULL, 0x5d395ada34220c26ULL, 0xe6de42a441a1e28eULL, 0x308fbf68cc864f59ULL,
+    0x216a3c81332862f9ULL, 0xbaceca0a77f3132eULL, 0xdf2a2215339ca69cULL, 0x3e4c11a103a5d859ULL,
+    0x6d0f173ffec5f603ULL, 0x0bf4bc630d193bb6ULL, 0x5f76c4ad104b57fdULL, 0x99ca459f4e93f651ULL,
+    0x4751799d68cf88a0ULL, 0xa6b1639e3b42b61cULL, 0x278b01031924ea35ULL, 0x430253eb7e993605ULL,
+};
+
+/* n stripes at p, the first being stripe number `first` of its block */
+typedef void (*accumulate_fn)(uint64_t acc[8], const uint8_t *p, size_t first, size_t n);
+typedef void (*scramble_fn)(uint64_t acc[8]);
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void accumulate_scalar(uint64_t acc[8], const uint8_t *p, size_t first, size_t n) {
+    for (size_t s = first; s < first + n; ++s, p += STRIPE) {
+        for (int i = 0; i < 8; ++i) {
+            uint64_t d = read64(p + 8 * i);
+            uint64_t k = d ^ secret[s + (size_t)i];
+            acc[i ^ 1] += d;
+            acc[i] += (k & 0xffffffffULL) * (k >> 32);
+        }
+    }
+}
+
+static void scramble_scalar(uint64_t acc[8]) {
+    for (int i = 0; i < 8; ++i) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= secret[24 + i];
+        acc[i] = a * PRIME32;
+    }
+}
+
+#if defined(LANEHASH_X86) && defined(__SSE2__)
+/* two lanes per register; the shuffle swaps the halves for acc[i ^ 1] += d */
+static void accumulate_sse2(uint64_t acc[8], const uint8_t *p, size_t first, size_t n) {
+    __m128i a[4];
+    for (int q = 0; q < 4; ++q) a[q] = _mm_loadu_si128((const __m128i *)(acc + 2 * q));
+    for (size_t s = first; s < first + n; ++s, p += STRIPE) {
+        for (int q = 0; q < 4; ++q) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * q));
+            __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(secret + s + 2 * q)));
+            __m128i prod = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+            __m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[q] = _mm_add_epi64(a[q], _mm_add_epi64(prod, swap));
+        }
+    }
+    for (int q = 0; q < 4; ++q) _mm_storeu_si128((__m128i *)(acc + 2 * q), a[q]);
+}
+
+static void scramble_sse2(uint64_t acc[8]) {
+    const __m128i prime = _mm_set1_epi64x((long long)PRIME32);
+    for (int q = 0; q < 4; ++q) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * q));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(secret + 24 + 2 * q)));
+        /* 64x32 multiply from two 32x32 products */
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        a = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        _mm_storeu_si128((__m128i *)(acc + 2 * q), a);
+    }
+}
+#endif
+
+#ifdef LANEHASH_X86
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t acc[8], const uint8_t *p, size_t first, size_t n) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+    for (size_t s = first; s < first + n; ++s, p += STRIPE) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i *)(secret + s)));
+        __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i *)(secret + s + 4)));
+        a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32)));
+        a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32)));
+        /* the shuffle stays inside 128-bit halves, which is the pair swap we need */
+        a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+    }
+    _mm256_storeu_si256((__m256i *)acc, a0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), a1);
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t acc[8]) {
+    const __m256i prime = _mm256_set1_epi64x((long long)PRIME32);
+    for (int q = 0; q < 2; ++q) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * q));
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(secret + 24 + 4 * q)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        _mm256_storeu_si256((__m256i *)(acc + 4 * q), a);
+    }
+}
+#endif
+
+static void hash_with(const void *data, size_t len, uint8_t out[LANEHASH_LEN],
+                      accumulate_fn accumulate, scramble_fn scramble) {
+    const uint8_t *p = data;
+    uint64_t acc[8];
+    for (int i = 0; i < 8; ++i) acc[i] = secret[16 + i] ^ (uint64_t)len;
+    for (size_t b = 0; b < len / BLOCK; ++b, p += BLOCK) {
+        accumulate(acc, p, 0, STRIPES_PER_BLOCK);
+        scramble(acc);
+    }
+    size_t rest = len % BLOCK;
+    size_t stripes = rest / STRIPE;
+    accumulate(acc, p, 0, stripes);
+    p += stripes * STRIPE;
+    if (rest % STRIPE) {
+        /* zero-padded last stripe; len in the seed keeps padding unambiguous */
+        uint8_t last[STRIPE] = {0};
+        memcpy(last, p, rest % STRIPE);
+        accumulate(acc, last, stripes, 1);
+    }
+    uint64_t total = (uint64_t)len * PRIME64;
+    for (int i = 0; i < 8; ++i) total += acc[i];
+    for (int j = 0; j < 4; ++j) {
+        uint64_t h = fmix64(acc[2 * j] ^ rotl64(acc[2 * j + 1], 31) ^ (total + (uint64_t)j * PRIME64));
+        for (int b = 0; b < 8; ++b) out[8 * j + b] = (uint8_t)(h >> (8 * b));
+    }
+}
+
+static void lanehash_scalar(const void *data, size_t len, uint8_t out[LANEHASH_LEN]) {
+    hash_with(data, len, out, accumulate_scalar, scramble_scalar);
+}
+
+#if defined(LANEHASH_X86) && defined(__SSE2__)
+static void lanehash_sse2(const void *data, size_t len, uint8_t out[LANEHASH_LEN]) {
+    hash_with(data, len, out, accumulate_sse2, scramble_sse2);
+}
+#endif
+
+#ifdef LANEHASH_X86
+static void lanehash_avx2(const void *data, size_t len, uint8_t out[LANEHASH_LEN]) {
+    hash_with(data, len, out, accumulate_avx2, scramble_avx2);
+}
+#endif
+
+lanehash_fn lanehash_variant(const char *name) {
+    if (strcmp(name, "scalar") == 0) return lanehash_scalar;
+#if defined(LANEHASH_X86) && defined(__SSE2__)
+    if (strcmp(name, "sse2") == 0) return lanehash_sse2;
+#endif
+#ifdef LANEHASH_X86
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) return lanehash_avx2;
+#endif
+    return NULL;
+}
+
+static pthread_once_t pick_once = PTHREAD_ONCE_INIT;
+static lanehash_fn picked = lanehash_scalar;
+static const char *picked_name = "scalar";
+
+static void pick_impl(void) {
+    static const char *order[] = { "avx2", "sse2" };
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); ++i) {
+        lanehash_fn fn = lanehash_variant(order[i]);
+        if (fn) {
+            picked = fn;
+            picked_name = order[i];
+            return;
+        }
+    }
+}
+
+void lanehash256(const void *data, size_t len, uint8_t out[LANEHASH_LEN]) {
+    pthread_once(&pick_once, pick_impl);
+    picked(data, len, out);
+}
+
+const char *lanehash_impl(void) {
+    pthread_once(&pick_once, pick_impl);
+    return picked_name;
+}
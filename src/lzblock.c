@@ -0,0 +1,187 @@
+#include "lzblock.h"
+#include <string.h>
+
+#define MINMATCH 4
+#define LASTLITERALS 5          /* the block always ends in literals */
+#define MFLIMIT 12              /* no match starts in the last 12 bytes */
+#define HASH_LOG 12
+#define MIN_SAVING 16           /* a block must shrink by 1/16 to be worth it */
+#define MAX_BACKOFF 64
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* length beyond a nibble of 15: runs of 255 and a final byte */
+static unsigned char *put_len(unsigned char *op, size_t len) {
+    len -= 15;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* token, literals and (unless last) the match; NULL if it does not fit */
+static unsigned char *emit(unsigned char *op, unsigned char *oend, const unsigned char *lit, size_t nlit,
+                           size_t offset, size_t ml, int last) {
+    if ((size_t)(oend - op) < 1 + nlit + nlit / 255 + 1 + (last ? 0 : 2 + ml / 255 + 1)) return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = put_len(op, nlit);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (last) return op;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(ml < 15 ? ml : 15);
+    if (ml >= 15) op = put_len(op, ml);
+    return op;
+}
+
+size_t lzblock_compress(const void *src, size_t n, void *dst, size_t cap) {
+    if (n > LZBLOCK_MAX) return 0;
+    const unsigned char *base = src, *ip = base, *anchor = base, *iend = base + n;
+    unsigned char *op = dst, *oend = op + cap;
+    uint16_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (n > MFLIMIT) {
+        const unsigned char *mflimit = iend - MFLIMIT, *matchlimit = iend - LASTLITERALS;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || read32(ref) != seq) {
+                /* step faster the longer nothing matched */
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *p = ip + MINMATCH, *q = ref + MINMATCH;
+            while (p < matchlimit && *p == *q) {
+                p++;
+                q++;
+            }
+            op = emit(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref),
+                      (size_t)(p - ip) - MINMATCH, 0);
+            if (!op) return 0;
+            ip = anchor = p;
+            if (ip < mflimit) table[hash4(read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+        }
+    }
+    op = emit(op, oend, anchor, (size_t)(iend - anchor), 0, 0, 1);
+    if (!op) return 0;
+    return (size_t)(op - (unsigned char *)dst);
+}
+
+/* read a length continuation; -1 if the input ends inside it */
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lzblock_decompress(const void *src, size_t n, void *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = ip + n;
+    unsigned char *out = dst, *op = out, *oend = out + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0) return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break; /* the last sequence has no match */
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return -1;
+        size_t ml = token & 15;
+        if (ml == 15 && get_len(&ip, iend, &ml) != 0) return -1;
+        ml += MINMATCH;
+        if (ml > (size_t)(oend - op)) return -1;
+        /* an overlapping match repeats the last offset bytes: copy them in
+         * runs that never overlap, each twice as long as the previous */
+        while (ml) {
+            size_t k = offset < ml ? offset : ml;
+            memcpy(op, op - offset, k);
+            op += k;
+            ml -= k;
+            offset += k;
+        }
+    }
+    return (long)(op - out);
+}
+
+size_t lzblock_frame(lzblock_adapt *a, const void *src, size_t n, void *dst, int *z) {
+    unsigned char *d = dst;
+    size_t zlen = 0;
+    if (a->skip) {
+        a->skip--;
+    } else if (n >= MIN_SAVING) {
+        zlen = lzblock_compress(src, n, d + LZBLOCK_HDR, n - n / MIN_SAVING);
+        if (zlen) {
+            a->backoff = 0;
+        } else {
+            a->backoff = a->backoff ? a->backoff * 2 : 1;
+            if (a->backoff > MAX_BACKOFF) a->backoff = MAX_BACKOFF;
+            a->skip = a->backoff;
+        }
+    }
+    put32(d, (uint32_t)n);
+    put32(d + 4, (uint32_t)zlen);
+    if (!zlen) memcpy(d + LZBLOCK_HDR, src, n);
+    if (z) *z = zlen != 0;
+    return LZBLOCK_HDR + (zlen ? zlen : n);
+}
+
+int lzblock_frame_header(const void *hdr, size_t *raw, size_t *payload) {
+    const unsigned char *h = hdr;
+    uint32_t r = get32(h), zlen = get32(h + 4);
+    if (r == 0 || r > LZBLOCK_MAX || zlen >= r) return -1;
+    *raw = r;
+    *payload = zlen ? zlen : r;
+    return 0;
+}
+
+long lzblock_frame_decode(const void *frame, size_t n, void *dst) {
+    size_t raw, payload;
+    if (n < LZBLOCK_HDR || lzblock_frame_header(frame, &raw, &payload) != 0 || n != LZBLOCK_HDR + payload)
+        return -1;
+    const unsigned char *p = (const unsigned char *)frame + LZBLOCK_HDR;
+    if (payload == raw) {
+        memcpy(dst, p, raw);
+        return (long)raw;
+    }
+    long got = lzblock_decompress(p, payload, dst, raw);
+    return got == (long)raw ? got : -1;
+}
@@ -4,6 +4,8 @@
 #include "worker_pool.h"
 #include "auth.h"
 #include "storage.h"
+#include "filecache.h"
+#include "durable.h"
 #include "dropbox.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,7 +18,6 @@
 #include <errno.h>
 
 static queue_t *client_queue = NULL;
-static queue_t *task_queue = NULL;
 static int server_fd = -1;
 /* self-pipe fds for safe signal handling */
 static int sig_pipe_fds[2] = {-1, -1};
@@ -31,7 +32,75 @@ static void handle_sigint(int sig) {
     }
 }
 
-int main(void) {
+/* a positive count; returns 0 and stores it, -1 if s is not one */
+static int parse_count(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s || *end != '\0' || v == 0) return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t cache_bytes = FILE_CACHE_CAP;
+    size_t reactors = CLIENT_POOL_SIZE, client_cap = CLIENT_QUEUE_CAP, task_cap = TASK_QUEUE_CAP;
+    size_t workers_min = WORKER_POOL_SIZE, workers_max = WORKER_POOL_MAX;
+    size_t upload_mb = UPLOAD_BUFFER_CAP >> 20, user_tasks = USER_MAX_TASKS;
+    unsigned long long quota_mb = USER_QUOTA_MB;
+    int durable = 0;
+    unsigned long durable_window = DURABLE_WINDOW_US;
+    for (int i = 1; i < argc; ++i) {
+        int bad = 0;
+        if (strcmp(argv[i], "--dedup") == 0) {
+            storage_set_dedup(1);
+        } else if (strcmp(argv[i], "--pack") == 0) {
+            storage_set_pack(1);
+        } else if (strcmp(argv[i], "--fanout") == 0) {
+            storage_set_fanout(1);
+        } else if (strcmp(argv[i], "--durable") == 0) {
+            durable = 1;
+        } else if (strcmp(argv[i], "--durable-window") == 0 && i + 1 < argc) {
+            char *end;
+            durable_window = strtoul(argv[++i], &end, 10);
+            bad = *end != '\0' || durable_window > 1000000;
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            char *end;
+            cache_bytes = (size_t)strtoull(argv[++i], &end, 10) << 20;
+            bad = *end != '\0';
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &reactors);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            /* <n> runs a fixed pool, <min>:<max> lets it scale */
+            char *arg = argv[++i], *colon = strchr(arg, ':');
+            if (colon) *colon = '\0';
+            bad = parse_count(arg, &workers_min) || parse_count(colon ? colon + 1 : arg, &workers_max) ||
+                  workers_max < workers_min;
+        } else if (strcmp(argv[i], "--client-queue") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &client_cap);
+        } else if (strcmp(argv[i], "--task-queue") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &task_cap);
+        } else if (strcmp(argv[i], "--upload-mb") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &upload_mb);
+        } else if (strcmp(argv[i], "--user-tasks") == 0 && i + 1 < argc) {
+            bad = parse_count(argv[++i], &user_tasks);
+        } else if (strcmp(argv[i], "--quota-mb") == 0 && i + 1 < argc) {
+            char *end;
+            quota_mb = strtoull(argv[++i], &end, 10);
+            bad = *end != '\0' || quota_mb > (1ULL << 40);
+        } else {
+            bad = 1;
+        }
+        if (bad) {
+            fprintf(stderr,
+                    "usage: %s [--dedup] [--pack] [--fanout] [--durable]\n"
+                    "          [--durable-window <us>] [--cache-mb <n>] [--reactors <n>] [--workers <n>|<min>:<max>]\n"
+                    "          [--client-queue <n>] [--task-queue <n>] [--upload-mb <n>] [--user-tasks <n>]\n"
+                    "          [--quota-mb <n>]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
     /* create self-pipe before installing handler */
     if (pipe(sig_pipe_fds) != 0) {
         perror("pipe");
@@ -43,22 +112,35 @@ int main(void) {
     signal(SIGINT, handle_sigint);
 
     auth_init();
-    storage_init();
-
-    client_queue = queue_create(CLIENT_QUEUE_CAP);
-    task_queue = queue_create(TASK_QUEUE_CAP);
+    storage_set_quota((uint64_t)quota_mb << 20);
+    if (storage_init() != 0) {
+        fprintf(stderr, "Failed to initialize storage\n");
+        return 1;
+    }
+    if (filecache_init(cache_bytes) != 0) {
+        fprintf(stderr, "Failed to create file cache\n");
+        return 1;
+    }
 
-    if (!client_queue || !task_queue) {
-        fprintf(stderr, "Failed to create queues\n");
+    client_queue = queue_create(client_cap);
+    if (!client_queue) {
+        fprintf(stderr, "Failed to create client queue\n");
         return 1;
     }
 
-    if (client_pool_start(CLIENT_POOL_SIZE, client_queue, task_queue) != 0) {
+    if (client_pool_start(reactors, client_queue, upload_mb << 20,
+                          SESSION_MAX_INFLIGHT) != 0) {
         fprintf(stderr, "Failed to start client pool\n");
         return 1;
     }
 
-    if (worker_pool_start(WORKER_POOL_SIZE, task_queue) != 0) {
+    /* before the workers: they hand it their writes */
+    if (durable && durable_start((unsigned)durable_window) != 0) {
+        fprintf(stderr, "Failed to start durable sync thread\n");
+        return 1;
+    }
+
+    if (worker_pool_start(workers_min, workers_max, WORKER_FAST_RESERVED, task_cap, user_tasks) != 0) {
         fprintf(stderr, "Failed to start worker pool\n");
         return 1;
     }
@@ -113,12 +195,14 @@ int main(void) {
         if (fds[0].revents & POLLIN) {
             int client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
             if (client_fd < 0) continue;
-            /* push fd pointer to client queue */
+            /* push fd pointer to client queue; if the reactors do not make
+             * room soon, say so instead of leaving the client hanging */
             int *pfd = malloc(sizeof(int));
             *pfd = client_fd;
-            if (queue_push(client_queue, pfd) != 0) {
-                /* queue closed or push failed */
-                close(client_fd);
+            int rc = queue_push_timed(client_queue, pfd, CLIENT_QUEUE_WAIT_MS);
+            if (rc != 0) {
+                if (rc == -2) client_pool_refuse(client_fd);
+                else close(client_fd); /* queue closed */
                 free(pfd);
             }
         }
@@ -130,14 +214,20 @@ int main(void) {
 
     /* shutdown sequence: close queues to wake worker threads */
     if (client_queue) queue_close(client_queue);
-    if (task_queue) queue_close(task_queue);
 
-    client_pool_stop();
+    /* workers first: they drain queued tasks and post results to live reactors */
     worker_pool_stop();
+    /* the last synced replies still need live reactors */
+    durable_stop();
+    client_pool_stop();
+    /* both pools are stopped, so no thread holds a Task or TaskResult */
+    slab_release(&task_slab);
+    slab_release(&task_result_slab);
 
     queue_destroy(client_queue);
-    queue_destroy(task_queue);
 
+    storage_shutdown();
+    filecache_shutdown();
     auth_shutdown();
 
     printf("Server stopped.\n");
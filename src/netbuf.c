@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L
+#include "netbuf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int netbuf_init(netbuf *nb, int fd, size_t cap) {
+    if (!nb || cap == 0) return -1;
+    memset(nb, 0, sizeof(*nb));
+    nb->buf = malloc(cap);
+    if (!nb->buf) return -1;
+    nb->fd = fd;
+    nb->cap = cap;
+    return 0;
+}
+
+void netbuf_free(netbuf *nb) {
+    if (!nb) return;
+    free(nb->buf);
+    nb->buf = NULL;
+    nb->cap = nb->head = nb->len = 0;
+}
+
+ssize_t netbuf_fill(netbuf *nb) {
+    if (netbuf_room(nb) == 0) return -1;
+    /* free space may wrap: hand both pieces to one readv */
+    size_t tail = (nb->head + nb->len) % nb->cap;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = nb->buf + tail;
+    if (tail >= nb->head && !(tail == nb->head && nb->len)) {
+        iov[0].iov_len = nb->cap - tail;
+        if (nb->head > 0) {
+            iov[1].iov_base = nb->buf;
+            iov[1].iov_len = nb->head;
+            iovcnt = 2;
+        }
+    } else {
+        iov[0].iov_len = nb->head - tail;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    ssize_t r;
+    do {
+        nb->recv_calls++;
+        r = recvmsg(nb->fd, &msg, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r > 0) nb->len += (size_t)r;
+    return r;
+}
+
+size_t netbuf_getline(netbuf *nb, char *out, size_t maxlen) {
+    if (maxlen < 2 || nb->len == 0) return 0;
+    size_t first = nb->cap - nb->head;
+    if (first > nb->len) first = nb->len;
+    size_t n = 0;
+    char *nl = memchr(nb->buf + nb->head, '\n', first);
+    if (nl) {
+        n = (size_t)(nl - (nb->buf + nb->head)) + 1;
+    } else if (nb->len > first) {
+        nl = memchr(nb->buf, '\n', nb->len - first);
+        if (nl) n = first + (size_t)(nl - nb->buf) + 1;
+    }
+    if (n == 0 || n > maxlen - 1) {
+        /* overlong (or a full buffer with no newline): split like a short read */
+        if (nb->len < maxlen - 1 && nb->len < nb->cap) return 0;
+        n = maxlen - 1;
+        if (n > nb->len) n = nb->len;
+    }
+    netbuf_take(nb, out, n);
+    out[n] = '\0';
+    return n;
+}
+
+size_t netbuf_take(netbuf *nb, void *dst, size_t n) {
+    if (n > nb->len) n = nb->len;
+    size_t first = nb->cap - nb->head;
+    if (first > n) first = n;
+    memcpy(dst, nb->buf + nb->head, first);
+    memcpy((char *)dst + first, nb->buf, n - first);
+    nb->head = (nb->head + n) % nb->cap;
+    nb->len -= n;
+    if (nb->len == 0) nb->head = 0; /* keep the next fill contiguous */
+    return n;
+}
+
+size_t netbuf_skip(netbuf *nb, size_t n) {
+    if (n > nb->len) n = nb->len;
+    nb->head = (nb->head + n) % nb->cap;
+    nb->len -= n;
+    if (nb->len == 0) nb->head = 0;
+    return n;
+}
+
+ssize_t netbuf_readline(netbuf *nb, char *out, size_t maxlen) {
+    while (1) {
+        size_t n = netbuf_getline(nb, out, maxlen);
+        if (n > 0) return (ssize_t)n;
+        ssize_t r = netbuf_fill(nb);
+        if (r == 0) {
+            /* EOF: hand back a partial last line, if any */
+            if (nb->len == 0) return 0;
+            n = netbuf_take(nb, out, nb->len < maxlen - 1 ? nb->len : maxlen - 1);
+            out[n] = '\0';
+            return (ssize_t)n;
+        }
+        if (r < 0) return -1;
+    }
+}
+
+ssize_t netbuf_read_n(netbuf *nb, void *dst, size_t n) {
+    size_t got = netbuf_take(nb, dst, n);
+    /* the rest bypasses the ring: large bodies are read straight into dst */
+    while (got < n) {
+        nb->recv_calls++;
+        ssize_t r = recv(nb->fd, (char *)dst + got, n - got, 0);
+        if (r == 0) break;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
@@ -0,0 +1,753 @@
+#define _GNU_SOURCE /* pwritev */
+#include "packstore.h"
+#include "fileindex.h"
+#include "util.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define PK_USER_BUCKETS 256
+#define PK_MAGIC "DBXPACK1"
+#define PK_MAGIC_LEN 8
+#define PK_COMPACT_MIN (1u << 20) /* dead bytes a user must have before compaction */
+
+enum { PK_PUT = 1, PK_DEL = 2 };
+
+/* segment record header, followed by name_len bytes of name (no NUL) and
+ * len bytes of data */
+typedef struct pk_rec {
+    uint32_t check;    /* FNV-1a of the rest of the header and the name */
+    uint8_t op;
+    uint8_t pad;
+    uint16_t name_len;
+    uint32_t len;
+    uint32_t pad2;
+    uint64_t seq;      /* orders the versions of a name across segments */
+    int64_t mtime_ns;
+    uint64_t hash;     /* of the data (fileindex_hash), checked on load */
+} pk_rec;
+
+typedef struct pk_seg {
+    uint64_t id;       /* its file name; newer segments have larger ids */
+    int fd;
+    uint64_t size;
+    uint64_t live;     /* bytes of records that are some file's current version */
+    int dirty;         /* written since the last packstore_sync */
+} pk_seg;
+
+typedef struct pk_entry {
+    struct pk_entry *chain;
+    pk_seg *seg;       /* NULL for a delete, only while replaying */
+    uint64_t off;      /* of the record */
+    uint32_t len;
+    uint64_t seq;
+    int64_t mtime_ns;
+    uint64_t hash;
+    uint16_t name_len;
+    char name[];
+} pk_entry;
+
+typedef struct pk_user {
+    char *name;
+    struct pk_user *chain;
+    pthread_mutex_t mtx;
+    int loaded;
+    int queued;        /* waiting for the compaction thread */
+    pk_entry **table;  /* chained by name hash */
+    size_t buckets, n;
+    pk_seg **segs;     /* oldest first; the last one takes appends */
+    size_t nsegs;
+    uint64_t seq;      /* the next record's */
+    uint64_t live, dead;
+    struct pk_user *next_due;
+} pk_user;
+
+static int active = 0;
+static char pack_root[512];
+static pk_user *users[PK_USER_BUCKETS];
+static pthread_mutex_t users_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* compaction thread; due_mtx nests inside a user's mtx, never around it */
+static pthread_t compact_thread;
+static pthread_mutex_t due_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t due_cv = PTHREAD_COND_INITIALIZER;
+static pk_user *due_head = NULL, *due_tail = NULL;
+static int stopping = 0;
+
+static atomic_ullong stat_files = 0;
+static atomic_ullong stat_segments = 0;
+static atomic_ullong stat_live = 0;
+static atomic_ullong stat_dead = 0;
+static atomic_ullong stat_compactions = 0;
+
+static uint32_t pk_check(const void *data, size_t n, uint32_t h) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t rec_check(const pk_rec *r, const char *name) {
+    uint32_t h = pk_check((const char *)r + sizeof(r->check), sizeof(*r) - sizeof(r->check), 2166136261u);
+    return pk_check(name, r->name_len, h);
+}
+
+static size_t rec_size(size_t name_len, size_t len) {
+    return sizeof(pk_rec) + name_len + len;
+}
+
+/* live and dead move together for the user and the global counters */
+static void account(pk_user *u, int64_t live, int64_t dead) {
+    u->live += (uint64_t)live;
+    u->dead += (uint64_t)dead;
+    atomic_fetch_add_explicit(&stat_live, (unsigned long long)live, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_dead, (unsigned long long)dead, memory_order_relaxed);
+}
+
+static pk_entry **entry_slot(pk_user *u, const char *name) {
+    if (!u->buckets) return NULL;
+    pk_entry **pp = &u->table[name_hash(name) % u->buckets];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->chain;
+    return pp;
+}
+
+static pk_entry *entry_find(pk_user *u, const char *name) {
+    pk_entry **pp = entry_slot(u, name);
+    return pp ? *pp : NULL;
+}
+
+static int table_grow(pk_user *u) {
+    size_t buckets = u->buckets ? u->buckets * 2 : 64;
+    pk_entry **table = calloc(buckets, sizeof(*table));
+    if (!table) return -1;
+    for (size_t b = 0; b < u->buckets; ++b) {
+        pk_entry *e = u->table[b];
+        while (e) {
+            pk_entry *next = e->chain;
+            pk_entry **head = &table[name_hash(e->name) % buckets];
+            e->chain = *head;
+            *head = e;
+            e = next;
+        }
+    }
+    free(u->table);
+    u->table = table;
+    u->buckets = buckets;
+    return 0;
+}
+
+static pk_entry *entry_add(pk_user *u, const char *name, size_t name_len) {
+    if (u->n >= u->buckets && table_grow(u) != 0) return NULL;
+    pk_entry *e = calloc(1, sizeof(pk_entry) + name_len + 1);
+    if (!e) return NULL;
+    e->name_len = (uint16_t)name_len;
+    memcpy(e->name, name, name_len);
+    pk_entry **head = &u->table[name_hash(e->name) % u->buckets];
+    e->chain = *head;
+    *head = e;
+    u->n++;
+    return e;
+}
+
+static void entry_drop(pk_user *u, pk_entry **pp) {
+    pk_entry *e = *pp;
+    *pp = e->chain;
+    free(e);
+    u->n--;
+}
+
+static void user_dir(const pk_user *u, char *path, size_t n) {
+    snprintf(path, n, "%s/%s", pack_root, u->name);
+}
+
+static void seg_path(const pk_user *u, uint64_t id, char *path, size_t n) {
+    snprintf(path, n, "%s/%s/%016llx.seg", pack_root, u->name, (unsigned long long)id);
+}
+
+static int fsync_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static pk_seg *seg_add(pk_user *u, uint64_t id, int fd, uint64_t size) {
+    pk_seg **segs = realloc(u->segs, (u->nsegs + 1) * sizeof(*segs));
+    pk_seg *s = calloc(1, sizeof(pk_seg));
+    if (segs) u->segs = segs;
+    if (!segs || !s) {
+        free(s);
+        return NULL;
+    }
+    s->id = id;
+    s->fd = fd;
+    s->size = size;
+    u->segs[u->nsegs++] = s;
+    atomic_fetch_add_explicit(&stat_segments, 1, memory_order_relaxed);
+    return s;
+}
+
+/* start the segment appends go to; its directory entry is synced right
+ * away so packstore_sync only has to sync data */
+static pk_seg *seg_new(pk_user *u) {
+    char dir[512], path[600];
+    user_dir(u, dir, sizeof(dir));
+    if (mkdir(dir, 0777) == 0) {
+        if (fsync_dir(pack_root) != 0) return NULL;
+    } else if (errno != EEXIST) {
+        return NULL;
+    }
+    uint64_t id = u->nsegs ? u->segs[u->nsegs - 1]->id + 1 : 1;
+    seg_path(u, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) return NULL;
+    pk_seg *s = NULL;
+    if (pwrite(fd, PK_MAGIC, PK_MAGIC_LEN, 0) == PK_MAGIC_LEN && fsync_dir(dir) == 0)
+        s = seg_add(u, id, fd, PK_MAGIC_LEN);
+    if (!s) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    s->dirty = 1;
+    return s;
+}
+
+/* append a record made of parts to the newest segment, starting a new one
+ * when it is full; *seg and *off get where it went */
+static int seg_append(pk_user *u, const struct iovec *iov, int iovcnt, pk_seg **seg, uint64_t *off) {
+    pk_seg *s = u->nsegs ? u->segs[u->nsegs - 1] : NULL;
+    if (!s || s->size >= PACKSTORE_SEGMENT_BYTES) s = seg_new(u);
+    if (!s) return -1;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+    ssize_t w;
+    do {
+        w = pwritev(s->fd, iov, iovcnt, (off_t)s->size);
+    } while (w < 0 && errno == EINTR);
+    if (w != (ssize_t)total) {
+        /* a torn record would end the segment for the next load */
+        if (w >= 0) errno = EIO;
+        int err = errno;
+        if (ftruncate(s->fd, (off_t)s->size) != 0)
+            fprintf(stderr, "[packstore] truncating segment %llx failed: %s\n", (unsigned long long)s->id,
+                    strerror(errno));
+        errno = err;
+        return -1;
+    }
+    *seg = s;
+    *off = s->size;
+    s->size += total;
+    s->dirty = 1;
+    return 0;
+}
+
+static int rec_append(pk_user *u, int op, const char *name, size_t name_len, const void *data, size_t len,
+                      int64_t mtime_ns, uint64_t hash, pk_seg **seg, uint64_t *off) {
+    pk_rec r;
+    memset(&r, 0, sizeof(r));
+    r.op = (uint8_t)op;
+    r.name_len = (uint16_t)name_len;
+    r.len = (uint32_t)len;
+    r.seq = u->seq;
+    r.mtime_ns = mtime_ns;
+    r.hash = hash;
+    r.check = rec_check(&r, name);
+    struct iovec iov[3] = {{&r, sizeof(r)}, {(void *)name, name_len}, {(void *)data, len}};
+    if (seg_append(u, iov, len ? 3 : 2, seg, off) != 0) return -1;
+    u->seq++;
+    return 0;
+}
+
+/* one replayed record: the highest sequence number per name wins */
+static int replay_apply(pk_user *u, pk_seg *s, uint64_t off, const pk_rec *r, const char *name) {
+    char key[FILEINDEX_NAME_MAX + 1];
+    memcpy(key, name, r->name_len);
+    key[r->name_len] = '\0';
+    pk_entry *e = entry_find(u, key);
+    if (!e) e = entry_add(u, key, r->name_len);
+    else if (r->seq < e->seq) return 0;
+    if (!e) return -1;
+    e->seg = r->op == PK_PUT ? s : NULL;
+    e->off = off;
+    e->len = r->len;
+    e->seq = r->seq;
+    e->mtime_ns = r->mtime_ns;
+    e->hash = r->hash;
+    if (r->seq >= u->seq) u->seq = r->seq + 1;
+    return 0;
+}
+
+/* read a segment and replay its records; a bad one ends it (a torn
+ * append), so the segment is cut back to the last good record */
+static int seg_load(pk_user *u, uint64_t id) {
+    char path[600];
+    seg_path(u, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size, got = 0;
+    char *data = malloc(len ? len : 1);
+    while (data && got < len) {
+        ssize_t r = pread(fd, data + got, len - got, (off_t)got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += (size_t)r;
+    }
+    pk_seg *s = data && got == len ? seg_add(u, id, fd, PK_MAGIC_LEN) : NULL;
+    if (!s) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    size_t pos = PK_MAGIC_LEN;
+    int rc = 0;
+    if (got < PK_MAGIC_LEN || memcmp(data, PK_MAGIC, PK_MAGIC_LEN) != 0) {
+        /* created but never written: start it over */
+        pos = 0;
+        if (pwrite(fd, PK_MAGIC, PK_MAGIC_LEN, 0) != PK_MAGIC_LEN) rc = -1;
+        got = 0;
+    }
+    while (rc == 0 && pos < got) {
+        pk_rec r;
+        if (got - pos < sizeof(r)) break;
+        memcpy(&r, data + pos, sizeof(r));
+        const char *name = data + pos + sizeof(r);
+        size_t n = rec_size(r.name_len, r.len);
+        if ((r.op != PK_PUT && r.op != PK_DEL) || r.name_len == 0 || r.name_len > FILEINDEX_NAME_MAX ||
+            r.len > PACKSTORE_FILE_MAX || n > got - pos || r.check != rec_check(&r, name))
+            break;
+        if (r.op == PK_PUT) {
+            fileindex_hasher h;
+            fileindex_hash_init(&h);
+            fileindex_hash_update(&h, name + r.name_len, r.len);
+            if (fileindex_hash_final(&h) != r.hash) break;
+        }
+        rc = replay_apply(u, s, pos, &r, name);
+        pos += n;
+    }
+    free(data);
+    if (rc == 0 && pos < (size_t)st.st_size) {
+        fprintf(stderr, "[packstore] %s: cutting %zu bytes after the last good record\n", path,
+                (size_t)st.st_size - pos);
+        if (ftruncate(fd, (off_t)(pos ? pos : PK_MAGIC_LEN)) != 0) rc = -1;
+    }
+    s->size = pos ? pos : PK_MAGIC_LEN;
+    return rc;
+}
+
+static int id_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void user_clear(pk_user *u) {
+    for (size_t b = 0; b < u->buckets; ++b) {
+        pk_entry *e = u->table[b];
+        while (e) {
+            pk_entry *next = e->chain;
+            free(e);
+            e = next;
+        }
+    }
+    free(u->table);
+    u->table = NULL;
+    u->buckets = u->n = 0;
+    for (size_t i = 0; i < u->nsegs; ++i) {
+        close(u->segs[i]->fd);
+        free(u->segs[i]);
+    }
+    atomic_fetch_sub_explicit(&stat_segments, u->nsegs, memory_order_relaxed);
+    free(u->segs);
+    u->segs = NULL;
+    u->nsegs = 0;
+}
+
+/* replay the user's segments, oldest first. Called with u->mtx held. */
+static int user_load(pk_user *u) {
+    if (u->loaded) return 0;
+    char dir[512];
+    user_dir(u, dir, sizeof(dir));
+    uint64_t *ids = NULL;
+    size_t nids = 0, cap = 0;
+    DIR *d = opendir(dir);
+    if (!d && errno != ENOENT) return -1;
+    struct dirent *de;
+    int rc = 0;
+    while (d && rc == 0 && (de = readdir(d)) != NULL) {
+        char *end;
+        unsigned long long id = strtoull(de->d_name, &end, 16);
+        if (end == de->d_name || strcmp(end, ".seg") != 0) continue;
+        if (nids == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(ids, cap * sizeof(*ids));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            ids = grown;
+        }
+        ids[nids++] = id;
+    }
+    if (d) closedir(d);
+    if (nids) qsort(ids, nids, sizeof(*ids), id_cmp);
+    for (size_t i = 0; rc == 0 && i < nids; ++i) rc = seg_load(u, ids[i]);
+    free(ids);
+    if (rc != 0) {
+        fprintf(stderr, "[packstore] loading %s's segments failed: %s\n", u->name, strerror(errno));
+        user_clear(u);
+        return -1;
+    }
+    /* deletes only hid older versions while replaying */
+    uint64_t total = 0;
+    for (size_t i = 0; i < u->nsegs; ++i) total += u->segs[i]->size - PK_MAGIC_LEN;
+    uint64_t live = 0;
+    for (size_t b = 0; b < u->buckets; ++b) {
+        pk_entry **pp = &u->table[b];
+        while (*pp) {
+            pk_entry *e = *pp;
+            if (!e->seg) {
+                entry_drop(u, pp);
+                continue;
+            }
+            size_t n = rec_size(e->name_len, e->len);
+            e->seg->live += n;
+            live += n;
+            pp = &e->chain;
+        }
+    }
+    account(u, (int64_t)live, (int64_t)(total - live));
+    atomic_fetch_add_explicit(&stat_files, u->n, memory_order_relaxed);
+    u->loaded = 1;
+    return 0;
+}
+
+/* the user's node, made on first use; its segments may not be loaded */
+static pk_user *user_get(const char *user) {
+    if (!active || !user) return NULL;
+    pk_user **bucket = &users[name_hash(user) % PK_USER_BUCKETS];
+    pthread_mutex_lock(&users_mtx);
+    pk_user *u = *bucket;
+    while (u && strcmp(u->name, user) != 0) u = u->chain;
+    if (!u) {
+        u = calloc(1, sizeof(pk_user));
+        if (u) u->name = strdup(user);
+        if (!u || !u->name) {
+            free(u);
+            pthread_mutex_unlock(&users_mtx);
+            return NULL;
+        }
+        pthread_mutex_init(&u->mtx, NULL);
+        u->seq = 1;
+        u->chain = *bucket;
+        *bucket = u;
+    }
+    pthread_mutex_unlock(&users_mtx);
+    return u;
+}
+
+static void maybe_compact(pk_user *u);
+
+/* the user's table, locked and loaded; NULL if it cannot be */
+static pk_user *user_lock(const char *user) {
+    pk_user *u = user_get(user);
+    if (!u) return NULL;
+    pthread_mutex_lock(&u->mtx);
+    if (user_load(u) != 0) {
+        pthread_mutex_unlock(&u->mtx);
+        return NULL;
+    }
+    maybe_compact(u);
+    return u;
+}
+
+static int compact_due(const pk_user *u) {
+    return u->nsegs && u->dead > u->live && u->dead >= PK_COMPACT_MIN;
+}
+
+/* hand the user to the compaction thread. Called with u->mtx held. */
+static void maybe_compact(pk_user *u) {
+    if (u->queued || !compact_due(u)) return;
+    u->queued = 1;
+    pthread_mutex_lock(&due_mtx);
+    u->next_due = NULL;
+    if (due_tail) due_tail->next_due = u;
+    else due_head = u;
+    due_tail = u;
+    pthread_cond_signal(&due_cv);
+    pthread_mutex_unlock(&due_mtx);
+}
+
+/* move the live records of the user's oldest segment to the newest, then
+ * unlink it. Records are copied verbatim (same sequence number), one per
+ * lock hold so uploads and downloads of the user keep going. Only this
+ * thread removes segments, so the ones it holds stay valid unlocked. */
+static void compact_oldest(pk_user *u) {
+    pthread_mutex_lock(&u->mtx);
+    u->queued = 0;
+    if (!compact_due(u) || (u->nsegs == 1 && !seg_new(u))) {
+        pthread_mutex_unlock(&u->mtx);
+        return;
+    }
+    pk_seg *old = u->segs[0];
+    char **names = malloc((u->n ? u->n : 1) * sizeof(*names));
+    size_t nnames = 0;
+    for (size_t b = 0; names && b < u->buckets; ++b)
+        for (pk_entry *e = u->table[b]; e; e = e->chain)
+            if (e->seg == old && (names[nnames] = strdup(e->name)) != NULL) nnames++;
+    pthread_mutex_unlock(&u->mtx);
+    if (!names) return;
+
+    pk_seg *touched[8];
+    size_t ntouched = 0;
+    int rc = 0;
+    char *buf = malloc(rec_size(FILEINDEX_NAME_MAX, PACKSTORE_FILE_MAX));
+    if (!buf) rc = -1;
+    for (size_t i = 0; i < nnames; ++i) {
+        pthread_mutex_lock(&u->mtx);
+        pk_entry *e = entry_find(u, names[i]);
+        if (rc == 0 && e && e->seg == old) {
+            size_t n = rec_size(e->name_len, e->len);
+            struct iovec iov = {buf, n};
+            pk_seg *to;
+            uint64_t off;
+            if (pread(old->fd, buf, n, (off_t)e->off) != (ssize_t)n || seg_append(u, &iov, 1, &to, &off) != 0) {
+                rc = -1;
+            } else {
+                old->live -= n;
+                to->live += n;
+                account(u, 0, (int64_t)n); /* the old copy */
+                e->seg = to;
+                e->off = off;
+                if (ntouched == 0 || touched[ntouched - 1] != to) {
+                    if (ntouched == sizeof(touched) / sizeof(*touched)) rc = -1;
+                    else touched[ntouched++] = to;
+                }
+            }
+        }
+        pthread_mutex_unlock(&u->mtx);
+        free(names[i]);
+    }
+    free(names);
+    free(buf);
+    /* the copies must be on disk before the originals go */
+    for (size_t i = 0; rc == 0 && i < ntouched; ++i) rc = fdatasync(touched[i]->fd);
+    pthread_mutex_lock(&u->mtx);
+    if (rc != 0 || old->live != 0) {
+        fprintf(stderr, "[packstore] compacting %s's segment %llx failed: %s\n", u->name,
+                (unsigned long long)old->id, rc != 0 ? strerror(errno) : "still in use");
+        pthread_mutex_unlock(&u->mtx);
+        return;
+    }
+    memmove(u->segs, u->segs + 1, (u->nsegs - 1) * sizeof(*u->segs));
+    u->nsegs--;
+    account(u, 0, -(int64_t)(old->size - PK_MAGIC_LEN));
+    char path[600], dir[512];
+    seg_path(u, old->id, path, sizeof(path));
+    user_dir(u, dir, sizeof(dir));
+    /* a segment that came back after a crash could outlive the deletes
+     * that hide its records */
+    if (unlink(path) != 0 || fsync_dir(dir) != 0)
+        fprintf(stderr, "[packstore] unlink(%s) failed: %s\n", path, strerror(errno));
+    close(old->fd);
+    free(old);
+    atomic_fetch_sub_explicit(&stat_segments, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_compactions, 1, memory_order_relaxed);
+    maybe_compact(u);
+    pthread_mutex_unlock(&u->mtx);
+}
+
+static void *compact_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&due_mtx);
+    for (;;) {
+        while (!due_head && !stopping) pthread_cond_wait(&due_cv, &due_mtx);
+        if (stopping) break;
+        pk_user *u = due_head;
+        due_head = u->next_due;
+        if (!due_head) due_tail = NULL;
+        pthread_mutex_unlock(&due_mtx);
+        compact_oldest(u);
+        pthread_mutex_lock(&due_mtx);
+    }
+    pthread_mutex_unlock(&due_mtx);
+    return NULL;
+}
+
+int packstore_init(const char *root, int enable) {
+    snprintf(pack_root, sizeof(pack_root), "%s/.pack", root);
+    struct stat st;
+    if (stat(pack_root, &st) != 0) {
+        if (!enable) return 0;
+        if (mkdir(pack_root, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "[packstore] mkdir(%s) failed: %s\n", pack_root, strerror(errno));
+            return -1;
+        }
+    } else if (!S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    stopping = 0;
+    if (pthread_create(&compact_thread, NULL, compact_main, NULL) != 0) return -1;
+    active = 1;
+    return 1;
+}
+
+void packstore_shutdown(void) {
+    if (!active) return;
+    pthread_mutex_lock(&due_mtx);
+    stopping = 1;
+    pthread_cond_signal(&due_cv);
+    pthread_mutex_unlock(&due_mtx);
+    pthread_join(compact_thread, NULL);
+    due_head = due_tail = NULL;
+    for (size_t b = 0; b < PK_USER_BUCKETS; ++b) {
+        pk_user *u = users[b];
+        while (u) {
+            pk_user *next = u->chain;
+            user_clear(u);
+            pthread_mutex_destroy(&u->mtx);
+            free(u->name);
+            free(u);
+            u = next;
+        }
+        users[b] = NULL;
+    }
+    active = 0;
+}
+
+int packstore_put(const char *user, const char *name, const void *data, size_t n, uint64_t hash,
+                  int64_t *mtime_ns) {
+    size_t name_len = name ? strlen(name) : 0;
+    if (n > PACKSTORE_FILE_MAX || name_len == 0 || name_len > FILEINDEX_NAME_MAX) return -1;
+    pk_user *u = user_lock(user);
+    if (!u) return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t mtime = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    uint64_t seq = u->seq;
+    pk_seg *s;
+    uint64_t off;
+    pk_entry *e = entry_find(u, name);
+    int replaced = e != NULL;
+    if (!e) e = entry_add(u, name, name_len);
+    if (!e || rec_append(u, PK_PUT, name, name_len, data, n, mtime, hash, &s, &off) != 0) {
+        if (e && !replaced) entry_drop(u, entry_slot(u, name));
+        pthread_mutex_unlock(&u->mtx);
+        return -1;
+    }
+    size_t size = rec_size(name_len, n);
+    if (replaced) {
+        size_t was = rec_size(e->name_len, e->len);
+        e->seg->live -= was;
+        account(u, -(int64_t)was, (int64_t)was);
+    } else {
+        atomic_fetch_add_explicit(&stat_files, 1, memory_order_relaxed);
+    }
+    s->live += size;
+    account(u, (int64_t)size, 0);
+    e->seg = s;
+    e->off = off;
+    e->len = (uint32_t)n;
+    e->seq = seq;
+    e->mtime_ns = mtime;
+    e->hash = hash;
+    maybe_compact(u);
+    pthread_mutex_unlock(&u->mtx);
+    if (mtime_ns) *mtime_ns = mtime;
+    return replaced;
+}
+
+int packstore_remove(const char *user, const char *name) {
+    if (!active || !name) return 1;
+    pk_user *u = user_lock(user);
+    if (!u) return -1;
+    pk_entry **pp = entry_slot(u, name);
+    if (!pp || !*pp) {
+        pthread_mutex_unlock(&u->mtx);
+        return 1;
+    }
+    pk_entry *e = *pp;
+    pk_seg *s;
+    uint64_t off;
+    if (rec_append(u, PK_DEL, e->name, e->name_len, NULL, 0, 0, 0, &s, &off) != 0) {
+        pthread_mutex_unlock(&u->mtx);
+        return -1;
+    }
+    size_t was = rec_size(e->name_len, e->len);
+    e->seg->live -= was;
+    /* the delete record itself is dead from the start */
+    account(u, -(int64_t)was, (int64_t)(was + rec_size(e->name_len, 0)));
+    entry_drop(u, pp);
+    atomic_fetch_sub_explicit(&stat_files, 1, memory_order_relaxed);
+    maybe_compact(u);
+    pthread_mutex_unlock(&u->mtx);
+    return 0;
+}
+
+int packstore_open(const char *user, const char *name, packstore_loc *loc) {
+    if (!active || !name) return 1;
+    pk_user *u = user_lock(user);
+    if (!u) return -1;
+    pk_entry *e = entry_find(u, name);
+    int rc = 1;
+    if (e) {
+        loc->fd = fcntl(e->seg->fd, F_DUPFD_CLOEXEC, 0);
+        loc->off = e->off + sizeof(pk_rec) + e->name_len;
+        loc->len = e->len;
+        loc->mtime_ns = e->mtime_ns;
+        loc->hash = e->hash;
+        rc = loc->fd >= 0 ? 0 : -1;
+    }
+    pthread_mutex_unlock(&u->mtx);
+    return rc;
+}
+
+int packstore_each(const char *user, packstore_visit_fn fn, void *ctx) {
+    if (!active) return 0;
+    pk_user *u = user_lock(user);
+    if (!u) return -1;
+    for (size_t b = 0; b < u->buckets; ++b)
+        for (pk_entry *e = u->table[b]; e; e = e->chain) fn(ctx, e->name, e->len, e->mtime_ns, e->hash);
+    pthread_mutex_unlock(&u->mtx);
+    return 0;
+}
+
+int packstore_sync(const char *user) {
+    if (!active) return 0;
+    pk_user *u = user_get(user);
+    if (!u) return -1;
+    int rc = 0;
+    pthread_mutex_lock(&u->mtx);
+    for (size_t i = 0; i < u->nsegs; ++i) {
+        pk_seg *s = u->segs[i];
+        if (!s->dirty) continue;
+        if (fdatasync(s->fd) != 0) rc = -1;
+        else s->dirty = 0;
+    }
+    pthread_mutex_unlock(&u->mtx);
+    return rc;
+}
+
+void packstore_get_stats(packstore_stats *st) {
+    st->files = atomic_load(&stat_files);
+    st->segments = atomic_load(&stat_segments);
+    st->live_bytes = atomic_load(&stat_live);
+    st->dead_bytes = atomic_load(&stat_dead);
+    st->compactions = atomic_load(&stat_compactions);
+}
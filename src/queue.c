@@ -1,22 +1,50 @@
 #define _POSIX_C_SOURCE 200809L
 #include "queue.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+
+/* waiting: busy-spin, then yield the CPU a few times, then park */
+#define QUEUE_SPIN 64
+#define QUEUE_YIELD 4
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#endif
+}
 
 queue_t *queue_create(size_t capacity) {
     if (capacity == 0) return NULL;
-    queue_t *q = calloc(1, sizeof(queue_t));
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    queue_t *q = aligned_alloc(QUEUE_CACHE_LINE, (sizeof(queue_t) + QUEUE_CACHE_LINE - 1) &
+                                                 ~(size_t)(QUEUE_CACHE_LINE - 1));
     if (!q) return NULL;
-    q->buf = calloc(capacity, sizeof(void*));
+    memset(q, 0, sizeof(*q));
+    q->buf = calloc(cap, sizeof(queue_cell));
     if (!q->buf) { free(q); return NULL; }
-    q->capacity = capacity;
-    pthread_mutex_init(&q->mtx, NULL);
-    pthread_cond_init(&q->not_empty, NULL);
-    pthread_cond_init(&q->not_full, NULL);
-    q->head = q->tail = q->count = 0;
+    q->mask = cap - 1;
+    /* slot i is free for the push at position i */
+    for (size_t i = 0; i < cap; ++i) atomic_init(&q->buf[i].seq, i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
     atomic_init(&q->closed, 0);
+    atomic_init(&q->pop_waiters, 0);
+    atomic_init(&q->push_waiters, 0);
+    pthread_mutex_init(&q->park_mtx, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    /* queue_push_timed's deadline must not move with the wall clock */
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->not_full, &ca);
+    pthread_condattr_destroy(&ca);
     return q;
 }
 
@@ -24,52 +52,211 @@ void queue_destroy(queue_t *q) {
     if (!q) return;
     pthread_cond_destroy(&q->not_full);
     pthread_cond_destroy(&q->not_empty);
-    pthread_mutex_destroy(&q->mtx);
+    pthread_mutex_destroy(&q->park_mtx);
     free(q->buf);
     free(q);
 }
 
-int __attribute__((no_sanitize("thread"))) queue_push(queue_t *q, void *item) {
-    if (!q) return -1;
-    pthread_mutex_lock(&q->mtx);
-    while (!atomic_load_explicit(&q->closed, memory_order_acquire) && q->count == q->capacity) {
-        pthread_cond_wait(&q->not_full, &q->mtx);
+/* claim up to n consecutive free slots with one CAS on tail and fill them;
+ * returns how many, 0 if the ring is full */
+static size_t try_push(queue_t *q, void **items, size_t n) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+        size_t k = 0;
+        intptr_t dif = 0;
+        while (k < n && k <= q->mask) {
+            queue_cell *c = &q->buf[(pos + k) & q->mask];
+            dif = (intptr_t)(atomic_load_explicit(&c->seq, memory_order_acquire) - (pos + k));
+            if (dif != 0) break;
+            k++;
+        }
+        if (k == 0) {
+            if (dif < 0) return 0; /* the slot still holds last lap's item */
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + k, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            for (size_t i = 0; i < k; ++i) {
+                queue_cell *c = &q->buf[(pos + i) & q->mask];
+                c->item = items[i];
+                atomic_store_explicit(&c->seq, pos + i + 1, memory_order_release);
+            }
+            return k;
+        }
     }
-    if (atomic_load_explicit(&q->closed, memory_order_acquire)) {
-        pthread_mutex_unlock(&q->mtx);
-        return -1;
+}
+
+/* claim up to max consecutive full slots with one CAS on head and empty
+ * them; returns how many, 0 if the ring is empty */
+static size_t try_pop(queue_t *q, void **out, size_t max) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        size_t k = 0;
+        intptr_t dif = 0;
+        while (k < max && k <= q->mask) {
+            queue_cell *c = &q->buf[(pos + k) & q->mask];
+            dif = (intptr_t)(atomic_load_explicit(&c->seq, memory_order_acquire) - (pos + k + 1));
+            if (dif != 0) break;
+            k++;
+        }
+        if (k == 0) {
+            if (dif < 0) return 0; /* not pushed yet */
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + k, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            for (size_t i = 0; i < k; ++i) {
+                queue_cell *c = &q->buf[(pos + i) & q->mask];
+                out[i] = c->item;
+                /* free for the push one lap later */
+                atomic_store_explicit(&c->seq, pos + i + q->mask + 1, memory_order_release);
+            }
+            return k;
+        }
     }
-    q->buf[q->tail] = item;
-    q->tail = (q->tail + 1) % q->capacity;
-    q->count++;
-    pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->mtx);
-    return 0;
 }
 
-void * __attribute__((no_sanitize("thread"))) queue_pop(queue_t *q) {
-    if (!q) return NULL;
-    pthread_mutex_lock(&q->mtx);
-    while (!atomic_load_explicit(&q->closed, memory_order_acquire) && q->count == 0) {
-        pthread_cond_wait(&q->not_empty, &q->mtx);
+/* wake parked threads after n slots changed hands. The fence pairs with
+ * the waiter's increment: either we see the waiter, or it sees our slots. */
+static void queue_wake(queue_t *q, atomic_int *waiters, pthread_cond_t *cond, size_t n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0) return;
+    pthread_mutex_lock(&q->park_mtx);
+    if (n > 1) pthread_cond_broadcast(cond);
+    else pthread_cond_signal(cond);
+    pthread_mutex_unlock(&q->park_mtx);
+}
+
+/* spin/yield step of a wait; returns 0 once it is time to park */
+static int queue_backoff(unsigned *spin) {
+    if (*spin < QUEUE_SPIN) cpu_relax();
+    else if (*spin < QUEUE_SPIN + QUEUE_YIELD) sched_yield();
+    else return 0;
+    (*spin)++;
+    return 1;
+}
+
+size_t queue_push_batch(queue_t *q, void **items, size_t n) {
+    if (!q) return 0;
+    size_t done = 0;
+    unsigned spin = 0;
+    while (done < n) {
+        if (atomic_load_explicit(&q->closed, memory_order_acquire)) break;
+        size_t k = try_push(q, items + done, n - done);
+        if (k == 0 && queue_backoff(&spin)) continue;
+        if (k == 0) {
+            atomic_fetch_add(&q->push_waiters, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            pthread_mutex_lock(&q->park_mtx);
+            while (!atomic_load_explicit(&q->closed, memory_order_acquire) &&
+                   (k = try_push(q, items + done, n - done)) == 0)
+                pthread_cond_wait(&q->not_full, &q->park_mtx);
+            pthread_mutex_unlock(&q->park_mtx);
+            atomic_fetch_sub(&q->push_waiters, 1);
+            if (k == 0) break; /* closed */
+        }
+        done += k;
+        spin = 0;
+        queue_wake(q, &q->pop_waiters, &q->not_empty, k);
     }
-    if (q->count == 0 && atomic_load_explicit(&q->closed, memory_order_acquire)) {
-        pthread_mutex_unlock(&q->mtx);
-        return NULL;
+    return done;
+}
+
+size_t queue_pop_batch(queue_t *q, void **out, size_t max) {
+    if (!q || max == 0) return 0;
+    unsigned spin = 0;
+    for (;;) {
+        /* closed: hand out what is left, then report empty */
+        int closed = atomic_load_explicit(&q->closed, memory_order_acquire);
+        size_t k = try_pop(q, out, max);
+        if (k == 0 && closed) return 0;
+        if (k == 0 && queue_backoff(&spin)) continue;
+        if (k == 0) {
+            atomic_fetch_add(&q->pop_waiters, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            pthread_mutex_lock(&q->park_mtx);
+            while ((k = try_pop(q, out, max)) == 0 && !atomic_load_explicit(&q->closed, memory_order_acquire))
+                pthread_cond_wait(&q->not_empty, &q->park_mtx);
+            pthread_mutex_unlock(&q->park_mtx);
+            atomic_fetch_sub(&q->pop_waiters, 1);
+            if (k == 0) continue; /* closed: drain check above */
+        }
+        queue_wake(q, &q->push_waiters, &q->not_full, k);
+        return k;
     }
-    void *item = q->buf[q->head];
-    q->head = (q->head + 1) % q->capacity;
-    q->count--;
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mtx);
+}
+
+int queue_push(queue_t *q, void *item) {
+    return queue_push_batch(q, &item, 1) == 1 ? 0 : -1;
+}
+
+int queue_push_timed(queue_t *q, void *item, unsigned timeout_ms) {
+    if (!q) return -1;
+    unsigned spin = 0;
+    for (;;) {
+        if (atomic_load_explicit(&q->closed, memory_order_acquire)) return -1;
+        if (try_push(q, &item, 1)) {
+            queue_wake(q, &q->pop_waiters, &q->not_empty, 1);
+            return 0;
+        }
+        if (!queue_backoff(&spin)) break;
+    }
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    size_t k = 0;
+    int rc = 0;
+    atomic_fetch_add(&q->push_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    pthread_mutex_lock(&q->park_mtx);
+    while (!atomic_load_explicit(&q->closed, memory_order_acquire) && (k = try_push(q, &item, 1)) == 0 &&
+           rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&q->not_full, &q->park_mtx, &until);
+    pthread_mutex_unlock(&q->park_mtx);
+    atomic_fetch_sub(&q->push_waiters, 1);
+    if (k == 0) return atomic_load_explicit(&q->closed, memory_order_acquire) ? -1 : -2;
+    queue_wake(q, &q->pop_waiters, &q->not_empty, 1);
+    return 0;
+}
+
+void *queue_pop(queue_t *q) {
+    void *item = NULL;
+    return queue_pop_batch(q, &item, 1) ? item : NULL;
+}
+
+int queue_try_push(queue_t *q, void *item) {
+    if (!q || atomic_load_explicit(&q->closed, memory_order_acquire)) return -1;
+    if (try_push(q, &item, 1) == 0) return -1;
+    queue_wake(q, &q->pop_waiters, &q->not_empty, 1);
+    return 0;
+}
+
+void *queue_try_pop(queue_t *q) {
+    void *item = NULL;
+    if (!q || try_pop(q, &item, 1) == 0) return NULL;
+    queue_wake(q, &q->push_waiters, &q->not_full, 1);
     return item;
 }
 
-void __attribute__((no_sanitize("thread"))) queue_close(queue_t *q) {
+size_t queue_depth(queue_t *q) {
+    if (!q) return 0;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+void queue_close(queue_t *q) {
     if (!q) return;
-    pthread_mutex_lock(&q->mtx);
     atomic_store_explicit(&q->closed, 1, memory_order_release);
+    pthread_mutex_lock(&q->park_mtx);
     pthread_cond_broadcast(&q->not_empty);
     pthread_cond_broadcast(&q->not_full);
-    pthread_mutex_unlock(&q->mtx);
+    pthread_mutex_unlock(&q->park_mtx);
 }
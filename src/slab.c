@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_ALIGN 16
+
+/* a free object; the first one of a magazine in the depot also links the
+ * next magazine and says how many objects it holds */
+typedef struct slab_obj {
+    struct slab_obj *next;
+    struct slab_obj *next_mag;
+    size_t count;
+} slab_obj;
+
+typedef struct slab_mag {
+    slab_obj *head;
+    size_t n;
+} slab_mag;
+
+typedef struct slab_local {
+    slab_mag loaded;        /* alloc and free use this one */
+    slab_mag spare;         /* full or empty, swapped in before the depot is used */
+} slab_local;
+
+static slab_cache *slab_caches[SLAB_MAX_CACHES];
+static int slab_ncaches = 0;
+static pthread_mutex_t slab_reg_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+static _Thread_local slab_local slab_tl[SLAB_MAX_CACHES];
+static _Thread_local int slab_tl_live = 0;
+
+/* slab header, padded so objects stay SLAB_ALIGN aligned */
+static size_t slab_hdr_size(void) {
+    return (sizeof(void *) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+static size_t slab_stride(const slab_cache *c) {
+    size_t size = c->size < sizeof(slab_obj) ? sizeof(slab_obj) : c->size;
+    return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/* c->mtx held */
+static void slab_depot_put(slab_cache *c, slab_mag *m) {
+    if (m->n == 0) return;
+    m->head->next_mag = c->depot;
+    m->head->count = m->n;
+    c->depot = m->head;
+    c->depot_swaps++;
+    m->head = NULL;
+    m->n = 0;
+}
+
+/* hand the exiting thread's magazines back */
+static void slab_thread_exit(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&slab_reg_mtx);
+    int n = slab_ncaches;
+    pthread_mutex_unlock(&slab_reg_mtx);
+    for (int i = 0; i < n; ++i) {
+        slab_cache *c = slab_caches[i];
+        slab_local *l = &slab_tl[i];
+        pthread_mutex_lock(&c->mtx);
+        slab_depot_put(c, &l->loaded);
+        slab_depot_put(c, &l->spare);
+        pthread_mutex_unlock(&c->mtx);
+    }
+}
+
+static void slab_key_init(void) {
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+/* gives c its magazine index; returns it, 0 if every index is taken */
+static int slab_register(slab_cache *c) {
+    pthread_mutex_lock(&slab_reg_mtx);
+    int id = atomic_load(&c->id);
+    if (id == 0 && slab_ncaches < SLAB_MAX_CACHES) {
+        slab_caches[slab_ncaches++] = c;
+        id = slab_ncaches;
+        atomic_store_explicit(&c->id, id, memory_order_release);
+    }
+    pthread_mutex_unlock(&slab_reg_mtx);
+    return id;
+}
+
+static slab_local *slab_local_of(int id) {
+    if (!slab_tl_live) {
+        pthread_once(&slab_once, slab_key_init);
+        pthread_setspecific(slab_key, &slab_tl_live);
+        slab_tl_live = 1;
+    }
+    return &slab_tl[id - 1];
+}
+
+/* load l with a full magazine from the depot, or carve a new slab */
+static int slab_refill(slab_cache *c, slab_local *l) {
+    pthread_mutex_lock(&c->mtx);
+    if (c->depot) {
+        l->loaded.head = c->depot;
+        l->loaded.n = c->depot->count;
+        c->depot = c->depot->next_mag;
+        c->depot_swaps++;
+        pthread_mutex_unlock(&c->mtx);
+        return 0;
+    }
+    size_t stride = slab_stride(c);
+    char *slab = malloc(slab_hdr_size() + SLAB_OBJECTS * stride);
+    if (!slab) {
+        pthread_mutex_unlock(&c->mtx);
+        return -1;
+    }
+    *(void **)slab = c->slabs;
+    c->slabs = slab;
+    c->sys_allocs++;
+    c->objects += SLAB_OBJECTS;
+    /* the first SLAB_BATCH objects go to the caller, the rest to the depot */
+    slab_mag rest = { NULL, 0 };
+    for (size_t i = SLAB_OBJECTS; i-- > 0;) {
+        slab_obj *o = (slab_obj *)(slab + slab_hdr_size() + i * stride);
+        slab_mag *m = i < SLAB_BATCH ? &l->loaded : &rest;
+        o->next = m->head;
+        m->head = o;
+        m->n++;
+        if (m == &rest && m->n == SLAB_BATCH) slab_depot_put(c, m);
+    }
+    slab_depot_put(c, &rest);
+    pthread_mutex_unlock(&c->mtx);
+    return 0;
+}
+
+void *slab_alloc(slab_cache *c) {
+    int id = atomic_load_explicit(&c->id, memory_order_acquire);
+    if (id == 0 && (id = slab_register(c)) == 0) return NULL;
+    slab_local *l = slab_local_of(id);
+    if (l->loaded.n == 0) {
+        if (l->spare.n) {
+            slab_mag m = l->loaded;
+            l->loaded = l->spare;
+            l->spare = m;
+        } else if (slab_refill(c, l) != 0) {
+            return NULL;
+        }
+    }
+    slab_obj *o = l->loaded.head;
+    l->loaded.head = o->next;
+    l->loaded.n--;
+    atomic_fetch_add_explicit(&c->allocs, 1, memory_order_relaxed);
+    memset(o, 0, c->size);
+    return o;
+}
+
+void slab_free(slab_cache *c, void *p) {
+    if (!p) return;
+    slab_local *l = slab_local_of(atomic_load_explicit(&c->id, memory_order_acquire));
+    if (l->loaded.n == SLAB_BATCH) {
+        if (l->spare.n) {
+            pthread_mutex_lock(&c->mtx);
+            slab_depot_put(c, &l->spare);
+            pthread_mutex_unlock(&c->mtx);
+        }
+        l->spare = l->loaded;
+        l->loaded.head = NULL;
+        l->loaded.n = 0;
+    }
+    slab_obj *o = p;
+    o->next = l->loaded.head;
+    l->loaded.head = o;
+    l->loaded.n++;
+}
+
+void slab_release(slab_cache *c) {
+    pthread_mutex_lock(&c->mtx);
+    while (c->slabs) {
+        void *next = *(void **)c->slabs;
+        free(c->slabs);
+        c->slabs = next;
+    }
+    c->depot = NULL;
+    c->objects = 0;
+    pthread_mutex_unlock(&c->mtx);
+    int id = atomic_load(&c->id);
+    /* the calling thread's magazines pointed into the freed slabs */
+    if (id) memset(&slab_tl[id - 1], 0, sizeof(slab_local));
+}
+
+size_t slab_get_stats(slab_stats *st, size_t max) {
+    pthread_mutex_lock(&slab_reg_mtx);
+    size_t n = (size_t)slab_ncaches < max ? (size_t)slab_ncaches : max;
+    for (size_t i = 0; i < n; ++i) {
+        slab_cache *c = slab_caches[i];
+        pthread_mutex_lock(&c->mtx);
+        st[i].name = c->name;
+        st[i].objects = c->objects;
+        st[i].sys_allocs = c->sys_allocs;
+        st[i].allocs = atomic_load_explicit(&c->allocs, memory_order_relaxed);
+        st[i].depot_swaps = c->depot_swaps;
+        pthread_mutex_unlock(&c->mtx);
+    }
+    pthread_mutex_unlock(&slab_reg_mtx);
+    return n;
+}
@@ -1,5 +1,11 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* syncfs */
 #include "storage.h"
+#include "chunkstore.h"
+#include "delta.h"
+#include "fileindex.h"
+#include "packstore.h"
+#include "fanout.h"
+#include "util.h"
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -8,9 +14,183 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 static const char *ROOT = "server_storage";
 
+/* dedup mode: user files are chunk store manifests (see chunkstore.h) */
+static int dedup_requested = 0;
+static int dedup = 0;
+
+void storage_set_dedup(int enable) {
+    dedup_requested = enable;
+}
+
+/* pack mode: files up to PACKSTORE_FILE_MAX live in segments (see packstore.h) */
+static int pack_requested = 0;
+static int pack = 0;
+
+void storage_set_pack(int enable) {
+    pack_requested = enable;
+}
+
+/* fanout: plain files of sharded users live in hashed subdirectories (see fanout.h) */
+static int fanout_requested = 0;
+static int fanout = 0;
+
+void storage_set_fanout(int enable) {
+    fanout_requested = enable;
+}
+
+/* per-user quotas: one default, overridden by "<user> <MB>" lines in
+ * <ROOT>/quotas.txt; 0 means no limit */
+typedef struct quota_entry {
+    char username[64];
+    uint64_t bytes;
+} quota_entry;
+static uint64_t quota_default = 0;
+static quota_entry *quotas = NULL;
+static size_t quota_count = 0;
+
+void storage_set_quota(uint64_t bytes) {
+    quota_default = bytes;
+}
+
+static int quota_cmp(const void *a, const void *b) {
+    return strcmp(((const quota_entry *)a)->username, ((const quota_entry *)b)->username);
+}
+
+static void quota_load(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/quotas.txt", ROOT);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    char line[256];
+    size_t cap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        quota_entry q;
+        unsigned long long mb;
+        if (sscanf(line, "%63s %llu", q.username, &mb) != 2 || q.username[0] == '#') continue;
+        q.bytes = (uint64_t)mb << 20;
+        if (quota_count == cap) {
+            cap = cap ? cap * 2 : 16;
+            quota_entry *grown = realloc(quotas, cap * sizeof(*grown));
+            if (!grown) break;
+            quotas = grown;
+        }
+        quotas[quota_count++] = q;
+    }
+    fclose(f);
+    qsort(quotas, quota_count, sizeof(*quotas), quota_cmp);
+    fprintf(stderr, "[storage_init] %zu quota override(s) from %s\n", quota_count, path);
+}
+
+uint64_t storage_quota(const char *username) {
+    quota_entry key;
+    snprintf(key.username, sizeof(key.username), "%s", username);
+    const quota_entry *q = quota_count ? bsearch(&key, quotas, quota_count, sizeof(*quotas), quota_cmp) : NULL;
+    return q ? q->bytes : quota_default;
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+typedef struct index_extra_ctx {
+    char **packed; /* sorted; these win over a plain file */
+    size_t n, cap;
+    int failed;
+    fileindex_add_fn add;
+    void *ctx;
+} index_extra_ctx;
+
+static void index_extra_pack(void *ctx, const char *name, uint64_t size, int64_t mtime_ns, uint64_t hash) {
+    index_extra_ctx *x = ctx;
+    if (x->n == x->cap) {
+        size_t cap = x->cap ? x->cap * 2 : 64;
+        char **grown = realloc(x->packed, cap * sizeof(*grown));
+        if (!grown) {
+            x->failed = 1;
+            return;
+        }
+        x->packed = grown;
+        x->cap = cap;
+    }
+    if ((x->packed[x->n] = strdup(name)) != NULL) x->n++;
+    else x->failed = 1;
+    x->add(x->ctx, name, size, mtime_ns, hash);
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void index_extra_shard(void *ctx, const char *name, const struct stat *st) {
+    index_extra_ctx *x = ctx;
+    if (x->n && bsearch(&name, x->packed, x->n, sizeof(*x->packed), name_cmp)) return;
+    /* hash unknown: the index keeps the old one if size and mtime match */
+    x->add(x->ctx, name, (uint64_t)st->st_size, mtime_ns(st), 0);
+}
+
+/* a rescan's files outside the user directory: packed, then sharded */
+static int index_extra(const char *user, fileindex_add_fn add, void *ctx) {
+    index_extra_ctx x = {NULL, 0, 0, 0, add, ctx};
+    int rc = pack ? packstore_each(user, index_extra_pack, &x) : 0;
+    if (x.failed) rc = -1;
+    if (x.n) qsort(x.packed, x.n, sizeof(*x.packed), name_cmp);
+    if (rc == 0 && fanout_each(user, index_extra_shard, &x) != 0) rc = -1;
+    for (size_t i = 0; i < x.n; ++i) free(x.packed[i]);
+    free(x.packed);
+    return rc;
+}
+
+/* the index lists logical sizes: in dedup mode, the manifest's */
+static int index_size(const char *path, const struct stat *st, uint64_t *size) {
+    if (!dedup) {
+        *size = (uint64_t)st->st_size;
+        return 0;
+    }
+    size_t n = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = chunkstore_manifest_size(fd, &n);
+    close(fd);
+    *size = n;
+    return rc;
+}
+
+static int storage_init_backend(void) {
+    int rc = chunkstore_init(ROOT, dedup_requested);
+    if (rc < 0) return -1;
+    dedup = rc;
+    if (dedup) {
+        if (pack_requested) fprintf(stderr, "[storage_init] pack store not used in dedup mode\n");
+        if (fanout_requested) fprintf(stderr, "[storage_init] fanout not used in dedup mode\n");
+    } else {
+        rc = packstore_init(ROOT, pack_requested);
+        if (rc < 0) return -1;
+        pack = rc;
+        if (pack) fprintf(stderr, "[storage_init] packing files up to %d bytes\n", PACKSTORE_FILE_MAX);
+        if (fanout_init(ROOT, fanout_requested) != 0) return -1;
+        fanout = fanout_requested;
+    }
+    quota_load();
+    if (fileindex_init(ROOT, index_size, dedup ? NULL : index_extra) != 0) return -1;
+    /* moves files under the index's feet: names, sizes and mtimes stay */
+    return fanout_migrate_start();
+}
+
+void storage_shutdown(void) {
+    fanout_shutdown();
+    packstore_shutdown();
+    fileindex_shutdown();
+    free(quotas);
+    quotas = NULL;
+    quota_count = 0;
+}
+
 int storage_init(void) {
     char cwd[1024];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -22,131 +202,1004 @@ int storage_init(void) {
     if (mkdir(ROOT, 0777) != 0) {
         if (errno == EEXIST) {
             fprintf(stderr, "[storage_init] %s already exists (ok)\n", ROOT);
-            return 0;
+            return storage_init_backend();
         } else {
             fprintf(stderr, "[storage_init] mkdir(%s) failed: %s\n", ROOT, strerror(errno));
             return -1;
         }
     }
     fprintf(stderr, "[storage_init] created %s\n", ROOT);
-    return 0;
+    return storage_init_backend();
 }
 
 int storage_ensure_userdir(const char *username) {
     if (!username) return -1;
     char path[512];
     snprintf(path, sizeof(path), "%s/%s", ROOT, username);
+    if (fanout) {
+        int rc = fanout_new_user(username);
+        if (rc != 0) return rc > 0 ? 0 : -1;
+        return fsync_path(ROOT);
+    }
     if (mkdir(path, 0777) != 0) {
         if (errno == EEXIST) return 0;
         fprintf(stderr, "[storage_ensure_userdir] mkdir(%s) failed: %s\n", path, strerror(errno));
         return -1;
     }
-    return 0;
+    /* once per user: storage_sync only syncs the user directories */
+    return fsync_path(ROOT);
 }
 
 /* rest of file unchanged... */
 
-int storage_write_blob(const char *username, const char *filename, const char *buf, size_t n) {
-    if (!username || !filename) return -1;
-    if (storage_ensure_userdir(username) != 0) return -1;
-    const char *base = strrchr(filename, '/');
-    if (base) base++;
-    else base = filename;
-    char path[512], tmp[512];
-    snprintf(path, sizeof(path), "%s/%s/%s", ROOT, username, base);
-    snprintf(tmp, sizeof(tmp), "%s/%s/.%s.tmp", ROOT, username, base);
-    FILE *fp = fopen(tmp, "wb");
-    if (!fp) {
-        fprintf(stderr, "[storage_write_blob] fopen(%s) failed: %s\n", tmp, strerror(errno));
+/* where a user in layout keeps the plain file base */
+static void plain_path(const char *username, const char *base, int layout, char *path, size_t n) {
+    if (layout == FANOUT_FLAT) snprintf(path, n, "%s/%s/%s", ROOT, username, base);
+    else fanout_path(username, base, path, n);
+}
+
+/* open a plain file read-only wherever it is; path gets where. A migrating
+ * user may have it in either place, and the migration can move it from
+ * one to the other between two tries, so a flat miss looks again. */
+static int plain_open(const char *username, const char *base, char *path, size_t n) {
+    int layout = fanout_layout(username);
+    int fd;
+    if (layout != FANOUT_FLAT) {
+        fanout_path(username, base, path, n);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 || errno != ENOENT || layout == FANOUT_SHARDED) return fd;
+    }
+    snprintf(path, n, "%s/%s/%s", ROOT, username, base);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 || errno != ENOENT) return fd;
+    if (fanout_layout(username) == FANOUT_FLAT) {
+        errno = ENOENT;
         return -1;
     }
-    size_t w = fwrite(buf, 1, n, fp);
-    fclose(fp);
-    if (w != n) { 
-        remove(tmp); 
-        fprintf(stderr, "[storage_write_blob] fwrite mismatch: wrote %zu expected %zu\n", w, n);
-        return -1; 
+    fanout_path(username, base, path, n);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void unlink_copy(const char *path, int *removed, int *err) {
+    if (unlink(path) == 0) *removed = 1;
+    else if (errno != ENOENT) *err = errno;
+}
+
+/* unlink every copy of a plain file (the caller holds fanout_lock): 0 if
+ * one went, -1 with errno otherwise */
+static int plain_unlink(const char *username, const char *base, int layout) {
+    char path[512];
+    int removed = 0, err = ENOENT;
+    if (layout != FANOUT_SHARDED) {
+        plain_path(username, base, FANOUT_FLAT, path, sizeof(path));
+        unlink_copy(path, &removed, &err);
+    }
+    if (layout != FANOUT_FLAT) {
+        /* after the flat one: the migration may move it to the shard meanwhile */
+        fanout_path(username, base, path, sizeof(path));
+        unlink_copy(path, &removed, &err);
     }
-    if (rename(tmp, path) != 0) { 
-        remove(tmp); 
-        fprintf(stderr, "[storage_write_blob] rename(%s -> %s) failed: %s\n", tmp, path, strerror(errno));
-        return -1; 
+    if (removed) return 0;
+    errno = err;
+    return -1;
+}
+
+struct storage_upload {
+    char path[512];
+    char tmp[512];
+    char username[64];
+    int fd; /* -1 until the first write opens the temp file */
+    int resumable; /* tmp is a persistent partial that outlives the session */
+    int packed; /* pack mode: held in small until it outgrows PACKSTORE_FILE_MAX */
+    int sharded; /* tmp is in a shard directory, made on first use */
+    char *small;
+    size_t small_len;
+    size_t total;
+    chunkstore_writer *cw; /* dedup mode: chunks are stored as they arrive */
+    fileindex_hasher hash; /* of the bytes written in this session */
+    int quota;             /* storage_upload_reserve checked it against the quota */
+    size_t want;           /* the size it was checked for */
+    size_t reserved;       /* quota held until the upload ends: what want adds */
+    struct storage_upload *next_partial;
+};
+
+static atomic_ulong upload_seq = 1;
+
+/* resumable uploads currently holding their partial file (one writer each) */
+static storage_upload *open_partials = NULL;
+static pthread_mutex_t open_partials_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int partial_claim(storage_upload *u) {
+    pthread_mutex_lock(&open_partials_mtx);
+    for (storage_upload *cur = open_partials; cur; cur = cur->next_partial) {
+        if (strcmp(cur->tmp, u->tmp) == 0) {
+            pthread_mutex_unlock(&open_partials_mtx);
+            return -1;
+        }
     }
+    u->next_partial = open_partials;
+    open_partials = u;
+    pthread_mutex_unlock(&open_partials_mtx);
     return 0;
 }
 
-char *storage_read_file(const char *username, const char *filename, size_t *len) {
+static void partial_release(storage_upload *u) {
+    pthread_mutex_lock(&open_partials_mtx);
+    storage_upload **pp = &open_partials;
+    while (*pp && *pp != u) pp = &(*pp)->next_partial;
+    if (*pp == u) *pp = u->next_partial;
+    pthread_mutex_unlock(&open_partials_mtx);
+}
+
+/* frees u, giving back the quota it held (after commit's put) */
+static void upload_free(storage_upload *u) {
+    if (u->reserved) fileindex_release(u->username, u->reserved);
+    free(u->small);
+    free(u);
+}
+
+/* names storage keeps for itself in a user directory: every dot name
+ * (.index, .fanout, temp files and partials), none of which is indexed */
+static int reserved_name(const char *base) {
+    return base[0] == '.';
+}
+
+int storage_name_reserved(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    return reserved_name(base ? base + 1 : filename);
+}
+
+/* temp files sit next to their target, so the rename stays in one
+ * directory; for a user not flat that is the name's shard */
+static void upload_tmp_dir(storage_upload *u, const char *base, char *dir, size_t n) {
+    u->sharded = fanout_layout(u->username) != FANOUT_FLAT;
+    if (u->sharded) fanout_dir(u->username, base, dir, n);
+    else snprintf(dir, n, "%s/%s", ROOT, u->username);
+}
+
+static storage_upload *upload_alloc(const char *username, const char *filename) {
     if (!username || !filename) return NULL;
     const char *base = strrchr(filename, '/');
     if (base) base++;
     else base = filename;
-    char path[512];
-    snprintf(path, sizeof(path), "%s/%s/%s", ROOT, username, base);
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        fprintf(stderr, "[storage_read_file] fopen(%s) failed: %s\n", path, strerror(errno));
+    if (reserved_name(base)) return NULL;
+    storage_upload *u = calloc(1, sizeof(storage_upload));
+    if (!u) return NULL;
+    fileindex_hash_init(&u->hash);
+    strncpy(u->username, username, sizeof(u->username)-1);
+    /* unique temp name so concurrent uploads of one file never share it */
+    unsigned long seq = atomic_fetch_add(&upload_seq, 1);
+    char dir[384];
+    upload_tmp_dir(u, base, dir, sizeof(dir));
+    snprintf(u->path, sizeof(u->path), "%s/%s/%s", ROOT, username, base);
+    snprintf(u->tmp, sizeof(u->tmp), "%s/.%s.%lu.tmp", dir, base, seq);
+    u->fd = -1;
+    u->packed = pack;
+    return u;
+}
+
+storage_upload *storage_upload_begin(const char *username, const char *filename) {
+    storage_upload *u = upload_alloc(username, filename);
+    if (!u || !dedup) return u;
+    /* plain uploads in dedup mode skip the temp file; resumable ones keep it
+     * and are chunked at commit */
+    u->cw = chunkstore_writer_new();
+    if (!u->cw) {
+        free(u);
         return NULL;
     }
-    fseek(fp, 0, SEEK_END);
-    long sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if (sz < 0) { fclose(fp); return NULL; }
-    char *buf = malloc((size_t)sz + 1);
-    if (!buf) { fclose(fp); return NULL; }
-    size_t r = fread(buf, 1, (size_t)sz, fp);
-    fclose(fp);
-    if (r != (size_t)sz) { free(buf); return NULL; }
+    return u;
+}
+
+storage_upload *storage_upload_resume(const char *username, const char *filename, size_t total) {
+    storage_upload *u = upload_alloc(username, filename);
+    if (!u) return NULL;
+    const char *base = strrchr(u->path, '/') + 1;
+    /* keyed by size so a different file under the same name starts over
+     * (as does one left flat by a user migrated since) */
+    char dir[384];
+    upload_tmp_dir(u, base, dir, sizeof(dir));
+    snprintf(u->tmp, sizeof(u->tmp), "%s/.%s.%zu.part", dir, base, total);
+    u->resumable = 1;
+    u->packed = 0;
+    u->total = total;
+    return u;
+}
+
+/* open u->tmp, making its shard directory if it has none yet */
+static int upload_tmp_open(storage_upload *u, int flags) {
+    int fd = open(u->tmp, flags, 0666);
+    if (fd < 0 && errno == ENOENT && u->sharded && fanout_mkdir(u->username, strrchr(u->path, '/') + 1) == 0)
+        fd = open(u->tmp, flags, 0666);
+    return fd;
+}
+
+/* hold what a version of u->want bytes adds over the one indexed now; a
+ * version that adds nothing needs no room, even past the quota */
+static int upload_hold(storage_upload *u) {
+    uint64_t old = fileindex_size(u->username, strrchr(u->path, '/') + 1);
+    size_t grow = u->want > old ? u->want - (size_t)old : 0;
+    if (grow <= u->reserved) return 0;
+    if (fileindex_reserve(u->username, grow - u->reserved, storage_quota(u->username)) != 0) return -1;
+    u->reserved = grow;
+    return 0;
+}
+
+int storage_upload_reserve(storage_upload *u, size_t size) {
+    if (!u || u->quota) return -1;
+    u->want = size;
+    if (upload_hold(u) != 0) return -2;
+    u->quota = 1;
+    return 0;
+}
+
+int storage_upload_open(storage_upload *u, size_t *offset) {
+    if (!u || !u->resumable || u->fd >= 0) return -1;
+    if (storage_ensure_userdir(u->username) != 0) return -1;
+    if (partial_claim(u) != 0) return -2;
+    u->fd = upload_tmp_open(u, O_WRONLY | O_CREAT | O_CLOEXEC);
+    struct stat st;
+    if (u->fd < 0 || fstat(u->fd, &st) != 0) {
+        fprintf(stderr, "[storage_upload_open] open(%s) failed: %s\n", u->tmp, strerror(errno));
+        if (u->fd >= 0) close(u->fd);
+        u->fd = -1;
+        partial_release(u);
+        return -1;
+    }
+    size_t have = (size_t)st.st_size;
+    if (have > u->total) have = 0; /* not ours: start over */
+    if (ftruncate(u->fd, (off_t)have) != 0 || lseek(u->fd, (off_t)have, SEEK_SET) < 0) {
+        close(u->fd);
+        u->fd = -1;
+        partial_release(u);
+        return -1;
+    }
+    if (offset) *offset = have;
+    return 0;
+}
+
+static int upload_open(storage_upload *u) {
+    if (u->fd >= 0) return 0;
+    if (u->resumable) return -1; /* storage_upload_open decides the offset */
+    if (storage_ensure_userdir(u->username) != 0) return -1;
+    u->fd = upload_tmp_open(u, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    if (u->fd < 0) {
+        fprintf(stderr, "[storage_upload] open(%s) failed: %s\n", u->tmp, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int upload_fd_write(storage_upload *u, const char *buf, size_t n) {
+    while (n) {
+        ssize_t w = write(u->fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "[storage_upload] write(%s) failed: %s\n", u->tmp, strerror(errno));
+            return -1;
+        }
+        buf += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+/* pack mode: an upload that outgrew PACKSTORE_FILE_MAX goes to a temp file */
+static int upload_spill(storage_upload *u) {
+    u->packed = 0;
+    int rc = upload_open(u) == 0 && upload_fd_write(u, u->small, u->small_len) == 0 ? 0 : -1;
+    free(u->small);
+    u->small = NULL;
+    u->small_len = 0;
+    return rc;
+}
+
+int storage_upload_write(storage_upload *u, const char *buf, size_t n) {
+    if (!u) return -1;
+    if (u->cw) {
+        if (chunkstore_writer_write(u->cw, buf, n) != 0) return -1;
+        fileindex_hash_update(&u->hash, buf, n);
+        return 0;
+    }
+    if (u->packed && u->small_len + n <= PACKSTORE_FILE_MAX) {
+        if (!u->small && !(u->small = malloc(PACKSTORE_FILE_MAX))) return -1;
+        memcpy(u->small + u->small_len, buf, n);
+        u->small_len += n;
+        fileindex_hash_update(&u->hash, buf, n);
+        return 0;
+    }
+    if (u->packed && upload_spill(u) != 0) return -1;
+    if (upload_open(u) != 0) return -1;
+    fileindex_hash_update(&u->hash, buf, n);
+    return upload_fd_write(u, buf, n);
+}
+
+/* write the manifest to tmp and rename it over path, releasing the chunks of
+ * the version it replaces. Consumes cw. */
+static int manifest_install(chunkstore_writer *cw, const char *tmp, const char *path) {
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "[storage_upload] open(%s) failed: %s\n", tmp, strerror(errno));
+        chunkstore_writer_abort(cw);
+        return -1;
+    }
+    if (chunkstore_writer_finish(cw, fd) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    int old = open(path, O_RDONLY | O_CLOEXEC);
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "[storage_upload] rename(%s -> %s) failed: %s\n", tmp, path, strerror(errno));
+        chunkstore_unref(fd);
+        unlink(tmp);
+        if (old >= 0) close(old);
+        close(fd);
+        return -1;
+    }
+    if (old >= 0) {
+        chunkstore_unref(old);
+        close(old);
+    }
+    close(fd);
+    return 0;
+}
+
+/* dedup mode, resumable upload: chunk the finished partial into a manifest;
+ * u->hash restarts to cover all of it */
+static int partial_ingest(storage_upload *u) {
+    int fd = open(u->tmp, O_RDONLY | O_CLOEXEC);
+    chunkstore_writer *cw = chunkstore_writer_new();
+    char *buf = malloc(256 * 1024);
+    int ok = fd >= 0 && cw && buf;
+    fileindex_hash_init(&u->hash);
+    while (ok) {
+        ssize_t r = read(fd, buf, 256 * 1024);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) ok = 0;
+        if (r <= 0) break;
+        if (chunkstore_writer_write(cw, buf, (size_t)r) != 0) ok = 0;
+        fileindex_hash_update(&u->hash, buf, (size_t)r);
+    }
+    free(buf);
+    if (fd >= 0) close(fd);
+    if (!ok) {
+        chunkstore_writer_abort(cw);
+        return -1;
+    }
+    const char *base = strrchr(u->path, '/') + 1;
+    char mtmp[512];
+    snprintf(mtmp, sizeof(mtmp), "%s/%s/.%s.%lu.tmp", ROOT, u->username, base,
+             atomic_fetch_add(&upload_seq, 1));
+    if (manifest_install(cw, mtmp, u->path) != 0) return -1;
+    unlink(u->tmp);
+    return 0;
+}
+
+/* a resumed upload only saw its own bytes: hash the partial from the start */
+static int partial_hash(storage_upload *u) {
+    int fd = open(u->tmp, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char *buf = malloc(256 * 1024);
+    fileindex_hash_init(&u->hash);
+    ssize_t r = buf ? 0 : -1;
+    while (buf && (r = read(fd, buf, 256 * 1024)) != 0) {
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) break;
+        fileindex_hash_update(&u->hash, buf, (size_t)r);
+    }
+    free(buf);
+    close(fd);
+    return r == 0 ? 0 : -1;
+}
+
+/* record the version just renamed into place; u->hash covers all of it */
+static void index_commit(storage_upload *u) {
+    struct stat st;
+    if (stat(u->path, &st) != 0) return;
+    fileindex_put(u->username, strrchr(u->path, '/') + 1, u->hash.len, mtime_ns(&st),
+                  fileindex_hash_final(&u->hash));
+}
+
+/* pack mode: append the upload held in u->small to the user's segment. A
+ * packed name has no plain file, so only a first pack needs the unlink. */
+static int pack_commit(storage_upload *u) {
+    const char *base = strrchr(u->path, '/') + 1;
+    uint64_t hash = fileindex_hash_final(&u->hash);
+    int64_t mtime = 0;
+    int layout;
+    fanout_user *fu = fanout_lock(u->username, &layout);
+    int rc = packstore_put(u->username, base, u->small, u->small_len, hash, &mtime);
+    if (rc == 0 && plain_unlink(u->username, base, layout) != 0 && errno != ENOENT)
+        fprintf(stderr, "[storage_upload] unlink(%s) failed: %s\n", u->path, strerror(errno));
+    fanout_unlock(fu);
+    if (rc < 0) {
+        fprintf(stderr, "[storage_upload] packing %s failed: %s\n", u->path, strerror(errno));
+        return -1;
+    }
+    fileindex_put(u->username, base, u->small_len, mtime, hash);
+    return 0;
+}
+
+/* pack mode, resumable upload of at most PACKSTORE_FILE_MAX bytes: pack
+ * the finished partial like an upload held in memory, then drop it */
+static int partial_pack(storage_upload *u) {
+    int fd = open(u->tmp, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (!u->small && !(u->small = malloc(PACKSTORE_FILE_MAX))) {
+        close(fd);
+        return -1;
+    }
+    u->small_len = 0;
+    ssize_t r;
+    while (u->small_len < PACKSTORE_FILE_MAX &&
+           (r = read(fd, u->small + u->small_len, PACKSTORE_FILE_MAX - u->small_len)) != 0) {
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) break;
+        u->small_len += (size_t)r;
+    }
+    close(fd);
+    if (u->small_len != u->total) {
+        fprintf(stderr, "[storage_upload] short partial %s\n", u->tmp);
+        return -1;
+    }
+    fileindex_hash_init(&u->hash);
+    fileindex_hash_update(&u->hash, u->small, u->small_len);
+    if (pack_commit(u) != 0) return -1;
+    unlink(u->tmp);
+    return 0;
+}
+
+/* pack mode: a plain version was renamed over a name that may be packed */
+static int pack_drop(storage_upload *u) {
+    if (!pack || packstore_remove(u->username, strrchr(u->path, '/') + 1) >= 0) return 0;
+    fprintf(stderr, "[storage_upload] unpacking %s failed: %s\n", u->path, strerror(errno));
+    return -1;
+}
+
+/* rename the finished temp file to where the user's layout keeps the name
+ * now (u->path follows). A migrating user's flat copy goes with it. */
+static int upload_install(storage_upload *u) {
+    char base[256], path[512];
+    snprintf(base, sizeof(base), "%s", strrchr(u->path, '/') + 1);
+    int layout;
+    fanout_user *fu = fanout_lock(u->username, &layout);
+    plain_path(u->username, base, layout, path, sizeof(path));
+    int rc = rename(u->tmp, path);
+    if (rc != 0 && errno == ENOENT && layout != FANOUT_FLAT && fanout_mkdir(u->username, base) == 0)
+        rc = rename(u->tmp, path);
+    if (rc != 0) {
+        fprintf(stderr, "[storage_upload] rename(%s -> %s) failed: %s\n", u->tmp, path, strerror(errno));
+    } else if (layout == FANOUT_MIGRATING) {
+        plain_path(u->username, base, FANOUT_FLAT, u->path, sizeof(u->path));
+        if (unlink(u->path) != 0 && errno != ENOENT)
+            fprintf(stderr, "[storage_upload] unlink(%s) failed: %s\n", u->path, strerror(errno));
+    }
+    fanout_unlock(fu);
+    if (rc == 0) memcpy(u->path, path, sizeof(u->path));
+    return rc;
+}
+
+int storage_upload_commit(storage_upload *u) {
+    if (!u) return -1;
+    /* under the file lock the version being replaced is settled: the
+     * growth over it must still fit (it may have shrunk or gone) */
+    if (u->quota && upload_hold(u) != 0) {
+        storage_upload_close(u);
+        return -3;
+    }
+    if (u->cw) {
+        int rc = storage_ensure_userdir(u->username);
+        if (rc != 0) chunkstore_writer_abort(u->cw);
+        else rc = manifest_install(u->cw, u->tmp, u->path);
+        if (rc == 0) index_commit(u);
+        u->cw = NULL;
+        upload_free(u);
+        return rc;
+    }
+    if (u->packed) {
+        int rc = pack_commit(u);
+        upload_free(u);
+        return rc;
+    }
+    /* empty uploads never wrote a chunk */
+    if (upload_open(u) != 0) { storage_upload_abort(u); return -1; }
+    int rc = close(u->fd);
+    u->fd = -1;
+    if (rc != 0) {
+        fprintf(stderr, "[storage_upload] close(%s) failed: %s\n", u->tmp, strerror(errno));
+        storage_upload_abort(u);
+        return -1;
+    }
+    if (pack && u->resumable && u->total <= PACKSTORE_FILE_MAX) {
+        /* the partial stays for a retry if packing fails */
+        int rc = partial_pack(u);
+        partial_release(u);
+        upload_free(u);
+        return rc;
+    }
+    if (dedup && u->resumable) {
+        /* the partial stays for a retry if chunking fails */
+        int rc = partial_ingest(u);
+        if (rc == 0) index_commit(u);
+        partial_release(u);
+        upload_free(u);
+        return rc;
+    }
+    if (u->resumable && u->hash.len != u->total && partial_hash(u) != 0) {
+        fprintf(stderr, "[storage_upload] read(%s) failed: %s\n", u->tmp, strerror(errno));
+        storage_upload_abort(u);
+        return -1;
+    }
+    if (upload_install(u) != 0) {
+        storage_upload_abort(u);
+        return -1;
+    }
+    rc = pack_drop(u);
+    index_commit(u);
+    if (u->resumable) partial_release(u);
+    upload_free(u);
+    return rc;
+}
+
+void storage_upload_abort(storage_upload *u) {
+    if (!u) return;
+    if (u->cw) chunkstore_writer_abort(u->cw);
+    if (u->fd >= 0) {
+        close(u->fd);
+        remove(u->tmp);
+    } else if (!u->resumable) {
+        /* commit may already have closed it */
+        unlink(u->tmp);
+    }
+    if (u->resumable) partial_release(u);
+    upload_free(u);
+}
+
+void storage_upload_close(storage_upload *u) {
+    if (!u) return;
+    if (!u->resumable) {
+        storage_upload_abort(u);
+        return;
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+        partial_release(u);
+    }
+    upload_free(u);
+}
+
+int storage_write_blob(const char *username, const char *filename, const char *buf, size_t n) {
+    storage_upload *u = storage_upload_begin(username, filename);
+    if (!u) return -1;
+    if (storage_upload_write(u, buf, n) != 0) {
+        storage_upload_abort(u);
+        return -1;
+    }
+    return storage_upload_commit(u);
+}
+
+/* n bytes from pos of a version opened by open_version; 0, or -1 if short */
+static int version_read(int fd, chunkstore_reader *chunks, size_t off, void *buf, size_t n, size_t pos) {
+    if (chunks) return chunkstore_reader_pread(chunks, buf, n, pos) == (ssize_t)n ? 0 : -1;
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(fd, (char *)buf + got, n - got, (off_t)(off + pos + got));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+char *storage_read_file(const char *username, const char *filename, size_t *len) {
+    size_t off = 0, sz = 0;
+    int fd;
+    chunkstore_reader *chunks;
+    if (storage_open_file(username, filename, &fd, &chunks, &off, &sz) != 0) return NULL;
+    char *buf = malloc(sz + 1);
+    int rc = buf ? version_read(fd, chunks, off, buf, sz, 0) : -1;
+    if (fd >= 0) close(fd);
+    chunkstore_reader_close(chunks);
+    if (rc != 0) { free(buf); return NULL; }
     buf[sz] = '\0';
-    if (len) *len = (size_t)sz;
+    if (len) *len = sz;
     return buf;
 }
 
+/* identifies one stored version: a commit always renames in a new inode */
+static void version_token(const struct stat *st, char *token) {
+    snprintf(token, STORAGE_TOKEN_LEN, "%llx-%llx-%llx", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + (unsigned long long)st->st_mtim.tv_nsec,
+             (unsigned long long)st->st_size);
+}
+
+/* a packed version has no inode of its own; compaction moves it unchanged */
+static void pack_token(const packstore_loc *loc, char *token) {
+    snprintf(token, STORAGE_TOKEN_LEN, "p%llx-%llx-%llx", (unsigned long long)loc->hash,
+             (unsigned long long)loc->mtime_ns, (unsigned long long)loc->len);
+}
+
+static const char *base_name(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    return base ? base + 1 : filename;
+}
+
+/* open the stored version for reading: bytes [*off, *off + *len) of *fd,
+ * or in dedup mode all of *chunks with *fd -1. token (optional) names that
+ * version. */
+static int open_version(const char *username, const char *filename, int *fd, chunkstore_reader **chunks,
+                        size_t *off, size_t *len, char *token) {
+    *fd = -1;
+    *chunks = NULL;
+    *off = 0;
+    if (!username || !filename) return -1;
+    if (pack) {
+        packstore_loc loc;
+        int rc = packstore_open(username, base_name(filename), &loc);
+        if (rc < 0) return -1;
+        if (rc == 0) {
+            if (token) pack_token(&loc, token);
+            *fd = loc.fd;
+            *off = (size_t)loc.off;
+            if (len) *len = (size_t)loc.len;
+            return 0;
+        }
+    }
+    char path[512];
+    int f = plain_open(username, base_name(filename), path, sizeof(path));
+    if (f < 0) {
+        fprintf(stderr, "[storage_open_file] open(%s) failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(f, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(f);
+        return -1;
+    }
+    if (token) version_token(&st, token);
+    if (dedup) {
+        /* the chunks are pinned: later overwrites or deletes cannot affect it */
+        *chunks = chunkstore_reader_open(f, len);
+        close(f);
+        return *chunks ? 0 : -1;
+    }
+    if (len) *len = (size_t)st.st_size;
+    *fd = f;
+    return 0;
+}
+
+int storage_open_file(const char *username, const char *filename, int *fd, chunkstore_reader **chunks,
+                      size_t *off, size_t *len) {
+    return open_version(username, filename, fd, chunks, off, len, NULL);
+}
+
+/* token of the version stored now, "" if there is none */
+static void current_token(const char *username, const char *filename, char *token) {
+    token[0] = '\0';
+    packstore_loc loc;
+    if (pack && packstore_open(username, base_name(filename), &loc) == 0) {
+        pack_token(&loc, token);
+        close(loc.fd);
+        return;
+    }
+    char path[512];
+    struct stat st;
+    int fd = plain_open(username, base_name(filename), path, sizeof(path));
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0) version_token(&st, token);
+    close(fd);
+}
+
+char *storage_signatures(const char *username, const char *filename, size_t *outlen) {
+    char token[STORAGE_TOKEN_LEN];
+    size_t base = 0, len = 0;
+    int fd;
+    chunkstore_reader *chunks;
+    if (open_version(username, filename, &fd, &chunks, &base, &len, token) != 0) return NULL;
+    size_t block = delta_block_size(len);
+    size_t count = (len + block - 1) / block;
+    size_t cap = 128 + count * DELTA_SIG_LEN;
+    char *out = malloc(cap);
+    size_t bufcap = block * 16;
+    unsigned char *buf = malloc(bufcap);
+    if (!out || !buf) {
+        free(out);
+        free(buf);
+        if (fd >= 0) close(fd);
+        chunkstore_reader_close(chunks);
+        return NULL;
+    }
+    size_t n = (size_t)snprintf(out, cap, "%s %zu %zu %zu\n", token, block, len, count);
+    size_t off = 0;
+    while (off < len) {
+        size_t want = len - off < bufcap ? len - off : bufcap;
+        if (version_read(fd, chunks, base, buf, want, off) != 0) {
+            fprintf(stderr, "[storage_signatures] short read on %s\n", filename);
+            free(out);
+            free(buf);
+            if (fd >= 0) close(fd);
+            chunkstore_reader_close(chunks);
+            return NULL;
+        }
+        for (size_t b = 0; b < want; b += block) {
+            size_t blen = want - b < block ? want - b : block;
+            unsigned char *sig = (unsigned char *)out + n;
+            delta_put_u32(sig, delta_weak(buf + b, blen));
+            delta_strong(buf + b, blen, sig + 4);
+            n += DELTA_SIG_LEN;
+        }
+        off += want;
+    }
+    free(buf);
+    if (fd >= 0) close(fd);
+    chunkstore_reader_close(chunks);
+    if (outlen) *outlen = n;
+    return out;
+}
+
+struct storage_patch {
+    storage_upload *out;    /* the new version, committed with temp+rename */
+    char username[64];
+    char filename[256];
+    char token[STORAGE_TOKEN_LEN]; /* version the delta was computed against */
+    int base_fd;            /* opened by the first copy op */
+    chunkstore_reader *base_chunks; /* dedup mode: the base, instead of base_fd */
+    size_t base_off;        /* where the base starts in base_fd */
+    size_t base_len;
+    size_t block;
+    size_t newsize;
+    size_t written;
+    unsigned char op[DELTA_OP_HDR]; /* op header split across writes */
+    size_t op_len;
+    size_t literal_left;
+};
+
+storage_patch *storage_patch_begin(const char *username, const char *filename, const char *base_token,
+                                   size_t block, size_t newsize) {
+    if (!username || !filename || !base_token || block < DELTA_MIN_BLOCK || block > DELTA_MAX_BLOCK) return NULL;
+    storage_patch *p = calloc(1, sizeof(storage_patch));
+    if (!p) return NULL;
+    p->out = storage_upload_begin(username, filename);
+    if (!p->out) {
+        free(p);
+        return NULL;
+    }
+    strncpy(p->username, username, sizeof(p->username)-1);
+    strncpy(p->filename, filename, sizeof(p->filename)-1);
+    strncpy(p->token, base_token, sizeof(p->token)-1);
+    p->base_fd = -1;
+    p->block = block;
+    p->newsize = newsize;
+    return p;
+}
+
+int storage_patch_reserve(storage_patch *p) {
+    return p ? storage_upload_reserve(p->out, p->newsize) : -1;
+}
+
+static int patch_emit(storage_patch *p, const void *buf, size_t n) {
+    if (n > p->newsize - p->written) return -1; /* delta longer than announced */
+    if (storage_upload_write(p->out, buf, n) != 0) return -1;
+    p->written += n;
+    return 0;
+}
+
+static int patch_copy(storage_patch *p, uint32_t first, uint32_t count) {
+    if (p->base_fd < 0 && !p->base_chunks) {
+        char token[STORAGE_TOKEN_LEN];
+        if (open_version(p->username, p->filename, &p->base_fd, &p->base_chunks, &p->base_off, &p->base_len,
+                         token) != 0 || strcmp(token, p->token) != 0)
+            return -2;
+    }
+    size_t nblocks = (p->base_len + p->block - 1) / p->block;
+    if (count == 0 || first >= nblocks || count > nblocks - first) return -1;
+    size_t off = (size_t)first * p->block;
+    size_t end = ((size_t)first + count) * p->block;
+    if (end > p->base_len) end = p->base_len;
+    char buf[64 * 1024];
+    while (off < end) {
+        size_t want = end - off < sizeof(buf) ? end - off : sizeof(buf);
+        if (version_read(p->base_fd, p->base_chunks, p->base_off, buf, want, off) != 0 ||
+            patch_emit(p, buf, want) != 0)
+            return -1;
+        off += want;
+    }
+    return 0;
+}
+
+int storage_patch_write(storage_patch *p, const char *buf, size_t n) {
+    if (!p) return -1;
+    while (n) {
+        if (p->literal_left) {
+            size_t k = n < p->literal_left ? n : p->literal_left;
+            if (patch_emit(p, buf, k) != 0) return -1;
+            buf += k;
+            n -= k;
+            p->literal_left -= k;
+            continue;
+        }
+        p->op[p->op_len++] = (unsigned char)*buf++;
+        n--;
+        if (p->op[0] != DELTA_OP_COPY && p->op[0] != DELTA_OP_LITERAL) return -1;
+        size_t need = p->op[0] == DELTA_OP_LITERAL ? 5 : DELTA_OP_HDR;
+        if (p->op_len < need) continue;
+        p->op_len = 0;
+        if (p->op[0] == DELTA_OP_LITERAL) {
+            p->literal_left = delta_get_u32(p->op + 1);
+        } else {
+            int rc = patch_copy(p, delta_get_u32(p->op + 1), delta_get_u32(p->op + 5));
+            if (rc != 0) return rc;
+        }
+    }
+    return 0;
+}
+
+int storage_patch_commit(storage_patch *p) {
+    if (!p) return -1;
+    if (p->op_len || p->literal_left || p->written != p->newsize) {
+        storage_patch_abort(p);
+        return -1;
+    }
+    /* the caller holds the file lock: nothing can replace the base after this */
+    char token[STORAGE_TOKEN_LEN];
+    current_token(p->username, p->filename, token);
+    if (strcmp(token, p->token) != 0) {
+        storage_patch_abort(p);
+        return -2;
+    }
+    int rc = storage_upload_commit(p->out);
+    p->out = NULL;
+    storage_patch_abort(p);
+    return rc;
+}
+
+void storage_patch_abort(storage_patch *p) {
+    if (!p) return;
+    if (p->out) storage_upload_abort(p->out);
+    if (p->base_fd >= 0) close(p->base_fd);
+    chunkstore_reader_close(p->base_chunks);
+    free(p);
+}
+
 int storage_delete_file(const char *username, const char *filename) {
     if (!username || !filename) return -1;
     const char *base = strrchr(filename, '/');
     if (base) base++;
     else base = filename;
+    if (reserved_name(base)) return -1;
     char path[512];
     snprintf(path, sizeof(path), "%s/%s/%s", ROOT, username, base);
-    if (unlink(path) == 0) return 0;
+    int layout;
+    fanout_user *fu = fanout_lock(username, &layout);
+    int packed = pack ? packstore_remove(username, base) : 1;
+    if (packed < 0) {
+        fanout_unlock(fu);
+        return -1;
+    }
+    if (packed == 0) {
+        /* a crash inside a commit can leave a plain copy behind the packed
+         * one; it must not come back now */
+        if (plain_unlink(username, base, layout) != 0 && errno != ENOENT)
+            fprintf(stderr, "[storage_delete_file] unlink(%s) failed: %s\n", path, strerror(errno));
+        fanout_unlock(fu);
+        fileindex_remove(username, base);
+        return 0;
+    }
+    /* keep the manifest open so its chunks can be released after the unlink
+     * (dedup mode is always flat) */
+    int fd = dedup ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    int rc = plain_unlink(username, base, layout);
+    fanout_unlock(fu);
+    if (rc == 0) {
+        fileindex_remove(username, base);
+        if (fd >= 0) {
+            chunkstore_unref(fd);
+            close(fd);
+        }
+        return 0;
+    }
     fprintf(stderr, "[storage_delete_file] unlink(%s) failed: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
     return -1;
 }
 
-char *storage_list_files(const char *username) {
-    if (!username) return NULL;
+char *storage_list_files(const char *username, const char *prefix, const char *after, size_t limit,
+                         size_t *len, char *next) {
+    /* the index answers without touching the directory */
+    return fileindex_list(username, prefix, after, limit, len, next);
+}
+
+int storage_sync(const storage_sync_item *items, size_t n) {
+    /* chunks live all over .chunks/, and past a few files one syncfs is
+     * cheaper than an fsync each */
+    if (dedup || n > STORAGE_SYNC_FILES) {
+        int fd = open(ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        int rc = syncfs(fd);
+        close(fd);
+        return rc == 0 ? 1 : -1;
+    }
     char path[512];
-    snprintf(path, sizeof(path), "%s/%s", ROOT, username);
-    DIR *d = opendir(path);
-    if (!d) {
-        fprintf(stderr, "[storage_list_files] opendir(%s) failed: %s\n", path, strerror(errno));
-        return NULL;
+    for (size_t i = 0; i < n; ++i) {
+        /* a file deleted (or packed) since counts as synced */
+        int fd = plain_open(items[i].username, base_name(items[i].filename), path, sizeof(path));
+        if (fd < 0 && errno != ENOENT) return -1;
+        if (fd < 0) continue;
+        int rc = fsync(fd);
+        close(fd);
+        if (rc != 0) return -1;
     }
-    size_t cap = 4096;
-    char *out = malloc(cap);
-    if (!out) { closedir(d); return NULL; }
-    out[0] = '\0';
-    size_t len = 0;
-    struct dirent *e;
-    while ((e = readdir(d)) != NULL) {
-        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
-        char fpath[512];
-        snprintf(fpath, sizeof(fpath), "%s/%s", path, e->d_name);
-        struct stat st;
-        if (stat(fpath, &st) == 0) {
-            char line[512];
-            int n = snprintf(line, sizeof(line), "%s %lld\n", e->d_name, (long long)st.st_size);
-            if (len + (size_t)n + 1 > cap) {
-                cap *= 2;
-                char *tmp = realloc(out, cap);
-                if (!tmp) { free(out); closedir(d); return NULL; }
-                out = tmp;
-            }
-            memcpy(out + len, line, (size_t)n);
-            len += (size_t)n;
-            out[len] = '\0';
+    /* then each directory once, for the renames and unlinks: the user's
+     * unless sharded, and the file's shard unless flat */
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = 0;
+        while (j < i && strcmp(items[j].username, items[i].username) != 0) j++;
+        int layout = fanout_layout(items[i].username);
+        if (j == i && layout != FANOUT_SHARDED) {
+            snprintf(path, sizeof(path), "%s/%s", ROOT, items[i].username);
+            if (fsync_path(path) != 0) return -1;
+        }
+        if (j == i && packstore_sync(items[i].username) != 0) return -1;
+        if (layout == FANOUT_FLAT) continue;
+        char dir[512];
+        fanout_dir(items[i].username, base_name(items[i].filename), path, sizeof(path));
+        for (j = 0; j < i; ++j) {
+            if (strcmp(items[j].username, items[i].username) != 0) continue;
+            fanout_dir(items[j].username, base_name(items[j].filename), dir, sizeof(dir));
+            if (strcmp(dir, path) == 0) break;
+        }
+        /* the shard, and .fanout in case the shard was made for it */
+        for (int up = 0; up < 2 && j == i; ++up) {
+            if (fsync_path(path) != 0) return -1;
+            *strrchr(path, '/') = '\0';
         }
     }
-    closedir(d);
-    return out;
-}
\ No newline at end of file
+    return 0;
+}
+
+void storage_get_usage(const char *username, storage_usage *us) {
+    fileindex_usage fu;
+    fileindex_get_usage(username, &fu);
+    us->bytes = fu.bytes;
+    us->files = fu.files;
+    us->reserved = fu.reserved;
+    us->limit = storage_quota(username);
+}
+
+void storage_get_stats(storage_stats *st) {
+    memset(st, 0, sizeof(*st));
+    fileindex_stats fi;
+    fileindex_get_stats(&fi);
+    st->index_users = fi.users;
+    st->index_entries = fi.entries;
+    st->index_appends = fi.appends;
+    st->index_compactions = fi.compactions;
+    st->index_rescans = fi.rescans;
+    if (pack) {
+        packstore_stats ps;
+        packstore_get_stats(&ps);
+        st->pack = 1;
+        st->pack_files = ps.files;
+        st->pack_segments = ps.segments;
+        st->pack_live_bytes = ps.live_bytes;
+        st->pack_dead_bytes = ps.dead_bytes;
+        st->pack_compactions = ps.compactions;
+    }
+    if (!dedup) {
+        /* users sharded before count even with fanout off */
+        fanout_stats fs;
+        fanout_get_stats(&fs);
+        st->fanout = fs.enabled;
+        st->fanout_sharded = fs.sharded;
+        st->fanout_migrating = fs.migrating;
+        st->fanout_moved = fs.moved;
+    }
+    if (!dedup) return;
+    chunkstore_stats cs;
+    chunkstore_get_stats(&cs);
+    st->dedup = 1;
+    st->chunks = cs.chunks;
+    st->logical_bytes = cs.logical_bytes;
+    st->stored_bytes = cs.stored_bytes;
+}
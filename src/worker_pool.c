@@ -1,144 +1,438 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np */
 #include "worker_pool.h"
 #include "queue.h"
 #include "server_types.h"
 #include "storage.h"
+#include "chunkstore.h"
+#include "client_pool.h"
+#include "lzblock.h"
+#include "filecache.h"
+#include "durable.h"
+#include "util.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
-/* worker running state is driven by queue_close; no atomic needed */
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* File-lock table: one reader/writer lock per file in use. DOWNLOAD takes
+ * it shared, so downloads of one file run in parallel; commits and deletes
+ * take it exclusive. Entries live in a hash table split into FL_SHARDS
+ * shards, each with its own mutex, so lookups of different files rarely
+ * touch the same lock. */
+#define FL_SHARDS 64
+#define FL_BUCKETS 64 /* per shard */
 
-/* Simple file-lock map */
 typedef struct file_lock_entry {
     char key[512]; /* username/filename */
-    pthread_mutex_t mtx;
+    uint64_t hash;
+    pthread_rwlock_t rw;
     struct file_lock_entry *next;
-    int ref;
+    int ref;       /* guarded by the shard mutex */
 } file_lock_entry;
 
-static file_lock_entry *file_locks = NULL;
-static pthread_mutex_t file_locks_mtx = PTHREAD_MUTEX_INITIALIZER;
+typedef struct fl_shard {
+    _Alignas(64) pthread_mutex_t mtx;
+    file_lock_entry *buckets[FL_BUCKETS];
+} fl_shard;
 
-static file_lock_entry *fl_get_or_create(const char *username, const char *filename) {
-    char key[512];
-    snprintf(key, sizeof(key), "%s/%s", username, filename);
-    pthread_mutex_lock(&file_locks_mtx);
-    file_lock_entry *cur = file_locks;
-    while (cur) {
-        if (strcmp(cur->key, key) == 0) { cur->ref++; pthread_mutex_unlock(&file_locks_mtx); return cur; }
-        cur = cur->next;
+static fl_shard fl_shards[FL_SHARDS];
+static pthread_rwlockattr_t fl_rwattr;
+static pthread_once_t fl_once = PTHREAD_ONCE_INIT;
+
+static void fl_init(void) {
+    for (size_t i = 0; i < FL_SHARDS; ++i) pthread_mutex_init(&fl_shards[i].mtx, NULL);
+    /* a steady stream of downloads must not starve an upload's commit */
+    pthread_rwlockattr_init(&fl_rwattr);
+    pthread_rwlockattr_setkind_np(&fl_rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+}
+
+static fl_shard *fl_shard_of(uint64_t h) {
+    return &fl_shards[h % FL_SHARDS];
+}
+
+static file_lock_entry **fl_bucket(fl_shard *s, uint64_t h) {
+    return &s->buckets[(h / FL_SHARDS) % FL_BUCKETS];
+}
+
+/* "<user>/<file>" names one stored file: storage keeps only the base name.
+ * Used for both the file lock and the file cache. */
+static void file_key(const char *username, const char *filename, char *key, size_t n) {
+    const char *base = strrchr(filename, '/');
+    snprintf(key, n, "%s/%s", username, base ? base + 1 : filename);
+}
+
+/* the lock entry for key (see file_key), created on first use */
+static file_lock_entry *fl_get_or_create(const char *key) {
+    uint64_t h = name_hash(key);
+    fl_shard *s = fl_shard_of(h);
+    file_lock_entry **bucket = fl_bucket(s, h);
+    pthread_mutex_lock(&s->mtx);
+    for (file_lock_entry *cur = *bucket; cur; cur = cur->next) {
+        if (cur->hash == h && strcmp(cur->key, key) == 0) {
+            cur->ref++;
+            pthread_mutex_unlock(&s->mtx);
+            return cur;
+        }
     }
     file_lock_entry *n = calloc(1, sizeof(file_lock_entry));
     strncpy(n->key, key, sizeof(n->key)-1);
-    pthread_mutex_init(&n->mtx, NULL);
+    n->hash = h;
+    pthread_rwlock_init(&n->rw, &fl_rwattr);
     n->ref = 1;
-    n->next = file_locks;
-    file_locks = n;
-    pthread_mutex_unlock(&file_locks_mtx);
+    n->next = *bucket;
+    *bucket = n;
+    pthread_mutex_unlock(&s->mtx);
     return n;
 }
 
 static void fl_release(file_lock_entry *e) {
-    pthread_mutex_lock(&file_locks_mtx);
-    e->ref--;
-    if (e->ref == 0) {
-        /* remove from list */
-        file_lock_entry **pp = &file_locks;
-        while (*pp && *pp != e) pp = &(*pp)->next;
-        if (*pp == e) {
-            *pp = e->next;
-        }
-        pthread_mutex_unlock(&file_locks_mtx);
-        pthread_mutex_destroy(&e->mtx);
-        free(e);
+    fl_shard *s = fl_shard_of(e->hash);
+    pthread_mutex_lock(&s->mtx);
+    if (--e->ref > 0) {
+        pthread_mutex_unlock(&s->mtx);
         return;
     }
-    pthread_mutex_unlock(&file_locks_mtx);
+    file_lock_entry **pp = fl_bucket(s, e->hash);
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    pthread_mutex_unlock(&s->mtx);
+    pthread_rwlock_destroy(&e->rw);
+    free(e);
 }
 
-/* worker threads */
-static pthread_t *worker_threads = NULL;
-static size_t worker_count = 0;
-static queue_t *task_queue_global = NULL;
-static unsigned long task_id_counter = 1;
-static pthread_mutex_t task_id_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* worker threads. Tasks run in two lanes: fast (LIST, DELETE, DOWNLOAD,
+ * which only opens the file while the reactor streams it, upload setup and
+ * small uploads) and bulk (upload chunks, large final chunks, PATCH, SIGS).
+ * Each worker owns one queue per lane; worker_pool_submit routes a task to
+ * the queue picked by its file key, so one file's tasks land on the same
+ * worker (warm file-lock and cache shards). The first wp_reserved workers
+ * run only fast tasks; the rest take at most WP_FAST_WEIGHT fast tasks in a
+ * row while bulk ones wait. An idle worker drains its own queues, then
+ * steals from busy workers, and parks only when nothing it may run is
+ * pending anywhere.
+ *
+ * In front of the worker queues sits a fair-share stage keyed by user.
+ * Submitted tasks wait in their user's per-lane backlog; only a few per
+ * worker (the ready stage) are in the worker queues at once, and those are
+ * admitted deficit-round-robin across users, weighted by payload size.
+ * While several users are active each may hold at most an equal part of
+ * the ready stage and of the backlog slots; new work over a user's share
+ * is refused (the reactor answers ERR serverbusy) instead of blocking the
+ * reactor, so one heavy user cannot monopolise worker time or make anyone
+ * else's submits wait. Independently of the shares, a user may have at most
+ * wp_user_cap tasks queued or running across all its sessions.
+ *
+ * The pool runs between a minimum and maximum number of workers. A scaler
+ * thread samples the backlog, queue wait and utilisation every tick, adds
+ * a worker when tasks wait, and retires the newest one after a sustained
+ * quiet spell; a retiring worker drains its own queues before it exits. */
+enum { LANE_FAST, LANE_BULK, LANES };
+static const char *lane_names[LANES] = { "fast", "bulk" };
+
+#define WP_SPIN 16                  /* empty scans (with sched_yield) before parking */
+#define WP_FAST_WEIGHT 4            /* fast tasks run per bulk task when both wait */
+#define WP_SMALL_UPLOAD (64 * 1024) /* final upload chunks up to this are fast */
+#define WP_LAT_BUCKETS 256          /* 4 per power of two of microseconds */
+#define WP_READY_PER_WORKER 2       /* admitted tasks (queued or running) per worker */
+#define WP_DRR_QUANTUM 8            /* credit per DRR round, in wp_cost units */
+#define WP_TENANT_BUCKETS 64
+#define WP_SCALE_TICK_MS 100        /* scaler sampling period */
+#define WP_GROW_WAIT_MS 20          /* average queue wait that adds a worker */
+#define WP_SHRINK_TICKS 50          /* quiet ticks before a worker is retired */
+#define WP_SHRINK_BUSY 50           /* ... while under this % of workers were busy */
+#define WP_SCALE_COOLDOWN 5         /* ticks after a change before the next */
+#define WP_RETRY_MIN_MS 100         /* retry-after hint bounds */
+#define WP_RETRY_MAX_MS 5000
+
+enum { WS_OFF, WS_RUN, WS_RETIRE };
+
+typedef struct wp_worker {
+    pthread_t thread;
+    int joinable;            /* thread created and not yet joined; scaler only */
+    atomic_int state;        /* WS_*; RETIRE drains own queues, then OFF */
+    queue_t *q[LANES];
+    pthread_cond_t wake;
+    int sleeping;            /* parked on wake; guarded by wp_park_mtx */
+    int fast_only;           /* reserved for the fast lane */
+    unsigned fast_run;       /* fast tasks since the last bulk one; own thread only */
+    atomic_int running;      /* in worker_do_task: its queues are fair game */
+    atomic_ullong tasks;     /* tasks run */
+    atomic_ullong steals;    /* of those, taken from another worker's queue */
+} wp_worker;
+
+static wp_worker *workers = NULL;
+static size_t worker_min = 0, worker_max = 0; /* workers has worker_max slots */
+static size_t wp_active = 0;  /* slots [0, wp_active) take new tasks; wp_fair_mtx */
+static size_t wp_reserved = 0;
+static atomic_size_t wp_pending[LANES]; /* pushed but not yet popped, all queues */
+static atomic_int wp_closed = 0;
+static atomic_int wp_sleepers = 0;
+static pthread_mutex_t wp_park_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* submit-to-completion latency histograms */
+static atomic_ullong wp_latency[LANES][WP_LAT_BUCKETS];
+
+/* fair-share stage; everything below is guarded by wp_fair_mtx */
+typedef struct wp_tenant {
+    char user[64];
+    struct wp_tenant *chain;            /* hash bucket */
+    Task *head[LANES], *tail[LANES];    /* backlog, linked through Task.next */
+    size_t queued[LANES];               /* backlog length */
+    size_t admitted[LANES];             /* in the ready stage */
+    long deficit[LANES];                /* DRR credit */
+    int in_ring[LANES];
+    struct wp_tenant *ring_next[LANES];
+} wp_tenant;
+
+typedef struct wp_ring {
+    wp_tenant *head, *tail;
+    size_t len;
+} wp_ring;
+
+static pthread_mutex_t wp_fair_mtx = PTHREAD_MUTEX_INITIALIZER;
+static wp_tenant *wp_tenants[WP_TENANT_BUCKETS];
+static wp_ring wp_rings[LANES];     /* tenants with a backlog, in DRR order */
+static size_t wp_busy_tenants = 0;  /* tenants with tasks queued or admitted */
+static size_t wp_ready[LANES];      /* admitted tasks, all tenants */
+static size_t wp_ready_cap[LANES];
+static size_t wp_backlog_cap = 0;   /* per lane */
+static size_t wp_backlog[LANES];
+static uint64_t wp_refused = 0;
+static size_t wp_user_cap = 0;      /* tasks per user, all lanes; 0 = no limit */
+static uint64_t wp_user_limited = 0; /* of wp_refused, over wp_user_cap */
+/* submitted and not yet finished; the pool is done when closed and 0 */
+static atomic_size_t wp_unfinished = 0;
+
+static void wp_finish(wp_tenant *tn, int lane);
+
+/* scaler */
+static pthread_t wp_scaler;
+static pthread_mutex_t wp_scale_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wp_scale_cv = PTHREAD_COND_INITIALIZER; /* stop */
+static int wp_scale_stop = 0;
+static atomic_ullong wp_wait_ns = 0; /* queue wait of tasks started this tick */
+static atomic_ullong wp_wait_n = 0;
+static uint64_t wp_scale_ups = 0, wp_scale_downs = 0; /* wp_fair_mtx */
 
-static unsigned long next_task_id(void) {
-    pthread_mutex_lock(&task_id_mtx);
-    unsigned long v = task_id_counter++;
-    pthread_mutex_unlock(&task_id_mtx);
-    return v;
+/* append one chunk to the upload, decoding it first if it holds lzblock
+ * frames; -2 if a frame is corrupt */
+static int upload_write(Task *t) {
+    if (!t->framed) return storage_upload_write(t->upload, t->upload_data, t->filesize);
+    char raw[LZBLOCK_MAX];
+    size_t off = 0;
+    while (off < t->filesize) {
+        size_t n, payload;
+        if (t->filesize - off < LZBLOCK_HDR || lzblock_frame_header(t->upload_data + off, &n, &payload) != 0 ||
+            payload > t->filesize - off - LZBLOCK_HDR)
+            return -2;
+        long got = lzblock_frame_decode(t->upload_data + off, LZBLOCK_HDR + payload, raw);
+        if (got < 0) return -2;
+        if (storage_upload_write(t->upload, raw, (size_t)got) != 0) return -1;
+        off += LZBLOCK_HDR + payload;
+    }
+    return 0;
 }
 
-static void deliver_result_to_session(ClientSession *sess, TaskResult *res) {
-    pthread_mutex_lock(&sess->resp_lock);
-    /* if session closed, free result */
-    if (!sess->alive) {
-        pthread_mutex_unlock(&sess->resp_lock);
-        if (res->payload) free(res->payload);
-        free(res);
-        return;
+/* filecache_read_fn over a dedup file's chunks */
+static ssize_t chunk_read(void *ctx, void *buf, size_t n, size_t off) {
+    return chunkstore_reader_pread(ctx, buf, n, off);
+}
+
+slab_cache task_slab = SLAB_CACHE_INIT("task", sizeof(Task));
+slab_cache task_result_slab = SLAB_CACHE_INIT("task_result", sizeof(TaskResult));
+
+/* a task that finds no result to answer with is failed with the worker's
+ * spare, so the reactor still sees it finish; it only waits when the spare
+ * is gone too */
+static TaskResult *worker_result(TaskResult **spare, int *starved) {
+    TaskResult *res = slab_alloc(&task_result_slab);
+    *starved = 0;
+    if (res) return res;
+    *starved = 1;
+    if (*spare) {
+        res = *spare;
+        *spare = NULL;
+        return res;
     }
-    sess->pending_result = res;
-    pthread_cond_signal(&sess->resp_cv);
-    pthread_mutex_unlock(&sess->resp_lock);
+    fprintf(stderr, "worker: out of task results, waiting\n");
+    while (!(res = slab_alloc(&task_result_slab))) usleep(1000);
+    return res;
 }
 
-static void worker_do_task(Task *t) {
-    TaskResult *res = calloc(1, sizeof(TaskResult));
+static void worker_do_task(Task *t, TaskResult **spare) {
+    int starved;
+    TaskResult *res = worker_result(spare, &starved);
+    res->type = t->type;
+    res->session = t->session;
     res->task_id = t->task_id;
+    res->ctx = t->ctx;
     res->status = -1;
+    res->unsynced = 0;
     res->payload = NULL;
+    res->cursor = NULL;
+    res->fd = -1;
     res->payload_size = 0;
     res->errmsg[0] = '\0';
 
     const char *username = t->session->username[0] ? t->session->username : "default";
+    char key[512];
+    file_key(username, t->filename, key, sizeof(key));
 
-    if (t->type == TASK_UPLOAD) {
-        /* lock file */
-        file_lock_entry *fe = fl_get_or_create(username, t->filename);
-        pthread_mutex_lock(&fe->mtx);
-    int w = storage_write_blob(username, t->filename, t->upload_data ? t->upload_data : "", t->upload_data ? t->filesize : 0);
-        pthread_mutex_unlock(&fe->mtx);
-        fl_release(fe);
+    if (starved) {
+        /* the connection owns a begun upload; a finishing one is ours */
+        if (t->type == TASK_UPLOAD) storage_upload_close(t->upload);
+        else if (t->type == TASK_PATCH) storage_patch_abort(t->patch);
+        snprintf(res->errmsg, sizeof(res->errmsg), "nomem");
+    } else if (t->type == TASK_UPLOAD_BEGIN) {
+        int rc = storage_upload_open(t->upload, &res->offset);
+        if (rc == 0) {
+            res->status = 0;
+        } else {
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), rc == -2 ? "busy" : "open failed");
+        }
+    } else if (t->type == TASK_UPLOAD_CHUNK && t->patch) {
+        /* copy ops read a pinned fd of the base version: no lock needed */
+        int rc = storage_patch_write(t->patch, t->upload_data, t->filesize);
+        if (rc == 0) {
+            res->status = 0;
+        } else {
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), rc == -2 ? "stale" : "bad delta");
+        }
+    } else if (t->type == TASK_UPLOAD_CHUNK) {
+        /* temp file is private to the upload: no file lock until commit */
+        int w = upload_write(t);
+        if (w == 0) {
+            res->status = 0;
+        } else {
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), w == -2 ? "badframe" : "write failed");
+        }
+    } else if (t->type == TASK_PATCH) {
+        int rc = storage_patch_write(t->patch, t->upload_data, t->filesize);
+        if (rc == 0) {
+            /* the base must still be current when the new version replaces it */
+            file_lock_entry *fe = fl_get_or_create(key);
+            pthread_rwlock_wrlock(&fe->rw);
+            rc = storage_patch_commit(t->patch);
+            filecache_invalidate(key);
+            pthread_rwlock_unlock(&fe->rw);
+            fl_release(fe);
+        } else {
+            storage_patch_abort(t->patch);
+        }
+        if (rc == 0) {
+            res->status = 0;
+        } else {
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), rc == -2 ? "stale" : rc == -3 ? "quota" : "bad delta");
+        }
+    } else if (t->type == TASK_UPLOAD) {
+        int w = upload_write(t);
+        int bad = w == -2;
+        if (w == 0) {
+            /* lock file */
+            file_lock_entry *fe = fl_get_or_create(key);
+            pthread_rwlock_wrlock(&fe->rw);
+            w = storage_upload_commit(t->upload);
+            filecache_invalidate(key);
+            pthread_rwlock_unlock(&fe->rw);
+            fl_release(fe);
+        } else {
+            /* a resumable upload keeps what it has for the retry */
+            storage_upload_close(t->upload);
+        }
         if (w == 0) {
             res->status = 0;
         } else {
             res->status = -1;
-            snprintf(res->errmsg, sizeof(res->errmsg), "write failed");
+            snprintf(res->errmsg, sizeof(res->errmsg), bad ? "badframe" : w == -3 ? "quota" : "write failed");
         }
     } else if (t->type == TASK_DOWNLOAD) {
-        file_lock_entry *fe = fl_get_or_create(username, t->filename);
-        pthread_mutex_lock(&fe->mtx);
-        size_t len = 0;
-        char *buf = storage_read_file(username, t->filename, &len);
-        pthread_mutex_unlock(&fe->mtx);
+        /* shared: concurrent downloads of one file do not wait for each other */
+        file_lock_entry *fe = fl_get_or_create(key);
+        pthread_rwlock_rdlock(&fe->rw);
+        /* a cached copy, an fd or a chunk reader pins the current version;
+         * the reactor sends the buffer or sendfile()s the fd from base (a
+         * packed file is a range of its segment) or the chunk files */
+        size_t base = 0, len = 0;
+        int fd = -1;
+        chunkstore_reader *chunks = NULL;
+        filecache_blob *blob = filecache_get(key);
+        if (blob) {
+            len = blob->len;
+        } else if (storage_open_file(username, t->filename, &fd, &chunks, &base, &len) == 0) {
+            /* filled under the lock so an upload cannot slip in between;
+             * two readers filling at once just replace each other's entry */
+            blob = chunks ? filecache_load_with(key, chunk_read, chunks, 0, len) : filecache_load(key, fd, base, len);
+            if (blob) {
+                if (fd >= 0) close(fd);
+                chunkstore_reader_close(chunks);
+                fd = -1;
+                chunks = NULL;
+            }
+        }
+        pthread_rwlock_unlock(&fe->rw);
         fl_release(fe);
-        if (buf) {
+        int found = fd >= 0 || chunks || blob;
+        if (found && t->offset > len) {
+            if (fd >= 0) close(fd);
+            chunkstore_reader_close(chunks);
+            filecache_release(blob);
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), "badrange");
+        } else if (found) {
+            size_t n = len - t->offset;
+            if (t->length && t->length < n) n = t->length;
             res->status = 0;
-            res->payload = buf;
-            res->payload_size = len;
+            res->fd = fd;
+            res->chunks = chunks;
+            res->blob = blob;
+            res->offset = (fd >= 0 ? base : 0) + t->offset;
+            res->payload_size = n;
         } else {
             res->status = -1;
             snprintf(res->errmsg, sizeof(res->errmsg), "not found");
         }
     } else if (t->type == TASK_LIST) {
-        char *list = storage_list_files(username);
+        char next[STORAGE_NAME_MAX + 1];
+        size_t n = 0;
+        char *list = storage_list_files(username, t->filename, t->after, t->length, &n, next);
         if (list) {
             res->status = 0;
             res->payload = list;
-            res->payload_size = strlen(list);
+            res->payload_size = n;
+            if (next[0] && !(res->cursor = strdup(next))) {
+                res->status = -1;
+                snprintf(res->errmsg, sizeof(res->errmsg), "nomem");
+            }
         } else {
             res->status = -1;
             snprintf(res->errmsg, sizeof(res->errmsg), "list failed");
         }
+    } else if (t->type == TASK_SIGS) {
+        /* no lock: renames are atomic and the token names whichever version was read */
+        size_t n = 0;
+        char *sigs = storage_signatures(username, t->filename, &n);
+        if (sigs) {
+            res->status = 0;
+            res->payload = sigs;
+            res->payload_size = n;
+        } else {
+            res->status = -1;
+            snprintf(res->errmsg, sizeof(res->errmsg), "not found");
+        }
     } else if (t->type == TASK_DELETE) {
-        file_lock_entry *fe = fl_get_or_create(username, t->filename);
-        pthread_mutex_lock(&fe->mtx);
+        file_lock_entry *fe = fl_get_or_create(key);
+        pthread_rwlock_wrlock(&fe->rw);
         int d = storage_delete_file(username, t->filename);
-        pthread_mutex_unlock(&fe->mtx);
+        filecache_invalidate(key);
+        pthread_rwlock_unlock(&fe->rw);
         fl_release(fe);
         if (d == 0) res->status = 0;
         else { res->status = -1; snprintf(res->errmsg, sizeof(res->errmsg), "delete failed"); }
@@ -147,51 +441,586 @@ static void worker_do_task(Task *t) {
         snprintf(res->errmsg, sizeof(res->errmsg), "unknown task");
     }
 
-    /* free upload_data (ownership transferred to worker) */
-    if (t->upload_data) {
-        free(t->upload_data);
-        t->upload_data = NULL;
+    /* deliver result to the reactor that owns the session; in durable mode
+     * a write is only acknowledged once it is synced */
+    if (res->status == 0 && durable_enabled() &&
+        (t->type == TASK_UPLOAD || t->type == TASK_PATCH || t->type == TASK_DELETE))
+        durable_submit(res, username, t->filename);
+    else
+        client_pool_complete(res);
+
+    /* free task */
+    slab_free(&task_slab, t);
+    if (!*spare) *spare = slab_alloc(&task_result_slab);
+}
+
+static int wp_lane(const Task *t) {
+    switch (t->type) {
+    case TASK_UPLOAD_CHUNK:
+    case TASK_PATCH:
+    case TASK_SIGS:
+        return LANE_BULK;
+    case TASK_UPLOAD:
+        return t->filesize > WP_SMALL_UPLOAD ? LANE_BULK : LANE_FAST;
+    default:
+        return LANE_FAST;
     }
+}
 
-    /* deliver result */
-    deliver_result_to_session(t->session, res);
+static uint64_t wp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-    /* free task */
-    free(t);
+static size_t lat_bucket(uint64_t us) {
+    if (us < 4) return (size_t)us;
+    int lg = 63 - __builtin_clzll(us);
+    return 4 + (size_t)(lg - 2) * 4 + ((us >> (lg - 2)) & 3);
+}
+
+/* largest value that falls in bucket b */
+static uint64_t lat_bucket_max(size_t b) {
+    if (b < 4) return b;
+    int lg = (int)(b - 4) / 4 + 2;
+    uint64_t sub = (b - 4) % 4;
+    return ((4 + sub + 1) << (lg - 2)) - 1;
+}
+
+/* p-th percentile of a lane's histogram, rounded up to its bucket's edge */
+static uint64_t lat_percentile(int lane, unsigned p, uint64_t total) {
+    if (total == 0) return 0;
+    uint64_t want = (total * p + 99) / 100, seen = 0;
+    for (size_t b = 0; b < WP_LAT_BUCKETS; ++b) {
+        seen += atomic_load_explicit(&wp_latency[lane][b], memory_order_relaxed);
+        if (seen >= want) return lat_bucket_max(b);
+    }
+    return lat_bucket_max(WP_LAT_BUCKETS - 1);
+}
+
+/* can w run tasks of this lane */
+static int wp_serves(const wp_worker *w, int lane) {
+    return lane == LANE_FAST || !w->fast_only;
+}
+
+/* wake w if it is parked, else any parked worker that serves the lane, so
+ * someone steals */
+static void wp_wake(wp_worker *w, int lane) {
+    /* seq_cst against the sleeper's increment: either we see it parked,
+     * or it sees wp_pending > 0 and does not park */
+    if (atomic_load(&wp_sleepers) == 0) return;
+    pthread_mutex_lock(&wp_park_mtx);
+    if (!w->sleeping) {
+        for (size_t i = 0; i < worker_max; ++i) {
+            if (workers[i].sleeping && wp_serves(&workers[i], lane)) { w = &workers[i]; break; }
+        }
+    }
+    if (w->sleeping) {
+        w->sleeping = 0;
+        pthread_cond_signal(&w->wake);
+    }
+    pthread_mutex_unlock(&wp_park_mtx);
+}
+
+/* take one task of the lane from a busy worker's queue, starting after
+ * self; an idle owner is about to pop its own tasks, so those keep their
+ * affinity */
+static Task *wp_steal(size_t self, int lane) {
+    for (size_t k = 1; k < worker_max; ++k) {
+        wp_worker *v = &workers[(self + k) % worker_max];
+        if (!atomic_load_explicit(&v->running, memory_order_relaxed)) continue;
+        Task *t = queue_try_pop(v->q[lane]);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+/* next task for w: its own queues before stealing, fast before bulk
+ * unless WP_FAST_WEIGHT fast tasks ran since the last bulk one. A retiring
+ * worker only drains its own queues. */
+static Task *wp_next(size_t self, int *lane, int *stolen) {
+    wp_worker *w = &workers[self];
+    int order[LANES] = { LANE_FAST, LANE_BULK };
+    if (w->fast_run >= WP_FAST_WEIGHT) {
+        order[0] = LANE_BULK;
+        order[1] = LANE_FAST;
+    }
+    int passes = atomic_load(&w->state) == WS_RUN ? 2 : 1;
+    for (int pass = 0; pass < passes; ++pass) {
+        for (int i = 0; i < LANES; ++i) {
+            if (!wp_serves(w, order[i])) continue;
+            Task *t = pass == 0 ? queue_try_pop(w->q[order[i]]) : wp_steal(self, order[i]);
+            if (t) {
+                *lane = order[i];
+                *stolen = pass;
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* tasks w may run are pending somewhere (or about to be pushed) */
+static int wp_has_work(const wp_worker *w) {
+    return atomic_load(&wp_pending[LANE_FAST]) > 0 ||
+           (!w->fast_only && atomic_load(&wp_pending[LANE_BULK]) > 0);
+}
+
+static int wp_done(void) {
+    return atomic_load(&wp_closed) && atomic_load(&wp_unfinished) == 0;
 }
 
 static void *worker_thread_main(void *arg) {
+    size_t self = (size_t)(uintptr_t)arg;
+    wp_worker *w = &workers[self];
+    unsigned idle = 0;
+    TaskResult *spare = slab_alloc(&task_result_slab);
+    for (;;) {
+        int lane, stolen;
+        Task *t = wp_next(self, &lane, &stolen);
+        if (t) {
+            atomic_fetch_sub(&wp_pending[lane], 1);
+            atomic_fetch_add_explicit(&w->tasks, 1, memory_order_relaxed);
+            if (stolen) atomic_fetch_add_explicit(&w->steals, 1, memory_order_relaxed);
+            w->fast_run = lane == LANE_FAST ? w->fast_run + 1 : 0;
+            idle = 0;
+            uint64_t submitted = t->submit_ns;
+            wp_tenant *tn = t->tenant;
+            atomic_fetch_add_explicit(&wp_wait_ns, wp_now_ns() - submitted, memory_order_relaxed);
+            atomic_fetch_add_explicit(&wp_wait_n, 1, memory_order_relaxed);
+            atomic_store_explicit(&w->running, 1, memory_order_relaxed);
+            worker_do_task(t, &spare);
+            atomic_store_explicit(&w->running, 0, memory_order_relaxed);
+            uint64_t us = (wp_now_ns() - submitted) / 1000;
+            atomic_fetch_add_explicit(&wp_latency[lane][lat_bucket(us)], 1, memory_order_relaxed);
+            wp_finish(tn, lane);
+            continue;
+        }
+        /* own queues are empty and no new task is routed here */
+        int st = WS_RETIRE;
+        if (atomic_compare_exchange_strong(&w->state, &st, WS_OFF)) break;
+        /* pending counts a task before it is visible in a queue */
+        if (wp_has_work(w) || idle < WP_SPIN) {
+            if (wp_done()) break;
+            idle++;
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&wp_park_mtx);
+        w->sleeping = 1;
+        atomic_fetch_add(&wp_sleepers, 1);
+        while (w->sleeping && !wp_has_work(w) && !atomic_load(&wp_closed) &&
+               atomic_load(&w->state) == WS_RUN)
+            pthread_cond_wait(&w->wake, &wp_park_mtx);
+        w->sleeping = 0;
+        atomic_fetch_sub(&wp_sleepers, 1);
+        pthread_mutex_unlock(&wp_park_mtx);
+        if (wp_done()) break;
+        idle = 0;
+    }
+    if (spare) slab_free(&task_result_slab, spare);
+    return NULL;
+}
+
+/* push an admitted task to a worker queue; wp_fair_mtx held */
+static void wp_dispatch(Task *t, int lane) {
+    atomic_fetch_add(&wp_pending[lane], 1);
+    const char *username = t->session->username[0] ? t->session->username : "default";
+    char key[512];
+    file_key(username, t->filename, key, sizeof(key));
+    /* bulk tasks only go to workers that run them */
+    size_t first = lane == LANE_BULK ? wp_reserved : 0, span = wp_active - first;
+    size_t home = first + name_hash(key) % span, i = home;
+    /* the home queue when it has room, else the next one that does; each
+     * queue can hold the whole ready stage, so this does not block */
+    while (queue_try_push(workers[i].q[lane], t) != 0) {
+        i = first + (i - first + 1) % span;
+        if (i != home) continue;
+        queue_push(workers[home].q[lane], t);
+        break;
+    }
+    wp_wake(&workers[i], lane);
+}
+
+/* DRR cost: one unit per task plus one per 64 KB of payload */
+static long wp_cost(const Task *t) {
+    return 1 + (long)(t->filesize >> 16);
+}
+
+static size_t wp_share(size_t cap) {
+    size_t n = wp_busy_tenants ? wp_busy_tenants : 1;
+    return cap / n ? cap / n : 1;
+}
+
+static void wp_ring_pop(wp_ring *r, int lane) {
+    wp_tenant *tn = r->head;
+    r->head = tn->ring_next[lane];
+    if (!r->head) r->tail = NULL;
+    tn->ring_next[lane] = NULL;
+    r->len--;
+}
+
+static void wp_ring_push(wp_ring *r, wp_tenant *tn, int lane) {
+    tn->ring_next[lane] = NULL;
+    if (r->tail) r->tail->ring_next[lane] = tn;
+    else r->head = tn;
+    r->tail = tn;
+    r->len++;
+}
+
+/* move backlog into the ready stage while it has room: the tenant at the
+ * head of the ring spends its credit, then goes to the back with a fresh
+ * quantum; tenants at their share of the ready stage are passed over */
+static void wp_admit(int lane) {
+    wp_ring *r = &wp_rings[lane];
+    size_t passed = 0;
+    while (wp_ready[lane] < wp_ready_cap[lane] && r->head && passed < r->len) {
+        wp_tenant *tn = r->head;
+        Task *t = tn->head[lane];
+        if (tn->admitted[lane] >= wp_share(wp_ready_cap[lane])) {
+            wp_ring_pop(r, lane);
+            wp_ring_push(r, tn, lane);
+            passed++;
+            continue;
+        }
+        long cost = wp_cost(t);
+        if (tn->deficit[lane] < cost) {
+            tn->deficit[lane] += WP_DRR_QUANTUM;
+            wp_ring_pop(r, lane);
+            wp_ring_push(r, tn, lane);
+            continue;
+        }
+        tn->deficit[lane] -= cost;
+        tn->head[lane] = t->next;
+        if (!tn->head[lane]) tn->tail[lane] = NULL;
+        t->next = NULL;
+        tn->queued[lane]--;
+        wp_backlog[lane]--;
+        tn->admitted[lane]++;
+        wp_ready[lane]++;
+        passed = 0;
+        if (!tn->head[lane]) {
+            /* an emptied backlog keeps no credit */
+            tn->deficit[lane] = 0;
+            tn->in_ring[lane] = 0;
+            wp_ring_pop(r, lane);
+        }
+        wp_dispatch(t, lane);
+    }
+}
+
+static int wp_tenant_idle(const wp_tenant *tn) {
+    for (int l = 0; l < LANES; ++l) {
+        if (tn->queued[l] || tn->admitted[l]) return 0;
+    }
+    return 1;
+}
+
+static size_t wp_tenant_tasks(const wp_tenant *tn) {
+    size_t n = 0;
+    for (int l = 0; l < LANES; ++l) n += tn->queued[l] + tn->admitted[l];
+    return n;
+}
+
+static wp_tenant **wp_tenant_slot(const char *user) {
+    wp_tenant **pp = &wp_tenants[name_hash(user) % WP_TENANT_BUCKETS];
+    while (*pp && strcmp((*pp)->user, user) != 0) pp = &(*pp)->chain;
+    return pp;
+}
+
+/* a task of tn finished: free its ready slot and refill the stage */
+static void wp_finish(wp_tenant *tn, int lane) {
+    pthread_mutex_lock(&wp_fair_mtx);
+    tn->admitted[lane]--;
+    wp_ready[lane]--;
+    if (wp_tenant_idle(tn)) {
+        /* shares grow for the others */
+        wp_busy_tenants--;
+        wp_tenant **pp = wp_tenant_slot(tn->user);
+        *pp = tn->chain;
+        free(tn);
+    }
+    for (int l = 0; l < LANES; ++l) wp_admit(l);
+    atomic_fetch_sub(&wp_unfinished, 1);
+    pthread_mutex_unlock(&wp_fair_mtx);
+}
+
+/* a chunk of an upload the client is already sending: never refused, so
+ * a transfer is not cut off halfway (one per upload is in flight) */
+static int wp_continues(const Task *t) {
+    return (t->upload || t->patch) && t->type != TASK_UPLOAD_BEGIN;
+}
+
+int worker_pool_submit(Task *t) {
+    if (!workers) return -1;
+    int lane = wp_lane(t);
+    t->submit_ns = wp_now_ns();
+    t->next = NULL;
+    const char *username = t->session->username[0] ? t->session->username : "default";
+    pthread_mutex_lock(&wp_fair_mtx);
+    /* closed under this mutex: a stopping pool either has the task counted
+     * in wp_unfinished or refuses it here */
+    if (atomic_load(&wp_closed)) {
+        pthread_mutex_unlock(&wp_fair_mtx);
+        return -1;
+    }
+    wp_tenant **pp = wp_tenant_slot(username);
+    wp_tenant *tn = *pp;
+    if (!tn) {
+        tn = calloc(1, sizeof(wp_tenant));
+        if (!tn) {
+            pthread_mutex_unlock(&wp_fair_mtx);
+            return -1;
+        }
+        snprintf(tn->user, sizeof(tn->user), "%s", username);
+        *pp = tn;
+        wp_busy_tenants++;
+    }
+    /* new work over the user's share of the lane's slots, with the lane
+     * full, or over the user's task limit is refused */
+    int over_user = wp_user_cap && wp_tenant_tasks(tn) >= wp_user_cap;
+    if (!wp_continues(t) &&
+        (over_user || tn->queued[lane] >= wp_share(wp_backlog_cap) || wp_backlog[lane] >= wp_backlog_cap)) {
+        wp_refused++;
+        if (over_user) wp_user_limited++;
+        if (wp_tenant_idle(tn)) {
+            wp_busy_tenants--;
+            *pp = tn->chain;
+            free(tn);
+        }
+        pthread_mutex_unlock(&wp_fair_mtx);
+        return -1;
+    }
+    t->tenant = tn;
+    if (tn->tail[lane]) tn->tail[lane]->next = t;
+    else tn->head[lane] = t;
+    tn->tail[lane] = t;
+    tn->queued[lane]++;
+    wp_backlog[lane]++;
+    atomic_fetch_add(&wp_unfinished, 1);
+    if (!tn->in_ring[lane]) {
+        tn->in_ring[lane] = 1;
+        wp_ring_push(&wp_rings[lane], tn, lane);
+    }
+    wp_admit(lane);
+    pthread_mutex_unlock(&wp_fair_mtx);
+    return 0;
+}
+
+/* ready stage sized for the active workers; wp_fair_mtx held */
+static void wp_size_ready(void) {
+    wp_ready_cap[LANE_FAST] = WP_READY_PER_WORKER * wp_active;
+    wp_ready_cap[LANE_BULK] = WP_READY_PER_WORKER * (wp_active - wp_reserved);
+}
+
+/* start a worker in slot wp_active, or keep a retiring one there; wp_fair_mtx held */
+static int wp_grow(void) {
+    wp_worker *w = &workers[wp_active];
+    int st = WS_RETIRE;
+    if (!atomic_compare_exchange_strong(&w->state, &st, WS_RUN)) {
+        /* OFF: the old thread has left its loop, so the join is quick */
+        if (w->joinable) pthread_join(w->thread, NULL);
+        w->joinable = 0;
+        w->fast_run = 0;
+        atomic_store(&w->state, WS_RUN);
+        if (pthread_create(&w->thread, NULL, worker_thread_main, (void *)(uintptr_t)wp_active) != 0) {
+            atomic_store(&w->state, WS_OFF);
+            return -1;
+        }
+        w->joinable = 1;
+    }
+    wp_active++;
+    wp_size_ready();
+    for (int l = 0; l < LANES; ++l) wp_admit(l);
+    return 0;
+}
+
+/* retire the newest worker: no new tasks reach it and it exits once its
+ * queues are empty; wp_fair_mtx held */
+static void wp_shrink(void) {
+    wp_worker *w = &workers[--wp_active];
+    atomic_store(&w->state, WS_RETIRE);
+    wp_size_ready();
+    pthread_mutex_lock(&wp_park_mtx);
+    w->sleeping = 0;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&wp_park_mtx);
+}
+
+static void *wp_scaler_main(void *arg) {
     (void)arg;
-    while (1) {
-        Task *t = (Task *)queue_pop(task_queue_global);
-        if (!t) break;
-        worker_do_task(t);
+    unsigned cooldown = 0, quiet = 0;
+    uint64_t busy_sum = 0;
+    pthread_mutex_lock(&wp_scale_mtx);
+    while (!wp_scale_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WP_SCALE_TICK_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wp_scale_cv, &wp_scale_mtx, &until);
+        if (wp_scale_stop) break;
+
+        uint64_t n = atomic_exchange(&wp_wait_n, 0), ns = atomic_exchange(&wp_wait_ns, 0);
+        double wait_ms = n ? (double)ns / (double)n / 1e6 : 0.0;
+        pthread_mutex_lock(&wp_fair_mtx);
+        size_t active = wp_active, busy = 0;
+        size_t waiting = wp_backlog[LANE_FAST] + wp_backlog[LANE_BULK] +
+                         atomic_load(&wp_pending[LANE_FAST]) + atomic_load(&wp_pending[LANE_BULK]);
+        for (size_t i = 0; i < active; ++i) busy += (size_t)atomic_load(&workers[i].running);
+        if (cooldown) {
+            cooldown--;
+        } else if (active < worker_max && (waiting > active || wait_ms >= WP_GROW_WAIT_MS)) {
+            if (wp_grow() == 0) {
+                wp_scale_ups++;
+                fprintf(stderr, "[worker_pool] grow to %zu workers: %zu tasks waiting, avg wait %.1f ms\n",
+                        wp_active, waiting, wait_ms);
+            }
+            cooldown = WP_SCALE_COOLDOWN;
+            quiet = 0;
+            busy_sum = 0;
+        } else if (waiting == 0 && wait_ms < WP_GROW_WAIT_MS) {
+            quiet++;
+            busy_sum += busy;
+            if (quiet >= WP_SHRINK_TICKS) {
+                unsigned pct = (unsigned)(busy_sum * 100 / ((uint64_t)quiet * active));
+                if (active > worker_min && pct < WP_SHRINK_BUSY) {
+                    wp_shrink();
+                    wp_scale_downs++;
+                    fprintf(stderr, "[worker_pool] shrink to %zu workers: no backlog for %u ms, %u%% busy\n",
+                            wp_active, quiet * WP_SCALE_TICK_MS, pct);
+                    cooldown = WP_SCALE_COOLDOWN;
+                }
+                quiet = 0;
+                busy_sum = 0;
+            }
+        } else {
+            quiet = 0;
+            busy_sum = 0;
+        }
+        pthread_mutex_unlock(&wp_fair_mtx);
     }
+    pthread_mutex_unlock(&wp_scale_mtx);
     return NULL;
 }
 
-int worker_pool_start(size_t num_threads, queue_t *task_queue) {
-    if (worker_threads != NULL) return -1;
-    if (!task_queue || num_threads == 0) return -1;
-    task_queue_global = task_queue;
-    worker_threads = calloc(num_threads, sizeof(pthread_t));
-    if (!worker_threads) return -1;
-    worker_count = num_threads;
-    for (size_t i = 0; i < num_threads; ++i) {
-        pthread_create(&worker_threads[i], NULL, worker_thread_main, NULL);
+int worker_pool_start(size_t min_threads, size_t max_threads, size_t fast_reserved, size_t queue_cap,
+                      size_t user_cap) {
+    if (workers != NULL) return -1;
+    if (min_threads == 0 || max_threads < min_threads || queue_cap == 0) return -1;
+    workers = calloc(max_threads, sizeof(wp_worker));
+    if (!workers) return -1;
+    worker_min = min_threads;
+    worker_max = max_threads;
+    /* at least one worker must run bulk tasks */
+    wp_reserved = fast_reserved < min_threads ? fast_reserved : min_threads - 1;
+    atomic_store(&wp_closed, 0);
+    pthread_once(&fl_once, fl_init);
+    /* queue_cap bounds each lane's backlog; the worker queues only ever
+     * hold the ready stage, which is largest at worker_max */
+    wp_backlog_cap = queue_cap;
+    wp_user_cap = user_cap;
+    for (size_t i = 0; i < max_threads; ++i) {
+        for (int l = 0; l < LANES; ++l) {
+            workers[i].q[l] = queue_create(WP_READY_PER_WORKER * max_threads);
+            if (!workers[i].q[l]) return -1;
+        }
+        workers[i].fast_only = i < wp_reserved;
+        atomic_init(&workers[i].state, WS_OFF);
+        pthread_cond_init(&workers[i].wake, NULL);
     }
+    pthread_mutex_lock(&wp_fair_mtx);
+    int rc = 0;
+    while (rc == 0 && wp_active < min_threads) rc = wp_grow();
+    pthread_mutex_unlock(&wp_fair_mtx);
+    if (rc != 0) return -1;
+    wp_scale_stop = 0;
+    if (max_threads > min_threads) pthread_create(&wp_scaler, NULL, wp_scaler_main, NULL);
     return 0;
 }
 
 void worker_pool_stop(void) {
-    if (!worker_threads) return;
-    /* close the task queue to wake workers */
-    queue_close(task_queue_global);
-    for (size_t i = 0; i < worker_count; ++i) {
-        pthread_join(worker_threads[i], NULL);
-    }
-    free(worker_threads);
-    worker_threads = NULL;
-    worker_count = 0;
-    task_queue_global = NULL;
+    if (!workers) return;
+    if (worker_max > worker_min) {
+        pthread_mutex_lock(&wp_scale_mtx);
+        wp_scale_stop = 1;
+        pthread_cond_signal(&wp_scale_cv);
+        pthread_mutex_unlock(&wp_scale_mtx);
+        pthread_join(wp_scaler, NULL);
+    }
+    /* workers drain what was queued, then exit */
+    pthread_mutex_lock(&wp_fair_mtx);
+    atomic_store(&wp_closed, 1);
+    pthread_mutex_unlock(&wp_fair_mtx);
+    for (size_t i = 0; i < worker_max; ++i) {
+        for (int l = 0; l < LANES; ++l) queue_close(workers[i].q[l]);
+    }
+    pthread_mutex_lock(&wp_park_mtx);
+    for (size_t i = 0; i < worker_max; ++i) pthread_cond_signal(&workers[i].wake);
+    pthread_mutex_unlock(&wp_park_mtx);
+    for (size_t i = 0; i < worker_max; ++i) {
+        if (workers[i].joinable) pthread_join(workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < worker_max; ++i) {
+        for (int l = 0; l < LANES; ++l) queue_destroy(workers[i].q[l]);
+        pthread_cond_destroy(&workers[i].wake);
+    }
+    free(workers);
+    workers = NULL;
+    worker_min = worker_max = wp_active = 0;
+}
+
+void worker_pool_get_stats(worker_pool_stats *st) {
+    memset(st, 0, sizeof(*st));
+    if (!workers) return;
+    st->reserved = wp_reserved;
+    st->workers_min = worker_min;
+    st->workers_max = worker_max;
+    for (size_t i = 0; i < worker_max; ++i) {
+        for (int l = 0; l < LANES; ++l) {
+            size_t d = queue_depth(workers[i].q[l]);
+            st->queued += d;
+            if (d > st->queued_max) st->queued_max = d;
+        }
+        st->tasks += atomic_load_explicit(&workers[i].tasks, memory_order_relaxed);
+        st->steals += atomic_load_explicit(&workers[i].steals, memory_order_relaxed);
+    }
+    for (int l = 0; l < LANES; ++l) {
+        worker_lane_stats *ls = &st->lanes[l];
+        ls->name = lane_names[l];
+        for (size_t b = 0; b < WP_LAT_BUCKETS; ++b)
+            ls->tasks += atomic_load_explicit(&wp_latency[l][b], memory_order_relaxed);
+        ls->p50_us = lat_percentile(l, 50, ls->tasks);
+        ls->p99_us = lat_percentile(l, 99, ls->tasks);
+        ls->max_us = lat_percentile(l, 100, ls->tasks);
+    }
+    pthread_mutex_lock(&wp_fair_mtx);
+    st->workers = wp_active;
+    st->scale_ups = wp_scale_ups;
+    st->scale_downs = wp_scale_downs;
+    st->tenants = wp_busy_tenants;
+    st->backlog = wp_backlog[LANE_FAST] + wp_backlog[LANE_BULK];
+    st->refused = wp_refused;
+    st->user_cap = wp_user_cap;
+    st->user_limited = wp_user_limited;
+    pthread_mutex_unlock(&wp_fair_mtx);
+}
+
+unsigned worker_pool_retry_ms(void) {
+    if (!workers) return WP_RETRY_MIN_MS;
+    /* the backlog, worked off by the active workers at the median latency */
+    uint64_t p50 = 0;
+    for (int l = 0; l < LANES; ++l) {
+        uint64_t total = 0;
+        for (size_t b = 0; b < WP_LAT_BUCKETS; ++b)
+            total += atomic_load_explicit(&wp_latency[l][b], memory_order_relaxed);
+        uint64_t p = lat_percentile(l, 50, total);
+        if (p > p50) p50 = p;
+    }
+    pthread_mutex_lock(&wp_fair_mtx);
+    uint64_t waiting = wp_backlog[LANE_FAST] + wp_backlog[LANE_BULK] + wp_ready[LANE_FAST] + wp_ready[LANE_BULK];
+    uint64_t active = wp_active ? wp_active : 1;
+    pthread_mutex_unlock(&wp_fair_mtx);
+    uint64_t ms = WP_RETRY_MIN_MS + waiting * p50 / active / 1000;
+    return ms > WP_RETRY_MAX_MS ? WP_RETRY_MAX_MS : (unsigned)ms;
 }
@@ -47,7 +47,7 @@ echo "It contains multiple lines." >> $TEST_FILE
 echo "Line 3." >> $TEST_FILE
 
 # Start server in background
-echo "[1/7] Starting server..."
+echo "[1/18] Starting server..."
 cd ..
 ./server > tests/$SERVER_LOG 2>&1 &
 SERVER_PID=$!
@@ -62,6 +62,44 @@ if ! kill -0 $SERVER_PID 2>/dev/null; then
 fi
 echo "    Server started (PID: $SERVER_PID)"
 
+# One raw protocol session as testuser: logs in, runs "$@" with its output
+# going to the server, sends QUIT and prints every reply line
+raw_session() {
+    exec 3<>/dev/tcp/127.0.0.1/8080
+    echo "LOGIN testuser testpass" >&3
+    "$@" >&3
+    echo "QUIT" >&3
+    timeout 5 cat <&3 || true
+    exec 3<&-
+}
+
+# stop the server with SIGINT, which ends every file index log with a clean
+# record, and start it again with the given options
+restart_server() {
+    kill -INT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null || true
+    cd ..
+    ./server "$@" >> tests/$SERVER_LOG 2>&1 &
+    SERVER_PID=$!
+    cd tests
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/8080) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "ERROR: Server did not come back. Check $SERVER_LOG"
+    exit 1
+}
+
+# bytes compressed transfers have saved since the server started
+lz_saved() {
+    raw_session echo "STATS" | grep "^lz_saved_bytes " | cut -d' ' -f2
+}
+
+# UPLOAD commands for one-byte files with the given names
+upload_small() {
+    for f in "$@"; do printf 'UPLOAD %s 1\nx' "$f"; done
+}
+
 # Create client command script
 cat > $CLIENT_SCRIPT << 'EOF'
 SIGNUP testuser testpass
@@ -74,7 +112,7 @@ LIST
 QUIT
 EOF
 
-echo "[2/7] Testing SIGNUP..."
+echo "[2/18] Testing SIGNUP..."
 echo "SIGNUP testuser testpass" | ../client_app 2>&1 | grep -q "OK signup"
 if [ $? -eq 0 ]; then
     echo "    ✓ SIGNUP successful"
@@ -83,7 +121,7 @@ else
     exit 1
 fi
 
-echo "[3/7] Testing LOGIN..."
+echo "[3/18] Testing LOGIN..."
 (echo "LOGIN testuser testpass"; sleep 1) | timeout 5 ../client_app 2>&1 | grep -q "OK login"
 if [ $? -eq 0 ]; then
     echo "    ✓ LOGIN successful"
@@ -92,7 +130,7 @@ else
     exit 1
 fi
 
-echo "[4/7] Testing UPLOAD..."
+echo "[4/18] Testing UPLOAD..."
 # Full session: login then upload
 {
     echo "LOGIN testuser testpass"
@@ -110,7 +148,7 @@ else
     exit 1
 fi
 
-echo "[5/7] Testing LIST..."
+echo "[5/18] Testing LIST..."
 {
     echo "LOGIN testuser testpass"
     sleep 0.5
@@ -125,7 +163,7 @@ else
     exit 1
 fi
 
-echo "[6/7] Testing DOWNLOAD..."
+echo "[6/18] Testing DOWNLOAD..."
 {
     echo "LOGIN testuser testpass"
     sleep 0.5
@@ -146,7 +184,7 @@ else
     exit 1
 fi
 
-echo "[7/7] Testing DELETE..."
+echo "[7/18] Testing DELETE..."
 {
     echo "LOGIN testuser testpass"
     sleep 0.5
@@ -162,6 +200,254 @@ else
     exit 1
 fi
 
+echo "[8/18] Testing LIST prefix and pages..."
+raw_session upload_small b-2 a-1 b-1 b-3 -dash > /dev/null
+OUT=$(raw_session echo "LIST prefix=b- limit=2")
+CURSOR=$(echo "$OUT" | sed -n 's/^OK list 12 \([0-9a-f]*\)$/\1/p')
+PAGE1=$(echo "$OUT" | grep -A2 '^OK list' | tail -n 2)
+OUT=$(raw_session echo "LIST prefix=b- limit=2 after=$CURSOR")
+PAGE2=$(echo "$OUT" | grep -A1 '^OK list 6$' | tail -n 1)
+OUT=$(raw_session echo "LIST prefix=-")
+DASH=$(echo "$OUT" | grep -A1 '^OK list 8$' | tail -n 1)
+if [ -n "$CURSOR" ] && [ "$PAGE1" = $'b-1 1\nb-2 1' ] && [ "$PAGE2" = "b-3 1" ] && [ "$DASH" = "-dash 1" ]; then
+    echo "    ✓ LIST pages sorted by name, cursor resumes after the first page"
+else
+    echo "    ✗ LIST paging failed (cursor '$CURSOR', pages '$PAGE1' / '$PAGE2', '-' prefix '$DASH')"
+    exit 1
+fi
+
+echo "[9/18] Testing LIST after a restart..."
+restart_server
+OUT=$(raw_session printf 'LIST\nSTATS\n')
+FILES=$(echo "$OUT" | grep -A5 '^OK list 32$' | tail -n 5 | tr '\n' ' ')
+if [ "$FILES" = "-dash 1 a-1 1 b-1 1 b-2 1 b-3 1 " ] && echo "$OUT" | grep -qx "index_rescans 0"; then
+    echo "    ✓ LIST survives a restart, loaded from the .index log without a rescan"
+else
+    echo "    ✗ LIST after restart failed (files '$FILES')"
+    exit 1
+fi
+
+echo "[10/18] Testing quotas and USAGE..."
+restart_server --quota-mb 1
+# untagged: a refused upload's body must not be sent
+quota_uploads() {
+    echo "USAGE"
+    echo "UPLOAD big 600000"
+    head -c 600000 /dev/zero
+    echo "UPLOAD big2 600000"
+    echo "UPLOAD big 600000"
+    head -c 600000 /dev/zero
+    echo "UPLOAD .hidden 1"
+    echo "USAGE"
+}
+REPLIES=$(raw_session quota_uploads | grep -E '^(OK usage|OK upload|ERR upload)' | tr '\n' '|')
+EXPECT="OK usage 5 1048576 5|OK upload|ERR upload quota|OK upload|ERR upload badname|OK usage 600005 1048576 6|"
+if [ "$REPLIES" = "$EXPECT" ]; then
+    echo "    ✓ Over-quota upload refused, same-size overwrite accepted, USAGE exact"
+else
+    echo "    ✗ Quota replies were '$REPLIES'"
+    exit 1
+fi
+
+echo "[11/18] Testing tagged pipelining..."
+OUT=$(raw_session printf '#1 LIST prefix=b-\n#2 USAGE\n#3 DELETE nothere\n#4 UPLOAD t.txt 1\nx')
+if echo "$OUT" | grep -qx "#1 OK list 18" && echo "$OUT" | grep -q "^#2 OK usage " &&
+   echo "$OUT" | grep -q "^#3 ERR delete " && echo "$OUT" | grep -qx "#4 OK upload"; then
+    echo "    ✓ Pipelined commands each answered under their own tag"
+else
+    echo "    ✗ Tagged replies were:"
+    echo "$OUT"
+    exit 1
+fi
+
+echo "[12/18] Testing ERR serverbusy..."
+restart_server --upload-mb 1
+# four uploads that never send their body hold the whole 1 MB of chunk buffers
+HOLD=()
+for i in 1 2 3 4; do
+    exec {fd}<>/dev/tcp/127.0.0.1/8080
+    printf 'LOGIN testuser testpass\nUPLOAD hold%s 1000000\n' "$i" >&$fd
+    HOLD+=($fd)
+done
+sleep 0.5
+OUT=$(raw_session echo "UPLOAD extra 300000")
+for fd in "${HOLD[@]}"; do exec {fd}<&-; done
+if echo "$OUT" | grep -Eqx "ERR serverbusy retry-after [0-9]+"; then
+    echo "    ✓ Upload over the buffer budget refused with a retry-after hint"
+else
+    echo "    ✗ Expected ERR serverbusy, got:"
+    echo "$OUT"
+    exit 1
+fi
+
+echo "[13/18] Testing a resumable upload in pack mode..."
+restart_server --pack
+PACK_FILE="packed.txt"
+seq 1 500 > $PACK_FILE
+# client_app sends every UPLOAD as a resumable one
+{
+    echo "LOGIN testuser testpass"
+    sleep 0.5
+    echo "UPLOAD $PACK_FILE"
+    sleep 1
+    echo "DOWNLOAD $PACK_FILE"
+    sleep 1
+    echo "QUIT"
+} | timeout 10 ../client_app > /dev/null 2>&1
+SEGS=$(ls ../server_storage/.pack/testuser/*.seg 2>/dev/null || true)
+PARTS=$(ls -a ../server_storage/testuser | grep -c "^\.$PACK_FILE\." || true)
+if [ -n "$SEGS" ] && grep -qa "$PACK_FILE" $SEGS && [ ! -e "../server_storage/testuser/$PACK_FILE" ] &&
+   [ "$PARTS" = "0" ] && cmp -s $PACK_FILE downloads/$PACK_FILE; then
+    echo "    ✓ Small resumable upload packed into a .seg record, partial removed, download matches"
+else
+    echo "    ✗ Pack mode upload failed (segments '$SEGS', partials $PARTS)"
+    exit 1
+fi
+rm -f $PACK_FILE downloads/$PACK_FILE
+
+echo "[14/18] Testing migration to --fanout..."
+BEFORE=$(raw_session printf 'LIST\nUSAGE\nDOWNLOAD b-2\nDOWNLOAD t.txt\n')
+restart_server --fanout
+for i in $(seq 50); do
+    [ -f ../server_storage/testuser/.fanout/done ] && break
+    sleep 0.1
+done
+AFTER=$(raw_session printf 'LIST\nUSAGE\nDOWNLOAD b-2\nDOWNLOAD t.txt\n')
+FLAT=$(ls ../server_storage/testuser)
+if [ -f ../server_storage/testuser/.fanout/done ] && [ -z "$FLAT" ] && [ "$BEFORE" = "$AFTER" ]; then
+    echo "    ✓ Flat files moved into shards; LIST, USAGE and DOWNLOAD unchanged"
+else
+    echo "    ✗ Fanout migration failed (flat files left: '$FLAT')"
+    echo "    before: $BEFORE"
+    echo "    after:  $AFTER"
+    exit 1
+fi
+
+echo "[15/18] Testing ranged downloads and resuming an upload..."
+RANGES=$(raw_session printf 'UPLOAD range.txt 10\n0123456789DOWNLOAD range.txt 3 4\nDOWNLOAD range.txt 7\nDOWNLOAD range.txt 11\n')
+EXPECTED=$(printf 'OK login\nREADY\nOK upload\nOK download 4\n3456OK download 3\n789ERR download badrange\nOK bye')
+if [ "$RANGES" = "$EXPECTED" ]; then
+    echo "    ✓ DOWNLOAD with an offset and length returns just that range"
+else
+    echo "    ✗ Ranged download failed, got:"
+    echo "$RANGES"
+    exit 1
+fi
+# the body is bigger than one upload chunk so part of it reaches the disk
+# before the first connection drops
+RESUME_FILE="resume.bin"
+head -c 1000000 /dev/urandom > $RESUME_FILE
+exec 4<>/dev/tcp/127.0.0.1/8080
+printf 'LOGIN testuser testpass\nUPLOAD %s 1000000 resume\n' $RESUME_FILE >&4
+read -r -t 5 LINE <&4 || true
+read -r -t 5 LINE <&4 || true
+head -c 600000 $RESUME_FILE >&4
+sleep 0.5
+exec 4<&-
+sleep 0.5
+exec 4<>/dev/tcp/127.0.0.1/8080
+printf 'LOGIN testuser testpass\nUPLOAD %s 1000000 resume\n' $RESUME_FILE >&4
+read -r -t 5 LINE <&4 || true
+read -r -t 5 READY <&4 || true
+OFFSET=${READY#READY }
+case "$OFFSET" in ''|*[!0-9]*) OFFSET=0 ;; esac
+[ "$OFFSET" -gt 0 ] && tail -c +$((OFFSET + 1)) $RESUME_FILE >&4
+read -r -t 5 LINE <&4 || true
+exec 4<&-
+(echo "LOGIN testuser testpass"; sleep 0.5; echo "DOWNLOAD $RESUME_FILE"; sleep 1; echo "QUIT") |
+    timeout 10 ../client_app > /dev/null 2>&1
+if [ "$OFFSET" -gt 0 ] && [ "$OFFSET" -lt 1000000 ] && [ "$LINE" = "OK upload" ] &&
+   cmp -s $RESUME_FILE downloads/$RESUME_FILE; then
+    echo "    ✓ Reconnected upload continued from READY $OFFSET; download matches"
+else
+    echo "    ✗ Resumed upload failed (reply '$READY', then '$LINE')"
+    exit 1
+fi
+rm -f $RESUME_FILE downloads/$RESUME_FILE
+
+echo "[16/18] Testing SYNC and a stale PATCH..."
+SYNC_FILE="sync.txt"
+seq 1 20000 > $SYNC_FILE
+(echo "LOGIN testuser testpass"; sleep 0.5; echo "UPLOAD $SYNC_FILE"; sleep 1; echo "QUIT") |
+    timeout 10 ../client_app > /dev/null 2>&1
+sed -i 's/^10000$/ten thousand/' $SYNC_FILE
+echo "appended" >> $SYNC_FILE
+SYNC_OUT=$( (echo "LOGIN testuser testpass"; sleep 0.5; echo "SYNC $SYNC_FILE"; sleep 1
+             echo "DOWNLOAD $SYNC_FILE"; sleep 1; echo "QUIT") | timeout 10 ../client_app 2>&1)
+if echo "$SYNC_OUT" | grep -q "OK patch" &&
+   echo "$SYNC_OUT" | grep -Eq "Synced $SYNC_FILE: [1-9][0-9]* blocks reused" &&
+   cmp -s $SYNC_FILE downloads/$SYNC_FILE; then
+    echo "    ✓ SYNC sent a delta and the download matches the edited file"
+else
+    echo "    ✗ SYNC failed:"
+    echo "$SYNC_OUT"
+    exit 1
+fi
+# a PATCH against the version from SIGS after that version was replaced
+exec 4<>/dev/tcp/127.0.0.1/8080
+printf 'LOGIN testuser testpass\nSIGS %s\n' $SYNC_FILE >&4
+read -r -t 5 LINE <&4 || true
+read -r -t 5 LINE <&4 || true
+read -r -t 5 TOKEN BLOCK SIZE COUNT <&4 || true
+exec 4<&-
+STALE=$(raw_session printf 'UPLOAD %s 1\nxPATCH %s %s %s 1 6\nL\001\000\000\000y' \
+        $SYNC_FILE $SYNC_FILE "$TOKEN" "$BLOCK")
+if [ -n "$TOKEN" ] && echo "$STALE" | grep -qx "ERR patch stale"; then
+    echo "    ✓ PATCH against a replaced version rejected as stale"
+else
+    echo "    ✗ Expected ERR patch stale, got:"
+    echo "$STALE"
+    exit 1
+fi
+rm -f $SYNC_FILE downloads/$SYNC_FILE
+
+echo "[17/18] Testing compressed (lz) transfers..."
+LZ_FILE="lz.txt"
+seq 1 100000 > $LZ_FILE
+SAVED_BEFORE=$(lz_saved)
+# client_app sends CAPS lz after LOGIN, so both bodies are framed
+(echo "LOGIN testuser testpass"; sleep 0.5; echo "UPLOAD $LZ_FILE"; sleep 1
+ echo "DOWNLOAD $LZ_FILE"; sleep 1; echo "QUIT") | timeout 10 ../client_app > /dev/null 2>&1
+SAVED_AFTER=$(lz_saved)
+if cmp -s $LZ_FILE downloads/$LZ_FILE && [ "${SAVED_AFTER:-0}" -gt "${SAVED_BEFORE:-0}" ]; then
+    echo "    ✓ Round trip matches; lz saved $((SAVED_AFTER - SAVED_BEFORE)) bytes"
+else
+    echo "    ✗ lz round trip failed (lz_saved_bytes $SAVED_BEFORE -> $SAVED_AFTER)"
+    exit 1
+fi
+# a frame claiming 5 compressed bytes of garbage for 10 raw ones
+BADFRAME=$(raw_session printf 'CAPS lz\nUPLOAD badframe.txt 10 lz\n\012\000\000\000\005\000\000\000\377\377\377\377\377')
+if echo "$BADFRAME" | grep -qx "ERR upload badframe"; then
+    echo "    ✓ Corrupt frame rejected with ERR upload badframe"
+else
+    echo "    ✗ Expected ERR upload badframe, got:"
+    echo "$BADFRAME"
+    exit 1
+fi
+rm -f $LZ_FILE downloads/$LZ_FILE
+
+echo "[18/18] Testing uploads, LIST and DELETE with --durable..."
+restart_server --durable
+DURABLE_FILE="durable.bin"
+head -c 50000 /dev/urandom > $DURABLE_FILE
+(echo "LOGIN testuser testpass"; sleep 0.5; echo "UPLOAD $DURABLE_FILE"; sleep 1
+ echo "DOWNLOAD $DURABLE_FILE"; sleep 1; echo "QUIT") | timeout 10 ../client_app > /dev/null 2>&1
+OUT=$(raw_session printf 'UPLOAD d-small 1\nxLIST\nDELETE d-small\nDELETE %s\nLIST\nSTATS\n' $DURABLE_FILE)
+# each file is in the first LIST only
+LISTED=$(echo "$OUT" | grep -Ec "^(d-small 1|$DURABLE_FILE 50000)$" || true)
+WRITES=$(echo "$OUT" | grep "^durable_writes " | cut -d' ' -f2)
+if echo "$OUT" | grep -qx "OK upload" && [ "$LISTED" = "2" ] &&
+   [ "$(echo "$OUT" | grep -cx "OK delete")" = "2" ] && ! echo "$OUT" | grep -q "unsynced" &&
+   echo "$OUT" | grep -qx "durable on" && [ "${WRITES:-0}" -ge 4 ] &&
+   cmp -s $DURABLE_FILE downloads/$DURABLE_FILE; then
+    echo "    ✓ Writes acknowledged after group commits ($WRITES); LIST and DELETE agree"
+else
+    echo "    ✗ Durable mode flow failed:"
+    echo "$OUT"
+    exit 1
+fi
+rm -f $DURABLE_FILE downloads/$DURABLE_FILE
+
 echo
 echo "=== All Tests Passed! ==="
 echo